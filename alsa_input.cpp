@@ -3,8 +3,11 @@
 #include <alsa/error.h>
 #include <assert.h>
 #include <errno.h>
+#include <math.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
+#include <algorithm>
 #include <cstdint>
 
 #include "alsa_pool.h"
@@ -47,6 +50,9 @@ ALSAInput::ALSAInput(const char *device, unsigned sample_rate, unsigned num_chan
 	  parent_pool(parent_pool),
 	  internal_dev_index(internal_dev_index)
 {
+	labels.emplace_back("card", device);
+	metric_alsa_timestamp_jitter_system_seconds.init_geometric(1e-6, 0.1, 21);
+	metric_alsa_timestamp_jitter_hardware_seconds.init_geometric(1e-6, 0.1, 21);
 }
 
 bool ALSAInput::open_device()
@@ -111,6 +117,17 @@ bool ALSAInput::open_device()
 	snd_pcm_sw_params_alloca(&sw_params);
 	RETURN_FALSE_ON_ERROR("snd_pcm_sw_params_current()", snd_pcm_sw_params_current(pcm_handle, sw_params));
 	RETURN_FALSE_ON_ERROR("snd_pcm_sw_params_set_start_threshold", snd_pcm_sw_params_set_start_threshold(pcm_handle, sw_params, num_periods * period_size / 2));
+
+	// Ask for timestamps in CLOCK_MONOTONIC, which is what steady_clock uses
+	// on Linux, so that we can use them directly as frame times. Old kernels
+	// (and some plugins) don't support this; if so, we fall back to taking
+	// the time ourselves after each read, with all the jitter that implies.
+	hardware_timestamps =
+		snd_pcm_sw_params_set_tstamp_mode(pcm_handle, sw_params, SND_PCM_TSTAMP_ENABLE) >= 0 &&
+		snd_pcm_sw_params_set_tstamp_type(pcm_handle, sw_params, SND_PCM_TSTAMP_TYPE_MONOTONIC) >= 0;
+	if (!hardware_timestamps) {
+		fprintf(stderr, "[%s] No monotonic timestamps available, using system time for audio timing\n", device.c_str());
+	}
 	RETURN_FALSE_ON_ERROR("snd_pcm_sw_params()", snd_pcm_sw_params(pcm_handle, sw_params));
 
 	RETURN_FALSE_ON_ERROR("snd_pcm_nonblock()", snd_pcm_nonblock(pcm_handle, 1));
@@ -158,6 +175,17 @@ ALSAInput::~ALSAInput()
 
 void ALSAInput::start_capture_thread()
 {
+	// The metrics are registered here and not in the constructor, since
+	// ALSAPool creates the new input for a device before destroying the old one.
+	vector<pair<string, string>> labels_system = labels;
+	labels_system.emplace_back("timestamp", "system");
+	vector<pair<string, string>> labels_hardware = labels;
+	labels_hardware.emplace_back("timestamp", "hardware");
+	global_metrics.add("alsa_timestamp_jitter_seconds", labels_system, &metric_alsa_timestamp_jitter_system_seconds);
+	global_metrics.add("alsa_timestamp_jitter_seconds", labels_hardware, &metric_alsa_timestamp_jitter_hardware_seconds, Metrics::PRINT_WHEN_NONEMPTY);
+	global_metrics.add("alsa_hardware_timestamps", labels, &metric_alsa_hardware_timestamps_used);
+	global_metrics.add("alsa_hardware_timestamps_unavailable", labels, &metric_alsa_hardware_timestamps_unavailable);
+
 	should_quit.unquit();
 	capture_thread = thread(&ALSAInput::capture_thread_func, this);
 }
@@ -166,6 +194,15 @@ void ALSAInput::stop_capture_thread()
 {
 	should_quit.quit();
 	capture_thread.join();
+
+	vector<pair<string, string>> labels_system = labels;
+	labels_system.emplace_back("timestamp", "system");
+	vector<pair<string, string>> labels_hardware = labels;
+	labels_hardware.emplace_back("timestamp", "hardware");
+	global_metrics.remove("alsa_timestamp_jitter_seconds", labels_system);
+	global_metrics.remove("alsa_timestamp_jitter_seconds", labels_hardware);
+	global_metrics.remove("alsa_hardware_timestamps", labels);
+	global_metrics.remove("alsa_hardware_timestamps_unavailable", labels);
 }
 
 void ALSAInput::capture_thread_func()
@@ -217,6 +254,8 @@ ALSAInput::CaptureEndReason ALSAInput::do_capture()
 	parent_pool->set_card_state(internal_dev_index, ALSAPool::Device::State::STARTING);
 	RETURN_ON_ERROR("snd_pcm_start()", snd_pcm_start(pcm_handle));
 	parent_pool->set_card_state(internal_dev_index, ALSAPool::Device::State::RUNNING);
+	frames_since_start = 0;
+	has_last_ts = has_last_hardware_ts = false;
 
 	uint64_t num_frames_output = 0;
 	while (!should_quit.should_quit()) {
@@ -226,6 +265,8 @@ ALSAInput::CaptureEndReason ALSAInput::do_capture()
 			fprintf(stderr, "[%s] ALSA overrun\n", device.c_str());
 			snd_pcm_prepare(pcm_handle);
 			snd_pcm_start(pcm_handle);
+			frames_since_start = 0;
+			has_last_ts = has_last_hardware_ts = false;
 			continue;
 		}
 		RETURN_ON_ERROR("snd_pcm_wait()", ret);
@@ -235,6 +276,8 @@ ALSAInput::CaptureEndReason ALSAInput::do_capture()
 			fprintf(stderr, "[%s] ALSA overrun\n", device.c_str());
 			snd_pcm_prepare(pcm_handle);
 			snd_pcm_start(pcm_handle);
+			frames_since_start = 0;
+			has_last_ts = has_last_hardware_ts = false;
 			continue;
 		}
 		if (frames == 0) {
@@ -242,20 +285,107 @@ ALSAInput::CaptureEndReason ALSAInput::do_capture()
 			break;
 		}
 		RETURN_ON_ERROR("snd_pcm_readi()", frames);
+		frames_since_start += frames;
 
 		const int64_t prev_pts = frames_to_pts(num_frames_output);
 		const int64_t pts = frames_to_pts(num_frames_output + frames);
 		const steady_clock::time_point now = steady_clock::now();
+		steady_clock::time_point hardware_ts;
+		const bool has_hardware_ts = get_hardware_timestamp(&hardware_ts);
+		if (has_hardware_ts) {
+			++metric_alsa_hardware_timestamps_used;
+		} else {
+			++metric_alsa_hardware_timestamps_unavailable;
+		}
+		count_jitter(now, hardware_ts, has_hardware_ts, frames);
+
+		const steady_clock::time_point ts = has_hardware_ts ? hardware_ts : now;
 		bool success;
 		do {
 			if (should_quit.should_quit()) return CaptureEndReason::REQUESTED_QUIT;
-			success = audio_callback(buffer.get(), frames, audio_format, pts - prev_pts, now);
+			success = audio_callback(buffer.get(), frames, audio_format, pts - prev_pts, ts);
 		} while (!success);
 		num_frames_output += frames;
 	}
 	return CaptureEndReason::REQUESTED_QUIT;
 }
 
+bool ALSAInput::get_hardware_timestamp(steady_clock::time_point *ts)
+{
+	if (!hardware_timestamps) {
+		return false;
+	}
+
+	snd_pcm_status_t *status;
+	snd_pcm_status_alloca(&status);
+
+	// If the card can give us a link timestamp (ie., the position as measured
+	// by the hardware at <htstamp>, as opposed to the last position the driver
+	// has been told about), prefer that, since it's not quantized to period
+	// boundaries like the avail count is.
+	snd_pcm_audio_tstamp_config_t audio_tstamp_config;
+	memset(&audio_tstamp_config, 0, sizeof(audio_tstamp_config));
+	audio_tstamp_config.type_requested = SND_PCM_AUDIO_TSTAMP_TYPE_LINK;
+	snd_pcm_status_set_audio_htstamp_config(status, &audio_tstamp_config);
+
+	if (snd_pcm_status(pcm_handle, status) < 0) {
+		return false;
+	}
+
+	// Must be taken after snd_pcm_status(), since <htstamp> is (roughly)
+	// the time of that call, so a valid timestamp can never be later than this.
+	const steady_clock::time_point now = steady_clock::now();
+
+	snd_htimestamp_t htstamp;
+	snd_pcm_status_get_htstamp(status, &htstamp);
+	if (htstamp.tv_sec == 0 && htstamp.tv_nsec == 0) {
+		return false;
+	}
+
+	// Find out how many frames the card had captured at <htstamp>
+	// that we haven't read yet.
+	double frames_after_last_read;
+	snd_pcm_audio_tstamp_report_t audio_tstamp_report;
+	snd_pcm_status_get_audio_htstamp_report(status, &audio_tstamp_report);
+	if (audio_tstamp_report.valid && audio_tstamp_report.actual_type == SND_PCM_AUDIO_TSTAMP_TYPE_LINK) {
+		snd_htimestamp_t audio_htstamp;
+		snd_pcm_status_get_audio_htstamp(status, &audio_htstamp);
+		const double frames_captured = (audio_htstamp.tv_sec + 1e-9 * audio_htstamp.tv_nsec) * sample_rate;
+		frames_after_last_read = max(frames_captured - double(frames_since_start), 0.0);
+	} else {
+		frames_after_last_read = snd_pcm_status_get_avail(status);
+	}
+
+	*ts = steady_clock::time_point(duration_cast<steady_clock::duration>(
+		seconds(htstamp.tv_sec) + nanoseconds(htstamp.tv_nsec) -
+		duration<double>(frames_after_last_read / sample_rate)));
+
+	// Guard against the timestamps being in some other clock domain
+	// than we asked for (e.g. from a buggy driver); if so, we'd much rather
+	// have jittery timestamps than wildly wrong ones.
+	if (*ts > now || now - *ts > seconds(1)) {
+		return false;
+	}
+	return true;
+}
+
+void ALSAInput::count_jitter(steady_clock::time_point system_ts, steady_clock::time_point hardware_ts, bool has_hardware_ts, snd_pcm_sframes_t frames)
+{
+	const double expected_sec = double(frames) / sample_rate;
+	if (has_last_ts) {
+		const double actual_sec = duration<double>(system_ts - last_system_ts).count();
+		metric_alsa_timestamp_jitter_system_seconds.count_event(fabs(actual_sec - expected_sec));
+	}
+	if (has_hardware_ts && has_last_hardware_ts) {
+		const double actual_sec = duration<double>(hardware_ts - last_hardware_ts).count();
+		metric_alsa_timestamp_jitter_hardware_seconds.count_event(fabs(actual_sec - expected_sec));
+	}
+	last_system_ts = system_ts;
+	last_hardware_ts = hardware_ts;
+	has_last_ts = true;
+	has_last_hardware_ts = has_hardware_ts;
+}
+
 int64_t ALSAInput::frames_to_pts(uint64_t n) const
 {
 	return (n * TIMEBASE) / sample_rate;
@@ -18,8 +18,11 @@
 #include <memory>
 #include <string>
 #include <thread>
+#include <utility>
+#include <vector>
 
 #include "bmusb/bmusb.h"
+#include "metrics.h"
 #include "quittable_sleeper.h"
 
 class ALSAPool;
@@ -60,6 +63,15 @@ private:
 	};
 	CaptureEndReason do_capture();
 
+	// Find the time the last captured frame (ie., the one just returned
+	// by snd_pcm_readi()) was sampled, from the kernel's timestamps.
+	// Returns false if no usable timestamp is available.
+	bool get_hardware_timestamp(std::chrono::steady_clock::time_point *ts);
+
+	// Update the jitter histograms, measured as the difference between the
+	// actual and expected (from the number of frames) time since the last read.
+	void count_jitter(std::chrono::steady_clock::time_point system_ts, std::chrono::steady_clock::time_point hardware_ts, bool has_hardware_ts, snd_pcm_sframes_t frames);
+
 	std::string device;
 	unsigned sample_rate, num_channels, num_periods;
 	snd_pcm_uframes_t period_size;
@@ -73,6 +85,25 @@ private:
 	std::unique_ptr<uint8_t[]> buffer;
 	ALSAPool *parent_pool;
 	unsigned internal_dev_index;
+
+	// Whether the device gives us timestamps in the CLOCK_MONOTONIC domain
+	// (see open_device()).
+	bool hardware_timestamps = false;
+
+	// Number of frames read since the last snd_pcm_start(), for matching
+	// up with the audio timestamp (which counts from the same point).
+	uint64_t frames_since_start = 0;
+
+	// For count_jitter(); reset on every (re)start.
+	bool has_last_ts = false, has_last_hardware_ts = false;
+	std::chrono::steady_clock::time_point last_system_ts, last_hardware_ts;
+
+	// Metrics.
+	std::vector<std::pair<std::string, std::string>> labels;
+	Histogram metric_alsa_timestamp_jitter_system_seconds;
+	Histogram metric_alsa_timestamp_jitter_hardware_seconds;
+	std::atomic<int64_t> metric_alsa_hardware_timestamps_used{0};
+	std::atomic<int64_t> metric_alsa_hardware_timestamps_unavailable{0};
 };
 
 #endif  // !defined(_ALSA_INPUT_H)
@@ -5,11 +5,13 @@
 #include <errno.h>
 #include <limits.h>
 #include <pthread.h>
-#include <poll.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
+#include <sys/epoll.h>
 #include <sys/eventfd.h>
 #include <sys/inotify.h>
+#include <sys/timerfd.h>
 #include <unistd.h>
 #include <algorithm>
 #include <chrono>
@@ -25,12 +27,15 @@
 #include "state.pb.h"
 
 using namespace std;
+using namespace std::chrono;
 using namespace std::placeholders;
 
 ALSAPool::ALSAPool()
 {
 	should_quit_fd = eventfd(/*initval=*/0, /*flags=*/0);
 	assert(should_quit_fd != -1);
+	retry_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	assert(retry_timer_fd != -1);
 }
 
 ALSAPool::~ALSAPool()
@@ -46,11 +51,7 @@ ALSAPool::~ALSAPool()
 		perror("write(should_quit_fd)");
 		exit(1);
 	}
-	inotify_thread.join();
-
-	while (retry_threads_running > 0) {
-		this_thread::sleep_for(std::chrono::milliseconds(100));
-	}
+	hotplug_thread.join();
 }
 
 std::vector<ALSAPool::Device> ALSAPool::get_devices()
@@ -105,10 +106,10 @@ void ALSAPool::probe_device_with_retry(unsigned card_index, unsigned dev_index)
 	snprintf(address, sizeof(address), "hw:%d,%d", card_index, dev_index);
 
 	lock_guard<mutex> lock(add_device_mutex);
-	if (add_device_tries_left.count(address)) {
-		// Some thread is already busy retrying this,
-		// so just reset its count.
-		add_device_tries_left[address] = num_retries;
+	auto it = pending_probes.find(address);
+	if (it != pending_probes.end()) {
+		// We're already retrying this, so just reset its count.
+		it->second.tries_left = num_retries;
 		return;
 	}
 
@@ -122,55 +123,66 @@ void ALSAPool::probe_device_with_retry(unsigned card_index, unsigned dev_index)
 	assert(result == ProbeResult::DEFER);
 
 	// Add failed for whatever reason (probably just that the device
-	// isn't up yet. Set up a count so that nobody else starts a thread,
-	// then start it ourselves.
+	// isn't up yet). Let the hotplug thread try again later.
 	fprintf(stderr, "Trying %s again in one second...\n", address);
-	add_device_tries_left[address] = num_retries;
-	++retry_threads_running;
-	thread(&ALSAPool::probe_device_retry_thread_func, this, card_index, dev_index).detach();
+	pending_probes[address] = PendingProbe{ card_index, dev_index, num_retries, steady_clock::now() + seconds(1) };
+	rearm_retry_timer();
 }
 
-void ALSAPool::probe_device_retry_thread_func(unsigned card_index, unsigned dev_index)
+void ALSAPool::retry_pending_probes()
 {
-	char address[256];
-	snprintf(address, sizeof(address), "hw:%d,%d", card_index, dev_index);
-
-	char thread_name[16];
-	snprintf(thread_name, sizeof(thread_name), "Reprobe_hw:%d,%d", card_index, dev_index);
-	pthread_setname_np(pthread_self(), thread_name);
-
-	for ( ;; ) {  // Termination condition within the loop.
-		sleep(1);
-
-		// See if there are any retries left.
-		lock_guard<mutex> lock(add_device_mutex);
-		if (should_quit ||
-		    !add_device_tries_left.count(address) ||
-		    add_device_tries_left[address] == 0) {
-			add_device_tries_left.erase(address);
-			fprintf(stderr, "Giving up probe of %s.\n", address);
+	lock_guard<mutex> lock(add_device_mutex);
+	const steady_clock::time_point now = steady_clock::now();
+	for (auto it = pending_probes.begin(); it != pending_probes.end(); ) {
+		const string &address = it->first;
+		PendingProbe &probe = it->second;
+		if (should_quit) {
 			break;
 		}
+		if (probe.next_try > now) {
+			++it;
+			continue;
+		}
 
-		// Seemingly there were. Give it a try (we still hold the mutex).
-		ProbeResult result = probe_device_once(card_index, dev_index);
+		// Give it a try (we still hold the mutex).
+		ProbeResult result = probe_device_once(probe.card_index, probe.dev_index);
 		if (result == ProbeResult::SUCCESS) {
-			add_device_tries_left.erase(address);
-			fprintf(stderr, "Probe of %s succeeded.\n", address);
-			break;
-		} else if (result == ProbeResult::FAILURE || --add_device_tries_left[address] == 0) {
-			add_device_tries_left.erase(address);
-			fprintf(stderr, "Giving up probe of %s.\n", address);
-			break;
+			fprintf(stderr, "Probe of %s succeeded.\n", address.c_str());
+			it = pending_probes.erase(it);
+		} else if (result == ProbeResult::FAILURE || --probe.tries_left == 0) {
+			fprintf(stderr, "Giving up probe of %s.\n", address.c_str());
+			it = pending_probes.erase(it);
+		} else {
+			// Failed again.
+			assert(result == ProbeResult::DEFER);
+			fprintf(stderr, "Trying %s again in one second (%d tries left)...\n",
+				address.c_str(), probe.tries_left);
+			probe.next_try = now + seconds(1);
+			++it;
 		}
-
-		// Failed again.
-		assert(result == ProbeResult::DEFER);
-		fprintf(stderr, "Trying %s again in one second (%d tries left)...\n",
-			address, add_device_tries_left[address]);
 	}
+	rearm_retry_timer();
+}
 
-	--retry_threads_running;
+void ALSAPool::rearm_retry_timer()
+{
+	itimerspec timer_spec;
+	memset(&timer_spec, 0, sizeof(timer_spec));  // Disarms the timer if there's nothing to wait for.
+	if (!pending_probes.empty()) {
+		steady_clock::time_point next_try = steady_clock::time_point::max();
+		for (const auto &address_and_probe : pending_probes) {
+			next_try = min(next_try, address_and_probe.second.next_try);
+		}
+
+		// An all-zero it_value would disarm the timer, so make sure
+		// we wait at least a little bit.
+		const nanoseconds wait = max<nanoseconds>(next_try - steady_clock::now(), microseconds(1));
+		timer_spec.it_value.tv_sec = duration_cast<seconds>(wait).count();
+		timer_spec.it_value.tv_nsec = (wait % seconds(1)).count();
+	}
+	if (timerfd_settime(retry_timer_fd, /*flags=*/0, &timer_spec, nullptr) == -1) {
+		perror("timerfd_settime()");
+	}
 }
 
 ALSAPool::ProbeResult ALSAPool::probe_device_once(unsigned card_index, unsigned dev_index)
@@ -287,99 +299,126 @@ void ALSAPool::unplug_device(unsigned card_index, unsigned dev_index)
 
 void ALSAPool::init()
 {
-	inotify_thread = thread(&ALSAPool::inotify_thread_func, this);
+	hotplug_thread = thread(&ALSAPool::hotplug_thread_func, this);
 	enumerate_devices();
 }
 
-void ALSAPool::inotify_thread_func()
+void ALSAPool::hotplug_thread_func()
 {
 	pthread_setname_np(pthread_self(), "ALSA_Hotplug");
 
-	int inotify_fd = inotify_init();
+	int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd == -1) {
+		perror("epoll_create1()");
+		exit(1);
+	}
+
+	// If inotify fails, we still need to run the loop for retries;
+	// we just won't get any hotplug events.
+	int inotify_fd = inotify_init1(IN_CLOEXEC);
+	int watch_fd = -1;
 	if (inotify_fd == -1) {
-		perror("inotify_init()");
+		perror("inotify_init1()");
 		fprintf(stderr, "No hotplug of ALSA devices available.\n");
-		return;
+	} else {
+		watch_fd = inotify_add_watch(inotify_fd, "/dev/snd", IN_MOVE | IN_CREATE | IN_DELETE);
+		if (watch_fd == -1) {
+			perror("inotify_add_watch()");
+			fprintf(stderr, "No hotplug of ALSA devices available.\n");
+			close(inotify_fd);
+			inotify_fd = -1;
+		}
 	}
 
-	int watch_fd = inotify_add_watch(inotify_fd, "/dev/snd", IN_MOVE | IN_CREATE | IN_DELETE);
-	if (watch_fd == -1) {
-		perror("inotify_add_watch()");
-		fprintf(stderr, "No hotplug of ALSA devices available.\n");
-		close(inotify_fd);
-		return;
+	for (int fd : { should_quit_fd, retry_timer_fd, inotify_fd }) {
+		if (fd == -1) continue;
+		epoll_event event;
+		memset(&event, 0, sizeof(event));
+		event.events = EPOLLIN;
+		event.data.fd = fd;
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+			perror("epoll_ctl()");
+			exit(1);
+		}
 	}
 
-	int size = sizeof(inotify_event) + NAME_MAX + 1;
-	unique_ptr<char[]> buf(new char[size]);
 	while (!should_quit) {
-		pollfd fds[2];
-		fds[0].fd = inotify_fd;
-		fds[0].events = POLLIN;
-		fds[0].revents = 0;
-		fds[1].fd = should_quit_fd;
-		fds[1].events = POLLIN;
-		fds[1].revents = 0;
-
-		int ret = poll(fds, 2, -1);
+		epoll_event events[3];
+		int ret = epoll_wait(epoll_fd, events, 3, -1);
 		if (ret == -1) {
 			if (errno == EINTR) {
 				continue;
 			} else {
-				perror("poll(inotify_fd)");
-				return;
+				perror("epoll_wait()");
+				break;
 			}
 		}
-		if (ret == 0) {
-			continue;
-		}
 
-		if (fds[1].revents) break;  // should_quit_fd asserted.
-
-		ret = read(inotify_fd, buf.get(), size);
-		if (ret == -1) {
-			if (errno == EINTR) {
-				continue;
-			} else {
-				perror("read(inotify_fd)");
-				close(watch_fd);
-				close(inotify_fd);
-				return;
+		bool quit = false;
+		for (int i = 0; i < ret; ++i) {
+			const int fd = events[i].data.fd;
+			if (fd == should_quit_fd) {
+				quit = true;
+			} else if (fd == retry_timer_fd) {
+				uint64_t num_expirations;
+				if (read(retry_timer_fd, &num_expirations, sizeof(num_expirations)) == -1 && errno != EAGAIN) {
+					perror("read(retry_timer_fd)");
+				}
+				retry_pending_probes();
+			} else if (fd == inotify_fd) {
+				handle_inotify_events(inotify_fd);
 			}
 		}
-		if (ret < int(sizeof(inotify_event))) {
-			fprintf(stderr, "inotify read unexpectedly returned %d, giving up hotplug of ALSA devices.\n",
-				int(ret));
-			close(watch_fd);
-			close(inotify_fd);
-			return;
+		if (quit) break;
+	}
+
+	if (inotify_fd != -1) {
+		close(watch_fd);
+		close(inotify_fd);
+	}
+	close(epoll_fd);
+	close(retry_timer_fd);
+	close(should_quit_fd);
+}
+
+void ALSAPool::handle_inotify_events(int inotify_fd)
+{
+	int size = sizeof(inotify_event) + NAME_MAX + 1;
+	unique_ptr<char[]> buf(new char[size]);
+	int ret = read(inotify_fd, buf.get(), size);
+	if (ret == -1) {
+		if (errno != EINTR) {
+			perror("read(inotify_fd)");
 		}
+		return;
+	}
+	if (ret < int(sizeof(inotify_event))) {
+		fprintf(stderr, "inotify read unexpectedly returned %d, may lose ALSA hotplug events.\n",
+			int(ret));
+		return;
+	}
 
-		for (int i = 0; i < ret; ) {
-			const inotify_event *event = reinterpret_cast<const inotify_event *>(&buf[i]);
-			i += sizeof(inotify_event) + event->len;
+	for (int i = 0; i < ret; ) {
+		const inotify_event *event = reinterpret_cast<const inotify_event *>(&buf[i]);
+		i += sizeof(inotify_event) + event->len;
 
-			if (event->mask & IN_Q_OVERFLOW) {
-				fprintf(stderr, "WARNING: inotify overflowed, may lose ALSA hotplug events.\n");
-				continue;
+		if (event->mask & IN_Q_OVERFLOW) {
+			fprintf(stderr, "WARNING: inotify overflowed, may lose ALSA hotplug events.\n");
+			continue;
+		}
+		unsigned card, device;
+		char type;
+		if (sscanf(event->name, "pcmC%uD%u%c", &card, &device, &type) == 3 && type == 'c') {
+			if (event->mask & (IN_MOVED_FROM | IN_DELETE)) {
+				printf("Deleted capture device: Card %u, device %u\n", card, device);
+				unplug_device(card, device);
 			}
-			unsigned card, device;
-			char type;
-			if (sscanf(event->name, "pcmC%uD%u%c", &card, &device, &type) == 3 && type == 'c') {
-				if (event->mask & (IN_MOVED_FROM | IN_DELETE)) {
-					printf("Deleted capture device: Card %u, device %u\n", card, device);
-					unplug_device(card, device);
-				}
-				if (event->mask & (IN_MOVED_TO | IN_CREATE)) {
-					printf("Adding capture device: Card %u, device %u\n", card, device);
-					probe_device_with_retry(card, device);
-				}
+			if (event->mask & (IN_MOVED_TO | IN_CREATE)) {
+				printf("Adding capture device: Card %u, device %u\n", card, device);
+				probe_device_with_retry(card, device);
 			}
 		}
 	}
-	close(watch_fd);
-	close(inotify_fd);
-	close(should_quit_fd);
 }
 
 void ALSAPool::reset_device(unsigned index)
@@ -2,6 +2,7 @@
 #define _ALSA_POOL_H 1
 
 #include <atomic>
+#include <chrono>
 #include <memory>
 #include <mutex>
 #include <string>
@@ -111,22 +112,37 @@ private:
 	std::vector<Device> devices;  // Under mu.
 	std::vector<std::unique_ptr<ALSAInput>> inputs;  // Under mu, corresponds 1:1 to devices.
 
-	// Keyed on device address (e.g. “hw:0,0”). If there's an entry here,
-	// it means we already have a thread doing retries, so we shouldn't
-	// start a new one.
-	std::unordered_map<std::string, unsigned> add_device_tries_left;  // Under add_device_mutex.
+	// Probes that failed but should be retried later, keyed on device
+	// address (e.g. “hw:0,0”). If there's an entry here, the hotplug thread
+	// will retry it when the time comes, so nobody else should.
+	struct PendingProbe {
+		unsigned card_index, dev_index;
+		unsigned tries_left;
+		std::chrono::steady_clock::time_point next_try;
+	};
+	std::unordered_map<std::string, PendingProbe> pending_probes;  // Under add_device_mutex.
 	std::mutex add_device_mutex;
 
 	static constexpr int num_retries = 10;
 
-	void inotify_thread_func();
+	// The hotplug thread runs a single epoll loop that handles inotify events
+	// from /dev/snd, probe retries (through <retry_timer_fd>) and quitting,
+	// so that we don't need a thread per device that is being retried.
+	void hotplug_thread_func();
+	void handle_inotify_events(int inotify_fd);
 	void enumerate_devices();
 
 	// Try to add an input at the given card/device. If it succeeds, return
-	// synchronously. If not, fire off a background thread to try up to
-	// <num_retries> times.
+	// synchronously. If not, schedule it to be retried up to <num_retries>
+	// times by the hotplug thread.
 	void probe_device_with_retry(unsigned card_index, unsigned dev_index);
-	void probe_device_retry_thread_func(unsigned card_index, unsigned dev_index);
+
+	// Called by the hotplug thread when <retry_timer_fd> expires.
+	void retry_pending_probes();
+
+	// Must be called with <add_device_mutex> held. Sets <retry_timer_fd> to
+	// expire at the next pending probe, or disarms it if there are none.
+	void rearm_retry_timer();
 
 	enum class ProbeResult {
 		SUCCESS,
@@ -146,8 +162,8 @@ private:
 
 	std::atomic<bool> should_quit{false};
 	int should_quit_fd;
-	std::thread inotify_thread;
-	std::atomic<int> retry_threads_running{0};
+	int retry_timer_fd;
+	std::thread hotplug_thread;
 
 	friend class ALSAInput;
 };
@@ -232,16 +232,20 @@ void AudioMixer::reset_resampler(DeviceSpec device_spec)
 void AudioMixer::reset_resampler_mutex_held(DeviceSpec device_spec)
 {
 	AudioDevice *device = find_audio_device(device_spec);
+	device->resampling_queue = create_resampling_queue(device_spec, device->capture_frequency, device->interesting_channels.size());
+}
 
-	if (device->interesting_channels.empty()) {
-		device->resampling_queue.reset();
-	} else {
-		// TODO: ResamplingQueue should probably take the full device spec.
-		// (It's only used for console output, though.)
-		device->resampling_queue.reset(new ResamplingQueue(
-			device_spec.index, device->capture_frequency, OUTPUT_FREQUENCY, device->interesting_channels.size(),
-			global_flags.audio_queue_length_ms * 0.001));
+unique_ptr<ResamplingQueue> AudioMixer::create_resampling_queue(DeviceSpec device_spec, unsigned capture_frequency, unsigned num_channels)
+{
+	if (num_channels == 0) {
+		return nullptr;
 	}
+
+	// TODO: ResamplingQueue should probably take the full device spec.
+	// (It's only used for console output, though.)
+	return unique_ptr<ResamplingQueue>(new ResamplingQueue(
+		device_spec.index, capture_frequency, OUTPUT_FREQUENCY, num_channels,
+		global_flags.audio_queue_length_ms * 0.001));
 }
 
 bool AudioMixer::add_audio(DeviceSpec device_spec, const uint8_t *data, unsigned num_samples, AudioFormat audio_format, int64_t frame_length, steady_clock::time_point frame_time)
@@ -631,8 +635,8 @@ namespace {
 void apply_filter_fade(StereoFilter *filter, float *data, unsigned num_samples, float cutoff_hz, float db, float last_db)
 {
 	// A granularity of 32 samples is an okay tradeoff between speed and
-	// smoothness; recalculating the filters is pretty expensive, so it's
-	// good that we don't do this all the time.
+	// smoothness. The filter only recalculates its coefficients at the
+	// start and end of the fade, and interpolates between them.
 	static constexpr unsigned filter_granularity_samples = 32;
 
 	const float cutoff_linear = cutoff_hz * 2.0 * M_PI / OUTPUT_FREQUENCY;
@@ -642,15 +646,8 @@ void apply_filter_fade(StereoFilter *filter, float *data, unsigned num_samples,
 			filter->render(data, num_samples, cutoff_linear, 0.5f, db / 40.0f);
 		}
 	} else {
-		// We need to do a fade. (Rounding up avoids division by zero.)
-		unsigned num_blocks = (num_samples + filter_granularity_samples - 1) / filter_granularity_samples;
-		const float inc_db_norm = (db - last_db) / 40.0f / num_blocks;
-		float db_norm = db / 40.0f;
-		for (size_t i = 0; i < num_samples; i += filter_granularity_samples) {
-			size_t samples_this_block = std::min<size_t>(num_samples - i, filter_granularity_samples);
-			filter->render(data + i * 2, samples_this_block, cutoff_linear, 0.5f, db_norm);
-			db_norm += inc_db_norm;
-		}
+		// We need to do a fade.
+		filter->render_fade(data, num_samples, cutoff_linear, 0.5f, last_db / 40.0f, db / 40.0f, filter_granularity_samples);
 	}
 }
 
@@ -941,9 +938,7 @@ void AudioMixer::set_simple_input(unsigned card_index)
 
 	new_input_mapping.buses.push_back(input);
 
-	lock_guard<timed_mutex> lock(audio_mutex);
-	current_mapping_mode = MappingMode::SIMPLE;
-	set_input_mapping_lock_held(new_input_mapping);
+	apply_input_mapping(new_input_mapping, MappingMode::SIMPLE);
 	fader_volume_db[0] = 0.0f;
 }
 
@@ -962,9 +957,7 @@ unsigned AudioMixer::get_simple_input() const
 
 void AudioMixer::set_input_mapping(const InputMapping &new_input_mapping)
 {
-	lock_guard<timed_mutex> lock(audio_mutex);
-	set_input_mapping_lock_held(new_input_mapping);
-	current_mapping_mode = MappingMode::MULTICHANNEL;
+	apply_input_mapping(new_input_mapping, MappingMode::MULTICHANNEL);
 }
 
 AudioMixer::MappingMode AudioMixer::get_mapping_mode() const
@@ -973,8 +966,21 @@ AudioMixer::MappingMode AudioMixer::get_mapping_mode() const
 	return current_mapping_mode;
 }
 
-void AudioMixer::set_input_mapping_lock_held(const InputMapping &new_input_mapping)
+namespace {
+
+vector<pair<string, string>> with_channel_label(const vector<pair<string, string>> &labels, const char *channel)
 {
+	vector<pair<string, string>> ret = labels;
+	ret.emplace_back("channel", channel);
+	return ret;
+}
+
+}  // namespace
+
+void AudioMixer::apply_input_mapping(const InputMapping &new_input_mapping, MappingMode new_mapping_mode)
+{
+	lock_guard<mutex> mapping_lock(mapping_mutex);
+
 	map<DeviceSpec, set<unsigned>> interesting_channels;
 	for (const InputMapping::Bus &bus : new_input_mapping.buses) {
 		if (bus.device.type == InputSourceType::CAPTURE_CARD ||
@@ -987,34 +993,50 @@ void AudioMixer::set_input_mapping_lock_held(const InputMapping &new_input_mappi
 		}
 	}
 
-	// Kill all the old metrics, and set up new ones.
-	for (unsigned bus_index = 0; bus_index < input_mapping.buses.size(); ++bus_index) {
-		BusMetrics &metrics = bus_metrics[bus_index];
-
-		vector<pair<string, string>> labels_left = metrics.labels;
-		labels_left.emplace_back("channel", "left");
-		vector<pair<string, string>> labels_right = metrics.labels;
-		labels_right.emplace_back("channel", "right");
+	vector<DeviceSpec> all_devices;
+	for (unsigned card_index = 0; card_index < MAX_VIDEO_CARDS; ++card_index) {
+		all_devices.push_back(DeviceSpec{InputSourceType::CAPTURE_CARD, card_index});
+	}
+	for (unsigned card_index = 0; card_index < MAX_ALSA_CARDS; ++card_index) {
+		all_devices.push_back(DeviceSpec{InputSourceType::ALSA_INPUT, card_index});
+	}
 
-		global_metrics.remove("bus_current_level_dbfs", labels_left);
-		global_metrics.remove("bus_current_level_dbfs", labels_right);
-		global_metrics.remove("bus_peak_level_dbfs", labels_left);
-		global_metrics.remove("bus_peak_level_dbfs", labels_right);
-		global_metrics.remove("bus_historic_peak_dbfs", metrics.labels);
-		global_metrics.remove("bus_gain_staging_db", metrics.labels);
-		global_metrics.remove("bus_compressor_attenuation_db", metrics.labels);
+	// Find all devices that don't have the exact same state as before;
+	// only those will get new resampling queues. Setting up and priming
+	// a resampler is fairly expensive, so we do it before taking the lock
+	// for real, so that we don't stall get_output() and drop audio.
+	struct ChangedDevice {
+		DeviceSpec device_spec;
+		unsigned capture_frequency;
+		unique_ptr<ResamplingQueue> resampling_queue;
+	};
+	vector<ChangedDevice> changed_devices;
+	{
+		lock_guard<timed_mutex> lock(audio_mutex);
+		for (const DeviceSpec &device_spec : all_devices) {
+			const AudioDevice *device = find_audio_device(device_spec);
+			if (device->interesting_channels != interesting_channels[device_spec]) {
+				changed_devices.push_back(ChangedDevice{ device_spec, device->capture_frequency, nullptr });
+			}
+		}
 	}
-	bus_metrics.reset(new BusMetrics[new_input_mapping.buses.size()]);
+	for (ChangedDevice &changed : changed_devices) {
+		changed.resampling_queue = create_resampling_queue(
+			changed.device_spec, changed.capture_frequency, interesting_channels[changed.device_spec].size());
+	}
+
+	// Set up labels for the new bus metrics. They are registered below,
+	// once the new mapping is in place.
+	unique_ptr<BusMetrics[]> new_bus_metrics(new BusMetrics[new_input_mapping.buses.size()]);
 	for (unsigned bus_index = 0; bus_index < new_input_mapping.buses.size(); ++bus_index) {
 		const InputMapping::Bus &bus = new_input_mapping.buses[bus_index];
-		BusMetrics &metrics = bus_metrics[bus_index];
+		BusMetrics &metrics = new_bus_metrics[bus_index];
 
 		char bus_index_str[16], source_index_str[16], source_channels_str[64];
 		snprintf(bus_index_str, sizeof(bus_index_str), "%u", bus_index);
 		snprintf(source_index_str, sizeof(source_index_str), "%u", bus.device.index);
 		snprintf(source_channels_str, sizeof(source_channels_str), "%d:%d", bus.source_channel[0], bus.source_channel[1]);
 
-		vector<pair<string, string>> labels;
 		metrics.labels.emplace_back("index", bus_index_str);
 		metrics.labels.emplace_back("name", bus.name);
 		if (bus.device.type == InputSourceType::SILENCE) {
@@ -1028,46 +1050,76 @@ void AudioMixer::set_input_mapping_lock_held(const InputMapping &new_input_mappi
 		}
 		metrics.labels.emplace_back("source_index", source_index_str);
 		metrics.labels.emplace_back("source_channels", source_channels_str);
+	}
 
-		vector<pair<string, string>> labels_left = metrics.labels;
-		labels_left.emplace_back("channel", "left");
-		vector<pair<string, string>> labels_right = metrics.labels;
-		labels_right.emplace_back("channel", "right");
+	// Now swap in the new state. get_output() holds audio_mutex for an entire
+	// frame, so this happens at a frame boundary. Devices and buses that are
+	// unchanged keep their queues, filters and compressors untouched.
+	// The old queues are freed after we've let go of the lock.
+	vector<unique_ptr<ResamplingQueue>> old_resampling_queues;
+	unique_ptr<BusMetrics[]> old_bus_metrics;
+	unsigned old_num_buses;
+	{
+		lock_guard<timed_mutex> lock(audio_mutex);
+		for (ChangedDevice &changed : changed_devices) {
+			AudioDevice *device = find_audio_device(changed.device_spec);
+			device->interesting_channels = interesting_channels[changed.device_spec];
+			if (device->capture_frequency != changed.capture_frequency) {
+				// add_audio() saw a sample rate change while we were building
+				// the queue. This is rare enough that we just rebuild it here.
+				changed.resampling_queue = create_resampling_queue(
+					changed.device_spec, device->capture_frequency, device->interesting_channels.size());
+			}
+			old_resampling_queues.push_back(move(device->resampling_queue));
+			device->resampling_queue = move(changed.resampling_queue);
+		}
 
-		global_metrics.add("bus_current_level_dbfs", labels_left, &metrics.current_level_dbfs[0], Metrics::TYPE_GAUGE);
-		global_metrics.add("bus_current_level_dbfs", labels_right, &metrics.current_level_dbfs[1], Metrics::TYPE_GAUGE);
-		global_metrics.add("bus_peak_level_dbfs", labels_left, &metrics.peak_level_dbfs[0], Metrics::TYPE_GAUGE);
-		global_metrics.add("bus_peak_level_dbfs", labels_right, &metrics.peak_level_dbfs[1], Metrics::TYPE_GAUGE);
+		old_num_buses = input_mapping.buses.size();
+		old_bus_metrics = move(bus_metrics);
+		bus_metrics = move(new_bus_metrics);
+		input_mapping = new_input_mapping;
+		current_mapping_mode = new_mapping_mode;
+	}
+
+	// Kill all the old metrics, and register the new ones.
+	for (unsigned bus_index = 0; bus_index < old_num_buses; ++bus_index) {
+		const BusMetrics &metrics = old_bus_metrics[bus_index];
+		global_metrics.remove("bus_current_level_dbfs", with_channel_label(metrics.labels, "left"));
+		global_metrics.remove("bus_current_level_dbfs", with_channel_label(metrics.labels, "right"));
+		global_metrics.remove("bus_peak_level_dbfs", with_channel_label(metrics.labels, "left"));
+		global_metrics.remove("bus_peak_level_dbfs", with_channel_label(metrics.labels, "right"));
+		global_metrics.remove("bus_historic_peak_dbfs", metrics.labels);
+		global_metrics.remove("bus_gain_staging_db", metrics.labels);
+		global_metrics.remove("bus_compressor_attenuation_db", metrics.labels);
+	}
+	old_bus_metrics.reset();
+	for (unsigned bus_index = 0; bus_index < new_input_mapping.buses.size(); ++bus_index) {
+		BusMetrics &metrics = bus_metrics[bus_index];
+		global_metrics.add("bus_current_level_dbfs", with_channel_label(metrics.labels, "left"), &metrics.current_level_dbfs[0], Metrics::TYPE_GAUGE);
+		global_metrics.add("bus_current_level_dbfs", with_channel_label(metrics.labels, "right"), &metrics.current_level_dbfs[1], Metrics::TYPE_GAUGE);
+		global_metrics.add("bus_peak_level_dbfs", with_channel_label(metrics.labels, "left"), &metrics.peak_level_dbfs[0], Metrics::TYPE_GAUGE);
+		global_metrics.add("bus_peak_level_dbfs", with_channel_label(metrics.labels, "right"), &metrics.peak_level_dbfs[1], Metrics::TYPE_GAUGE);
 		global_metrics.add("bus_historic_peak_dbfs", metrics.labels, &metrics.historic_peak_dbfs, Metrics::TYPE_GAUGE);
 		global_metrics.add("bus_gain_staging_db", metrics.labels, &metrics.gain_staging_db, Metrics::TYPE_GAUGE);
 		global_metrics.add("bus_compressor_attenuation_db", metrics.labels, &metrics.compressor_attenuation_db, Metrics::TYPE_GAUGE);
 	}
 
-	// Reset resamplers for all cards that don't have the exact same state as before.
-	for (unsigned card_index = 0; card_index < MAX_VIDEO_CARDS; ++card_index) {
-		const DeviceSpec device_spec{InputSourceType::CAPTURE_CARD, card_index};
-		AudioDevice *device = find_audio_device(device_spec);
-		if (device->interesting_channels != interesting_channels[device_spec]) {
-			device->interesting_channels = interesting_channels[device_spec];
-			reset_resampler_mutex_held(device_spec);
-		}
-	}
+	// Finally, hold the ALSA cards we need and restart the ones whose
+	// channels changed. Restarting means stopping the capture thread,
+	// which can take a while, so this is also done without audio_mutex.
 	for (unsigned card_index = 0; card_index < MAX_ALSA_CARDS; ++card_index) {
 		const DeviceSpec device_spec{InputSourceType::ALSA_INPUT, card_index};
-		AudioDevice *device = find_audio_device(device_spec);
 		if (interesting_channels[device_spec].empty()) {
 			alsa_pool.release_device(card_index);
 		} else {
 			alsa_pool.hold_device(card_index);
 		}
-		if (device->interesting_channels != interesting_channels[device_spec]) {
-			device->interesting_channels = interesting_channels[device_spec];
-			alsa_pool.reset_device(device_spec.index);
-			reset_resampler_mutex_held(device_spec);
+	}
+	for (const ChangedDevice &changed : changed_devices) {
+		if (changed.device_spec.type == InputSourceType::ALSA_INPUT) {
+			alsa_pool.reset_device(changed.device_spec.index);
 		}
 	}
-
-	input_mapping = new_input_mapping;
 }
 
 InputMapping AudioMixer::get_input_mapping() const
@@ -10,7 +10,6 @@
 
 #include <assert.h>
 #include <stdint.h>
-#include <zita-resampler/resampler.h>
 #include <atomic>
 #include <chrono>
 #include <functional>
@@ -28,6 +27,7 @@
 #include "ebu_r128_proc.h"
 #include "filter.h"
 #include "input_mapping.h"
+#include "polyphase_resampler.h"
 #include "resampling_queue.h"
 #include "stereocompressor.h"
 
@@ -325,12 +325,22 @@ private:
 	void measure_bus_levels(unsigned bus_index, const std::vector<float> &left, const std::vector<float> &right);
 	void send_audio_level_callback();
 	std::vector<DeviceSpec> get_active_devices() const;
-	void set_input_mapping_lock_held(const InputMapping &input_mapping);
+	std::unique_ptr<ResamplingQueue> create_resampling_queue(DeviceSpec device_spec, unsigned capture_frequency, unsigned num_channels);
+
+	// Diffs the new mapping against the current one and applies it. Only devices
+	// whose set of interesting channels changes get new resampling queues;
+	// they are built before taking audio_mutex, and then everything is
+	// swapped in at once, between two calls to get_output().
+	void apply_input_mapping(const InputMapping &input_mapping, MappingMode mapping_mode);
 
 	unsigned num_cards;
 
 	mutable std::timed_mutex audio_mutex;
 
+	// Serializes apply_input_mapping(), which only holds audio_mutex
+	// for short periods. Must be taken before audio_mutex.
+	std::mutex mapping_mutex;
+
 	ALSAPool alsa_pool;
 	AudioDevice video_cards[MAX_VIDEO_CARDS];  // Under audio_mutex.
 	AudioDevice alsa_inputs[MAX_ALSA_CARDS];  // Under audio_mutex.
@@ -383,7 +393,7 @@ private:
 	mutable std::mutex audio_measure_mutex;
 	Ebu_r128_proc r128;  // Under audio_measure_mutex.
 	CorrelationMeasurer correlation;  // Under audio_measure_mutex.
-	Resampler peak_resampler;  // Under audio_measure_mutex.
+	PolyphaseResampler peak_resampler;  // Under audio_measure_mutex.
 	std::atomic<float> peak{0.0f};
 
 	// Metrics.
@@ -0,0 +1,145 @@
+// Microbenchmark of JitterHistory, and a check that its quantized estimator
+// agrees with the straightforward exact one (a sorted multiset over the
+// same window, which is what JitterHistory used to do).
+//
+// The input is synthetic: mostly sub-millisecond jitter, with rare bursts
+// of much larger values, roughly like the drifting clocks described in
+// experiments/queue_drop_policy.cpp.
+
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <iterator>
+#include <random>
+#include <set>
+#include <vector>
+
+#include "jitter_history.h"
+
+#define NUM_SAMPLES 1000000
+
+using namespace std;
+using namespace std::chrono;
+
+namespace {
+
+// Must match JitterHistory.
+constexpr double percentile = 0.999;
+constexpr double multiplier = 2.0;
+
+class ReferenceJitterHistory {
+public:
+	explicit ReferenceJitterHistory(size_t history_length) : history_length(history_length) {}
+
+	void add_jitter_sample(double jitter_seconds)
+	{
+		history.push_back(orders.insert(jitter_seconds));
+		if (history.size() > history_length) {
+			orders.erase(history.front());
+			history.pop_front();
+		}
+	}
+
+	double estimate_max_jitter() const
+	{
+		if (orders.empty()) {
+			return 0.0;
+		}
+		size_t elem_idx = lrint((orders.size() - 1) * percentile);
+		if (percentile <= 0.5) {
+			return *next(orders.begin(), elem_idx) * multiplier;
+		} else {
+			// The same element as the old prev(orders.end(), elem_idx + 1),
+			// but without walking almost the entire set to get there.
+			return *next(orders.begin(), orders.size() - 1 - elem_idx) * multiplier;
+		}
+	}
+
+private:
+	const size_t history_length;
+	multiset<double> orders;
+	deque<multiset<double>::iterator> history;
+};
+
+vector<double> make_samples()
+{
+	mt19937 rng(1234);
+	normal_distribution<double> normal(0.0, 0.0003);
+	uniform_real_distribution<double> uniform(0.0, 1.0);
+	vector<double> samples;
+	samples.reserve(NUM_SAMPLES);
+	for (unsigned i = 0; i < NUM_SAMPLES; ++i) {
+		double jitter = fabs(normal(rng));
+		if (uniform(rng) < 0.002) {
+			jitter += 0.02 * uniform(rng);  // Rare burst.
+		}
+		samples.push_back(jitter);
+	}
+	return samples;
+}
+
+template<class T>
+double run(T *history, const vector<double> &samples, vector<double> *estimates)
+{
+	steady_clock::time_point start = steady_clock::now();
+	double sum = 0.0;  // To keep the compiler from optimizing anything away.
+	for (size_t i = 0; i < samples.size(); ++i) {
+		history->add_jitter_sample(samples[i]);
+		double estimate = history->estimate_max_jitter();
+		sum += estimate;
+		if (estimates != nullptr) {
+			(*estimates)[i] = estimate;
+		}
+	}
+	steady_clock::time_point end = steady_clock::now();
+	if (sum < 0.0) abort();
+	return duration<double>(end - start).count();
+}
+
+bool check_and_benchmark(size_t history_length, const char *description, const vector<double> &samples)
+{
+	printf("Window of %zu frames (%s):\n", history_length, description);
+
+	vector<double> ref_estimates(samples.size()), estimates(samples.size());
+	ReferenceJitterHistory ref(history_length);
+	double ref_seconds = run(&ref, samples, &ref_estimates);
+	JitterHistory history(history_length);
+	double seconds = run(&history, samples, &estimates);
+
+	// The quantization is about 1% per bucket; values below 10 µs all go into one bucket.
+	double max_rel_err = 0.0;
+	bool ok = true;
+	for (size_t i = 0; i < samples.size(); ++i) {
+		if (ref_estimates[i] < 2e-5 * multiplier && estimates[i] < 2e-5 * multiplier) {
+			continue;
+		}
+		double rel_err = fabs(estimates[i] - ref_estimates[i]) / ref_estimates[i];
+		max_rel_err = max(max_rel_err, rel_err);
+		if (rel_err > 0.01) {
+			fprintf(stderr, "  MISMATCH at sample %zu: exact %.6f ms, estimated %.6f ms\n",
+				i, 1e3 * ref_estimates[i], 1e3 * estimates[i]);
+			ok = false;
+			break;
+		}
+	}
+
+	printf("  multiset:      %7.1f ns/frame\n", 1e9 * ref_seconds / samples.size());
+	printf("  JitterHistory: %7.1f ns/frame\n", 1e9 * seconds / samples.size());
+	printf("  Max relative difference: %.3f%%  [%s]\n", 100.0 * max_rel_err, ok ? "OK" : "FAIL");
+	return ok;
+}
+
+}  // namespace
+
+int main(void)
+{
+	vector<double> samples = make_samples();
+	bool ok = true;
+	ok &= check_and_benchmark(5000, "default", samples);
+	ok &= check_and_benchmark(60 * 60 * 60, "one hour at 60 fps", samples);
+	return ok ? 0 : 1;
+}
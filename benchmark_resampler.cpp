@@ -0,0 +1,140 @@
+// Benchmark of the in-tree polyphase resamplers against the system
+// zita-resampler, for the configurations Nageru actually uses:
+// the variable-rate resampler at a ratio near 1 (ResamplingQueue), and
+// 4x oversampling for the peak meter. Also checks that the output
+// matches zita-resampler's to within floating-point rounding.
+
+#include <stdio.h>
+#include <zita-resampler/resampler.h>
+#include <zita-resampler/vresampler.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <random>
+#include <vector>
+
+#include "polyphase_resampler.h"
+
+#define NUM_INPUT_FRAMES 480000  // Ten seconds at 48 kHz.
+#define CHUNK_FRAMES 1024
+
+using namespace std;
+using namespace std::chrono;
+
+namespace {
+
+vector<float> make_input(unsigned num_channels)
+{
+	// Noise plus a sine, so that the output is not all decaying tails.
+	mt19937 rng(1234);
+	uniform_real_distribution<float> noise(-0.5f, 0.5f);
+	vector<float> in(NUM_INPUT_FRAMES * num_channels);
+	for (unsigned i = 0; i < NUM_INPUT_FRAMES; ++i) {
+		for (unsigned c = 0; c < num_channels; ++c) {
+			in[i * num_channels + c] = 0.4f * sin(i * 0.01 * (c + 1)) + noise(rng);
+		}
+	}
+	return in;
+}
+
+// Works for both zita-resampler's and our own classes, since they have the same API.
+template<class T>
+vector<float> run(T *resampler, const vector<float> &in, unsigned num_channels, double ratio, double *elapsed_seconds)
+{
+	vector<float> out(size_t(ceil(NUM_INPUT_FRAMES * ratio)) * num_channels);
+	size_t num_out_frames = 0;
+
+	steady_clock::time_point start = steady_clock::now();
+	for (size_t i = 0; i < NUM_INPUT_FRAMES; i += CHUNK_FRAMES) {
+		resampler->inp_data = const_cast<float *>(&in[i * num_channels]);
+		resampler->inp_count = min<size_t>(CHUNK_FRAMES, NUM_INPUT_FRAMES - i);
+		while (resampler->inp_count > 0 && num_out_frames < out.size() / num_channels) {
+			resampler->out_data = &out[num_out_frames * num_channels];
+			resampler->out_count = out.size() / num_channels - num_out_frames;
+			resampler->process();
+			num_out_frames = out.size() / num_channels - resampler->out_count;
+		}
+	}
+	steady_clock::time_point end = steady_clock::now();
+	*elapsed_seconds = duration<double>(end - start).count();
+
+	out.resize(num_out_frames * num_channels);
+	return out;
+}
+
+double max_difference(const vector<float> &a, const vector<float> &b)
+{
+	double diff = 0.0;
+	for (size_t i = 0; i < min(a.size(), b.size()); ++i) {
+		diff = max<double>(diff, fabs(a[i] - b[i]));
+	}
+	return diff;
+}
+
+void print_result(const char *name, double elapsed_seconds, double ref_seconds, double diff)
+{
+	printf("  %-12s %8.2f ms  (%.2fx realtime, %.2fx zita)  max diff %.2g\n",
+		name, 1e3 * elapsed_seconds, (NUM_INPUT_FRAMES / 48000.0) / elapsed_seconds,
+		ref_seconds / elapsed_seconds, diff);
+}
+
+void benchmark_variable(unsigned num_channels)
+{
+	const double ratio = 48000.0 / 48003.0;
+	const double rratio = 1.0001;
+	printf("Variable-rate resampler, %u channel(s), ratio %.5f:\n", num_channels, ratio * rratio);
+
+	vector<float> in = make_input(num_channels);
+
+	VResampler zita;
+	zita.setup(ratio, num_channels, /*hlen=*/32);
+	zita.set_rratio(rratio);
+	double ref_seconds;
+	vector<float> ref = run(&zita, in, num_channels, ratio * rratio, &ref_seconds);
+	print_result("zita", ref_seconds, ref_seconds, 0.0);
+
+	for (ResamplerISA isa : { ResamplerISA::SCALAR, ResamplerISA::SSE2, ResamplerISA::AVX2_FMA, ResamplerISA::AVX512 }) {
+		if (isa > detect_resampler_isa()) break;
+		set_max_resampler_isa(isa);
+		VariablePolyphaseResampler ours;
+		ours.setup(ratio, num_channels, /*hlen=*/32);
+		ours.set_rratio(rratio);
+		double seconds;
+		vector<float> out = run(&ours, in, num_channels, ratio * rratio, &seconds);
+		print_result(resampler_isa_name(isa), seconds, ref_seconds, max_difference(ref, out));
+	}
+}
+
+void benchmark_fixed(unsigned num_channels)
+{
+	printf("Fixed-rate resampler (peak meter), %u channel(s), 4x oversampling:\n", num_channels);
+
+	vector<float> in = make_input(num_channels);
+
+	Resampler zita;
+	zita.setup(48000, 48000 * 4, num_channels, /*hlen=*/16, /*frel=*/1.0);
+	double ref_seconds;
+	vector<float> ref = run(&zita, in, num_channels, 4.0, &ref_seconds);
+	print_result("zita", ref_seconds, ref_seconds, 0.0);
+
+	for (ResamplerISA isa : { ResamplerISA::SCALAR, ResamplerISA::SSE2, ResamplerISA::AVX2_FMA, ResamplerISA::AVX512 }) {
+		if (isa > detect_resampler_isa()) break;
+		set_max_resampler_isa(isa);
+		PolyphaseResampler ours;
+		ours.setup(48000, 48000 * 4, num_channels, /*hlen=*/16, /*frel=*/1.0);
+		double seconds;
+		vector<float> out = run(&ours, in, num_channels, 4.0, &seconds);
+		print_result(resampler_isa_name(isa), seconds, ref_seconds, max_difference(ref, out));
+	}
+}
+
+}  // namespace
+
+int main(void)
+{
+	printf("Best supported instruction set: %s\n\n", resampler_isa_name(detect_resampler_isa()));
+	for (unsigned num_channels : { 1, 2, 8 }) {
+		benchmark_variable(num_channels);
+	}
+	benchmark_fixed(2);
+}
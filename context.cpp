@@ -13,6 +13,7 @@ extern "C" {
 #include <QSurfaceFormat>
 
 QGLWidget *global_share_widget = nullptr;
+QOpenGLContext *global_share_context = nullptr;
 bool using_egl = false;
 
 using namespace std;
@@ -119,7 +120,7 @@ QSurface *create_surface_with_same_format(const QSurface *surface)
 QOpenGLContext *create_context(const QSurface *surface)
 {
 	QOpenGLContext *context = new QOpenGLContext;
-	context->setShareContext(global_share_widget->context()->contextHandle());
+	context->setShareContext(global_share_context);
 	context->setFormat(surface->format());
 	context->create();
 	return context;
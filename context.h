@@ -8,7 +8,8 @@ class QSurfaceFormat;
 class QGLWidget;
 
 extern bool using_egl;
-extern QGLWidget *global_share_widget;
+extern QGLWidget *global_share_widget;  // Only when running with a GUI.
+extern QOpenGLContext *global_share_context;  // All contexts share with this one.
 QSurface *create_surface(const QSurfaceFormat &format);
 QSurface *create_surface_with_same_format(const QSurface *surface);
 QOpenGLContext *create_context(const QSurface *surface);
@@ -247,7 +247,7 @@ void DeckLinkOutput::end_output()
 	}
 }
 
-void DeckLinkOutput::send_frame(GLuint y_tex, GLuint cbcr_tex, YCbCrLumaCoefficients output_ycbcr_coefficients, const vector<RefCountedFrame> &input_frames, int64_t pts, int64_t duration)
+void DeckLinkOutput::send_frame(GLuint y_tex, GLuint cbcr_tex, YCbCrLumaCoefficients output_ycbcr_coefficients, const InputFrameSet &input_frames, int64_t pts, int64_t duration)
 {
 	assert(!should_quit.should_quit());
 
@@ -572,7 +572,7 @@ void DeckLinkOutput::present_thread_func()
 		}
 
 		// Release any input frames we needed to render this frame.
-		frame->input_frames.clear();
+		frame->input_frames.reset();
 
 		BMDTimeValue pts = frame->pts;
 		BMDTimeValue duration = frame->duration;
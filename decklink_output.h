@@ -20,7 +20,7 @@
 #include "context.h"
 #include "print_latency.h"
 #include "quittable_sleeper.h"
-#include "ref_counted_frame.h"
+#include "input_state.h"
 #include "ref_counted_gl_sync.h"
 
 namespace movit {
@@ -42,7 +42,7 @@ public:
 	void start_output(uint32_t mode, int64_t base_pts);  // Mode comes from get_available_video_modes().
 	void end_output();
 
-	void send_frame(GLuint y_tex, GLuint cbcr_tex, movit::YCbCrLumaCoefficients ycbcr_coefficients, const std::vector<RefCountedFrame> &input_frames, int64_t pts, int64_t duration);
+	void send_frame(GLuint y_tex, GLuint cbcr_tex, movit::YCbCrLumaCoefficients ycbcr_coefficients, const InputFrameSet &input_frames, int64_t pts, int64_t duration);
 	void send_audio(int64_t pts, const std::vector<float> &samples);
 
 	// NOTE: The returned timestamp is undefined for preroll.
@@ -97,7 +97,7 @@ private:
 	private:
 		std::atomic<int> refcount{1};
 		RefCountedGLsync fence;  // Needs to be waited on before uyvy_ptr can be read from.
-		std::vector<RefCountedFrame> input_frames;  // Cannot be released before we are done rendering (ie., <fence> is asserted).
+		InputFrameSet input_frames;  // Cannot be released before we are done rendering (ie., <fence> is asserted).
 		ReceivedTimestamps received_ts;
 		int64_t pts, duration;
 		movit::ResourcePool *resource_pool;
@@ -8,6 +8,10 @@
 #define MAX_ALSA_CARDS 16
 #define MAX_BUSES 256  // Audio buses.
 
+// For the master clock watchdog (see --master-clock-timeout-frames).
+#define MASTER_CLOCK_STARTUP_SECONDS 2.0  // Timeout for the very first frame, to give the cards time to start.
+#define MASTER_CLOCK_FAILBACK_SECONDS 2.0  // How long the master card must be steady before we go back to it.
+
 // For deinterlacing. See also comments on InputState.
 #define FRAME_HISTORY_LENGTH 5
 
@@ -39,6 +43,10 @@
 // (frame threading, lookahead, etc.).
 #define X264_QUEUE_LENGTH 50
 
+// Same, for each rung of --x264-ladder. Their queues hold full-size frames,
+// since they are downscaled on the rung's own encoder thread, so keep them short.
+#define X264_LADDER_QUEUE_LENGTH 8
+
 #define X264_DEFAULT_PRESET "ultrafast"
 #define X264_DEFAULT_TUNE "film"
 
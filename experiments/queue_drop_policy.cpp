@@ -15,7 +15,9 @@
  * of jitter can make it hard for the algorithm to find the right level of
  * conservatism.
  *
- * This is not meant to be production-quality code.
+ * This is not meant to be production-quality code. For replaying logs
+ * recorded by Nageru itself (--record-frame-arrivals) through the actual
+ * production code, see queue_policy_simulator.cpp in the top directory.
  */
 
 #include <assert.h>
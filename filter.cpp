@@ -294,56 +294,151 @@ void StereoFilter::init(FilterType type, int new_order)
 		filters[i].init(type, new_order);
 	}
 #endif
+	cached_coeff_valid = false;
 }
 
-void StereoFilter::render(float *inout_left_ptr, unsigned n_samples, float cutoff, float resonance, float dbgain_normalized)
+StereoFilter::Coefficients StereoFilter::get_coefficients(float cutoff, float resonance, float dbgain_normalized)
 {
+	if (cached_coeff_valid &&
+	    cutoff == cached_cutoff &&
+	    resonance == cached_resonance &&
+	    dbgain_normalized == cached_dbgain_normalized) {
+		return cached_coeff;
+	}
+
 #ifdef __SSE__
-	if (parm_filter.filtertype == FILTER_NONE || parm_filter.filter_order == 0)
+	Filter *filter = &parm_filter;
+#else
+	Filter *filter = &filters[0];
+#endif
+	filter->set_linear_cutoff(cutoff);
+	filter->set_resonance(resonance);
+	filter->set_dbgain_normalized(dbgain_normalized);
+	filter->update();
+
+	cached_coeff_valid = true;
+	cached_cutoff = cutoff;
+	cached_resonance = resonance;
+	cached_dbgain_normalized = dbgain_normalized;
+	cached_coeff.b0 = filter->b0;
+	cached_coeff.b1 = filter->b1;
+	cached_coeff.b2 = filter->b2;
+	cached_coeff.a1 = filter->a1;
+	cached_coeff.a2 = filter->a2;
+	return cached_coeff;
+}
+
+void StereoFilter::render(float *inout_left_ptr, unsigned n_samples, float cutoff, float resonance, float dbgain_normalized)
+{
+	if (get_type() == FILTER_NONE) {
 		return;
+	}
+	render_chunk(inout_left_ptr, n_samples, get_coefficients(cutoff, resonance, dbgain_normalized));
+}
 
-	unsigned old_denormals_mode = _MM_GET_FLUSH_ZERO_MODE();
-	_MM_SET_FLUSH_ZERO_MODE(_MM_FLUSH_ZERO_ON);
+void StereoFilter::render_fade(float *inout_left_ptr, unsigned n_samples, float cutoff, float resonance, float start_dbgain_normalized, float end_dbgain_normalized, unsigned granularity)
+{
+	if (get_type() == FILTER_NONE) {
+		return;
+	}
+
+	const Coefficients start = get_coefficients(cutoff, resonance, start_dbgain_normalized);
+	const Coefficients end = get_coefficients(cutoff, resonance, end_dbgain_normalized);
+
+	// Rounding up avoids division by zero. The last block gets exactly
+	// the end coefficients, so that there's no jump when we go back
+	// to rendering with a constant gain.
+	unsigned num_blocks = (n_samples + granularity - 1) / granularity;
+	for (unsigned block = 0; block < num_blocks; ++block) {
+		const float t = float(block + 1) / num_blocks;
+		Coefficients coeff;
+		coeff.b0 = start.b0 + (end.b0 - start.b0) * t;
+		coeff.b1 = start.b1 + (end.b1 - start.b1) * t;
+		coeff.b2 = start.b2 + (end.b2 - start.b2) * t;
+		coeff.a1 = start.a1 + (end.a1 - start.a1) * t;
+		coeff.a2 = start.a2 + (end.a2 - start.a2) * t;
+
+		unsigned offset = block * granularity;
+		unsigned samples_this_block = min(n_samples - offset, granularity);
+		render_chunk(inout_left_ptr + offset * 2, samples_this_block, coeff);
+	}
+}
 
-	parm_filter.set_linear_cutoff(cutoff);
-	parm_filter.set_resonance(resonance);
-	parm_filter.set_dbgain_normalized(dbgain_normalized);
-	parm_filter.update();
+#ifdef __SSE__
+template<unsigned filter_order>
+void StereoFilter::render_chunk_sse(float *inout_left_ptr, unsigned n_samples, const Coefficients &coeff)
+{
+	const __m128 b0 = _mm_set1_ps(coeff.b0);
+	const __m128 b1 = _mm_set1_ps(coeff.b1);
+	const __m128 b2 = _mm_set1_ps(coeff.b2);
+	const __m128 a1 = _mm_set1_ps(coeff.a1);
+	const __m128 a2 = _mm_set1_ps(coeff.a2);
 
-	__m128 b0 = _mm_set1_ps(parm_filter.b0);
-	__m128 b1 = _mm_set1_ps(parm_filter.b1);
-	__m128 b2 = _mm_set1_ps(parm_filter.b2);
-	__m128 a1 = _mm_set1_ps(parm_filter.a1);
-	__m128 a2 = _mm_set1_ps(parm_filter.a2);
+	__m128 d0[filter_order], d1[filter_order];
+	for (unsigned j = 0; j < filter_order; j++) {
+		d0[j] = feedback[j].d0;
+		d1[j] = feedback[j].d1;
+	}
 
-	// Apply the filter FILTER_ORDER times.
-	for (unsigned j = 0; j < parm_filter.filter_order; j++) {
-		__m128 d0 = feedback[j].d0;
-		__m128 d1 = feedback[j].d1;
-		__m64 *inout_ptr = (__m64 *)inout_left_ptr;
-
-		__m128 in = _mm_set1_ps(0.0f), out;
-		for (unsigned i = n_samples; i; i--) {
-			in = _mm_loadl_pi(in, inout_ptr);
-			out = _mm_add_ps(_mm_mul_ps(b0, in), d0);
-			_mm_storel_pi(inout_ptr, out);
-			d0 = _mm_add_ps(_mm_sub_ps(_mm_mul_ps(b1, in), _mm_mul_ps(a1, out)), d1);
-			d1 = _mm_sub_ps(_mm_mul_ps(b2, in), _mm_mul_ps(a2, out));
-			++inout_ptr;
+	// Apply the filter FILTER_ORDER times. Since the stages are independent
+	// except for their input, we can just as well run each sample through all
+	// of them before going to the next one; this gives the same result as
+	// doing one pass per stage, but only loads and stores each sample once.
+	__m64 *inout_ptr = (__m64 *)inout_left_ptr;
+	__m128 in = _mm_set1_ps(0.0f), out;
+	for (unsigned i = n_samples; i; i--) {
+		in = _mm_loadl_pi(in, inout_ptr);
+		for (unsigned j = 0; j < filter_order; j++) {
+			out = _mm_add_ps(_mm_mul_ps(b0, in), d0[j]);
+			d0[j] = _mm_add_ps(_mm_sub_ps(_mm_mul_ps(b1, in), _mm_mul_ps(a1, out)), d1[j]);
+			d1[j] = _mm_sub_ps(_mm_mul_ps(b2, in), _mm_mul_ps(a2, out));
+			in = out;
 		}
-		feedback[j].d0 = d0;
-		feedback[j].d1 = d1;
+		_mm_storel_pi(inout_ptr, in);
+		++inout_ptr;
+	}
+
+	for (unsigned j = 0; j < filter_order; j++) {
+		feedback[j].d0 = d0[j];
+		feedback[j].d1 = d1[j];
+	}
+}
+#endif
+
+void StereoFilter::render_chunk(float *inout_left_ptr, unsigned n_samples, const Coefficients &coeff)
+{
+#ifdef __SSE__
+	unsigned old_denormals_mode = _MM_GET_FLUSH_ZERO_MODE();
+	_MM_SET_FLUSH_ZERO_MODE(_MM_FLUSH_ZERO_ON);
+
+	// AudioMixer only uses order 1 (the EQ shelves) and 2 (the lo-cut),
+	// but we instantiate all of them so that no order needs a slow path.
+	static_assert(FILTER_MAX_ORDER == 4, "Add more specializations below");
+	switch (parm_filter.filter_order) {
+	case 1:
+		render_chunk_sse<1>(inout_left_ptr, n_samples, coeff);
+		break;
+	case 2:
+		render_chunk_sse<2>(inout_left_ptr, n_samples, coeff);
+		break;
+	case 3:
+		render_chunk_sse<3>(inout_left_ptr, n_samples, coeff);
+		break;
+	case 4:
+		render_chunk_sse<4>(inout_left_ptr, n_samples, coeff);
+		break;
+	default:
+		assert(false);
 	}
 
 	_MM_SET_FLUSH_ZERO_MODE(old_denormals_mode);
 #else
-	if (filters[0].filtertype == FILTER_NONE || filters[0].filter_order == 0)
-		return;
-
 	for (unsigned i = 0; i < 2; ++i) {
-		filters[i].set_linear_cutoff(cutoff);
-		filters[i].set_resonance(resonance);
-		filters[i].update();
+		filters[i].b0 = coeff.b0;
+		filters[i].b1 = coeff.b1;
+		filters[i].b2 = coeff.b2;
+		filters[i].a1 = coeff.a1;
+		filters[i].a2 = coeff.a2;
 		filters[i].render_chunk(inout_left_ptr, n_samples, 2);
 
 		++inout_left_ptr;
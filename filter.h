@@ -110,6 +110,15 @@ public:
 	void init(FilterType type, int new_order);
 	
 	void render(float *inout_left_ptr, unsigned n_samples, float cutoff, float resonance, float dbgain_normalized = 0.0f);
+
+	// Like render(), but sweeps the gain from start_dbgain_normalized to
+	// end_dbgain_normalized over the course of the buffer, changing it every
+	// <granularity> samples. The filter coefficients are only calculated for
+	// the two end points and then linearly interpolated, which is much cheaper
+	// than calling render() once for every block. (Linear interpolation is safe,
+	// since the set of stable biquads is convex in (a1, a2).)
+	void render_fade(float *inout_left_ptr, unsigned n_samples, float cutoff, float resonance, float start_dbgain_normalized, float end_dbgain_normalized, unsigned granularity);
+
 #ifndef NDEBUG
 #ifdef __SSE__
 	void debug() { parm_filter.debug(); }
@@ -124,7 +133,23 @@ public:
 #endif
 
 private:
+	struct Coefficients {
+		float b0, b1, b2, a1, a2;
+	};
+
+	// Returns the coefficients for the given parameters. The last set is cached,
+	// since the parameters very rarely change between calls (and during fades,
+	// the start of one fade is the end of the previous one).
+	Coefficients get_coefficients(float cutoff, float resonance, float dbgain_normalized);
+	void render_chunk(float *inout_left_ptr, unsigned n_samples, const Coefficients &coeff);
+
 #ifdef __SSE__
+	// Specialized for each filter order, so that all the cascaded
+	// stages can be run on each sample in turn, keeping the feedback
+	// in registers.
+	template<unsigned filter_order>
+	void render_chunk_sse(float *inout_left_ptr, unsigned n_samples, const Coefficients &coeff);
+
 	// We only use the filter to calculate coefficients; we don't actually
 	// use its feedbacks.
 	Filter parm_filter;
@@ -134,6 +159,10 @@ private:
 #else
 	Filter filters[2];
 #endif
+
+	bool cached_coeff_valid = false;
+	float cached_cutoff, cached_resonance, cached_dbgain_normalized;
+	Coefficients cached_coeff;
 };
 
 #endif // !defined(_FILTER_H)
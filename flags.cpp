@@ -29,6 +29,7 @@ enum LongOption {
 	OPTION_X264_VBV_BUFSIZE,
 	OPTION_X264_VBV_MAX_BITRATE,
 	OPTION_X264_PARAM,
+	OPTION_X264_LADDER,
 	OPTION_HTTP_MUX,
 	OPTION_HTTP_COARSE_TIMEBASE,
 	OPTION_HTTP_AUDIO_CODEC,
@@ -50,6 +51,8 @@ enum LongOption {
 	OPTION_NO_FLUSH_PBOS,
 	OPTION_PRINT_VIDEO_LATENCY,
 	OPTION_MAX_INPUT_QUEUE_FRAMES,
+	OPTION_JITTER_HISTORY_FRAMES,
+	OPTION_MASTER_CLOCK_TIMEOUT_FRAMES,
 	OPTION_AUDIO_QUEUE_LENGTH_MS,
 	OPTION_OUTPUT_YCBCR_COEFFICIENTS,
 	OPTION_OUTPUT_BUFFER_FRAMES,
@@ -59,6 +62,15 @@ enum LongOption {
 	OPTION_10_BIT_INPUT,
 	OPTION_10_BIT_OUTPUT,
 	OPTION_INPUT_YCBCR_INTERPRETATION,
+	OPTION_PIPELINE_THEME,
+	OPTION_THEME_STATE_PER_CHANNEL,
+	OPTION_PROFILE_THEME,
+	OPTION_ENABLE_TRACING,
+	OPTION_HEADLESS,
+	OPTION_FREE_RUN,
+	OPTION_UPLOAD_THREAD,
+	OPTION_RECORD_FRAME_ARRIVALS,
+	OPTION_PREVIEW_RESOLUTION,
 };
 
 void usage(Program program)
@@ -102,6 +114,8 @@ void usage(Program program)
 	fprintf(stderr, "      --x264-vbv-max-bitrate      x264 local max bitrate (in kilobit/sec per --vbv-bufsize,\n");
 	fprintf(stderr, "                                  0 = no limit, default: same as --x264-bitrate, i.e., CBR)\n");
 	fprintf(stderr, "      --x264-param=NAME[,VALUE]   set any x264 parameter, for fine tuning\n");
+	fprintf(stderr, "      --x264-ladder=WxH[:KBIT],...  also encode downscaled renditions of the x264 stream,\n");
+	fprintf(stderr, "                                  served on /ladder/WxH (default bitrate is scaled by area)\n");
 	fprintf(stderr, "      --http-mux=NAME             mux to use for HTTP streams (default " DEFAULT_STREAM_MUX_NAME ")\n");
 	fprintf(stderr, "      --http-audio-codec=NAME     audio codec to use for HTTP streams\n");
 	fprintf(stderr, "                                  (default is to use the same as for the recording)\n");
@@ -114,6 +128,12 @@ void usage(Program program)
 	}
 	fprintf(stderr, "      --http-coarse-timebase      use less timebase for HTTP (recommended for muxers\n");
 	fprintf(stderr, "                                  that handle large pts poorly, like e.g. MP4)\n");
+	fprintf(stderr, "      --enable-tracing            record per-frame timing events, for download from\n");
+	if (program == PROGRAM_NAGERU) {
+		fprintf(stderr, "                                    /trace over HTTP (or written to a file on SIGUSR2)\n");
+	} else {
+		fprintf(stderr, "                                    /trace over HTTP\n");
+	}
 	if (program == PROGRAM_NAGERU) {
 		fprintf(stderr, "      --flat-audio                start with most audio processing turned off\n");
 		fprintf(stderr, "                                    (can be overridden by e.g. --enable-limiter)\n");
@@ -131,6 +151,12 @@ void usage(Program program)
 		fprintf(stderr, "      --print-video-latency       print out measurements of video latency on stdout\n");
 		fprintf(stderr, "      --max-input-queue-frames=FRAMES  never keep more than FRAMES frames for each card\n");
 		fprintf(stderr, "                                    (default 6, minimum 1)\n");
+		fprintf(stderr, "      --jitter-history-frames=FRAMES  estimate input and output jitter over the last\n");
+		fprintf(stderr, "                                    FRAMES frames (default 5000; e.g. 216000 for an\n");
+		fprintf(stderr, "                                    hour at 60 fps, which costs 432 kB per card)\n");
+		fprintf(stderr, "      --master-clock-timeout-frames=FRAMES  if the master card delivers nothing for\n");
+		fprintf(stderr, "                                    FRAMES frame periods, clock to another card or an\n");
+		fprintf(stderr, "                                    internal timer until it is back (default 5, 0 = wait forever)\n");
 		fprintf(stderr, "      --audio-queue-length-ms=MS  length of audio resampling queue (default 100.0)\n");
 		fprintf(stderr, "      --output-ycbcr-coefficients={rec601,rec709,auto}\n");
 		fprintf(stderr, "                                  Y'CbCr coefficient standard of output (default auto)\n");
@@ -151,6 +177,30 @@ void usage(Program program)
 		fprintf(stderr, "                                  Y'CbCr coefficient standard of card CARD (default auto)\n");
 		fprintf(stderr, "                                    auto is rec601 for SD, rec709 for HD, always limited\n");
 		fprintf(stderr, "                                    limited means standard 0-240/0-235 input range (for 8-bit)\n");
+		fprintf(stderr, "      --pipeline-theme            run the theme for the next frame on a separate thread\n");
+		fprintf(stderr, "                                    while the current one renders (the theme will see\n");
+		fprintf(stderr, "                                    input signal changes one frame late)\n");
+		fprintf(stderr, "      --theme-state-per-channel   load the theme once more for each channel, so that\n");
+		fprintf(stderr, "                                    channels can be evaluated in parallel and the UI\n");
+		fprintf(stderr, "                                    never waits for them (the theme must keep state that\n");
+		fprintf(stderr, "                                    the UI changes in Nageru.set_shared())\n");
+		fprintf(stderr, "      --profile-theme             measure the time spent in each theme function (in\n");
+		fprintf(stderr, "                                    /metrics) and on each line (in /theme_profile)\n");
+		fprintf(stderr, "      --headless                  run without a GUI (and without X), rendering\n");
+		fprintf(stderr, "                                    through EGL; control through POST to /control/ over\n");
+		fprintf(stderr, "                                    HTTP, stop with SIGINT or SIGTERM (needs a DRM/KMS\n");
+		fprintf(stderr, "                                    device for Qt's eglfs, and a DRM --va-display\n");
+		fprintf(stderr, "                                    or --record-x264-video)\n");
+		fprintf(stderr, "      --free-run                  render as fast as possible instead of following the\n");
+		fprintf(stderr, "                                    master card, for benchmarking (only with fake cards\n");
+		fprintf(stderr, "                                    and video inputs; audio output is silence)\n");
+		fprintf(stderr, "      --upload-thread             upload input frames to the GPU from a separate thread\n");
+		fprintf(stderr, "                                    as soon as they arrive, instead of from the mixer\n");
+		fprintf(stderr, "                                    thread before rendering (has triggered driver bugs)\n");
+		fprintf(stderr, "      --record-frame-arrivals=FILE  log input frame arrivals and output ticks to FILE,\n");
+		fprintf(stderr, "                                    for use with queue_policy_simulator\n");
+		fprintf(stderr, "      --preview-resolution=WxH    render preview and other non-live channels at this\n");
+		fprintf(stderr, "                                    resolution (default: same as --width and --height)\n");
 	}
 }
 
@@ -183,6 +233,7 @@ void parse_flags(Program program, int argc, char * const argv[])
 		{ "x264-vbv-bufsize", required_argument, 0, OPTION_X264_VBV_BUFSIZE },
 		{ "x264-vbv-max-bitrate", required_argument, 0, OPTION_X264_VBV_MAX_BITRATE },
 		{ "x264-param", required_argument, 0, OPTION_X264_PARAM },
+		{ "x264-ladder", required_argument, 0, OPTION_X264_LADDER },
 		{ "http-mux", required_argument, 0, OPTION_HTTP_MUX },
 		{ "http-coarse-timebase", no_argument, 0, OPTION_HTTP_COARSE_TIMEBASE },
 		{ "http-audio-codec", required_argument, 0, OPTION_HTTP_AUDIO_CODEC },
@@ -204,6 +255,8 @@ void parse_flags(Program program, int argc, char * const argv[])
 		{ "no-flush-pbos", no_argument, 0, OPTION_NO_FLUSH_PBOS },
 		{ "print-video-latency", no_argument, 0, OPTION_PRINT_VIDEO_LATENCY },
 		{ "max-input-queue-frames", required_argument, 0, OPTION_MAX_INPUT_QUEUE_FRAMES },
+		{ "jitter-history-frames", required_argument, 0, OPTION_JITTER_HISTORY_FRAMES },
+		{ "master-clock-timeout-frames", required_argument, 0, OPTION_MASTER_CLOCK_TIMEOUT_FRAMES },
 		{ "audio-queue-length-ms", required_argument, 0, OPTION_AUDIO_QUEUE_LENGTH_MS },
 		{ "output-ycbcr-coefficients", required_argument, 0, OPTION_OUTPUT_YCBCR_COEFFICIENTS },
 		{ "output-buffer-frames", required_argument, 0, OPTION_OUTPUT_BUFFER_FRAMES },
@@ -213,6 +266,15 @@ void parse_flags(Program program, int argc, char * const argv[])
 		{ "10-bit-input", no_argument, 0, OPTION_10_BIT_INPUT },
 		{ "10-bit-output", no_argument, 0, OPTION_10_BIT_OUTPUT },
 		{ "input-ycbcr-interpretation", required_argument, 0, OPTION_INPUT_YCBCR_INTERPRETATION },
+		{ "pipeline-theme", no_argument, 0, OPTION_PIPELINE_THEME },
+		{ "theme-state-per-channel", no_argument, 0, OPTION_THEME_STATE_PER_CHANNEL },
+		{ "profile-theme", no_argument, 0, OPTION_PROFILE_THEME },
+		{ "enable-tracing", no_argument, 0, OPTION_ENABLE_TRACING },
+		{ "headless", no_argument, 0, OPTION_HEADLESS },
+		{ "free-run", no_argument, 0, OPTION_FREE_RUN },
+		{ "upload-thread", no_argument, 0, OPTION_UPLOAD_THREAD },
+		{ "record-frame-arrivals", required_argument, 0, OPTION_RECORD_FRAME_ARRIVALS },
+		{ "preview-resolution", required_argument, 0, OPTION_PREVIEW_RESOLUTION },
 		{ 0, 0, 0, 0 }
 	};
 	vector<string> theme_dirs;
@@ -331,6 +393,20 @@ void parse_flags(Program program, int argc, char * const argv[])
 		case OPTION_X264_PARAM:
 			global_flags.x264_extra_param.push_back(optarg);
 			break;
+		case OPTION_X264_LADDER: {
+			char *saveptr = nullptr;
+			for (char *token = strtok_r(optarg, ",", &saveptr); token != nullptr; token = strtok_r(nullptr, ",", &saveptr)) {
+				X264LadderRung rung;
+				rung.bitrate_kbit = 0;
+				int num_fields = sscanf(token, "%dx%d:%d", &rung.width, &rung.height, &rung.bitrate_kbit);
+				if (num_fields < 2) {
+					fprintf(stderr, "ERROR: Invalid rung '%s' in --x264-ladder (needs e.g. 640x360 or 640x360:800)\n", token);
+					exit(1);
+				}
+				global_flags.x264_ladder.push_back(rung);
+			}
+			break;
+		}
 		case OPTION_FLAT_AUDIO:
 			// If --flat-audio is given, turn off everything that messes with the sound,
 			// except the final makeup gain.
@@ -385,6 +461,12 @@ void parse_flags(Program program, int argc, char * const argv[])
 		case OPTION_MAX_INPUT_QUEUE_FRAMES:
 			global_flags.max_input_queue_frames = atoi(optarg);
 			break;
+		case OPTION_JITTER_HISTORY_FRAMES:
+			global_flags.jitter_history_frames = atoi(optarg);
+			break;
+		case OPTION_MASTER_CLOCK_TIMEOUT_FRAMES:
+			global_flags.master_clock_timeout_frames = atoi(optarg);
+			break;
 		case OPTION_AUDIO_QUEUE_LENGTH_MS:
 			global_flags.audio_queue_length_ms = atof(optarg);
 			break;
@@ -412,6 +494,37 @@ void parse_flags(Program program, int argc, char * const argv[])
 			global_flags.x264_video_to_http = true;
 			global_flags.x264_bit_depth = 10;
 			break;
+		case OPTION_PIPELINE_THEME:
+			global_flags.pipeline_theme = true;
+			break;
+		case OPTION_THEME_STATE_PER_CHANNEL:
+			global_flags.theme_state_per_channel = true;
+			break;
+		case OPTION_PROFILE_THEME:
+			global_flags.profile_theme = true;
+			break;
+		case OPTION_ENABLE_TRACING:
+			global_flags.enable_tracing = true;
+			break;
+		case OPTION_HEADLESS:
+			global_flags.headless = true;
+			break;
+		case OPTION_FREE_RUN:
+			global_flags.free_run = true;
+			global_flags.enable_alsa_output = false;
+			break;
+		case OPTION_UPLOAD_THREAD:
+			global_flags.upload_thread = true;
+			break;
+		case OPTION_RECORD_FRAME_ARRIVALS:
+			global_flags.frame_arrival_log_filename = optarg;
+			break;
+		case OPTION_PREVIEW_RESOLUTION:
+			if (sscanf(optarg, "%dx%d", &global_flags.preview_width, &global_flags.preview_height) != 2) {
+				fprintf(stderr, "ERROR: Invalid argument '%s' to --preview-resolution (needs e.g. 640x360)\n", optarg);
+				exit(1);
+			}
+			break;
 		case OPTION_INPUT_YCBCR_INTERPRETATION: {
 			char *ptr = strchr(optarg, ',');
 			if (ptr == nullptr) {
@@ -485,6 +598,17 @@ void parse_flags(Program program, int argc, char * const argv[])
 		fprintf(stderr, "ERROR: --output-card points to a nonexistant card\n");
 		exit(1);
 	}
+	if (global_flags.headless && !global_flags.x264_video_to_disk &&
+	    (global_flags.va_display.empty() || global_flags.va_display[0] != '/')) {
+		// Quick Sync would otherwise try to open the VA-API display through X.
+		fprintf(stderr, "ERROR: --headless needs either --va-display pointing to a DRM render node\n");
+		fprintf(stderr, "       (e.g. /dev/dri/renderD128) or --record-x264-video, since there is no X server\n");
+		exit(1);
+	}
+	if (global_flags.free_run && global_flags.output_card != -1) {
+		fprintf(stderr, "ERROR: --free-run cannot be combined with --output-card\n");
+		exit(1);
+	}
 	if (!global_flags.transcode_audio && global_flags.stream_audio_codec_name.empty()) {
 		fprintf(stderr, "ERROR: If not transcoding audio, you must specify ahead-of-time what audio codec is in use\n");
 		fprintf(stderr, "       (using --http-audio-codec).\n");
@@ -511,6 +635,14 @@ void parse_flags(Program program, int argc, char * const argv[])
 		fprintf(stderr, "ERROR: --width and --height must be positive integers divisible by 8\n");
 		exit(1);
 	}
+	if (global_flags.preview_width == 0 && global_flags.preview_height == 0) {
+		global_flags.preview_width = global_flags.width;
+		global_flags.preview_height = global_flags.height;
+	} else if (global_flags.preview_width <= 0 || global_flags.preview_width > global_flags.width ||
+	           global_flags.preview_height <= 0 || global_flags.preview_height > global_flags.height) {
+		fprintf(stderr, "ERROR: --preview-resolution must be positive, and no larger than --width and --height\n");
+		exit(1);
+	}
 
 	for (pair<int, int> mapping : global_flags.default_stream_mapping) {
 		if (mapping.second >= global_flags.num_cards) {
@@ -568,6 +700,14 @@ void parse_flags(Program program, int argc, char * const argv[])
 	if (global_flags.max_input_queue_frames > 10) {
 		fprintf(stderr, "WARNING: --max-input-queue-frames has little effect over 10.\n");
 	}
+	if (global_flags.jitter_history_frames < 1) {
+		fprintf(stderr, "ERROR: --jitter-history-frames must be at least 1.\n");
+		exit(1);
+	}
+	if (global_flags.master_clock_timeout_frames < 0) {
+		fprintf(stderr, "ERROR: --master-clock-timeout-frames can't be negative.\n");
+		exit(1);
+	}
 
 	if (!isinf(global_flags.x264_crf)) {  // CRF mode is selected.
 		if (global_flags.x264_bitrate != -1) {
@@ -580,4 +720,32 @@ void parse_flags(Program program, int argc, char * const argv[])
 	} else if (global_flags.x264_bitrate == -1) {
 		global_flags.x264_bitrate = DEFAULT_X264_OUTPUT_BIT_RATE;
 	}
+
+	if (!global_flags.x264_ladder.empty()) {
+		if (!global_flags.x264_video_to_http) {
+			fprintf(stderr, "ERROR: --x264-ladder requires --http-x264-video or --record-x264-video.\n");
+			exit(1);
+		}
+		for (unsigned i = 0; i < global_flags.x264_ladder.size(); ++i) {
+			const X264LadderRung &rung = global_flags.x264_ladder[i];
+			for (unsigned j = 0; j < i; ++j) {
+				if (global_flags.x264_ladder[j].width == rung.width &&
+				    global_flags.x264_ladder[j].height == rung.height) {
+					fprintf(stderr, "ERROR: --x264-ladder has rung %dx%d more than once.\n", rung.width, rung.height);
+					exit(1);
+				}
+			}
+			// x264 needs even dimensions for 4:2:0.
+			if (rung.width <= 0 || rung.height <= 0 || rung.width % 2 != 0 || rung.height % 2 != 0 ||
+			    rung.width > global_flags.width || rung.height > global_flags.height) {
+				fprintf(stderr, "ERROR: --x264-ladder rung %dx%d must have positive, even dimensions no larger than --width and --height.\n",
+					rung.width, rung.height);
+				exit(1);
+			}
+			if (rung.bitrate_kbit < 0) {
+				fprintf(stderr, "ERROR: --x264-ladder rung %dx%d has a negative bitrate.\n", rung.width, rung.height);
+				exit(1);
+			}
+		}
+	}
 }
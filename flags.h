@@ -10,6 +10,12 @@
 #include "defs.h"
 #include "ycbcr_interpretation.h"
 
+// One extra, downscaled rendition of the x264 stream; see --x264-ladder.
+struct X264LadderRung {
+	int width, height;
+	int bitrate_kbit;  // 0 = scale the main stream's bitrate by the number of pixels.
+};
+
 struct Flags {
 	int width = 1280, height = 720;
 	int num_cards = 2;
@@ -41,6 +47,7 @@ struct Flags {
 	int x264_vbv_max_bitrate = -1;  // In kilobits. 0 = no limit, -1 = same as <x264_bitrate> (CBR).
 	int x264_vbv_buffer_size = -1;  // In kilobits. 0 = one-frame VBV, -1 = same as <x264_bitrate> (one-second VBV).
 	std::vector<std::string> x264_extra_param;  // In “key[,value]” format.
+	std::vector<X264LadderRung> x264_ladder;  // Empty = only the main stream.
 	bool enable_alsa_output = true;
 	std::map<int, int> default_stream_mapping;
 	bool multichannel_mapping_mode = false;  // Implicitly true if input_mapping_filename is nonempty.
@@ -54,11 +61,22 @@ struct Flags {
 	double output_buffer_frames = 6.0;
 	double output_slop_frames = 0.5;
 	int max_input_queue_frames = 6;
+	int jitter_history_frames = 5000;
+	int master_clock_timeout_frames = 5;  // 0 = no watchdog.
 	bool display_timecode_in_stream = false;
 	bool display_timecode_on_stdout = false;
 	bool ten_bit_input = false;
 	bool ten_bit_output = false;  // Implies x264_video_to_disk == true and x264_bit_depth == 10.
 	YCbCrInterpretation ycbcr_interpretation[MAX_VIDEO_CARDS];
+	bool pipeline_theme = false;
+	bool theme_state_per_channel = false;
+	bool profile_theme = false;
+	bool enable_tracing = false;
+	bool headless = false;
+	bool free_run = false;  // Use a virtual clock instead of waiting for the master card.
+	bool upload_thread = false;
+	std::string frame_arrival_log_filename;  // Empty for none.
+	int preview_width = 0, preview_height = 0;  // Resolution for all channels except live. 0 = same as width/height.
 	bool transcode_audio = true;  // Kaeru only.
 	int x264_bit_depth = 8;  // Not user-settable.
 	bool use_zerocopy = false;  // Not user-settable.
@@ -0,0 +1,126 @@
+#include "frame_arrival_log.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "timebase.h"
+
+using namespace std;
+using namespace std::chrono;
+
+namespace {
+
+const char magic[] = "NgrArrv1";
+constexpr size_t header_size = 16;
+constexpr size_t record_size = 16;
+
+void write_le(uint64_t val, unsigned num_bytes, uint8_t *out)
+{
+	for (unsigned i = 0; i < num_bytes; ++i) {
+		out[i] = val >> (i * 8);
+	}
+}
+
+uint64_t read_le(const uint8_t *in, unsigned num_bytes)
+{
+	uint64_t val = 0;
+	for (unsigned i = 0; i < num_bytes; ++i) {
+		val |= uint64_t(in[i]) << (i * 8);
+	}
+	return val;
+}
+
+}  // namespace
+
+FrameArrivalLogWriter::FrameArrivalLogWriter(const string &filename)
+	: filename(filename)
+{
+	fp = fopen(filename.c_str(), "wb");
+	if (fp == nullptr) {
+		perror(filename.c_str());
+		exit(1);
+	}
+
+	// The mixer thread writes a few hundred bytes a second, so with a large
+	// enough buffer, it will very rarely actually need to call write().
+	file_buffer.resize(1 << 20);
+	setvbuf(fp, file_buffer.data(), _IOFBF, file_buffer.size());
+
+	uint8_t header[header_size];
+	memcpy(header, magic, 8);
+	write_le(TIMEBASE, 8, header + 8);
+	if (fwrite(header, sizeof(header), 1, fp) != 1) {
+		perror(filename.c_str());
+		exit(1);
+	}
+}
+
+FrameArrivalLogWriter::~FrameArrivalLogWriter()
+{
+	if (fp != nullptr && fclose(fp) != 0) {
+		perror(filename.c_str());
+	}
+}
+
+void FrameArrivalLogWriter::write(const FrameArrivalRecord &record)
+{
+	if (fp == nullptr) {
+		return;
+	}
+
+	uint8_t buf[record_size];
+	buf[0] = record.type;
+	buf[1] = record.card_index;
+	buf[2] = record.flags;
+	buf[3] = record.dropped_frames;
+	write_le(record.frame_duration, 4, buf + 4);
+	write_le(duration_cast<nanoseconds>(record.timestamp.time_since_epoch()).count(), 8, buf + 8);
+	if (fwrite(buf, sizeof(buf), 1, fp) != 1) {
+		perror(filename.c_str());
+		fprintf(stderr, "Stopping frame arrival logging.\n");
+		fclose(fp);
+		fp = nullptr;
+	}
+}
+
+bool read_frame_arrival_log(const string &filename, int64_t expected_timebase, vector<FrameArrivalRecord> *records)
+{
+	FILE *fp = fopen(filename.c_str(), "rb");
+	if (fp == nullptr) {
+		perror(filename.c_str());
+		return false;
+	}
+
+	uint8_t header[header_size];
+	if (fread(header, sizeof(header), 1, fp) != 1 || memcmp(header, magic, 8) != 0) {
+		fprintf(stderr, "%s: Not a frame arrival log.\n", filename.c_str());
+		fclose(fp);
+		return false;
+	}
+	if (int64_t(read_le(header + 8, 8)) != expected_timebase) {
+		fprintf(stderr, "%s: Recorded with a different TIMEBASE (%lld, expected %lld).\n",
+			filename.c_str(), (long long)read_le(header + 8, 8), (long long)expected_timebase);
+		fclose(fp);
+		return false;
+	}
+
+	uint8_t buf[record_size];
+	while (fread(buf, sizeof(buf), 1, fp) == 1) {
+		if (buf[0] > FrameArrivalRecord::POLICY) {
+			fprintf(stderr, "%s: Unknown record type %d; corrupted file?\n", filename.c_str(), buf[0]);
+			fclose(fp);
+			return false;
+		}
+		FrameArrivalRecord record;
+		record.type = FrameArrivalRecord::Type(buf[0]);
+		record.card_index = buf[1];
+		record.flags = buf[2];
+		record.dropped_frames = buf[3];
+		record.frame_duration = read_le(buf + 4, 4);
+		record.timestamp = steady_clock::time_point(nanoseconds(int64_t(read_le(buf + 8, 8))));
+		records->push_back(record);
+	}
+	// A truncated last record (e.g. if Nageru crashed) is silently ignored.
+	fclose(fp);
+	return true;
+}
@@ -0,0 +1,67 @@
+#ifndef _FRAME_ARRIVAL_LOG_H
+#define _FRAME_ARRIVAL_LOG_H 1
+
+// A compact binary log of when frames arrive from each card and when the
+// mixer ticks, as seen by the mixer thread (see --record-frame-arrivals).
+// It contains exactly what the queue length policy gets to see, so that
+// queue_policy_simulator can replay a recording from a real venue through
+// the production QueueLengthPolicy and any alternatives.
+//
+// The file is a 16-byte header (“NgrArrv1”, then TIMEBASE as a little-endian
+// 64-bit integer), followed by 16-byte records, all little-endian:
+//
+//   uint8   type (see FrameArrivalRecord::Type)
+//   uint8   card index (for OUT and POLICY: the master card)
+//   uint8   flags (for OUT: FLAG_PREROLL, FLAG_MASTER_IS_OUTPUT)
+//   uint8   number of dropped frames before this one (saturates at 255)
+//   uint32  frame duration, in TIMEBASE units
+//   int64   steady_clock timestamp, in nanoseconds
+//
+// The records are in the order the mixer thread saw them, which is not
+// necessarily timestamp order; in particular, frames that arrived
+// just before a tick can be logged before that tick.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <chrono>
+#include <string>
+#include <vector>
+
+struct FrameArrivalRecord {
+	enum Type : uint8_t {
+		IN = 0,  // A frame from <card_index> has been queued.
+		OUT = 1,  // The mixer picked one frame from each card's queue.
+		POLICY = 2,  // The mixer evaluated the queue length policy and trimmed the queues.
+	};
+	enum Flags : uint8_t {
+		FLAG_PREROLL = 1,
+		FLAG_MASTER_IS_OUTPUT = 2,  // The output side of <card_index> is the clock, not its input.
+	};
+
+	Type type;
+	uint8_t card_index;
+	uint8_t flags;
+	uint8_t dropped_frames;
+	uint32_t frame_duration;
+	std::chrono::steady_clock::time_point timestamp;
+};
+
+// Not thread-safe; only meant to be called from the mixer thread.
+class FrameArrivalLogWriter {
+public:
+	// Prints an error and exits if the file cannot be opened.
+	explicit FrameArrivalLogWriter(const std::string &filename);
+	~FrameArrivalLogWriter();
+
+	void write(const FrameArrivalRecord &record);
+
+private:
+	FILE *fp;
+	std::string filename;
+	std::vector<char> file_buffer;  // For setvbuf().
+};
+
+// Returns false (after printing an error) if the file could not be read.
+bool read_frame_arrival_log(const std::string &filename, int64_t expected_timebase, std::vector<FrameArrivalRecord> *records);
+
+#endif  // !defined(_FRAME_ARRIVAL_LOG_H)
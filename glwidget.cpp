@@ -52,7 +52,50 @@ void GLWidget::shutdown()
 		makeCurrent();
 		resource_pool->clean_context();
 	}
-	global_mixer->remove_frame_ready_callback(output, this);
+	if (timer_query != 0) {
+		makeCurrent();
+		glDeleteQueries(1, &timer_query);
+		timer_query = 0;
+		timer_query_pending = false;
+	}
+	initialized = false;
+	update_frame_ready_callback();
+}
+
+void GLWidget::set_output(Mixer::Output output)
+{
+	this->output = output;
+	update_frame_ready_callback();
+}
+
+void GLWidget::showEvent(QShowEvent *event)
+{
+	QGLWidget::showEvent(event);
+	shown = true;
+	update_frame_ready_callback();
+}
+
+void GLWidget::hideEvent(QHideEvent *event)
+{
+	QGLWidget::hideEvent(event);
+	shown = false;
+	update_frame_ready_callback();
+}
+
+void GLWidget::update_frame_ready_callback()
+{
+	bool want_callback = initialized && shown;
+	if (frame_ready_callback_registered && (!want_callback || frame_ready_callback_output != output)) {
+		global_mixer->remove_frame_ready_callback(frame_ready_callback_output, this);
+		frame_ready_callback_registered = false;
+	}
+	if (want_callback && !frame_ready_callback_registered) {
+		global_mixer->add_frame_ready_callback(output, this, [this]{
+			QMetaObject::invokeMethod(this, "update", Qt::AutoConnection);
+		});
+		frame_ready_callback_registered = true;
+		frame_ready_callback_output = output;
+	}
 }
 
 void GLWidget::initializeGL()
@@ -64,9 +107,9 @@ void GLWidget::initializeGL()
 		global_mainwindow->mixer_created(global_mixer);
 		global_mixer->start();
 	});
-	global_mixer->add_frame_ready_callback(output, this, [this]{
-		QMetaObject::invokeMethod(this, "update", Qt::AutoConnection);
-	});
+	initialized = true;
+	shown = true;  // initializeGL() is only called when we are about to be painted.
+	update_frame_ready_callback();
 	if (output == Mixer::OUTPUT_LIVE) {
 		global_mixer->set_transition_names_updated_callback(output, [this](const vector<string> &names){
 			emit transition_names_updated(names);
@@ -86,6 +129,11 @@ void GLWidget::initializeGL()
 	glDisable(GL_BLEND);
 	glDisable(GL_DEPTH_TEST);
 	glDepthMask(GL_FALSE);
+
+	if (epoxy_gl_version() >= 33 || epoxy_has_gl_extension("GL_ARB_timer_query")) {
+		glGenQueries(1, &timer_query);
+		check_error();
+	}
 }
 
 void GLWidget::resizeGL(int width, int height)
@@ -113,8 +161,31 @@ void GLWidget::paintGL()
 	check_error();
 	glDisable(GL_FRAMEBUFFER_SRGB);
 	check_error();
+
+	if (timer_query_pending) {
+		GLint available;
+		glGetQueryObjectiv(timer_query, GL_QUERY_RESULT_AVAILABLE, &available);
+		if (available) {
+			GLuint64 elapsed_ns;
+			glGetQueryObjectui64v(timer_query, GL_QUERY_RESULT, &elapsed_ns);
+			global_mixer->display_frame_rendered(timer_query_output, elapsed_ns * 1e-9);
+			timer_query_pending = false;
+		}
+		check_error();
+	}
+	const bool measure = (timer_query != 0 && !timer_query_pending);
+	if (measure) {
+		glBeginQuery(GL_TIME_ELAPSED, timer_query);
+		check_error();
+	}
 	frame.chain->render_to_fbo(0, current_width, current_height);
 	check_error();
+	if (measure) {
+		glEndQuery(GL_TIME_ELAPSED);
+		check_error();
+		timer_query_pending = true;
+		timer_query_output = output;
+	}
 
 	if (resource_pool == nullptr) {
 		resource_pool = frame.chain->get_resource_pool();
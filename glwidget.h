@@ -9,9 +9,11 @@
 
 #include "mixer.h"
 
+class QHideEvent;
 class QMouseEvent;
 class QObject;
 class QPoint;
+class QShowEvent;
 class QWidget;
 
 namespace movit {
@@ -32,10 +34,7 @@ public:
 	GLWidget(QWidget *parent = 0);
 	~GLWidget();
 
-	void set_output(Mixer::Output output)
-	{
-		this->output = output;
-	}
+	void set_output(Mixer::Output output);
 
 	void shutdown();
 
@@ -44,6 +43,8 @@ protected:
 	void resizeGL(int width, int height) override;
 	void paintGL() override;
 	void mousePressEvent(QMouseEvent *event) override;
+	void showEvent(QShowEvent *event) override;
+	void hideEvent(QHideEvent *event) override;
 
 signals:
 	void clicked();
@@ -58,11 +59,27 @@ private:
 	void show_live_context_menu(const QPoint &pos);
 	void show_preview_context_menu(unsigned signal_num, const QPoint &pos);
 
+	// The mixer only renders channels at full rate if somebody has asked
+	// to be told about new frames, so we only do that while we are shown
+	// (hidden widgets, or minimized windows, get hide events).
+	void update_frame_ready_callback();
+
 	Mixer::Output output;
 	GLuint vao, program_num;
 	GLuint position_vbo, texcoord_vbo;
 	movit::ResourcePool *resource_pool = nullptr;
 	int current_width = 1, current_height = 1;
+
+	// For measuring the GPU time of rendering each frame. We only have one
+	// query in flight at any given time, and pick up the result when we
+	// get around to painting the next frame, so we never wait for the GPU.
+	GLuint timer_query = 0;
+	bool timer_query_pending = false;
+	Mixer::Output timer_query_output;  // Valid if timer_query_pending.
+
+	bool initialized = false, shown = false;
+	bool frame_ready_callback_registered = false;
+	Mixer::Output frame_ready_callback_output;  // Valid if frame_ready_callback_registered.
 };
 
 #endif
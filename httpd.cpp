@@ -14,6 +14,7 @@
 #include "defs.h"
 #include "metacube2.h"
 #include "metrics.h"
+#include "tracing.h"
 
 struct MHD_Connection;
 struct MHD_Response;
@@ -22,6 +23,7 @@ using namespace std;
 
 HTTPD::HTTPD()
 {
+	headers[""];  // The main stream always exists.
 	global_metrics.add("num_connected_clients", &metric_num_connected_clients, Metrics::TYPE_GAUGE);
 }
 
@@ -49,10 +51,14 @@ void HTTPD::start(int port)
 	}
 }
 
-void HTTPD::add_data(const char *buf, size_t size, bool keyframe)
+void HTTPD::add_data(const string &rendition, const char *buf, size_t size, bool keyframe)
 {
+	TraceScope trace("HTTPD::add_data");
 	unique_lock<mutex> lock(streams_mutex);
 	for (Stream *stream : streams) {
+		if (stream->get_rendition() != rendition) {
+			continue;
+		}
 		stream->add_data(buf, size, keyframe ? Stream::DATA_TYPE_KEYFRAME : Stream::DATA_TYPE_OTHER);
 	}
 }
@@ -73,7 +79,9 @@ int HTTPD::answer_to_connection(MHD_Connection *connection,
 {
 	// See if the URL ends in “.metacube”.
 	HTTPD::Stream::Framing framing;
-	if (strstr(url, ".metacube") == url + strlen(url) - strlen(".metacube")) {
+	const bool metacube = strlen(url) >= strlen(".metacube") &&
+		strcmp(url + strlen(url) - strlen(".metacube"), ".metacube") == 0;
+	if (metacube) {
 		framing = HTTPD::Stream::FRAMING_METACUBE;
 	} else {
 		framing = HTTPD::Stream::FRAMING_RAW;
@@ -88,8 +96,72 @@ int HTTPD::answer_to_connection(MHD_Connection *connection,
 		MHD_destroy_response(response);  // Only decreases the refcount; actual free is after the request is done.
 		return ret;
 	}
+	if (strcmp(url, "/trace") == 0) {
+		// Load into chrome://tracing or https://ui.perfetto.dev/.
+		string contents = tracing_enabled ? serialize_trace() : "Tracing is not enabled; use --enable-tracing.\n";
+		MHD_Response *response = MHD_create_response_from_buffer(
+			contents.size(), &contents[0], MHD_RESPMEM_MUST_COPY);
+		MHD_add_response_header(response, "Content-type", tracing_enabled ? "application/json" : "text/plain");
+		int ret = MHD_queue_response(connection, tracing_enabled ? MHD_HTTP_OK : MHD_HTTP_NOT_FOUND, response);
+		MHD_destroy_response(response);  // Only decreases the refcount; actual free is after the request is done.
+		return ret;
+	}
+
+	auto endpoint_it = endpoints.find(url);
+	if (endpoint_it != endpoints.end()) {
+		if (endpoint_it->second.method != method) {
+			string contents = "Use " + endpoint_it->second.method + ".\n";
+			MHD_Response *response = MHD_create_response_from_buffer(
+				contents.size(), &contents[0], MHD_RESPMEM_MUST_COPY);
+			MHD_add_response_header(response, "Content-type", "text/plain");
+			MHD_add_response_header(response, "Allow", endpoint_it->second.method.c_str());
+			int ret = MHD_queue_response(connection, MHD_HTTP_METHOD_NOT_ALLOWED, response);
+			MHD_destroy_response(response);  // Only decreases the refcount; actual free is after the request is done.
+			return ret;
+		}
+		if (strcmp(method, "POST") == 0) {
+			// libmicrohttpd calls us once for the headers, then for each
+			// piece of the body, and then once more at the end; we do not
+			// use the body, so only answer on that last call.
+			if (*con_cls == nullptr) {
+				*con_cls = &endpoint_it->second;
+				return MHD_YES;
+			}
+			if (*upload_data_size != 0) {
+				*upload_data_size = 0;
+				return MHD_YES;
+			}
+		}
+		string contents = endpoint_it->second.callback();
+		MHD_Response *response = MHD_create_response_from_buffer(
+			contents.size(), &contents[0], MHD_RESPMEM_MUST_COPY);
+		MHD_add_response_header(response, "Content-type", endpoint_it->second.content_type.c_str());
+		int ret = MHD_queue_response(connection, MHD_HTTP_OK, response);
+		MHD_destroy_response(response);  // Only decreases the refcount; actual free is after the request is done.
+		return ret;
+	}
+
+	// /ladder/<name>[.metacube] selects one of the extra renditions;
+	// everything else gets the main stream.
+	string rendition;
+	if (strncmp(url, "/ladder/", strlen("/ladder/")) == 0) {
+		rendition = url + strlen("/ladder/");
+		if (metacube) {
+			rendition.resize(rendition.size() - strlen(".metacube"));
+		}
+		if (rendition.empty() || !headers.count(rendition)) {
+			string contents = "No such rendition.\n";
+			MHD_Response *response = MHD_create_response_from_buffer(
+				contents.size(), &contents[0], MHD_RESPMEM_MUST_COPY);
+			MHD_add_response_header(response, "Content-type", "text/plain");
+			int ret = MHD_queue_response(connection, MHD_HTTP_NOT_FOUND, response);
+			MHD_destroy_response(response);  // Only decreases the refcount; actual free is after the request is done.
+			return ret;
+		}
+	}
 
-	HTTPD::Stream *stream = new HTTPD::Stream(this, framing);
+	HTTPD::Stream *stream = new HTTPD::Stream(this, framing, rendition);
+	const string &header = headers.at(rendition);
 	stream->add_data(header.data(), header.size(), Stream::DATA_TYPE_HEADER);
 	{
 		unique_lock<mutex> lock(streams_mutex);
@@ -5,10 +5,13 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <assert.h>
 #include <sys/types.h>
 #include <atomic>
 #include <condition_variable>
 #include <deque>
+#include <functional>
+#include <map>
 #include <mutex>
 #include <set>
 #include <string>
@@ -23,11 +26,35 @@ public:
 
 	// Should be called before start().
 	void set_header(const std::string &data) {
-		header = data;
+		headers[""] = data;
+	}
+
+	// Additional renditions of the stream (see --x264-ladder) are served
+	// on /ladder/<name>, with an optional .metacube suffix, and have their
+	// own headers. add_rendition() must be called before start().
+	void add_rendition(const std::string &rendition) {
+		headers[rendition];
+	}
+	void set_header(const std::string &rendition, const std::string &data) {
+		assert(headers.count(rendition));
+		headers[rendition] = data;
+	}
+
+	// Serves the result of <callback> as a document of type <content_type>
+	// on <url>. Should be called before start(); the callback is called
+	// from the HTTP server's threads. Requests with any other method than
+	// <method> get 405 Method Not Allowed; use POST for endpoints that
+	// change state, so that e.g. prefetching browsers cannot trigger them.
+	void add_endpoint(const std::string &url, const std::function<std::string()> &callback, const std::string &content_type = "text/plain", const std::string &method = "GET")
+	{
+		endpoints[url] = Endpoint{ callback, content_type, method };
 	}
 
 	void start(int port);
-	void add_data(const char *buf, size_t size, bool keyframe);
+	void add_data(const char *buf, size_t size, bool keyframe) {
+		add_data("", buf, size, keyframe);
+	}
+	void add_data(const std::string &rendition, const char *buf, size_t size, bool keyframe);
 
 private:
 	static int answer_to_connection_thunk(void *cls, MHD_Connection *connection,
@@ -49,7 +76,8 @@ private:
 			FRAMING_RAW,
 			FRAMING_METACUBE
 		};
-		Stream(HTTPD *parent, Framing framing) : parent(parent), framing(framing) {}
+		Stream(HTTPD *parent, Framing framing, const std::string &rendition)
+			: parent(parent), framing(framing), rendition(rendition) {}
 
 		static ssize_t reader_callback_thunk(void *cls, uint64_t pos, char *buf, size_t max);
 		ssize_t reader_callback(uint64_t pos, char *buf, size_t max);
@@ -62,10 +90,12 @@ private:
 		void add_data(const char *buf, size_t size, DataType data_type);
 		void stop();
 		HTTPD *get_parent() const { return parent; }
+		const std::string &get_rendition() const { return rendition; }
 
 	private:
 		HTTPD *parent;
 		Framing framing;
+		const std::string rendition;  // Empty for the main stream.
 
 		std::mutex buffer_mutex;
 		bool should_quit = false;  // Under <buffer_mutex>.
@@ -78,7 +108,17 @@ private:
 	MHD_Daemon *mhd = nullptr;
 	std::mutex streams_mutex;
 	std::set<Stream *> streams;  // Not owned.
-	std::string header;
+
+	// Keyed by rendition name; the main stream is "". The set of keys is
+	// fixed once start() has been called.
+	std::map<std::string, std::string> headers;
+
+	struct Endpoint {
+		std::function<std::string()> callback;
+		std::string content_type;
+		std::string method;
+	};
+	std::map<std::string, Endpoint> endpoints;  // Fixed once start() has been called.
 
 	// Metrics.
 	std::atomic<int64_t> metric_num_connected_clients{0};
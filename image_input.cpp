@@ -21,10 +21,12 @@ extern "C" {
 }
 
 #include <fcntl.h>
+#include <poll.h>
+#include <sys/inotify.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <algorithm>
 #include <cstddef>
-#include <functional>
 #include <mutex>
 #include <thread>
 #include <utility>
@@ -43,7 +45,7 @@ ImageInput::ImageInput(const string &filename)
 	                   GL_UNSIGNED_BYTE, 1280, 720),  // Resolution will be overwritten.
 	  filename(filename),
 	  pathname(search_for_file_or_die(filename)),
-	  current_image(load_image(filename, pathname))
+	  current_image(load_image(pathname))
 {
 	if (current_image == nullptr) {  // Could happen even though search_for_file() returned.
 		fprintf(stderr, "Couldn't load image, exiting.\n");
@@ -51,28 +53,47 @@ ImageInput::ImageInput(const string &filename)
 	}
 	set_width(current_image->width);
 	set_height(current_image->height);
-	set_pixel_data(current_image->pixels.get());
+}
+
+ImageInput::Image::~Image()
+{
+	lock_guard<mutex> lock(textures_to_delete_lock);
+	for (GLuint texnum : tex) {
+		if (texnum != 0) {
+			textures_to_delete.push_back(texnum);
+		}
+	}
 }
 
 void ImageInput::set_gl_state(GLuint glsl_program_num, const string& prefix, unsigned *sampler_num)
 {
+	delete_unused_textures();
+
+	// Our texture unit; don't disturb the ones of the inputs before us.
+	glActiveTexture(GL_TEXTURE0 + *sampler_num);
+
 	// See if the background thread has given us a new version of our image.
 	// Note: The old version might still be lying around in other ImageInputs
-	// (in fact, it's likely), but at least the total amount of memory used
-	// is bounded. Currently we don't even share textures between them,
-	// so there's a fair amount of OpenGL memory waste anyway (the cache
-	// is mostly there to save startup time, not RAM).
+	// (in fact, it's likely), but only until they are rendered again.
 	{
 		unique_lock<mutex> lock(all_images_lock);
 		if (all_images[pathname] != current_image) {
 			current_image = all_images[pathname];
-			set_pixel_data(current_image->pixels.get());
 		}
+		set_texture_num(get_texture(*current_image, output_linear_gamma));
 	}
 	movit::FlatInput::set_gl_state(glsl_program_num, prefix, sampler_num);
 }
 
-shared_ptr<const ImageInput::Image> ImageInput::load_image(const string &filename, const string &pathname)
+bool ImageInput::set_int(const string &key, int value)
+{
+	if (key == "output_linear_gamma") {
+		output_linear_gamma = value;
+	}
+	return movit::FlatInput::set_int(key, value);
+}
+
+shared_ptr<const ImageInput::Image> ImageInput::load_image(const string &pathname)
 {
 	unique_lock<mutex> lock(all_images_lock);  // Held also during loading.
 	if (all_images.count(pathname)) {
@@ -80,13 +101,50 @@ shared_ptr<const ImageInput::Image> ImageInput::load_image(const string &filenam
 	}
 
 	all_images[pathname] = load_image_raw(pathname);
-	timespec first_modified = all_images[pathname]->last_modified;
-	update_threads[pathname] =
-		thread(bind(update_thread_func, filename, pathname, first_modified));
+	if (all_images[pathname] == nullptr) {
+		all_images.erase(pathname);
+		return nullptr;
+	}
+	watch_file(pathname);
 
 	return all_images[pathname];
 }
 
+GLuint ImageInput::get_texture(const Image &image, bool srgb)
+{
+	GLuint &texnum = image.tex[srgb];
+	if (texnum != 0) {
+		return texnum;
+	}
+
+	glGenTextures(1, &texnum);
+	glBindTexture(GL_TEXTURE_2D, texnum);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+	glTexImage2D(GL_TEXTURE_2D, 0, srgb ? GL_SRGB8_ALPHA8 : GL_RGBA8, image.width, image.height, 0,
+		GL_RGBA, GL_UNSIGNED_BYTE, image.pixels.get());
+	// We don't know which chains will need mipmaps, so always make them.
+	glGenerateMipmap(GL_TEXTURE_2D);
+
+	// Make sure the upload is done before other contexts (which share
+	// the texture with us, but not our command stream) can use it.
+	// Happens only once per version of each image.
+	glFinish();
+	return texnum;
+}
+
+void ImageInput::delete_unused_textures()
+{
+	vector<GLuint> textures;
+	{
+		lock_guard<mutex> lock(textures_to_delete_lock);
+		swap(textures, textures_to_delete);
+	}
+	if (!textures.empty()) {
+		glDeleteTextures(textures.size(), textures.data());
+	}
+}
+
 shared_ptr<const ImageInput::Image> ImageInput::load_image_raw(const string &pathname)
 {
 	// Note: Call before open, not after; otherwise, there's a race.
@@ -195,66 +253,179 @@ shared_ptr<const ImageInput::Image> ImageInput::load_image_raw(const string &pat
 	unique_ptr<uint8_t[]> image_data(new uint8_t[len]);
 	av_image_copy_to_buffer(image_data.get(), len, pic_data, linesizes, AV_PIX_FMT_RGBA, frame->width, frame->height, 1);
 
-	shared_ptr<Image> image(new Image{unsigned(frame->width), unsigned(frame->height), move(image_data), last_modified});
+	shared_ptr<Image> image(new Image(unsigned(frame->width), unsigned(frame->height), move(image_data), last_modified));
 	return image;
 }
 
-// Fire up a thread to update the image every second.
-// We could do inotify, but this is good enough for now.
-void ImageInput::update_thread_func(const std::string &filename, const std::string &pathname, const timespec &first_modified)
+void ImageInput::watch_file(const string &pathname)
 {
-	char thread_name[16];
-	snprintf(thread_name, sizeof(thread_name), "Update_%s", filename.c_str());
-	pthread_setname_np(pthread_self(), thread_name);
+	if (!update_thread.joinable()) {
+		if (pipe2(update_quit_fd, O_CLOEXEC) == -1) {
+			perror("pipe2");
+			exit(1);
+		}
+		inotify_fd = inotify_init1(IN_CLOEXEC);
+		if (inotify_fd == -1) {
+			perror("inotify_init1");
+			fprintf(stderr, "Checking images for new versions every second instead.\n");
+		}
+		update_thread = thread(update_thread_func);
+	}
+	if (inotify_fd == -1) {
+		return;
+	}
 
-	timespec last_modified = first_modified;
+	// Watch the directory instead of the file itself, so that we also
+	// see new versions that are written elsewhere and then renamed
+	// into place (which most programs do).
+	string dirname, basename;
+	size_t slash_pos = pathname.rfind('/');
+	if (slash_pos == string::npos) {
+		dirname = ".";
+		basename = pathname;
+	} else {
+		dirname = pathname.substr(0, slash_pos + 1);
+		basename = pathname.substr(slash_pos + 1);
+	}
+	int wd = inotify_add_watch(inotify_fd, dirname.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+	if (wd == -1) {
+		perror(dirname.c_str());
+		fprintf(stderr, "%s: Will not be reloaded when it changes.\n", pathname.c_str());
+		return;
+	}
+	watched_files[wd][basename] = pathname;
+}
+
+void ImageInput::reload_if_changed(const string &pathname)
+{
 	struct stat buf;
-	for ( ;; ) {
-		{
-			unique_lock<mutex> lock(threads_should_quit_mu);
-			threads_should_quit_modified.wait_for(lock, chrono::seconds(1), []() { return threads_should_quit; });
+	if (stat(pathname.c_str(), &buf) != 0) {
+		fprintf(stderr, "%s: Couldn't check for new version, leaving the old in place.\n", pathname.c_str());
+		return;
+	}
+	{
+		unique_lock<mutex> lock(all_images_lock);
+		const timespec &last_modified = all_images[pathname]->last_modified;
+		if (buf.st_mtim.tv_sec == last_modified.tv_sec &&
+		    buf.st_mtim.tv_nsec == last_modified.tv_nsec) {
+			// Not changed.
+			return;
 		}
+	}
+
+	// Decode without holding the lock, so that the mixer is not held up.
+	shared_ptr<const Image> image = load_image_raw(pathname);
+	if (image == nullptr) {
+		fprintf(stderr, "Couldn't load image, leaving the old in place.\n");
+		return;
+	}
+	fprintf(stderr, "Loaded new version of %s from disk.\n", pathname.c_str());
+	unique_lock<mutex> lock(all_images_lock);
+	all_images[pathname] = image;
+	++image_generation;
+}
 
-		if (threads_should_quit) {
+void ImageInput::update_thread_func()
+{
+	pthread_setname_np(pthread_self(), "Update_images");
+
+	for ( ;; ) {
+		// Without inotify, check every image once a second.
+		// (poll() ignores negative file descriptors.)
+		pollfd fds[2];
+		fds[0].fd = update_quit_fd[0];
+		fds[0].events = POLLIN;
+		fds[1].fd = inotify_fd;
+		fds[1].events = POLLIN;
+		int ret = poll(fds, 2, inotify_fd == -1 ? 1000 : -1);
+		if (ret == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("poll");
 			return;
 		}
-
-		if (stat(pathname.c_str(), &buf) != 0) {
-			fprintf(stderr, "%s: Couldn't check for new version, leaving the old in place.\n", pathname.c_str());
-			continue;
+		if (fds[0].revents != 0) {
+			// shutdown_updaters() was called.
+			return;
 		}
-		if (buf.st_mtim.tv_sec == last_modified.tv_sec &&
-		    buf.st_mtim.tv_nsec == last_modified.tv_nsec) {
-			// Not changed.
-			continue;
+
+		vector<string> changed;
+		if (inotify_fd == -1) {
+			unique_lock<mutex> lock(all_images_lock);
+			for (const auto &pathname_and_image : all_images) {
+				changed.push_back(pathname_and_image.first);
+			}
+		} else if (fds[1].revents & POLLIN) {
+			alignas(inotify_event) char buf[4096];
+			ssize_t len = read(inotify_fd, buf, sizeof(buf));
+			if (len == -1) {
+				if (errno != EINTR && errno != EAGAIN) {
+					perror("read(inotify)");
+				}
+				continue;
+			}
+
+			unique_lock<mutex> lock(all_images_lock);
+			for (const char *ptr = buf; ptr < buf + len; ) {
+				const inotify_event *event = (const inotify_event *)ptr;
+				ptr += sizeof(inotify_event) + event->len;
+
+				if (event->mask & IN_Q_OVERFLOW) {
+					// We don't know what we missed, so check everything.
+					for (const auto &pathname_and_image : all_images) {
+						changed.push_back(pathname_and_image.first);
+					}
+					continue;
+				}
+				auto dir_it = watched_files.find(event->wd);
+				if (dir_it == watched_files.end() || event->len == 0) {
+					continue;
+				}
+				auto file_it = dir_it->second.find(event->name);
+				if (file_it != dir_it->second.end()) {
+					changed.push_back(file_it->second);
+				}
+			}
 		}
-		shared_ptr<const Image> image = load_image_raw(pathname);
-		if (image == nullptr) {
-			fprintf(stderr, "Couldn't load image, leaving the old in place.\n");
-			continue;
+
+		sort(changed.begin(), changed.end());
+		changed.erase(unique(changed.begin(), changed.end()), changed.end());
+		for (const string &pathname : changed) {
+			reload_if_changed(pathname);
 		}
-		fprintf(stderr, "Loaded new version of %s from disk.\n", pathname.c_str());
-		unique_lock<mutex> lock(all_images_lock);
-		all_images[pathname] = image;
-		last_modified = image->last_modified;
 	}
 }
 
+uint64_t ImageInput::get_image_generation()
+{
+	unique_lock<mutex> lock(all_images_lock);
+	return image_generation;
+}
+
 void ImageInput::shutdown_updaters()
 {
-	{
-		unique_lock<mutex> lock(threads_should_quit_mu);
-		threads_should_quit = true;
-		threads_should_quit_modified.notify_all();
+	if (!update_thread.joinable()) {
+		return;
+	}
+	if (write(update_quit_fd[1], "q", 1) != 1) {
+		perror("write");
 	}
-	for (auto &it : update_threads) {
-		it.second.join();
+	update_thread.join();
+	close(update_quit_fd[0]);
+	close(update_quit_fd[1]);
+	if (inotify_fd != -1) {
+		close(inotify_fd);
+		inotify_fd = -1;
 	}
 }
 
 mutex ImageInput::all_images_lock;
 map<string, shared_ptr<const ImageInput::Image>> ImageInput::all_images;
-map<string, thread> ImageInput::update_threads;
-mutex ImageInput::threads_should_quit_mu;
-bool ImageInput::threads_should_quit = false;
-condition_variable ImageInput::threads_should_quit_modified;
+uint64_t ImageInput::image_generation = 0;
+mutex ImageInput::textures_to_delete_lock;
+vector<GLuint> ImageInput::textures_to_delete;
+thread ImageInput::update_thread;
+int ImageInput::inotify_fd = -1;
+int ImageInput::update_quit_fd[2] = { -1, -1 };
+map<int, map<string, string>> ImageInput::watched_files;
@@ -5,17 +5,24 @@
 #include <movit/flat_input.h>
 #include <stdbool.h>
 #include <time.h>
-#include <condition_variable>
 #include <cstdint>
 #include <map>
 #include <memory>
 #include <mutex>
 #include <string>
 #include <thread>
+#include <utility>
+#include <vector>
 
 // An output that takes its input from a static image, loaded with ffmpeg.
-// comes from a single 2D array with chunky pixels. The image is refreshed
-// from disk about every second.
+// comes from a single 2D array with chunky pixels. The image is reloaded
+// from disk whenever it changes.
+//
+// Each version of an image file is decoded only once, and uploaded to
+// the GPU only once (per internal format; see set_int()), no matter how
+// many ImageInputs show it. A single background thread watches all the
+// files with inotify (or polls them every second if that is not available),
+// and decodes new versions, so that the mixer only ever has to upload them.
 class ImageInput : public movit::FlatInput {
 public:
 	ImageInput(const std::string &filename);
@@ -23,27 +30,59 @@ public:
 	std::string effect_type_id() const override { return "ImageInput"; }
 	void set_gl_state(GLuint glsl_program_num, const std::string& prefix, unsigned *sampler_num) override;
 	static void shutdown_updaters();
+
+	// Overridden to see what internal format FlatInput wants;
+	// with linear gamma, it needs the GPU to decode sRGB for it.
+	bool set_int(const std::string &key, int value) override;
+
+	// Changes every time any image is reloaded from disk, so that the mixer
+	// can tell whether chains with ImageInputs need to be rendered again.
+	static uint64_t get_image_generation();
 	
 private:
 	struct Image {
+		Image(unsigned width, unsigned height, std::unique_ptr<uint8_t[]> pixels, const timespec &last_modified)
+			: width(width), height(height), pixels(std::move(pixels)), last_modified(last_modified) {}
+		~Image();
+
 		unsigned width, height;
 		std::unique_ptr<uint8_t[]> pixels;
 		timespec last_modified;
+
+		// Uploaded on first use, from whatever context renders it first,
+		// and deleted when the last ImageInput stops using this version.
+		// [0] is GL_RGBA8, [1] is GL_SRGB8_ALPHA8. Under all_images_lock.
+		mutable GLuint tex[2] = { 0, 0 };
 	};
 
 	std::string filename, pathname;
 	std::shared_ptr<const Image> current_image;
+	bool output_linear_gamma = false;
 
-	static std::shared_ptr<const Image> load_image(const std::string &filename, const std::string &pathname);
+	static std::shared_ptr<const Image> load_image(const std::string &pathname);
 	static std::shared_ptr<const Image> load_image_raw(const std::string &pathname);
-	static void update_thread_func(const std::string &filename, const std::string &pathname, const timespec &first_modified);
+	static GLuint get_texture(const Image &image, bool srgb);  // Must be called with all_images_lock held.
+	static void delete_unused_textures();  // Must be called with a GL context current.
+	static void watch_file(const std::string &pathname);  // Must be called with all_images_lock held.
+	static void reload_if_changed(const std::string &pathname);
+	static void update_thread_func();
 	static std::mutex all_images_lock;
 	static std::map<std::string, std::shared_ptr<const Image>> all_images;
-	static std::map<std::string, std::thread> update_threads;
+	static uint64_t image_generation;  // Under all_images_lock.
+
+	// Textures from Image versions that nobody uses anymore. An Image
+	// can be freed from a thread without a GL context, so the textures
+	// are deleted from set_gl_state() instead.
+	static std::mutex textures_to_delete_lock;
+	static std::vector<GLuint> textures_to_delete;  // Under textures_to_delete_lock.
+
+	static std::thread update_thread;  // Started on the first load_image().
+	static int inotify_fd;  // -1 if inotify is not available.
+	static int update_quit_fd[2];  // A pipe; written to by shutdown_updaters().
 
-	static std::mutex threads_should_quit_mu;
-	static bool threads_should_quit;  // Under threads_should_quit_mu.
-	static std::condition_variable threads_should_quit_modified;  // Signals when threads_should_quit is set.
+	// inotify watch descriptor (of the directory) -> file name -> pathname.
+	// Under all_images_lock.
+	static std::map<int, std::map<std::string, std::string>> watched_files;
 };
 
 #endif // !defined(_IMAGE_INPUT_H)
@@ -2,6 +2,7 @@
 #define _INPUT_STATE_H 1
 
 #include <movit/image_format.h>
+#include <memory>
 
 #include "defs.h"
 #include "ref_counted_frame.h"
@@ -31,4 +32,11 @@ struct InputState {
 	bool full_range[MAX_VIDEO_CARDS];
 };
 
+// The input frames for one output frame. The mixer makes one of these per
+// output frame, and everything that needs to hold on to the frames until
+// it is done rendering (the chains, the display frames, the encoders)
+// shares it, instead of each copying num_cards * FRAME_HISTORY_LENGTH
+// frame references.
+typedef std::shared_ptr<const InputState> InputFrameSet;
+
 #endif  // !defined(_INPUT_STATE_H)
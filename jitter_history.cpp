@@ -0,0 +1,142 @@
+#include "jitter_history.h"
+
+#include <assert.h>
+#include <math.h>
+#include <algorithm>
+
+#include "metrics.h"
+#include "timebase.h"
+
+using namespace std;
+using namespace std::chrono;
+
+namespace {
+
+// Bucket 0 is everything below min_jitter_seconds; then buckets are spaced
+// geometrically with a ratio of bucket_ratio, up to max_jitter_seconds.
+// Anything above that goes into the last bucket.
+constexpr double min_jitter_seconds = 1e-5;
+constexpr double max_jitter_seconds = 10.0;
+constexpr double bucket_ratio = 1.01;
+const double log_bucket_ratio = log(bucket_ratio);
+const unsigned num_buckets = 2 + unsigned(ceil(log(max_jitter_seconds / min_jitter_seconds) / log_bucket_ratio));
+
+}  // namespace
+
+JitterHistory::JitterHistory(size_t history_length)
+	: history_length(history_length), history(history_length), fenwick(num_buckets + 1)
+{
+	assert(num_buckets <= 65536);  // Must fit in <history>.
+}
+
+void JitterHistory::register_metrics(const vector<pair<string, string>> &labels)
+{
+	global_metrics.add("input_underestimated_jitter_frames", labels, &metric_input_underestimated_jitter_frames);
+	global_metrics.add("input_estimated_max_jitter_seconds", labels, &metric_input_estimated_max_jitter_seconds, Metrics::TYPE_GAUGE);
+}
+
+void JitterHistory::unregister_metrics(const vector<pair<string, string>> &labels)
+{
+	global_metrics.remove("input_underestimated_jitter_frames", labels);
+	global_metrics.remove("input_estimated_max_jitter_seconds", labels);
+}
+
+void JitterHistory::set_history_length(size_t history_length)
+{
+	this->history_length = history_length;
+	history.assign(history_length, 0);
+	clear();
+}
+
+void JitterHistory::clear()
+{
+	history_head = history_size = 0;
+	fill(fenwick.begin(), fenwick.end(), 0);
+}
+
+void JitterHistory::frame_arrived(steady_clock::time_point now, int64_t frame_duration, size_t dropped_frames)
+{
+	if (expected_timestamp > steady_clock::time_point::min()) {
+		expected_timestamp += dropped_frames * nanoseconds(frame_duration * 1000000000 / TIMEBASE);
+		double jitter_seconds = fabs(duration<double>(expected_timestamp - now).count());
+		add_jitter_sample(jitter_seconds);
+		if (jitter_seconds > estimate_max_jitter()) {
+			++metric_input_underestimated_jitter_frames;
+		}
+
+		metric_input_estimated_max_jitter_seconds = estimate_max_jitter();
+	}
+	expected_timestamp = now + nanoseconds(frame_duration * 1000000000 / TIMEBASE);
+}
+
+void JitterHistory::add_jitter_sample(double jitter_seconds)
+{
+	unsigned bucket = bucket_for_jitter(jitter_seconds);
+	if (history_size == history_length) {
+		// Window is full, so throw out the oldest sample.
+		fenwick_add(history[history_head], -1);
+		history[history_head] = bucket;
+		history_head = (history_head + 1) % history_length;
+	} else {
+		history[(history_head + history_size) % history_length] = bucket;
+		++history_size;
+	}
+	fenwick_add(bucket, 1);
+}
+
+double JitterHistory::estimate_max_jitter() const
+{
+	if (history_size == 0) {
+		return 0.0;
+	}
+	// This picks the same element as the old multiset version did, which was
+	// prev(orders.end(), elem_idx + 1); note that this is counted from the top,
+	// so it is the low tail, not the 99.9th percentile the class comment talks
+	// about. Changing it would raise the safe queue lengths (and thus latency),
+	// so that would need to be evaluated on its own.
+	size_t elem_idx = lrint((history_size - 1) * percentile);
+	return jitter_for_bucket(fenwick_find_kth(history_size - 1 - elem_idx)) * multiplier;
+}
+
+unsigned JitterHistory::bucket_for_jitter(double jitter_seconds)
+{
+	if (!(jitter_seconds >= min_jitter_seconds)) {  // Also catches NaN.
+		return 0;
+	}
+	unsigned bucket = 1 + unsigned(log(jitter_seconds / min_jitter_seconds) / log_bucket_ratio);
+	return min(bucket, num_buckets - 1);
+}
+
+double JitterHistory::jitter_for_bucket(unsigned bucket)
+{
+	if (bucket == 0) {
+		return 0.5 * min_jitter_seconds;
+	}
+	// The geometric midpoint of the bucket.
+	return min_jitter_seconds * exp((bucket - 0.5) * log_bucket_ratio);
+}
+
+void JitterHistory::fenwick_add(unsigned bucket, int delta)
+{
+	for (unsigned i = bucket + 1; i <= num_buckets; i += i & -i) {
+		fenwick[i] += delta;
+	}
+}
+
+unsigned JitterHistory::fenwick_find_kth(size_t k) const
+{
+	assert(k < history_size);
+
+	// Standard binary lifting; find the largest position whose prefix sum
+	// is <= k. The bucket we want is the one right after that.
+	unsigned pos = 0;
+	unsigned step = 1;
+	while (step * 2 <= num_buckets) step *= 2;
+	for ( ; step > 0; step /= 2) {
+		if (pos + step <= num_buckets && fenwick[pos + step] <= k) {
+			pos += step;
+			k -= fenwick[pos];
+		}
+	}
+	return pos;  // 1-indexed pos + 1, minus one to make it a bucket number.
+}
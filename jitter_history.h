@@ -0,0 +1,79 @@
+#ifndef _JITTER_HISTORY_H
+#define _JITTER_HISTORY_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <utility>
+#include <vector>
+
+// A class to estimate the future jitter. Used in QueueLengthPolicy (see mixer.h).
+//
+// There are many ways to estimate jitter; I've tested a few ones (and also
+// some algorithms that don't explicitly model jitter) with different
+// parameters on some real-life data in experiments/queue_drop_policy.cpp.
+// This is one based on simple order statistics where I've added some margin in
+// the number of starvation events; I believe that about one every hour would
+// probably be acceptable, but this one typically goes lower than that, at the
+// cost of 2–3 ms extra latency. (If the queue is hard-limited to one frame, it's
+// possible to get ~10 ms further down, but this would mean framedrops every
+// second or so.) The general strategy is: Take the 99.9-percentile jitter over
+// last 5000 frames (see --jitter-history-frames), multiply by two, and that's our worst-case jitter
+// estimate. The fact that we're not using the max value means that we could
+// actually even throw away very late frames immediately, which means we only
+// get one user-visible event instead of seeing something both when the frame
+// arrives late (duplicate frame) and then again when we drop.
+class JitterHistory {
+private:
+	static constexpr size_t default_history_length = 5000;
+	static constexpr double percentile = 0.999;
+	static constexpr double multiplier = 2.0;
+
+public:
+	// The history length only affects memory usage by two bytes per frame,
+	// and does not affect the CPU usage at all, so it is perfectly feasible
+	// to keep e.g. an hour's worth of history.
+	explicit JitterHistory(size_t history_length = default_history_length);
+
+	// Also clears the history. Used for --jitter-history-frames.
+	void set_history_length(size_t history_length);
+
+	void register_metrics(const std::vector<std::pair<std::string, std::string>> &labels);
+	void unregister_metrics(const std::vector<std::pair<std::string, std::string>> &labels);
+
+	void clear();
+	void frame_arrived(std::chrono::steady_clock::time_point now, int64_t frame_duration, size_t dropped_frames);
+	std::chrono::steady_clock::time_point get_expected_next_frame() const { return expected_timestamp; }
+	double estimate_max_jitter() const;
+
+	// Exposed for benchmark_jitter_history. Add a jitter sample directly.
+	void add_jitter_sample(double jitter_seconds);
+
+private:
+	// Instead of keeping the exact samples in a sorted container, we quantize
+	// them into geometrically spaced buckets (about 0.5% relative error,
+	// which is way below the safety margin given by <multiplier>)
+	// and keep a count for each bucket in a Fenwick tree, which gives us
+	// O(log B) insertion, removal and order statistics for B buckets.
+	// The sliding window is a ring buffer of bucket indexes.
+	static unsigned bucket_for_jitter(double jitter_seconds);
+	static double jitter_for_bucket(unsigned bucket);
+	void fenwick_add(unsigned bucket, int delta);
+	unsigned fenwick_find_kth(size_t k) const;  // 0-indexed.
+
+	size_t history_length;
+	std::vector<uint16_t> history;  // Ring buffer.
+	size_t history_head = 0;  // Index of the oldest element in <history>.
+	size_t history_size = 0;
+	std::vector<uint32_t> fenwick;  // 1-indexed.
+
+	std::chrono::steady_clock::time_point expected_timestamp = std::chrono::steady_clock::time_point::min();
+
+	// Metrics. There are no direct summaries for jitter, since we already have latency summaries.
+	std::atomic<int64_t> metric_input_underestimated_jitter_frames{0};
+	std::atomic<double> metric_input_estimated_max_jitter_seconds{0.0 / 0.0};
+};
+
+#endif  // !defined(_JITTER_HISTORY_H)
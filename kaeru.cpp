@@ -10,6 +10,7 @@
 #include "mux.h"
 #include "quittable_sleeper.h"
 #include "timebase.h"
+#include "tracing.h"
 #include "x264_encoder.h"
 
 #include <assert.h>
@@ -167,6 +168,9 @@ void request_quit(int signal)
 int main(int argc, char *argv[])
 {
 	parse_flags(PROGRAM_KAERU, argc, argv);
+	if (global_flags.enable_tracing) {
+		enable_tracing(/*dump_signal=*/0);  // SIGUSR2 is taken by adjust_bitrate().
+	}
 	if (optind + 1 != argc) {
 		usage(PROGRAM_KAERU);
 		exit(1);
@@ -0,0 +1,116 @@
+#include "lua_pool_allocator.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <new>
+
+using namespace std;
+
+void *LuaPoolAllocator::alloc(void *ud, void *ptr, size_t osize, size_t nsize)
+{
+	LuaPoolAllocator *allocator = (LuaPoolAllocator *)ud;
+
+	// If <ptr> is nullptr, <osize> is the type of the object
+	// being allocated, not a size.
+	size_t old_size = (ptr == nullptr) ? 0 : osize;
+	void *new_ptr = allocator->reallocate(ptr, old_size, nsize);
+	if (new_ptr != nullptr || nsize == 0) {
+		*allocator->heap_bytes += int64_t(nsize) - int64_t(old_size);
+		if (nsize > old_size) {
+			allocator->allocated_since_take += nsize - old_size;
+		}
+	}
+	return new_ptr;
+}
+
+size_t LuaPoolAllocator::take_allocated_kb()
+{
+	size_t kb = allocated_since_take / 1024;
+	allocated_since_take -= kb * 1024;
+	return kb;
+}
+
+int LuaPoolAllocator::size_class(size_t size)
+{
+	for (unsigned i = 0; i < num_size_classes; ++i) {
+		if (size <= block_size(i)) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+void *LuaPoolAllocator::reallocate(void *ptr, size_t old_size, size_t new_size)
+{
+	if (new_size == 0) {
+		if (ptr != nullptr) {
+			free(ptr, old_size);
+		}
+		return nullptr;
+	}
+	if (ptr == nullptr) {
+		return allocate(new_size);
+	}
+
+	// If the block still fits in the same size class, keep it.
+	int old_class = size_class(old_size), new_class = size_class(new_size);
+	if (old_class == -1 && new_class == -1) {
+		void *new_ptr = realloc(ptr, new_size);
+		if (new_ptr == nullptr && new_size <= old_size) {
+			return ptr;  // See below.
+		}
+		return new_ptr;
+	}
+	if (old_class == new_class) {
+		return ptr;
+	}
+	void *new_ptr = allocate(new_size);
+	if (new_ptr == nullptr) {
+		// Lua assumes that shrinking never fails, so keep the old block.
+		// It will later be freed as if it were of the new (smaller) size,
+		// which is safe; at worst, it ends up in a smaller size class
+		// than it needs to be (or, if it came from malloc(), is never freed).
+		return (new_size <= old_size) ? ptr : nullptr;
+	}
+	memcpy(new_ptr, ptr, min(old_size, new_size));
+	free(ptr, old_size);
+	return new_ptr;
+}
+
+void *LuaPoolAllocator::allocate(size_t size)
+{
+	int cls = size_class(size);
+	if (cls == -1) {
+		return malloc(size);
+	}
+	if (free_lists[cls] == nullptr) {
+		// Carve a new chunk into blocks of this class.
+		char *chunk = new(nothrow) char[chunk_size];
+		if (chunk == nullptr) {
+			return nullptr;
+		}
+		chunks.emplace_back(chunk);
+		size_t bs = block_size(cls);
+		for (size_t offset = 0; offset + bs <= chunk_size; offset += bs) {
+			FreeBlock *block = (FreeBlock *)(chunk + offset);
+			block->next = free_lists[cls];
+			free_lists[cls] = block;
+		}
+	}
+	FreeBlock *block = free_lists[cls];
+	free_lists[cls] = block->next;
+	return block;
+}
+
+void LuaPoolAllocator::free(void *ptr, size_t size)
+{
+	int cls = size_class(size);
+	if (cls == -1) {
+		::free(ptr);
+		return;
+	}
+	FreeBlock *block = (FreeBlock *)ptr;
+	block->next = free_lists[cls];
+	free_lists[cls] = block;
+}
@@ -0,0 +1,63 @@
+#ifndef _LUA_POOL_ALLOCATOR_H
+#define _LUA_POOL_ALLOCATOR_H 1
+
+// A lua_Alloc for the theme's Lua states. Most of what Lua allocates
+// while evaluating the theme is small and short-lived (strings, tables,
+// closures, userdata), so small blocks come from free lists with one list
+// per size class, carved out of larger chunks; only blocks that are larger
+// than the largest class go to malloc. Chunks are never given back until
+// the allocator is destroyed, so once the state has reached its steady-state
+// size, allocating and freeing small objects does not touch the heap at all.
+//
+// Not thread-safe; all use of a lua_State must already be serialized
+// (for the theme, by its lock), and this only ever gets called from Lua.
+// Must outlive the lua_State.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <vector>
+
+class LuaPoolAllocator {
+public:
+	// The number of bytes currently allocated by Lua (ie., not counting
+	// unused space in the pools) is added to <heap_bytes>, which can be
+	// shared between several allocators.
+	explicit LuaPoolAllocator(std::atomic<int64_t> *heap_bytes) : heap_bytes(heap_bytes) {}
+
+	// To be given to lua_newstate(), with the allocator as <ud>.
+	static void *alloc(void *ud, void *ptr, size_t osize, size_t nsize);
+
+	// Returns how many kilobytes have been allocated since the last call
+	// (any remainder is carried over). Freeing memory does not count.
+	size_t take_allocated_kb();
+
+private:
+	// 16, 32, 64, …, 512 bytes. All are multiples of 16, so blocks are
+	// as aligned as the chunks are (ie., suitable for any type).
+	static constexpr unsigned num_size_classes = 6;
+	static constexpr size_t min_block_size = 16;
+	static constexpr size_t chunk_size = 65536;
+
+	// Returns -1 if the block is too large for any class.
+	static int size_class(size_t size);
+	static size_t block_size(int size_class) { return min_block_size << size_class; }
+
+	// Like realloc(), but needs the old size, and frees on <new_size> == 0.
+	void *reallocate(void *ptr, size_t old_size, size_t new_size);
+	void *allocate(size_t size);
+	void free(void *ptr, size_t size);
+
+	// Free blocks store the pointer to the next free block in their first bytes.
+	struct FreeBlock {
+		FreeBlock *next;
+	};
+	FreeBlock *free_lists[num_size_classes] = { nullptr };
+	std::vector<std::unique_ptr<char[]>> chunks;
+
+	std::atomic<int64_t> *heap_bytes;
+	size_t allocated_since_take = 0;
+};
+
+#endif  // !defined(_LUA_POOL_ALLOCATOR_H)
@@ -1,6 +1,7 @@
 extern "C" {
 #include <libavformat/avformat.h>
 }
+#include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -9,8 +10,10 @@ extern "C" {
 #include <QApplication>
 #include <QCoreApplication>
 #include <QGL>
+#include <QOpenGLContext>
 #include <QSize>
 #include <QSurfaceFormat>
+#include <chrono>
 #include <string>
 
 #include "basic_stats.h"
@@ -19,12 +22,79 @@ extern "C" {
 #include "image_input.h"
 #include "mainwindow.h"
 #include "mixer.h"
+#include "quittable_sleeper.h"
+#include "tracing.h"
+
+using namespace std;
+using namespace std::chrono;
+
+namespace {
+
+QuittableSleeper should_quit;
+
+void request_quit(int signal)
+{
+	should_quit.quit();
+}
+
+// Runs the mixer without any windows; it is then controlled through
+// the theme and the /control/ HTTP endpoints (see Mixer::Mixer()),
+// and stopped through SIGINT/SIGTERM. The GUI normally creates
+// the mixer when the first GLWidget is initialized, so we need to do
+// the equivalent setup ourselves.
+int run_headless(const QSurfaceFormat &fmt)
+{
+	QSurface *share_surface = create_surface(fmt);
+	global_share_context = create_context(share_surface);
+	if (!global_share_context->isValid()) {
+		fprintf(stderr, "Failed to initialize OpenGL. Nageru needs at least OpenGL 3.1 to function properly.\n");
+		exit(1);
+	}
+
+	// Mixer::Mixer() needs a current context (e.g. for init_movit()),
+	// just like it gets in GLWidget::initializeGL().
+	if (!make_current(global_share_context, share_surface)) {
+		fprintf(stderr, "Failed to make the OpenGL context current.\n");
+		exit(1);
+	}
+	global_mixer = new Mixer(fmt, global_flags.num_cards);
+	global_audio_mixer = global_mixer->get_audio_mixer();
+	global_share_context->doneCurrent();
+	global_mixer->start();
+
+	signal(SIGINT, request_quit);
+	signal(SIGTERM, request_quit);
+	while (!should_quit.should_quit()) {
+		should_quit.sleep_for(hours(1000));
+	}
+
+	global_mixer->quit();
+	delete global_mixer;
+	ImageInput::shutdown_updaters();
+	return 0;
+}
+
+}  // namespace
 
 int main(int argc, char *argv[])
 {
 	parse_flags(PROGRAM_NAGERU, argc, argv);
+	if (global_flags.enable_tracing) {
+		enable_tracing(SIGUSR2);
+	}
 
-	if (global_flags.va_display.empty() ||
+	if (global_flags.headless) {
+		// No X server, so use EGL directly. These are all defaults that
+		// can be overridden from the environment; e.g., if you want to
+		// run on a specific GPU, EGL_PLATFORM=drm and
+		// QT_QPA_EGLFS_KMS_CONFIG might be more appropriate.
+		// Note that Qt's eglfs platform still wants a DRM/KMS device
+		// to exist, even though we never show anything on it.
+		setenv("QT_QPA_PLATFORM", "eglfs", 0);
+		setenv("QT_QPA_EGLFS_INTEGRATION", "none", 0);
+		setenv("EGL_PLATFORM", "surfaceless", 0);
+		using_egl = true;
+	} else if (global_flags.va_display.empty() ||
 	    global_flags.va_display[0] != '/') {
 		// We normally use EGL for zerocopy, but if we use VA against DRM
 		// instead of against X11, we turn it off, and then don't need EGL.
@@ -52,11 +122,16 @@ int main(int argc, char *argv[])
 
 	QGLFormat::setDefaultFormat(QGLFormat::fromSurfaceFormat(fmt));
 
+	if (global_flags.headless) {
+		return run_headless(fmt);
+	}
+
 	global_share_widget = new QGLWidget();
 	if (!global_share_widget->isValid()) {
 		fprintf(stderr, "Failed to initialize OpenGL. Nageru needs at least OpenGL 3.1 to function properly.\n");
 		exit(1);
 	}
+	global_share_context = global_share_widget->context()->contextHandle();
 
 	MainWindow mainWindow;
 	mainWindow.resize(QSize(1500, 850));
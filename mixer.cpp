@@ -41,6 +41,7 @@
 #include "disk_space_estimator.h"
 #include "ffmpeg_capture.h"
 #include "flags.h"
+#include "frame_arrival_log.h"
 #include "input_mapping.h"
 #include "metrics.h"
 #include "pbo_frame_allocator.h"
@@ -48,6 +49,7 @@
 #include "resampling_queue.h"
 #include "timebase.h"
 #include "timecode_renderer.h"
+#include "tracing.h"
 #include "v210_converter.h"
 #include "video_encoder.h"
 
@@ -79,6 +81,23 @@ void insert_new_frame(RefCountedFrame frame, unsigned field_num, bool interlaced
 	}
 }
 
+// Counts the distinct frames held by <input_state>; progressive inputs
+// have the same frame in every history slot.
+int64_t count_pinned_frames(const InputState &input_state)
+{
+	int64_t num_frames = 0;
+	for (unsigned card_index = 0; card_index < MAX_VIDEO_CARDS; ++card_index) {
+		for (unsigned frame_num = 0; frame_num < FRAME_HISTORY_LENGTH; ++frame_num) {
+			const RefCountedFrame &frame = input_state.buffered_frames[card_index][frame_num].frame;
+			if (frame != nullptr &&
+			    (frame_num == 0 || frame != input_state.buffered_frames[card_index][frame_num - 1].frame)) {
+				++num_frames;
+			}
+		}
+	}
+	return num_frames;
+}
+
 void ensure_texture_resolution(PBOFrameAllocator::Userdata *userdata, unsigned field, unsigned width, unsigned height, unsigned cbcr_width, unsigned cbcr_height, unsigned v210_width)
 {
 	bool first;
@@ -197,99 +216,6 @@ void upload_texture(GLuint tex, GLuint width, GLuint height, GLuint stride, bool
 
 }  // namespace
 
-void JitterHistory::register_metrics(const vector<pair<string, string>> &labels)
-{
-	global_metrics.add("input_underestimated_jitter_frames", labels, &metric_input_underestimated_jitter_frames);
-	global_metrics.add("input_estimated_max_jitter_seconds", labels, &metric_input_estimated_max_jitter_seconds, Metrics::TYPE_GAUGE);
-}
-
-void JitterHistory::unregister_metrics(const vector<pair<string, string>> &labels)
-{
-	global_metrics.remove("input_underestimated_jitter_frames", labels);
-	global_metrics.remove("input_estimated_max_jitter_seconds", labels);
-}
-
-void JitterHistory::frame_arrived(steady_clock::time_point now, int64_t frame_duration, size_t dropped_frames)
-{
-	if (expected_timestamp > steady_clock::time_point::min()) {
-		expected_timestamp += dropped_frames * nanoseconds(frame_duration * 1000000000 / TIMEBASE);
-		double jitter_seconds = fabs(duration<double>(expected_timestamp - now).count());
-		history.push_back(orders.insert(jitter_seconds));
-		if (jitter_seconds > estimate_max_jitter()) {
-			++metric_input_underestimated_jitter_frames;
-		}
-
-		metric_input_estimated_max_jitter_seconds = estimate_max_jitter();
-
-		if (history.size() > history_length) {
-			orders.erase(history.front());
-			history.pop_front();
-		}
-		assert(history.size() <= history_length);
-	}
-	expected_timestamp = now + nanoseconds(frame_duration * 1000000000 / TIMEBASE);
-}
-
-double JitterHistory::estimate_max_jitter() const
-{
-	if (orders.empty()) {
-		return 0.0;
-	}
-	size_t elem_idx = lrint((orders.size() - 1) * percentile);
-	if (percentile <= 0.5) {
-		return *next(orders.begin(), elem_idx) * multiplier;
-	} else {
-		return *prev(orders.end(), elem_idx + 1) * multiplier;
-	}
-}
-
-void QueueLengthPolicy::register_metrics(const vector<pair<string, string>> &labels)
-{
-	global_metrics.add("input_queue_safe_length_frames", labels, &metric_input_queue_safe_length_frames, Metrics::TYPE_GAUGE);
-}
-
-void QueueLengthPolicy::unregister_metrics(const vector<pair<string, string>> &labels)
-{
-	global_metrics.remove("input_queue_safe_length_frames", labels);
-}
-
-void QueueLengthPolicy::update_policy(steady_clock::time_point now,
-                                      steady_clock::time_point expected_next_frame,
-                                      int64_t input_frame_duration,
-                                      int64_t master_frame_duration,
-                                      double max_input_card_jitter_seconds,
-                                      double max_master_card_jitter_seconds)
-{
-	double input_frame_duration_seconds = input_frame_duration / double(TIMEBASE);
-	double master_frame_duration_seconds = master_frame_duration / double(TIMEBASE);
-
-	// Figure out when we can expect the next frame for this card, assuming
-	// worst-case jitter (ie., the frame is maximally late).
-	double seconds_until_next_frame = max(duration<double>(expected_next_frame - now).count() + max_input_card_jitter_seconds, 0.0);
-
-	// How many times are the master card expected to tick in that time?
-	// We assume the master clock has worst-case jitter but not any rate
-	// discrepancy, ie., it ticks as early as possible every time, but not
-	// cumulatively.
-	double frames_needed = (seconds_until_next_frame + max_master_card_jitter_seconds) / master_frame_duration_seconds;
-
-	// As a special case, if the master card ticks faster than the input card,
-	// we expect the queue to drain by itself even without dropping. But if
-	// the difference is small (e.g. 60 Hz master and 59.94 input), it would
-	// go slowly enough that the effect wouldn't really be appreciable.
-	// We account for this by looking at the situation five frames ahead,
-	// assuming everything else is the same.
-	double frames_allowed;
-	if (master_frame_duration < input_frame_duration) {
-		frames_allowed = frames_needed + 5 * (input_frame_duration_seconds - master_frame_duration_seconds) / master_frame_duration_seconds;
-	} else {
-		frames_allowed = frames_needed;
-	}
-
-	safe_queue_length = max<int>(floor(frames_allowed), 0);
-	metric_input_queue_safe_length_frames = safe_queue_length;
-}
-
 Mixer::Mixer(const QSurfaceFormat &format, unsigned num_cards)
 	: httpd(),
 	  num_cards(num_cards),
@@ -315,6 +241,7 @@ Mixer::Mixer(const QSurfaceFormat &format, unsigned num_cards)
 	for (unsigned i = 0; i < NUM_OUTPUTS; ++i) {
 		output_channel[i].parent = this;
 		output_channel[i].channel = i;
+		output_channel[i].metric_display_render_seconds.init_geometric(0.0001, 0.1, 20);
 	}
 
 	ImageFormat inout_format;
@@ -351,6 +278,34 @@ Mixer::Mixer(const QSurfaceFormat &format, unsigned num_cards)
 
 	// Must be instantiated after VideoEncoder has initialized global_flags.use_zerocopy.
 	theme.reset(new Theme(global_flags.theme_filename, global_flags.theme_dirs, resource_pool.get(), num_cards));
+	httpd.add_endpoint("/theme_profile", [this]{ return theme->get_profile_hot_spots(); });
+	if (global_flags.headless) {
+		// Without a GUI, the buttons below the previews and the transition
+		// buttons are instead available over HTTP (so they can be bound to
+		// e.g. a hardware panel). The MIDI mapper only controls audio,
+		// which a headless setup does not need to adjust live.
+		// The clicks are POST-only, and run on the mixer thread
+		// (see run_control_actions()), not on the HTTP server's threads.
+		for (int i = 0; i < theme->get_num_channels(); ++i) {
+			httpd.add_endpoint("/control/channel/" + to_string(i), [this, i]{
+				queue_control_action([this, i]{ channel_clicked(i); });
+				return "OK\n";
+			}, "text/plain", "POST");
+		}
+		for (int i = 0; i < 3; ++i) {  // Same as the number of transition buttons in the UI.
+			httpd.add_endpoint("/control/transition/" + to_string(i), [this, i]{
+				queue_control_action([this, i]{ transition_clicked(i); });
+				return "OK\n";
+			}, "text/plain", "POST");
+		}
+		httpd.add_endpoint("/control/transitions", [this]{
+			string ret;
+			for (const string &name : get_transition_names()) {
+				ret += name + "\n";
+			}
+			return ret;
+		});
+	}
 
 	// Start listening for clients only once VideoEncoder has written its header, if any.
 	httpd.start(9095);
@@ -413,6 +368,16 @@ Mixer::Mixer(const QSurfaceFormat &format, unsigned num_cards)
 	}
 	num_video_inputs = video_inputs.size();
 
+	if (global_flags.free_run) {
+		for (unsigned card_index = 0; card_index < num_cards; ++card_index) {
+			if (cards[card_index].type == CardType::LIVE_CARD) {
+				fprintf(stderr, "ERROR: --free-run can only be used with fake cards and video inputs, but card %u is a real card.\n", card_index);
+				fprintf(stderr, "       (Try lowering --num-cards.)\n");
+				exit(1);
+			}
+		}
+	}
+
 	BMUSBCapture::set_card_connected_callback(bind(&Mixer::bm_hotplug_add, this, _1));
 	BMUSBCapture::start_bm_thread();
 
@@ -459,7 +424,46 @@ Mixer::Mixer(const QSurfaceFormat &format, unsigned num_cards)
 		set_output_card_internal(global_flags.output_card);
 	}
 
+	for (unsigned card_index = 0; card_index < MAX_VIDEO_CARDS; ++card_index) {
+		cards[card_index].jitter_history.set_history_length(global_flags.jitter_history_frames);
+	}
+	output_jitter_history.set_history_length(global_flags.jitter_history_frames);
 	output_jitter_history.register_metrics({{ "card", "output" }});
+
+	metric_theme_lua_seconds.init_geometric(0.0001, 0.1, 20);
+	global_metrics.add("theme_lua_seconds", &metric_theme_lua_seconds);
+	if (global_flags.pipeline_theme) {
+		metric_theme_wait_seconds.init_geometric(0.0001, 0.1, 20);
+		global_metrics.add("theme_pipeline_wait_seconds", &metric_theme_wait_seconds);
+	}
+	global_metrics.add("display_frames_skipped", &metric_display_frames_skipped);
+	global_metrics.add("display_frames_reused", &metric_display_frames_reused);
+	for (int i = 0; i < theme->get_num_channels() + 2; ++i) {
+		string channel_label = (i == 0) ? "live" : (i == 1) ? "preview" : to_string(i);
+		global_metrics.add("display_render_seconds", {{ "channel", channel_label }}, &output_channel[i].metric_display_render_seconds);
+		global_metrics.add("input_frames_pinned", {{ "channel", channel_label }}, &output_channel[i].metric_input_frames_pinned, Metrics::TYPE_GAUGE);
+	}
+
+	if (!global_flags.free_run && global_flags.master_clock_timeout_frames > 0) {
+		global_metrics.add("master_clock_failovers", &metric_master_clock_failovers);
+		global_metrics.add("master_clock_failbacks", &metric_master_clock_failbacks);
+		global_metrics.add("master_clock_source_seconds", {{ "source", "master_card" }}, &metric_master_clock_source_seconds[int(ClockSource::MASTER_CARD)]);
+		global_metrics.add("master_clock_source_seconds", {{ "source", "fallback_card" }}, &metric_master_clock_source_seconds[int(ClockSource::FALLBACK_CARD)]);
+		global_metrics.add("master_clock_source_seconds", {{ "source", "timer" }}, &metric_master_clock_source_seconds[int(ClockSource::TIMER)]);
+	}
+
+	if (!global_flags.frame_arrival_log_filename.empty()) {
+		frame_arrival_log.reset(new FrameArrivalLogWriter(global_flags.frame_arrival_log_filename));
+	}
+
+	metric_upload_seconds.init_geometric(0.0001, 0.1, 20);
+	global_metrics.add("input_upload_seconds", &metric_upload_seconds);
+	if (global_flags.upload_thread) {
+		upload_surface = create_surface(format);
+		metric_upload_wait_seconds.init_geometric(0.0001, 0.1, 20);
+		global_metrics.add("input_upload_wait_seconds", &metric_upload_wait_seconds);
+		global_metrics.add("input_upload_fence_not_signaled_frames", &metric_upload_fence_not_signaled);
+	}
 }
 
 Mixer::~Mixer()
@@ -467,11 +471,8 @@ Mixer::~Mixer()
 	BMUSBCapture::stop_bm_thread();
 
 	for (unsigned card_index = 0; card_index < num_cards + num_video_inputs; ++card_index) {
-		{
-			unique_lock<mutex> lock(card_mutex);
-			cards[card_index].should_quit = true;  // Unblock thread.
-			cards[card_index].new_frames_changed.notify_all();
-		}
+		cards[card_index].should_quit = true;  // Unblock thread.
+		cards[card_index].new_frames.wake();
 		cards[card_index].capture->stop_dequeue_thread();
 		if (cards[card_index].output) {
 			cards[card_index].output->end_output();
@@ -514,7 +515,7 @@ void Mixer::configure_card(unsigned card_index, CaptureInterface *capture, CardT
 	if (card->surface == nullptr) {
 		card->surface = create_surface_with_same_format(mixer_surface);
 	}
-	while (!card->new_frames.empty()) card->new_frames.pop_front();
+	card->new_frames.clear();  // Safe, since the old capture thread is stopped and the new one not started yet.
 	card->last_timecode = -1;
 	card->capture->set_pixel_format(pixel_format);
 	card->capture->configure_card();
@@ -537,6 +538,9 @@ void Mixer::configure_card(unsigned card_index, CaptureInterface *capture, CardT
 		global_metrics.remove("input_dropped_frames_resets", labels);
 		global_metrics.remove("input_queue_length_frames", labels);
 		global_metrics.remove("input_queue_duped_frames", labels);
+		global_metrics.remove("input_dropped_frames_queue_full", labels);
+		global_metrics.remove("input_queue_wait_seconds", labels);
+		global_metrics.remove("input_queue_wakeups", labels);
 
 		global_metrics.remove("input_has_signal_bool", labels);
 		global_metrics.remove("input_is_connected_bool", labels);
@@ -575,6 +579,12 @@ void Mixer::configure_card(unsigned card_index, CaptureInterface *capture, CardT
 	global_metrics.add("input_dropped_frames_resets", labels, &card->metric_input_resets);
 	global_metrics.add("input_queue_length_frames", labels, &card->metric_input_queue_length_frames, Metrics::TYPE_GAUGE);
 	global_metrics.add("input_queue_duped_frames", labels, &card->metric_input_duped_frames);
+	global_metrics.add("input_dropped_frames_queue_full", labels, &card->metric_input_dropped_frames_queue_full);
+	if (card->labels.empty()) {  // First time.
+		card->metric_input_queue_wait_seconds.init_geometric(0.0001, 1.0, 20);
+	}
+	global_metrics.add("input_queue_wait_seconds", labels, &card->metric_input_queue_wait_seconds);
+	global_metrics.add("input_queue_wakeups", labels, &card->new_frames.num_wakeups);
 
 	global_metrics.add("input_has_signal_bool", labels, &card->metric_input_has_signal_bool, Metrics::TYPE_GAUGE);
 	global_metrics.add("input_is_connected_bool", labels, &card->metric_input_is_connected_bool, Metrics::TYPE_GAUGE);
@@ -589,18 +599,16 @@ void Mixer::configure_card(unsigned card_index, CaptureInterface *capture, CardT
 
 void Mixer::set_output_card_internal(int card_index)
 {
-	// We don't really need to take card_mutex, since we're in the mixer
-	// thread and don't mess with any queues (which is the only thing that happens
-	// from other threads), but it's probably the safest in the long run.
+	// We're swapping out capture and output objects, which the UI thread
+	// can look at (see get_available_output_video_modes()), so we need card_mutex.
 	unique_lock<mutex> lock(card_mutex);
 	if (output_card_index != -1) {
 		// Switch the old card from output to input.
 		CaptureCard *old_card = &cards[output_card_index];
 		old_card->output->end_output();
 
-		// Stop the fake card that we put into place.
-		// This needs to _not_ happen under the mutex, to avoid deadlock
-		// (delivering the last frame needs to take the mutex).
+		// Stop the fake card that we put into place. This can take a while,
+		// so don't block the UI thread on it.
 		CaptureInterface *fake_capture = old_card->capture.get();
 		lock.unlock();
 		fake_capture->stop_dequeue_thread();
@@ -648,6 +656,7 @@ void Mixer::bm_frame(unsigned card_index, uint16_t timecode,
                      FrameAllocator::Frame video_frame, size_t video_offset, VideoFormat video_format,
 		     FrameAllocator::Frame audio_frame, size_t audio_offset, AudioFormat audio_format)
 {
+	TraceScope trace("bm_frame", -1, card_index);
 	DeviceSpec device{InputSourceType::CAPTURE_CARD, card_index};
 	CaptureCard *card = &cards[card_index];
 
@@ -723,7 +732,7 @@ void Mixer::bm_frame(unsigned card_index, uint16_t timecode,
 		} while (!success);
 	}
 
-	if (num_samples > 0) {
+	if (num_samples > 0 && !global_flags.free_run) {  // See audio_thread_func().
 		audio_mixer.add_audio(device, audio_frame.data + audio_offset, num_samples, audio_format, frame_length, audio_frame.received_timestamp);
 	}
 
@@ -768,18 +777,15 @@ void Mixer::bm_frame(unsigned card_index, uint16_t timecode,
 
 		// Still send on the information that we _had_ a frame, even though it's corrupted,
 		// so that pts can go up accordingly.
-		{
-			unique_lock<mutex> lock(card_mutex);
-			CaptureCard::NewFrame new_frame;
-			new_frame.frame = RefCountedFrame(FrameAllocator::Frame());
-			new_frame.length = frame_length;
-			new_frame.interlaced = false;
-			new_frame.dropped_frames = dropped_frames;
-			new_frame.received_timestamp = video_frame.received_timestamp;
-			card->new_frames.push_back(move(new_frame));
-			card->jitter_history.frame_arrived(video_frame.received_timestamp, frame_length, dropped_frames);
-		}
-		card->new_frames_changed.notify_all();
+		CaptureCard::NewFrame new_frame;
+		new_frame.frame = RefCountedFrame(FrameAllocator::Frame());
+		new_frame.length = frame_length;
+		new_frame.interlaced = false;
+		new_frame.dropped_frames = dropped_frames;
+		new_frame.received_timestamp = video_frame.received_timestamp;
+		if (!card->new_frames.push(move(new_frame))) {
+			++card->metric_input_dropped_frames_queue_full;
+		}
 		return;
 	}
 
@@ -814,6 +820,10 @@ void Mixer::bm_frame(unsigned card_index, uint16_t timecode,
 		// faster, depending on the GPU and driver), but it appears to be trickling
 		// driver bugs very easily.
 		//
+		// With --upload-thread, it is instead run on a dedicated thread with
+		// its own context right away, so that it overlaps with the rendering
+		// of the previous frame; see upload_thread_func().
+		//
 		// Note that this means we must hold on to the actual frame data in <userdata>
 		// until the upload command is run, but we hold on to <frame> much longer than that
 		// (in fact, all the way until we no longer use the texture in rendering).
@@ -880,32 +890,35 @@ void Mixer::bm_frame(unsigned card_index, uint16_t timecode,
 			check_error();
 		};
 
+		CaptureCard::NewFrame new_frame;
 		if (field == 1) {
-			// Don't upload the second field as fast as we can; wait until
-			// the field time has approximately passed. (Otherwise, we could
-			// get timing jitter against the other sources, and possibly also
-			// against the video display, although the latter is not as critical.)
-			// This requires our system clock to be reasonably close to the
-			// video clock, but that's not an unreasonable assumption.
-			steady_clock::time_point second_field_start = frame_upload_start +
+			// Don't let the mixer use the second field as fast as we can deliver it;
+			// it becomes eligible only when the field time has approximately passed.
+			// (Otherwise, we could get timing jitter against the other sources,
+			// and possibly also against the video display, although the latter is
+			// not as critical.) This requires our system clock to be reasonably
+			// close to the video clock, but that's not an unreasonable assumption.
+			// We used to sleep here instead, but that would block the capture
+			// thread (and thus audio ingestion) for a full field.
+			new_frame.not_before = frame_upload_start +
 				nanoseconds(frame_length * 1000000000 / TIMEBASE);
-			this_thread::sleep_until(second_field_start);
 		}
-
-		{
-			unique_lock<mutex> lock(card_mutex);
-			CaptureCard::NewFrame new_frame;
-			new_frame.frame = frame;
-			new_frame.length = frame_length;
-			new_frame.field = field;
-			new_frame.interlaced = video_format.interlaced;
+		new_frame.frame = frame;
+		new_frame.length = frame_length;
+		new_frame.field = field;
+		new_frame.interlaced = video_format.interlaced;
+		if (global_flags.upload_thread) {
+			new_frame.pending_upload = start_upload(card_index, frame, move(upload_func));
+		} else {
 			new_frame.upload_func = upload_func;
-			new_frame.dropped_frames = dropped_frames;
-			new_frame.received_timestamp = video_frame.received_timestamp;  // Ignore the audio timestamp.
-			card->new_frames.push_back(move(new_frame));
-			card->jitter_history.frame_arrived(video_frame.received_timestamp, frame_length, dropped_frames);
 		}
-		card->new_frames_changed.notify_all();
+		new_frame.dropped_frames = dropped_frames;
+		new_frame.received_timestamp = video_frame.received_timestamp;  // Ignore the audio timestamp.
+		if (!card->new_frames.push(move(new_frame))) {
+			// The mixer thread is not keeping up at all; this should never
+			// happen in practice, since trim_queue() keeps the queue much shorter.
+			++card->metric_input_dropped_frames_queue_full;
+		}
 	}
 }
 
@@ -917,7 +930,7 @@ void Mixer::bm_hotplug_add(libusb_device *dev)
 
 void Mixer::bm_hotplug_remove(unsigned card_index)
 {
-	cards[card_index].new_frames_changed.notify_all();
+	cards[card_index].new_frames.wake();
 }
 
 void Mixer::thread_func()
@@ -943,6 +956,7 @@ void Mixer::thread_func()
 	int stats_dropped_frames = 0;
 
 	while (!should_quit) {
+		run_control_actions();
 		if (desired_output_card_index != output_card_index) {
 			set_output_card_internal(desired_output_card_index);
 		}
@@ -975,7 +989,8 @@ void Mixer::thread_func()
 		handle_hotplugged_cards();
 
 		for (unsigned card_index = 0; card_index < num_cards + num_video_inputs; ++card_index) {
-			if (card_index == master_card_index || !has_new_frame[card_index]) {
+			if ((card_index == output_frame_info.clock_card_index && !output_frame_info.clocked_to_timer) ||
+			    !has_new_frame[card_index]) {
 				continue;
 			}
 			if (new_frames[card_index].frame->len == 0) {
@@ -989,9 +1004,9 @@ void Mixer::thread_func()
 
 		// If the first card is reporting a corrupted or otherwise dropped frame,
 		// just increase the pts (skipping over this frame) and don't try to compute anything new.
-		if (!master_card_is_output && new_frames[master_card_index].frame->len == 0) {
+		if (!master_card_is_output && !output_frame_info.clocked_to_timer && new_frames[output_frame_info.clock_card_index].frame->len == 0) {
 			++stats_dropped_frames;
-			pts_int += new_frames[master_card_index].length;
+			pts_int += new_frames[output_frame_info.clock_card_index].length;
 			continue;
 		}
 
@@ -1006,13 +1021,32 @@ void Mixer::thread_func()
 
 			// The new texture might need uploading before use.
 			if (new_frame->upload_func) {
+				TraceScope trace("upload_func", pts_int, card_index);
+				steady_clock::time_point start = steady_clock::now();
 				new_frame->upload_func();
 				new_frame->upload_func = nullptr;
+				metric_upload_seconds.count_event(duration<double>(steady_clock::now() - start).count());
+			}
+			if (new_frame->pending_upload) {
+				TraceScope trace("wait_for_upload", pts_int, card_index);
+				wait_for_upload(new_frame->pending_upload.get());
+				new_frame->pending_upload.reset();
 			}
 		}
 
 		int64_t frame_duration = output_frame_info.frame_duration;
-		render_one_frame(frame_duration);
+		{
+			TraceScope trace("render_one_frame", pts_int);
+			render_one_frame(frame_duration);
+		}
+
+		// The frame is on its way, and we are about to wait for the next one
+		// anyway, so this is the least bad time for garbage collection.
+		// With --pipeline-theme, the theme thread does it instead.
+		if (!global_flags.pipeline_theme) {
+			TraceScope trace("lua_gc", pts_int);
+			theme->step_garbage_collector();
+		}
 		++frame_num;
 		pts_int += frame_duration;
 
@@ -1057,9 +1091,15 @@ void Mixer::trim_queue(CaptureCard *card, size_t safe_queue_length)
 	// avoiding starvation, but they still add to the problem of latency.
 	// Since dropped frames is going to mean a bump in the signal anyway,
 	// we err on the side of having more stable latency instead.
+	//
+	// More frames could arrive while we're looking at the queue, but that's fine;
+	// they will simply be counted next time. Make sure we don't drop any frames
+	// without having seen them for the jitter history first, though.
+	// Second fields that are not due yet are not counted (or dropped).
+	const size_t num_queued = record_frame_arrivals(card);
 	unsigned queue_length = 0;
-	for (const CaptureCard::NewFrame &frame : card->new_frames) {
-		queue_length += frame.dropped_frames + 1;
+	for (size_t i = 0; i < num_queued; ++i) {
+		queue_length += card->new_frames.at(i).dropped_frames + 1;
 	}
 
 	// If needed, drop frames until the queue is below the safe limit.
@@ -1076,8 +1116,7 @@ void Mixer::trim_queue(CaptureCard *card, size_t safe_queue_length)
 			break;
 		}
 
-		card->new_frames.pop_front();
-		card->new_frames_changed.notify_all();
+		card->new_frames.pop();
 		--queue_length;
 		++dropped_frames;
 	}
@@ -1094,65 +1133,162 @@ void Mixer::trim_queue(CaptureCard *card, size_t safe_queue_length)
 }
 
 
+size_t Mixer::record_frame_arrivals(CaptureCard *card)
+{
+	// The jitter history used to be updated by the capture thread as the frame
+	// was queued, but since it only depends on the timestamps in the frames,
+	// we can just as well do it here as they are dequeued, which keeps
+	// the queue the only thing we share with the capture thread.
+	const steady_clock::time_point now = steady_clock::now();
+	const size_t num_queued = card->new_frames.size();
+	size_t num_eligible = 0;
+	for ( ; num_eligible < num_queued; ++num_eligible) {
+		CaptureCard::NewFrame *frame = &card->new_frames.at(num_eligible);
+		if (frame->not_before > now) {
+			// A second field that is not due yet. Everything behind it
+			// arrived later, so it cannot be due either.
+			break;
+		}
+		if (!frame->arrival_recorded) {
+			card->jitter_history.frame_arrived(frame->received_timestamp, frame->length, frame->dropped_frames);
+			card->last_arrival = frame->received_timestamp;
+			frame->arrival_recorded = true;
+			if (frame_arrival_log) {
+				frame_arrival_log->write(FrameArrivalRecord{
+					FrameArrivalRecord::IN, uint8_t(card - cards), /*flags=*/0,
+					uint8_t(min<unsigned>(frame->dropped_frames, 255)), uint32_t(frame->length),
+					frame->received_timestamp });
+			}
+		}
+	}
+	return num_eligible;
+}
+
 Mixer::OutputFrameInfo Mixer::get_one_frame_from_each_card(unsigned master_card_index, bool master_card_is_output, CaptureCard::NewFrame new_frames[MAX_VIDEO_CARDS], bool has_new_frame[MAX_VIDEO_CARDS])
 {
 	OutputFrameInfo output_frame_info;
+	output_frame_info.clock_card_index = master_card_index;
+	output_frame_info.clocked_to_timer = global_flags.free_run;
 start:
-	unique_lock<mutex> lock(card_mutex, defer_lock);
-	if (master_card_is_output) {
+	if (global_flags.free_run) {
+		// Don't wait for anything; just take whatever has arrived, and pretend
+		// we are a fake card. The frames from the actual master card (if any)
+		// are treated just like any other input.
+		output_frame_info.dropped_frames = 0;
+		output_frame_info.frame_duration = TIMEBASE / FAKE_FPS;
+		output_frame_info.is_preroll = false;
+		output_frame_info.frame_timestamp = steady_clock::now();
+	} else if (master_card_is_output) {
 		// Clocked to the output, so wait for it to be ready for the next frame.
 		cards[master_card_index].output->wait_for_frame(pts_int, &output_frame_info.dropped_frames, &output_frame_info.frame_duration, &output_frame_info.is_preroll, &output_frame_info.frame_timestamp);
-		lock.lock();
+	} else if (pick_clock_source(master_card_index) == ClockSource::TIMER) {
+		// The watchdog has given up on the master card for now; see fail_over_master_clock().
+		wait_for_timer_clock(&output_frame_info);
 	} else {
-		// Wait for the master card to have a new frame.
-		// TODO: Add a timeout.
+		// Wait for the master card (or whatever card the watchdog has
+		// failed over to) to have a new frame.
 		output_frame_info.is_preroll = false;
-		lock.lock();
-		cards[master_card_index].new_frames_changed.wait(lock, [this, master_card_index]{ return !cards[master_card_index].new_frames.empty() || cards[master_card_index].capture->get_disconnected(); });
+		output_frame_info.clocked_to_timer = false;
+		output_frame_info.clock_card_index =
+			(clock_watchdog.source == ClockSource::MASTER_CARD) ? master_card_index : clock_watchdog.fallback_card_index;
+		CaptureCard *master_card = &cards[output_frame_info.clock_card_index];
+		steady_clock::time_point deadline = steady_clock::time_point::max();
+		if (global_flags.master_clock_timeout_frames > 0) {
+			if (clock_watchdog.last_frame_timestamp == steady_clock::time_point::min()) {
+				deadline = steady_clock::now() + duration_cast<steady_clock::duration>(duration<double>(MASTER_CLOCK_STARTUP_SECONDS));
+			} else {
+				deadline = steady_clock::now() + get_master_clock_timeout();
+			}
+		}
+		steady_clock::duration waited = master_card->new_frames.wait_for_data_until([master_card]{
+			return master_card->capture->get_disconnected();
+		}, deadline);
+		if (master_card->new_frames.empty() && !master_card->capture->get_disconnected()) {
+			// The card has stalled without telling us; don't let it hold up
+			// the entire mixer (and thus audio and the encoders).
+			master_card->metric_input_queue_wait_seconds.count_event(duration<double>(waited).count());
+			fail_over_master_clock(output_frame_info.clock_card_index);
+			handle_hotplugged_cards();
+			goto start;
+		}
+		if (!master_card->new_frames.empty()) {
+			// If this is the second field of an interlaced frame,
+			// it might not be due yet; see bm_frame().
+			const steady_clock::time_point not_before = master_card->new_frames.front().not_before;
+			const steady_clock::time_point now = steady_clock::now();
+			if (not_before > now) {
+				this_thread::sleep_until(not_before);
+				waited += not_before - now;
+			}
+		}
+		master_card->metric_input_queue_wait_seconds.count_event(duration<double>(waited).count());
 	}
 
-	if (master_card_is_output) {
+	if (master_card_is_output || output_frame_info.clocked_to_timer) {
 		handle_hotplugged_cards();
-	} else if (cards[master_card_index].new_frames.empty()) {
+	} else if (cards[output_frame_info.clock_card_index].new_frames.empty()) {
 		// We were woken up, but not due to a new frame. Deal with it
 		// and then restart.
-		assert(cards[master_card_index].capture->get_disconnected());
+		assert(cards[output_frame_info.clock_card_index].capture->get_disconnected());
 		handle_hotplugged_cards();
-		lock.unlock();
 		goto start;
 	}
 
 	for (unsigned card_index = 0; card_index < num_cards + num_video_inputs; ++card_index) {
 		CaptureCard *card = &cards[card_index];
-		if (card->new_frames.empty()) {  // Starvation.
+		if (record_frame_arrivals(card) == 0) {  // Starvation.
 			++card->metric_input_duped_frames;
 		} else {
 			new_frames[card_index] = move(card->new_frames.front());
 			has_new_frame[card_index] = true;
-			card->new_frames.pop_front();
-			card->new_frames_changed.notify_all();
+			card->new_frames.pop();
 		}
 	}
 
-	if (!master_card_is_output) {
-		output_frame_info.frame_timestamp = new_frames[master_card_index].received_timestamp;
-		output_frame_info.dropped_frames = new_frames[master_card_index].dropped_frames;
-		output_frame_info.frame_duration = new_frames[master_card_index].length;
+	if (!master_card_is_output && !output_frame_info.clocked_to_timer) {
+		const unsigned clock_card_index = output_frame_info.clock_card_index;
+		output_frame_info.frame_timestamp = new_frames[clock_card_index].received_timestamp;
+		output_frame_info.dropped_frames = new_frames[clock_card_index].dropped_frames;
+		output_frame_info.frame_duration = new_frames[clock_card_index].length;
+	}
+	if (!master_card_is_output && !global_flags.free_run) {
+		// Keep the watchdog up-to-date, so that a failover can continue
+		// at the same frame rate. Frames lost while waiting for the timeout
+		// are reported as dropped, so that audio stays in sync.
+		ClockWatchdog *wd = &clock_watchdog;
+		output_frame_info.dropped_frames += wd->pending_dropped_frames;
+		wd->pending_dropped_frames = 0;
+		if (output_frame_info.frame_duration > 0) {
+			wd->frame_duration = output_frame_info.frame_duration;
+		}
+		wd->last_frame_timestamp = output_frame_info.frame_timestamp;
+
+		atomic<double> *seconds = &metric_master_clock_source_seconds[int(wd->source)];
+		*seconds = *seconds + double(output_frame_info.frame_duration) * (output_frame_info.dropped_frames + 1) / TIMEBASE;
 	}
 
 	if (!output_frame_info.is_preroll) {
 		output_jitter_history.frame_arrived(output_frame_info.frame_timestamp, output_frame_info.frame_duration, output_frame_info.dropped_frames);
 	}
+	if (frame_arrival_log) {
+		uint8_t flags = (output_frame_info.is_preroll ? FrameArrivalRecord::FLAG_PREROLL : 0) |
+			(master_card_is_output ? FrameArrivalRecord::FLAG_MASTER_IS_OUTPUT : 0);
+		frame_arrival_log->write(FrameArrivalRecord{
+			FrameArrivalRecord::OUT, uint8_t(output_frame_info.clock_card_index), flags,
+			uint8_t(min<unsigned>(output_frame_info.dropped_frames, 255)), uint32_t(output_frame_info.frame_duration),
+			output_frame_info.frame_timestamp });
+	}
 
 	for (unsigned card_index = 0; card_index < num_cards + num_video_inputs; ++card_index) {
 		CaptureCard *card = &cards[card_index];
 		if (has_new_frame[card_index] &&
-		    !input_card_is_master_clock(card_index, master_card_index) &&
-		    !output_frame_info.is_preroll) {
+		    !(input_card_is_master_clock(card_index, output_frame_info.clock_card_index) && !output_frame_info.clocked_to_timer) &&
+		    !output_frame_info.is_preroll &&
+		    !global_flags.free_run) {
 			card->queue_length_policy.update_policy(
 				output_frame_info.frame_timestamp,
 				card->jitter_history.get_expected_next_frame(),
-				new_frames[master_card_index].length,
+				output_frame_info.clocked_to_timer ? output_frame_info.frame_duration : new_frames[output_frame_info.clock_card_index].length,
 				output_frame_info.frame_duration,
 				card->jitter_history.estimate_max_jitter(),
 				output_jitter_history.estimate_max_jitter());
@@ -1160,6 +1296,11 @@ start:
 			                          card->queue_length_policy.get_safe_queue_length()));
 		}
 	}
+	if (frame_arrival_log) {
+		frame_arrival_log->write(FrameArrivalRecord{
+			FrameArrivalRecord::POLICY, uint8_t(output_frame_info.clock_card_index), /*flags=*/0, /*dropped_frames=*/0,
+			/*frame_duration=*/0, steady_clock::now() });
+	}
 
 	// This might get off by a fractional sample when changing master card
 	// between ones with different frame rates, but that's fine.
@@ -1171,6 +1312,113 @@ start:
 	return output_frame_info;
 }
 
+Mixer::ClockSource Mixer::pick_clock_source(unsigned master_card_index)
+{
+	ClockWatchdog *wd = &clock_watchdog;
+	if (master_card_index != wd->master_card_index) {
+		// A new master card has been chosen; give it a fair chance.
+		wd->source = ClockSource::MASTER_CARD;
+		wd->master_card_index = master_card_index;
+		wd->master_stable_since = steady_clock::time_point::min();
+		return wd->source;
+	}
+	if (wd->source == ClockSource::MASTER_CARD) {
+		return wd->source;
+	}
+
+	// See if the master card is back. We consider it steady if it has not
+	// had a gap long enough to trigger the watchdog for a while; its frames
+	// are still being recorded (as any other input's) while we are failed over.
+	const steady_clock::time_point now = steady_clock::now();
+	const steady_clock::time_point last_arrival = cards[master_card_index].last_arrival;
+	if (last_arrival == steady_clock::time_point::min() ||
+	    now - last_arrival > get_master_clock_timeout()) {
+		wd->master_stable_since = steady_clock::time_point::min();
+	} else if (wd->master_stable_since == steady_clock::time_point::min()) {
+		wd->master_stable_since = now;
+	} else if (duration<double>(now - wd->master_stable_since).count() >= MASTER_CLOCK_FAILBACK_SECONDS) {
+		fprintf(stderr, "Card %u is delivering frames again, using it as master clock.\n", master_card_index);
+		wd->source = ClockSource::MASTER_CARD;
+		wd->master_stable_since = steady_clock::time_point::min();
+		++metric_master_clock_failbacks;
+	}
+	return wd->source;
+}
+
+void Mixer::fail_over_master_clock(unsigned stalled_card_index)
+{
+	ClockWatchdog *wd = &clock_watchdog;
+	const steady_clock::time_point now = steady_clock::now();
+	const steady_clock::duration timeout = get_master_clock_timeout();
+
+	// Pick the live input that has most recently delivered a frame. Fake cards
+	// (and cards without signal, or that are just as quiet) are no better than
+	// our own timer, which at least keeps the frame rate we had.
+	int best_card_index = -1;
+	for (unsigned card_index = 0; card_index < num_cards; ++card_index) {
+		const CaptureCard *card = &cards[card_index];
+		if (card_index == stalled_card_index ||
+		    card_index == wd->master_card_index ||
+		    card->type != CardType::LIVE_CARD ||
+		    card->metric_input_has_signal_bool != 1 ||
+		    card->capture->get_disconnected() ||
+		    card->last_arrival == steady_clock::time_point::min() ||
+		    now - card->last_arrival > timeout) {
+			continue;
+		}
+		if (best_card_index == -1 || card->last_arrival > cards[best_card_index].last_arrival) {
+			best_card_index = card_index;
+		}
+	}
+
+	if (best_card_index == -1) {
+		fprintf(stderr, "Card %u delivered no frames for %d frame periods, using an internal timer as master clock.\n",
+			stalled_card_index, global_flags.master_clock_timeout_frames);
+		wd->source = ClockSource::TIMER;
+		wd->timer_next_tick = now;
+	} else {
+		fprintf(stderr, "Card %u delivered no frames for %d frame periods, using card %d as master clock.\n",
+			stalled_card_index, global_flags.master_clock_timeout_frames, best_card_index);
+		wd->source = ClockSource::FALLBACK_CARD;
+		wd->fallback_card_index = best_card_index;
+	}
+	wd->master_stable_since = steady_clock::time_point::min();
+
+	// Account for the frames we lost waiting, so that audio stays in sync.
+	// (pts simply continues at the same frame rate, as after any other
+	// dropped frames.)
+	if (wd->last_frame_timestamp != steady_clock::time_point::min()) {
+		const double missed_frames = duration<double>(now - wd->last_frame_timestamp).count() * TIMEBASE / wd->frame_duration;
+		wd->pending_dropped_frames = max<int>(min<int>(lrint(missed_frames) - 1, global_flags.master_clock_timeout_frames), 0);
+	}
+	++metric_master_clock_failovers;
+}
+
+void Mixer::wait_for_timer_clock(OutputFrameInfo *output_frame_info)
+{
+	ClockWatchdog *wd = &clock_watchdog;
+	const steady_clock::duration period = nanoseconds(wd->frame_duration * 1000000000 / TIMEBASE);
+	if (wd->timer_next_tick < steady_clock::now() - period) {
+		// We are more than a frame behind (the mixer thread must have been
+		// busy), so don't try to catch up with a burst of frames.
+		wd->timer_next_tick = steady_clock::now();
+	}
+	this_thread::sleep_until(wd->timer_next_tick);
+
+	output_frame_info->dropped_frames = 0;
+	output_frame_info->frame_duration = wd->frame_duration;
+	output_frame_info->is_preroll = false;
+	output_frame_info->frame_timestamp = wd->timer_next_tick;
+	output_frame_info->clock_card_index = wd->master_card_index;
+	output_frame_info->clocked_to_timer = true;
+	wd->timer_next_tick += period;
+}
+
+steady_clock::duration Mixer::get_master_clock_timeout() const
+{
+	return nanoseconds(global_flags.master_clock_timeout_frames * clock_watchdog.frame_duration * 1000000000 / TIMEBASE);
+}
+
 void Mixer::handle_hotplugged_cards()
 {
 	// Check for cards that have been disconnected since last frame.
@@ -1201,7 +1449,7 @@ void Mixer::handle_hotplugged_cards()
 			}
 		}
 
-		if (free_card_index == -1) {
+		if (free_card_index == -1 || global_flags.free_run) {
 			fprintf(stderr, "New card plugged in, but no free slots -- ignoring.\n");
 			libusb_unref_device(new_dev);
 		} else {
@@ -1272,10 +1520,38 @@ void Mixer::render_one_frame(int64_t duration)
 	}
 
 	// Get the main chain from the theme, and set its state immediately.
-	Theme::Chain theme_main_chain = theme->get_chain(0, pts(), global_flags.width, global_flags.height, input_state);
+	// With --pipeline-theme, the Lua side has already been run
+	// (see get_theme_snapshots()), and we only apply the result.
+	// Either way, it goes through a snapshot, so that we know which
+	// input frames it uses and need to hold on to.
+	vector<Theme::ChainSnapshot> theme_snapshots;
+	Theme::Chain theme_main_chain;
+	steady_clock::time_point lua_start = steady_clock::now();
+	if (global_flags.pipeline_theme) {
+		theme_snapshots = get_theme_snapshots(duration);
+		theme_main_chain = theme->bind_snapshot(theme_snapshots[0], input_state);
+	} else if (global_flags.theme_state_per_channel) {
+		// Every channel has its own Lua state, so evaluate them all up front,
+		// in parallel, instead of one by one as we render them below.
+		TraceScope trace("get_chain", pts_int);
+		theme_snapshots = theme->get_chain_snapshots(pts(), global_flags.width, global_flags.height,
+			global_flags.preview_width, global_flags.preview_height, input_state, get_channels_to_render(pts_int));
+		theme_main_chain = theme->bind_snapshot(theme_snapshots[0], input_state);
+	} else {
+		TraceScope trace("get_chain", pts_int);
+		theme_main_chain = theme->bind_snapshot(
+			theme->get_chain_snapshot(0, pts(), global_flags.width, global_flags.height, input_state),
+			input_state);
+	}
+	output_channel[OUTPUT_LIVE].metric_input_frames_pinned = count_pinned_frames(*theme_main_chain.input_frames);
 	EffectChain *chain = theme_main_chain.chain;
-	theme_main_chain.setup_chain();
+	{
+		TraceScope trace("setup_chain", pts_int);
+		theme_main_chain.setup_chain();
+	}
 	//theme_main_chain.chain->enable_phase_timing(true);
+	// (The parameter shadows std::chrono::duration, so we need to qualify.)
+	double lua_seconds = std::chrono::duration<double>(steady_clock::now() - lua_start).count();
 
 	// The theme can't (or at least shouldn't!) call connect_signal() on
 	// each FFmpeg input, so we'll do it here.
@@ -1343,7 +1619,10 @@ void Mixer::render_one_frame(int64_t duration)
 		fbo = resource_pool->create_fbo(y_tex, cbcr_full_tex);
 	}
 	check_error();
-	chain->render_to_fbo(fbo, global_flags.width, global_flags.height);
+	{
+		TraceScope trace("render_to_fbo", pts_int);
+		chain->render_to_fbo(fbo, global_flags.width, global_flags.height);
+	}
 
 	if (display_timecode_in_stream) {
 		// Render the timecode on top.
@@ -1352,10 +1631,13 @@ void Mixer::render_one_frame(int64_t duration)
 
 	resource_pool->release_fbo(fbo);
 
-	if (is_zerocopy) {
-		chroma_subsampler->subsample_chroma(cbcr_full_tex, global_flags.width, global_flags.height, cbcr_tex, cbcr_copy_tex);
-	} else {
-		chroma_subsampler->subsample_chroma(cbcr_full_tex, global_flags.width, global_flags.height, cbcr_tex);
+	{
+		TraceScope trace("subsample_chroma", pts_int);
+		if (is_zerocopy) {
+			chroma_subsampler->subsample_chroma(cbcr_full_tex, global_flags.width, global_flags.height, cbcr_tex, cbcr_copy_tex);
+		} else {
+			chroma_subsampler->subsample_chroma(cbcr_full_tex, global_flags.width, global_flags.height, cbcr_tex);
+		}
 	}
 	if (output_card_index != -1) {
 		cards[output_card_index].output->send_frame(y_tex, cbcr_full_tex, ycbcr_output_coefficients, theme_main_chain.input_frames, pts_int, duration);
@@ -1385,14 +1667,49 @@ void Mixer::render_one_frame(int64_t duration)
 		display_input->set_texture_num(1, cbcr_display_tex);
 	};
 	live_frame.ready_fence = fence;
-	live_frame.input_frames = {};
+	live_frame.input_frames = nullptr;
 	live_frame.temp_textures = { y_display_tex, cbcr_display_tex };
 	output_channel[OUTPUT_LIVE].output_frame(live_frame);
 
 	// Set up preview and any additional channels.
+	lua_start = steady_clock::now();
+	vector<bool> channels_to_render;
+	if (theme_snapshots.empty()) {
+		channels_to_render = get_channels_to_render(pts_int);
+	}
 	for (int i = 1; i < theme->get_num_channels() + 2; ++i) {
+		// These are always evaluated as snapshots, even without --pipeline-theme,
+		// so that we know what they depend on. Many channels are static
+		// (e.g. an ImageInput, or a paused video), and if nothing has changed
+		// since last time, we don't need to send a new frame, which saves
+		// rendering it again for display.
+		Theme::ChainSnapshot snapshot;
+		if (!theme_snapshots.empty()) {
+			// The decision was made when the snapshots were taken.
+			snapshot = theme_snapshots[i];
+			if (snapshot.chain == nullptr) {
+				++metric_display_frames_skipped;
+				continue;
+			}
+		} else {
+			if (!channels_to_render[i]) {
+				++metric_display_frames_skipped;
+				continue;
+			}
+			snapshot = theme->get_chain_snapshot(i, pts(), global_flags.preview_width, global_flags.preview_height, input_state);
+		}
+
+		string fingerprint = theme->get_fingerprint(snapshot, input_state);
+		if (fingerprint == output_channel[i].last_fingerprint) {
+			++metric_display_frames_reused;
+			output_channel[i].output_same_frame();
+			continue;
+		}
+		output_channel[i].last_fingerprint = move(fingerprint);
+
 		DisplayFrame display_frame;
-		Theme::Chain chain = theme->get_chain(i, pts(), global_flags.width, global_flags.height, input_state);  // FIXME: dimensions
+		Theme::Chain chain = theme->bind_snapshot(snapshot, input_state);
+		output_channel[i].metric_input_frames_pinned = count_pinned_frames(*chain.input_frames);
 		display_frame.chain = chain.chain;
 		display_frame.setup_chain = chain.setup_chain;
 		display_frame.ready_fence = fence;
@@ -1400,6 +1717,227 @@ void Mixer::render_one_frame(int64_t duration)
 		display_frame.temp_textures = {};
 		output_channel[i].output_frame(display_frame);
 	}
+	if (!global_flags.pipeline_theme) {
+		// In pipelined mode, this is measured by evaluate_theme() instead.
+		lua_seconds += std::chrono::duration<double>(steady_clock::now() - lua_start).count();
+		metric_theme_lua_seconds.count_event(lua_seconds);
+	}
+}
+
+vector<bool> Mixer::get_channels_to_render(int64_t pts)
+{
+	// The live channel always needs to be rendered, since it goes to the encoder.
+	// For the others, evaluating the theme, running the setup functions and
+	// holding on to the input frames is pure waste if nobody is looking
+	// (e.g. the preview is hidden, the window is minimized, or we are headless).
+	// We still render them about once a second in that case, so that the
+	// channel names and colors keep updating, and so that there is something
+	// not too stale to show as soon as a consumer appears.
+	vector<bool> channels(theme->get_num_channels() + 2, true);
+	for (unsigned i = 1; i < channels.size(); ++i) {
+		OutputChannel *channel = &output_channel[i];
+		if (!channel->has_consumers() &&
+		    channel->last_scheduled_pts != -1 &&
+		    pts - channel->last_scheduled_pts < TIMEBASE) {
+			channels[i] = false;
+		} else {
+			channel->last_scheduled_pts = pts;
+		}
+	}
+	return channels;
+}
+
+vector<Theme::ChainSnapshot> Mixer::get_theme_snapshots(int64_t duration)
+{
+	vector<Theme::ChainSnapshot> snapshots;
+	{
+		unique_lock<mutex> lock(theme_mutex);
+		if (theme_request_pending) {
+			steady_clock::time_point start = steady_clock::now();
+			theme_cond.wait(lock, [this]{ return theme_result_ready; });
+			metric_theme_wait_seconds.count_event(std::chrono::duration<double>(steady_clock::now() - start).count());
+		}
+		if (theme_result_ready) {
+			// If we dropped or duplicated frames since the request was made,
+			// the snapshot is for the wrong point in time, so throw it away.
+			if (theme_result_pts == pts_int) {
+				snapshots = move(theme_result);
+			}
+			theme_result.clear();
+			theme_result_ready = false;
+		}
+	}
+	if (snapshots.empty()) {
+		snapshots = evaluate_theme(pts_int, input_state, get_channels_to_render(pts_int));
+	}
+
+	// Ask for the next frame to be evaluated while we render this one.
+	// Note that the theme will see the signal state as of this frame,
+	// not the next one; when the snapshot is applied, the signals are
+	// connected to the frames that are current by then.
+	{
+		unique_lock<mutex> lock(theme_mutex);
+		theme_request_pts = pts_int + duration;
+		theme_request_input_state = input_state;
+		theme_request_channels = get_channels_to_render(pts_int + duration);
+		theme_request_pending = true;
+		theme_cond.notify_all();
+	}
+	return snapshots;
+}
+
+vector<Theme::ChainSnapshot> Mixer::evaluate_theme(int64_t pts, const InputState &input_state, const vector<bool> &channels)
+{
+	TraceScope trace("get_chain", pts);
+	steady_clock::time_point start = steady_clock::now();
+	vector<Theme::ChainSnapshot> snapshots = theme->get_chain_snapshots(double(pts) / TIMEBASE, global_flags.width, global_flags.height,
+		global_flags.preview_width, global_flags.preview_height, input_state, channels);
+	metric_theme_lua_seconds.count_event(std::chrono::duration<double>(steady_clock::now() - start).count());
+	return snapshots;
+}
+
+void Mixer::theme_thread_func()
+{
+	pthread_setname_np(pthread_self(), "Theme");
+
+	unique_lock<mutex> lock(theme_mutex);
+	for ( ;; ) {
+		theme_cond.wait(lock, [this]{ return theme_should_quit || (theme_request_pending && !theme_result_ready); });
+		if (theme_should_quit) {
+			break;
+		}
+		int64_t pts = theme_request_pts;
+		InputState request_input_state = theme_request_input_state;
+		vector<bool> request_channels = theme_request_channels;
+		lock.unlock();
+
+		vector<Theme::ChainSnapshot> snapshots = evaluate_theme(pts, request_input_state, request_channels);
+
+		lock.lock();
+		theme_result = move(snapshots);
+		theme_result_pts = pts;
+		theme_result_ready = true;
+		theme_request_pending = false;
+		theme_cond.notify_all();
+
+		// Collect garbage while waiting for the next request.
+		lock.unlock();
+		theme->step_garbage_collector();
+		lock.lock();
+	}
+}
+
+shared_ptr<Mixer::PendingUpload> Mixer::start_upload(unsigned card_index, RefCountedFrame frame, function<void()> &&upload_func)
+{
+	shared_ptr<PendingUpload> upload(new PendingUpload);
+	upload->upload_func = move(upload_func);
+	upload->card_index = card_index;
+	upload->frame = move(frame);
+
+	unique_lock<mutex> lock(upload_mutex);
+	upload_queue.push_back(upload);
+	upload_cond.notify_all();
+	return upload;
+}
+
+void Mixer::wait_for_upload(PendingUpload *upload)
+{
+	RefCountedGLsync fence;
+	{
+		unique_lock<mutex> lock(upload_mutex);
+		steady_clock::time_point start = steady_clock::now();
+		upload_cond.wait(lock, [upload]{ return upload->done; });
+		metric_upload_wait_seconds.count_event(duration<double>(steady_clock::now() - start).count());
+		fence = upload->fence;
+	}
+
+	// Purely for the metrics; if the GPU is not done yet, that's fine,
+	// since glWaitSync() only makes our context wait, not the CPU.
+	if (glClientWaitSync(fence.get(), /*flags=*/0, /*timeout=*/0) == GL_TIMEOUT_EXPIRED) {
+		++metric_upload_fence_not_signaled;
+	}
+	glWaitSync(fence.get(), /*flags=*/0, GL_TIMEOUT_IGNORED);
+	check_error();
+}
+
+void Mixer::upload_thread_func()
+{
+	pthread_setname_np(pthread_self(), "Mixer_Upload");
+
+	eglBindAPI(EGL_OPENGL_API);
+	QOpenGLContext *context = create_context(upload_surface);
+	if (!make_current(context, upload_surface)) {
+		fprintf(stderr, "Could not make the upload context current.\n");
+		exit(1);
+	}
+
+	// Frames that the GPU might still be reading from, oldest first, with
+	// the fences for their uploads. If the mixer thread has dropped a frame,
+	// ours is the last reference, so we cannot let go of it until then;
+	// but we don't want to wait for the GPU after every upload either.
+	deque<pair<RefCountedGLsync, RefCountedFrame>> uploads_in_flight;
+
+	for ( ;; ) {
+		shared_ptr<PendingUpload> upload;
+		{
+			unique_lock<mutex> lock(upload_mutex);
+			auto has_work = [this]{ return upload_should_quit || !upload_queue.empty(); };
+			if (uploads_in_flight.empty()) {
+				upload_cond.wait(lock, has_work);
+			} else {
+				// Come back now and then to release the frames that are done.
+				upload_cond.wait_for(lock, milliseconds(1), has_work);
+			}
+			if (upload_should_quit) {
+				break;
+			}
+			if (!upload_queue.empty()) {
+				upload = move(upload_queue.front());
+				upload_queue.pop_front();
+			}
+		}
+
+		// The GPU executes the uploads in order, so we only need to look
+		// at the oldest ones.
+		while (!uploads_in_flight.empty() &&
+		       glClientWaitSync(uploads_in_flight.front().first.get(), /*flags=*/0, /*timeout=*/0) != GL_TIMEOUT_EXPIRED) {
+			uploads_in_flight.pop_front();
+		}
+
+		if (upload == nullptr) {
+			continue;
+		}
+
+		RefCountedGLsync fence;
+		{
+			TraceScope trace("upload_func", -1, upload->card_index);
+			steady_clock::time_point start = steady_clock::now();
+			upload->upload_func();
+			upload->upload_func = nullptr;
+			fence = RefCountedGLsync(GL_SYNC_GPU_COMMANDS_COMPLETE, /*flags=*/0);
+			check_error();
+
+			// Make sure the fence is actually submitted, or the mixer thread's
+			// glWaitSync() could wait forever.
+			glFlush();
+			check_error();
+			metric_upload_seconds.count_event(duration<double>(steady_clock::now() - start).count());
+		}
+
+		{
+			unique_lock<mutex> lock(upload_mutex);
+			upload->fence = fence;
+			upload->done = true;
+			upload_cond.notify_all();
+		}
+		uploads_in_flight.emplace_back(fence, move(upload->frame));
+	}
+
+	for (const pair<RefCountedGLsync, RefCountedFrame> &upload : uploads_in_flight) {
+		glClientWaitSync(upload.first.get(), /*flags=*/0, GL_TIMEOUT_IGNORED);
+	}
+	uploads_in_flight.clear();
+	delete_context(context);
 }
 
 void Mixer::audio_thread_func()
@@ -1419,12 +1957,20 @@ void Mixer::audio_thread_func()
 			audio_task_queue.pop();
 		}
 
-		ResamplingQueue::RateAdjustmentPolicy rate_adjustment_policy =
-			task.adjust_rate ? ResamplingQueue::ADJUST_RATE : ResamplingQueue::DO_NOT_ADJUST_RATE;
-		vector<float> samples_out = audio_mixer.get_output(
-			task.frame_timestamp,
-			task.num_samples,
-			rate_adjustment_policy);
+		vector<float> samples_out;
+		if (global_flags.free_run) {
+			// The inputs arrive in real time, and we don't, so there's
+			// no sensible way to resample them; just send silence
+			// (and don't feed the audio mixer any input; see bm_frame()).
+			samples_out.resize(task.num_samples * 2);
+		} else {
+			ResamplingQueue::RateAdjustmentPolicy rate_adjustment_policy =
+				task.adjust_rate ? ResamplingQueue::ADJUST_RATE : ResamplingQueue::DO_NOT_ADJUST_RATE;
+			samples_out = audio_mixer.get_output(
+				task.frame_timestamp,
+				task.num_samples,
+				rate_adjustment_policy);
+		}
 
 		// Send the samples to the sound card, then add them to the output.
 		if (alsa) {
@@ -1445,13 +1991,19 @@ void Mixer::release_display_frame(DisplayFrame *frame)
 	}
 	frame->temp_textures.clear();
 	frame->ready_fence.reset();
-	frame->input_frames.clear();
+	frame->input_frames.reset();
 }
 
 void Mixer::start()
 {
 	mixer_thread = thread(&Mixer::thread_func, this);
 	audio_thread = thread(&Mixer::audio_thread_func, this);
+	if (global_flags.pipeline_theme) {
+		theme_thread = thread(&Mixer::theme_thread_func, this);
+	}
+	if (global_flags.upload_thread) {
+		upload_thread = thread(&Mixer::upload_thread_func, this);
+	}
 }
 
 void Mixer::quit()
@@ -1460,6 +2012,41 @@ void Mixer::quit()
 	audio_task_queue_changed.notify_one();
 	mixer_thread.join();
 	audio_thread.join();
+	if (global_flags.pipeline_theme) {
+		{
+			unique_lock<mutex> lock(theme_mutex);
+			theme_should_quit = true;
+			theme_cond.notify_all();
+		}
+		theme_thread.join();
+	}
+	if (global_flags.upload_thread) {
+		{
+			unique_lock<mutex> lock(upload_mutex);
+			upload_should_quit = true;
+			upload_cond.notify_all();
+		}
+		upload_thread.join();
+	}
+}
+
+void Mixer::queue_control_action(function<void()> &&action)
+{
+	lock_guard<mutex> lock(control_mutex);
+	control_queue.push(move(action));
+}
+
+void Mixer::run_control_actions()
+{
+	queue<function<void()>> actions;
+	{
+		lock_guard<mutex> lock(control_mutex);
+		swap(actions, control_queue);
+	}
+	while (!actions.empty()) {
+		actions.front()();
+		actions.pop();
+	}
 }
 
 void Mixer::transition_clicked(int transition_num)
@@ -1537,6 +2124,18 @@ void Mixer::OutputChannel::output_frame(DisplayFrame frame)
 		}
 	}
 
+	call_update_callbacks();
+}
+
+void Mixer::OutputChannel::output_same_frame()
+{
+	// No need to tell anyone about a new frame, but the name or color
+	// could still have changed.
+	call_update_callbacks();
+}
+
+void Mixer::OutputChannel::call_update_callbacks()
+{
 	// Reduce the number of callbacks by filtering duplicates. The reason
 	// why we bother doing this is that Qt seemingly can get into a state
 	// where its builds up an essentially unbounded queue of signals,
@@ -1592,7 +2191,7 @@ bool Mixer::OutputChannel::get_display_frame(DisplayFrame *frame)
 		assert(!has_current_frame);
 		current_frame = ready_frame;
 		ready_frame.ready_fence.reset();  // Drop the refcount.
-		ready_frame.input_frames.clear();  // Drop the refcounts.
+		ready_frame.input_frames.reset();  // Drop the refcounts.
 		has_current_frame = true;
 		has_ready_frame = false;
 	}
@@ -1613,6 +2212,12 @@ void Mixer::OutputChannel::remove_frame_ready_callback(void *key)
 	new_frame_ready_callbacks.erase(key);
 }
 
+bool Mixer::OutputChannel::has_consumers()
+{
+	unique_lock<mutex> lock(frame_mutex);
+	return !new_frame_ready_callbacks.empty();
+}
+
 void Mixer::OutputChannel::set_transition_names_updated_callback(Mixer::transition_names_updated_callback_t callback)
 {
 	transition_names_updated_callback = callback;
@@ -14,6 +14,7 @@
 #include <chrono>
 #include <condition_variable>
 #include <cstddef>
+#include <deque>
 #include <functional>
 #include <map>
 #include <memory>
@@ -30,10 +31,14 @@
 #include "defs.h"
 #include "httpd.h"
 #include "input_state.h"
+#include "jitter_history.h"
 #include "libusb.h"
+#include "metrics.h"
 #include "pbo_frame_allocator.h"
+#include "queue_length_policy.h"
 #include "ref_counted_frame.h"
 #include "ref_counted_gl_sync.h"
+#include "spsc_queue.h"
 #include "theme.h"
 #include "timebase.h"
 #include "video_encoder.h"
@@ -42,6 +47,7 @@
 class ALSAOutput;
 class ChromaSubsampler;
 class DeckLinkOutput;
+class FrameArrivalLogWriter;
 class QSurface;
 class QSurfaceFormat;
 class TimecodeRenderer;
@@ -54,105 +60,6 @@ class ResourcePool;
 class YCbCrInput;
 }  // namespace movit
 
-// A class to estimate the future jitter. Used in QueueLengthPolicy (see below).
-//
-// There are many ways to estimate jitter; I've tested a few ones (and also
-// some algorithms that don't explicitly model jitter) with different
-// parameters on some real-life data in experiments/queue_drop_policy.cpp.
-// This is one based on simple order statistics where I've added some margin in
-// the number of starvation events; I believe that about one every hour would
-// probably be acceptable, but this one typically goes lower than that, at the
-// cost of 2–3 ms extra latency. (If the queue is hard-limited to one frame, it's
-// possible to get ~10 ms further down, but this would mean framedrops every
-// second or so.) The general strategy is: Take the 99.9-percentile jitter over
-// last 5000 frames, multiply by two, and that's our worst-case jitter
-// estimate. The fact that we're not using the max value means that we could
-// actually even throw away very late frames immediately, which means we only
-// get one user-visible event instead of seeing something both when the frame
-// arrives late (duplicate frame) and then again when we drop.
-class JitterHistory {
-private:
-	static constexpr size_t history_length = 5000;
-	static constexpr double percentile = 0.999;
-	static constexpr double multiplier = 2.0;
-
-public:
-	void register_metrics(const std::vector<std::pair<std::string, std::string>> &labels);
-	void unregister_metrics(const std::vector<std::pair<std::string, std::string>> &labels);
-
-	void clear() {
-		history.clear();
-		orders.clear();
-	}
-	void frame_arrived(std::chrono::steady_clock::time_point now, int64_t frame_duration, size_t dropped_frames);
-	std::chrono::steady_clock::time_point get_expected_next_frame() const { return expected_timestamp; }
-	double estimate_max_jitter() const;
-
-private:
-	// A simple O(k) based algorithm for getting the k-th largest or
-	// smallest element from our window; we simply keep the multiset
-	// ordered (insertions and deletions are O(n) as always) and then
-	// iterate from one of the sides. If we had larger values of k,
-	// we could go for a more complicated setup with two sets or heaps
-	// (one increasing and one decreasing) that we keep balanced around
-	// the point, or it is possible to reimplement std::set with
-	// counts in each node. However, since k=5, we don't need this.
-	std::multiset<double> orders;
-	std::deque<std::multiset<double>::iterator> history;
-
-	std::chrono::steady_clock::time_point expected_timestamp = std::chrono::steady_clock::time_point::min();
-
-	// Metrics. There are no direct summaries for jitter, since we already have latency summaries.
-	std::atomic<int64_t> metric_input_underestimated_jitter_frames{0};
-	std::atomic<double> metric_input_estimated_max_jitter_seconds{0.0 / 0.0};
-};
-
-// For any card that's not the master (where we pick out the frames as they
-// come, as fast as we can process), there's going to be a queue. The question
-// is when we should drop frames from that queue (apart from the obvious
-// dropping if the 16-frame queue should become full), especially given that
-// the frame rate could be lower or higher than the master (either subtly or
-// dramatically). We have two (conflicting) demands:
-//
-//   1. We want to avoid starving the queue.
-//   2. We don't want to add more delay than is needed.
-//
-// Our general strategy is to drop as many frames as we can (helping for #2)
-// that we think is safe for #1 given jitter. To this end, we measure the
-// deviation from the expected arrival time for all cards, and use that for
-// continuous jitter estimation.
-//
-// We then drop everything from the queue that we're sure we won't need to
-// serve the output in the time before the next frame arrives. Typically,
-// this means the queue will contain 0 or 1 frames, although more is also
-// possible if the jitter is very high.
-class QueueLengthPolicy {
-public:
-	QueueLengthPolicy() {}
-	void reset(unsigned card_index) {
-		this->card_index = card_index;
-	}
-
-	void register_metrics(const std::vector<std::pair<std::string, std::string>> &labels);
-	void unregister_metrics(const std::vector<std::pair<std::string, std::string>> &labels);
-
-	// Call after picking out a frame, so 0 means starvation.
-	void update_policy(std::chrono::steady_clock::time_point now,
-	                   std::chrono::steady_clock::time_point expected_next_frame,
-			   int64_t input_frame_duration,
-	                   int64_t master_frame_duration,
-	                   double max_input_card_jitter_seconds,
-	                   double max_master_card_jitter_seconds);
-	unsigned get_safe_queue_length() const { return safe_queue_length; }
-
-private:
-	unsigned card_index;  // For debugging and metrics only.
-	unsigned safe_queue_length = 0;  // Can never go below zero.
-
-	// Metrics.
-	std::atomic<int64_t> metric_input_queue_safe_length_frames{1};
-};
-
 class Mixer {
 public:
 	// The surface format is used for offscreen destinations for OpenGL contexts we need.
@@ -185,7 +92,7 @@ public:
 
 		// Holds on to all the input frames needed for this display frame,
 		// so they are not released while still rendering.
-		std::vector<RefCountedFrame> input_frames;
+		InputFrameSet input_frames;
 
 		// Textures that should be released back to the resource pool
 		// when this frame disappears, if any.
@@ -210,6 +117,13 @@ public:
 		output_channel[output].remove_frame_ready_callback(key);
 	}
 
+	// Called by displays after they have rendered a frame from the given
+	// channel, with the GPU time it took. Only used for metrics.
+	void display_frame_rendered(Output output, double gpu_seconds)
+	{
+		output_channel[output].metric_display_render_seconds.count_event(gpu_seconds);
+	}
+
 	// TODO: Should this really be per-channel? Shouldn't it just be called for e.g. the live output?
 	typedef std::function<void(const std::vector<std::string> &)> transition_names_updated_callback_t;
 	void set_transition_names_updated_callback(Output output, transition_names_updated_callback_t callback)
@@ -420,6 +334,13 @@ private:
 	void schedule_audio_resampling_tasks(unsigned dropped_frames, int num_samples_per_frame, int length_per_frame, bool is_preroll, std::chrono::steady_clock::time_point frame_timestamp);
 	std::string get_timecode_text() const;
 	void render_one_frame(int64_t duration);
+	std::vector<bool> get_channels_to_render(int64_t pts);
+	std::vector<Theme::ChainSnapshot> get_theme_snapshots(int64_t duration);
+	std::vector<Theme::ChainSnapshot> evaluate_theme(int64_t pts, const InputState &input_state, const std::vector<bool> &channels);
+	void theme_thread_func();
+	std::shared_ptr<PendingUpload> start_upload(unsigned card_index, RefCountedFrame frame, std::function<void()> &&upload_func);
+	void wait_for_upload(PendingUpload *upload);
+	void upload_thread_func();
 	void audio_thread_func();
 	void release_display_frame(DisplayFrame *frame);
 	double pts() { return double(pts_int) / TIMEBASE; }
@@ -429,6 +350,7 @@ private:
 	unsigned num_cards, num_video_inputs;
 
 	QSurface *mixer_surface, *h264_encoder_surface, *decklink_output_surface;
+	QSurface *upload_surface = nullptr;  // Only if --upload-thread.
 	std::unique_ptr<movit::ResourcePool> resource_pool;
 	std::unique_ptr<Theme> theme;
 	std::atomic<unsigned> audio_source_channel{0};
@@ -463,8 +385,29 @@ private:
 	// frame rate is integer, will always stay zero.
 	unsigned fractional_samples = 0;
 
+	// Protects replacing the capture/output objects in <cards>, and
+	// <ycbcr_interpretation>. The frame queues are lock-free and
+	// do not need it.
 	mutable std::mutex card_mutex;
 	bool has_bmusb_thread = false;
+
+	// With --upload-thread, texture uploads are handed off to
+	// upload_thread_func() as soon as the frame arrives, instead of being
+	// run by the mixer thread right before rendering.
+	struct PendingUpload {
+		std::function<void()> upload_func;  // Cleared by the upload thread.
+		unsigned card_index;
+
+		// Keeps the frame (and thus its PBO) from being reused by the card
+		// until the GPU is done reading from it, even if the mixer thread
+		// drops the frame in the meantime (see trim_queue()).
+		// Taken over by the upload thread, which releases it
+		// once the fence has been signaled.
+		RefCountedFrame frame;
+		bool done = false;  // Under upload_mutex.
+		RefCountedGLsync fence;  // Under upload_mutex. Set when <done> is set.
+	};
+
 	struct CaptureCard {
 		std::unique_ptr<bmusb::CaptureInterface> capture;
 		bool is_fake_capture;
@@ -489,18 +432,34 @@ private:
 			bool interlaced;
 			unsigned field;  // Which field (0 or 1) of the frame to use. Always 0 for progressive.
 			std::function<void()> upload_func;  // Needs to be called to actually upload the texture to OpenGL.
+			std::shared_ptr<PendingUpload> pending_upload;  // Used instead of <upload_func> with --upload-thread.
 			unsigned dropped_frames = 0;  // Number of dropped frames before this one.
 			std::chrono::steady_clock::time_point received_timestamp = std::chrono::steady_clock::time_point::min();
+			bool arrival_recorded = false;  // Whether the mixer thread has given it to <jitter_history> yet.
+
+			// The frame must not be used before this time. Set for the second field
+			// of interlaced frames, so that the capture thread can queue it right away
+			// instead of sleeping for a field period.
+			std::chrono::steady_clock::time_point not_before = std::chrono::steady_clock::time_point::min();
 		};
-		std::deque<NewFrame> new_frames;
-		bool should_quit = false;
-		std::condition_variable new_frames_changed;  // Set whenever new_frames (or should_quit) is changed.
+
+		// Written to by the card's capture thread, read by the mixer thread.
+		// This is the only state shared between the two, so no lock is needed
+		// (see record_frame_arrivals()). The limit is far above what
+		// --max-input-queue-frames allows, even for interlaced inputs;
+		// it only matters if the mixer thread is stuck.
+		SPSCQueue<NewFrame, 64> new_frames;
+		std::atomic<bool> should_quit{false};  // Call new_frames.wake() after setting.
 
 		QueueLengthPolicy queue_length_policy;  // Refers to the "new_frames" queue.
 
 		int last_timecode = -1;  // Unwrapped.
 
-		JitterHistory jitter_history;
+		JitterHistory jitter_history;  // Only touched by the mixer thread.
+
+		// Received timestamp of the last frame given to <jitter_history>.
+		// Used by the master clock watchdog. Only touched by the mixer thread.
+		std::chrono::steady_clock::time_point last_arrival = std::chrono::steady_clock::time_point::min();
 
 		// Metrics.
 		std::vector<std::pair<std::string, std::string>> labels;
@@ -510,6 +469,8 @@ private:
 		std::atomic<int64_t> metric_input_dropped_frames_error{0};
 		std::atomic<int64_t> metric_input_resets{0};
 		std::atomic<int64_t> metric_input_queue_length_frames{0};
+		std::atomic<int64_t> metric_input_dropped_frames_queue_full{0};
+		Histogram metric_input_queue_wait_seconds;  // Time the mixer spent waiting for this card as master.
 
 		std::atomic<int64_t> metric_input_has_signal_bool{-1};
 		std::atomic<int64_t> metric_input_is_connected_bool{-1};
@@ -521,7 +482,8 @@ private:
 		std::atomic<int64_t> metric_input_sample_rate_hz{-1};
 	};
 	JitterHistory output_jitter_history;
-	CaptureCard cards[MAX_VIDEO_CARDS];  // Protected by <card_mutex>.
+	CaptureCard cards[MAX_VIDEO_CARDS];  // Protected by <card_mutex>, except for the frame queues.
+	std::unique_ptr<FrameArrivalLogWriter> frame_arrival_log;  // Only if --record-frame-arrivals. Only touched by the mixer thread.
 	YCbCrInterpretation ycbcr_interpretation[MAX_VIDEO_CARDS];  // Protected by <card_mutex>.
 	AudioMixer audio_mixer;  // Same as global_audio_mixer (see audio_mixer.h).
 	bool input_card_is_master_clock(unsigned card_index, unsigned master_card_index) const;
@@ -531,9 +493,54 @@ private:
 		int64_t frame_duration;  // In TIMEBASE units.
 		bool is_preroll;
 		std::chrono::steady_clock::time_point frame_timestamp;
+
+		// The input card we were actually clocked to; normally the master card,
+		// but the watchdog might have failed over to another one.
+		// Meaningless if <clocked_to_timer> is set.
+		unsigned clock_card_index = 0;
+		bool clocked_to_timer = false;  // --free-run, or the watchdog's internal timer.
 	};
+	// Returns the number of frames at the head of the queue that are eligible
+	// for use right now (all of which have now been recorded); frames whose
+	// <not_before> is still in the future are left for a later call.
+	size_t record_frame_arrivals(CaptureCard *card);
 	OutputFrameInfo get_one_frame_from_each_card(unsigned master_card_index, bool master_card_is_output, CaptureCard::NewFrame new_frames[MAX_VIDEO_CARDS], bool has_new_frame[MAX_VIDEO_CARDS]);
 
+	// The master clock watchdog. If the master card stops delivering frames
+	// without reporting a disconnect, we fail over to the input card that has
+	// most recently delivered one (or to an internal timer, if there is none),
+	// and fail back once the master card has been steady for a while.
+	// See get_one_frame_from_each_card(). Only touched by the mixer thread.
+	enum class ClockSource {
+		MASTER_CARD = 0,
+		FALLBACK_CARD = 1,
+		TIMER = 2,
+		NUM_SOURCES = 3
+	};
+	struct ClockWatchdog {
+		ClockSource source = ClockSource::MASTER_CARD;
+		unsigned master_card_index = 0;  // The card we would like to be clocked to.
+		unsigned fallback_card_index = 0;  // Only for FALLBACK_CARD.
+		std::chrono::steady_clock::time_point timer_next_tick;  // Only for TIMER.
+
+		// When the master card started delivering frames steadily again,
+		// or min() if it has not (or we are not failed over).
+		std::chrono::steady_clock::time_point master_stable_since = std::chrono::steady_clock::time_point::min();
+
+		// Of the last output frame; the timeout and the timer clock follow the same frame rate.
+		int64_t frame_duration = TIMEBASE / FAKE_FPS;
+		std::chrono::steady_clock::time_point last_frame_timestamp = std::chrono::steady_clock::time_point::min();
+
+		// Frame periods lost while waiting for the timeout, to be reported
+		// as dropped with the first frame after the failover.
+		int pending_dropped_frames = 0;
+	};
+	ClockSource pick_clock_source(unsigned master_card_index);
+	void fail_over_master_clock(unsigned stalled_card_index);
+	void wait_for_timer_clock(OutputFrameInfo *output_frame_info);
+	std::chrono::steady_clock::duration get_master_clock_timeout() const;
+	ClockWatchdog clock_watchdog;
+
 	InputState input_state;
 
 	// Cards we have been noticed about being hotplugged, but haven't tried adding yet.
@@ -545,6 +552,7 @@ private:
 	public:
 		~OutputChannel();
 		void output_frame(DisplayFrame frame);
+		void output_same_frame();  // Like output_frame(), if the previous frame would look exactly the same.
 		bool get_display_frame(DisplayFrame *frame);
 		void add_frame_ready_callback(void *key, new_frame_ready_callback_t callback);
 		void remove_frame_ready_callback(void *key);
@@ -552,9 +560,15 @@ private:
 		void set_name_updated_callback(name_updated_callback_t callback);
 		void set_color_updated_callback(color_updated_callback_t callback);
 
+		// Whether anybody wants to hear about new frames (typically a visible
+		// GLWidget). If not, there is little point in rendering every frame.
+		bool has_consumers();
+
 	private:
 		friend class Mixer;
 
+		void call_update_callbacks();
+
 		unsigned channel;
 		Mixer *parent = nullptr;  // Not owned.
 		std::mutex frame_mutex;
@@ -567,11 +581,24 @@ private:
 
 		std::vector<std::string> last_transition_names;
 		std::string last_name, last_color;
+
+		int64_t last_scheduled_pts = -1;  // Only touched by the mixer thread. See get_channels_to_render().
+
+		// Fingerprint (see Theme::get_fingerprint()) of the last frame given to
+		// output_frame(). Only touched by the mixer thread. The frame itself
+		// stays in <ready_frame> or <current_frame> (or both) until replaced,
+		// holding on to its input frames, so their addresses can't be reused.
+		std::string last_fingerprint;
+
+		Histogram metric_display_render_seconds;  // GPU time, as reported by display_frame_rendered().
+		std::atomic<int64_t> metric_input_frames_pinned{0};  // By the last chain bound for this channel.
 	};
 	OutputChannel output_channel[NUM_OUTPUTS];
 
 	std::thread mixer_thread;
 	std::thread audio_thread;
+	std::thread theme_thread;  // Only if --pipeline-theme.
+	std::thread upload_thread;  // Only if --upload-thread.
 	std::atomic<bool> should_quit{false};
 	std::atomic<bool> should_cut{false};
 
@@ -587,6 +614,47 @@ private:
 	std::condition_variable audio_task_queue_changed;
 	std::queue<AudioTask> audio_task_queue;  // Under audio_mutex.
 
+	// Actions from the /control/ HTTP endpoints (see --headless), which are
+	// run by the mixer thread at the start of the next frame.
+	void queue_control_action(std::function<void()> &&action);
+	void run_control_actions();
+	std::mutex control_mutex;
+	std::queue<std::function<void()>> control_queue;  // Under control_mutex.
+
+	// For --pipeline-theme. The mixer thread asks for the theme to be
+	// evaluated for the next frame (at <theme_request_pts>) right after
+	// it has fetched the snapshots for the current one, and the theme thread
+	// works on it while the current frame renders.
+	std::mutex theme_mutex;
+	std::condition_variable theme_cond;
+	bool theme_request_pending = false;  // Under theme_mutex. Stays true until the result is ready.
+	int64_t theme_request_pts;  // Under theme_mutex.
+	InputState theme_request_input_state;  // Under theme_mutex.
+	std::vector<bool> theme_request_channels;  // Under theme_mutex.
+	bool theme_result_ready = false;  // Under theme_mutex.
+	int64_t theme_result_pts;  // Under theme_mutex.
+	std::vector<Theme::ChainSnapshot> theme_result;  // Under theme_mutex.
+	bool theme_should_quit = false;  // Under theme_mutex.
+
+	Histogram metric_theme_lua_seconds;  // Time spent in Lua for each frame.
+	Histogram metric_theme_wait_seconds;  // Time the mixer thread waited for the theme thread.
+	std::atomic<int64_t> metric_display_frames_skipped{0};  // Channel frames not rendered since nobody was watching.
+	std::atomic<int64_t> metric_display_frames_reused{0};  // Channel frames not rendered since nothing had changed.
+
+	// For --upload-thread. The queue is multi-producer (one per card), so it is
+	// a plain locked one; the uploads are so heavy that it does not matter.
+	std::mutex upload_mutex;
+	std::condition_variable upload_cond;  // Signals both new uploads and finished ones.
+	std::deque<std::shared_ptr<PendingUpload>> upload_queue;  // Under upload_mutex.
+	bool upload_should_quit = false;  // Under upload_mutex.
+
+	Histogram metric_upload_seconds;  // CPU time for each upload (on whichever thread does it).
+	Histogram metric_upload_wait_seconds;  // Time the mixer thread waited for the upload thread.
+	std::atomic<int64_t> metric_upload_fence_not_signaled{0};  // Uploads the GPU had not finished when the mixer needed them.
+	std::atomic<int64_t> metric_master_clock_failovers{0};
+	std::atomic<int64_t> metric_master_clock_failbacks{0};
+	std::atomic<double> metric_master_clock_source_seconds[int(ClockSource::NUM_SOURCES)]{{0.0}, {0.0}, {0.0}};  // Indexed by ClockSource.
+
 	// For mode scanning.
 	bool is_mode_scanning[MAX_VIDEO_CARDS]{ false };
 	std::vector<uint32_t> mode_scanlist[MAX_VIDEO_CARDS];
@@ -25,6 +25,7 @@ extern "C" {
 #include "flags.h"
 #include "metrics.h"
 #include "timebase.h"
+#include "tracing.h"
 
 using namespace std;
 
@@ -181,6 +182,7 @@ void Mux::add_packet(const AVPacket &pkt, int64_t pts, int64_t dts, AVRational t
 
 void Mux::write_packet_or_die(const AVPacket &pkt, int64_t unscaled_pts)
 {
+	TraceScope trace("Mux::write_packet_or_die", unscaled_pts);
 	for (MuxMetrics *metric : metrics) {
 		if (pkt.stream_index == 0) {
 			metric->metric_video_bytes += pkt.size;
@@ -0,0 +1,672 @@
+// The filter design and buffer handling are adapted from zita-resampler
+// by Fons Adriaensen, although the filter table layout and kernels
+// are new. Original copyright follows:
+//
+//  Copyright (C) 2006-2012 Fons Adriaensen <fons@linuxaudio.org>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "polyphase_resampler.h"
+
+#include <assert.h>
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <tuple>
+
+#ifdef __SSE2__
+#include <immintrin.h>
+#define HAVE_SSE2_KERNELS 1
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_AVX_KERNELS 1
+#define TARGET_AVX2 __attribute__((target("avx2,fma")))
+#define TARGET_AVX512 __attribute__((target("avx512f,avx2,fma")))
+#endif
+
+using namespace std;
+
+// Each row (phase) of the table is a filter of 2 * hl taps, padded with
+// zeros up to a multiple of 16 taps (<stride>) so that the kernels don't
+// need to deal with tails. There are np + 1 rows, since the variable-rate
+// resampler interpolates between row k and k + 1.
+class PolyphaseTable {
+public:
+	PolyphaseTable(double frel, unsigned hl, unsigned np);
+
+	// Tables are fairly expensive to compute, so they are shared between
+	// all resamplers with the same parameters.
+	static shared_ptr<const PolyphaseTable> get(double frel, unsigned hl, unsigned np);
+
+	const float *row(unsigned phase) const { return coeff.get() + phase * stride; }
+
+	const unsigned hl, np, stride;
+
+private:
+	unique_ptr<float[]> coeff;
+};
+
+namespace {
+
+double sinc(double x)
+{
+	x = fabs(x);
+	if (x < 1e-6) return 1.0;
+	x *= M_PI;
+	return sin(x) / x;
+}
+
+double window(double x)
+{
+	x = fabs(x);
+	if (x >= 1.0) return 0.0;
+	x *= M_PI;
+	return 0.384 + 0.500 * cos(x) + 0.116 * cos(2 * x);
+}
+
+unsigned gcd(unsigned a, unsigned b)
+{
+	while (b != 0) {
+		unsigned t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+}  // namespace
+
+PolyphaseTable::PolyphaseTable(double frel, unsigned hl, unsigned np)
+	: hl(hl), np(np), stride((2 * hl + 15) & ~15u), coeff(new float[stride * (np + 1)]())
+{
+	// Tap m of phase j is at time offset t = m - (hl - 1) - j / np,
+	// relative to the output sample. (This is equivalent to zita-resampler's
+	// two half-filters, since the filter is symmetric.)
+	for (unsigned j = 0; j <= np; ++j) {
+		float *row = coeff.get() + j * stride;
+		for (unsigned m = 0; m < 2 * hl; ++m) {
+			double t = double(m) - double(hl - 1) - double(j) / np;
+			row[m] = frel * sinc(t * frel) * window(t / hl);
+		}
+	}
+}
+
+shared_ptr<const PolyphaseTable> PolyphaseTable::get(double frel, unsigned hl, unsigned np)
+{
+	static mutex mu;
+	static map<tuple<double, unsigned, unsigned>, weak_ptr<const PolyphaseTable>> tables;  // Under mu.
+
+	lock_guard<mutex> lock(mu);
+	auto key = make_tuple(frel, hl, np);
+	shared_ptr<const PolyphaseTable> table = tables[key].lock();
+	if (table == nullptr) {
+		table.reset(new PolyphaseTable(frel, hl, np));
+		tables[key] = table;
+	}
+	return table;
+}
+
+namespace {
+
+atomic<ResamplerISA> max_isa{ResamplerISA::AVX512};
+
+void filter_scalar(const float *in, const float *coeff, unsigned num_taps, unsigned num_channels, float *out)
+{
+	for (unsigned c = 0; c < num_channels; ++c) {
+		const float *ptr = in + c;
+		float sum = 0.0f;
+		for (unsigned m = 0; m < num_taps; ++m) {
+			sum += *ptr * coeff[m];
+			ptr += num_channels;
+		}
+		out[c] = sum;
+	}
+}
+
+void interpolate_scalar(const float *coeff0, const float *coeff1, float a, float b, unsigned num_taps, float *out)
+{
+	for (unsigned m = 0; m < num_taps; ++m) {
+		out[m] = a * coeff0[m] + b * coeff1[m];
+	}
+}
+
+#ifdef HAVE_SSE2_KERNELS
+
+inline float horizontal_sum_sse2(__m128 x)
+{
+	__m128 shuf = _mm_shuffle_ps(x, x, _MM_SHUFFLE(2, 3, 0, 1));
+	x = _mm_add_ps(x, shuf);
+	x = _mm_add_ss(x, _mm_movehl_ps(shuf, x));
+	return _mm_cvtss_f32(x);
+}
+
+// x is (L, R, L, R); stores the sum of the left and right lanes.
+inline void horizontal_sum_stereo_sse2(__m128 x, float *out)
+{
+	x = _mm_add_ps(x, _mm_movehl_ps(x, x));
+	out[0] = _mm_cvtss_f32(x);
+	out[1] = _mm_cvtss_f32(_mm_shuffle_ps(x, x, _MM_SHUFFLE(1, 1, 1, 1)));
+}
+
+void filter_mono_sse2(const float *in, const float *coeff, unsigned num_taps, unsigned num_channels, float *out)
+{
+	__m128 sum0 = _mm_setzero_ps(), sum1 = _mm_setzero_ps();
+	for (unsigned m = 0; m < num_taps; m += 8) {
+		sum0 = _mm_add_ps(sum0, _mm_mul_ps(_mm_loadu_ps(in + m), _mm_loadu_ps(coeff + m)));
+		sum1 = _mm_add_ps(sum1, _mm_mul_ps(_mm_loadu_ps(in + m + 4), _mm_loadu_ps(coeff + m + 4)));
+	}
+	out[0] = horizontal_sum_sse2(_mm_add_ps(sum0, sum1));
+}
+
+void filter_stereo_sse2(const float *in, const float *coeff, unsigned num_taps, unsigned num_channels, float *out)
+{
+	__m128 sum0 = _mm_setzero_ps(), sum1 = _mm_setzero_ps();
+	for (unsigned m = 0; m < num_taps; m += 4) {
+		__m128 w = _mm_loadu_ps(coeff + m);
+		sum0 = _mm_add_ps(sum0, _mm_mul_ps(_mm_loadu_ps(in + m * 2), _mm_unpacklo_ps(w, w)));
+		sum1 = _mm_add_ps(sum1, _mm_mul_ps(_mm_loadu_ps(in + m * 2 + 4), _mm_unpackhi_ps(w, w)));
+	}
+	horizontal_sum_stereo_sse2(_mm_add_ps(sum0, sum1), out);
+}
+
+// For any multiple of four channels; each tap is applied to four channels at a time.
+void filter_multi4_sse2(const float *in, const float *coeff, unsigned num_taps, unsigned num_channels, float *out)
+{
+	for (unsigned c = 0; c < num_channels; c += 4) {
+		const float *ptr = in + c;
+		__m128 sum = _mm_setzero_ps();
+		for (unsigned m = 0; m < num_taps; ++m) {
+			sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(ptr), _mm_set1_ps(coeff[m])));
+			ptr += num_channels;
+		}
+		_mm_storeu_ps(out + c, sum);
+	}
+}
+
+void interpolate_sse2(const float *coeff0, const float *coeff1, float a, float b, unsigned num_taps, float *out)
+{
+	const __m128 av = _mm_set1_ps(a), bv = _mm_set1_ps(b);
+	for (unsigned m = 0; m < num_taps; m += 4) {
+		__m128 x = _mm_add_ps(_mm_mul_ps(av, _mm_loadu_ps(coeff0 + m)), _mm_mul_ps(bv, _mm_loadu_ps(coeff1 + m)));
+		_mm_storeu_ps(out + m, x);
+	}
+}
+
+#endif  // defined(HAVE_SSE2_KERNELS)
+
+#ifdef HAVE_AVX_KERNELS
+
+TARGET_AVX2 inline __m128 fold_avx2(__m256 x)
+{
+	return _mm_add_ps(_mm256_castps256_ps128(x), _mm256_extractf128_ps(x, 1));
+}
+
+TARGET_AVX2 void filter_mono_avx2(const float *in, const float *coeff, unsigned num_taps, unsigned num_channels, float *out)
+{
+	__m256 sum0 = _mm256_setzero_ps(), sum1 = _mm256_setzero_ps();
+	for (unsigned m = 0; m < num_taps; m += 16) {
+		sum0 = _mm256_fmadd_ps(_mm256_loadu_ps(in + m), _mm256_loadu_ps(coeff + m), sum0);
+		sum1 = _mm256_fmadd_ps(_mm256_loadu_ps(in + m + 8), _mm256_loadu_ps(coeff + m + 8), sum1);
+	}
+	out[0] = horizontal_sum_sse2(fold_avx2(_mm256_add_ps(sum0, sum1)));
+}
+
+TARGET_AVX2 void filter_stereo_avx2(const float *in, const float *coeff, unsigned num_taps, unsigned num_channels, float *out)
+{
+	// Duplicates taps 0..3 into (0, 0, 1, 1, 2, 2, 3, 3), to match up with L/R pairs.
+	const __m256i dup = _mm256_setr_epi32(0, 0, 1, 1, 2, 2, 3, 3);
+	__m256 sum0 = _mm256_setzero_ps(), sum1 = _mm256_setzero_ps();
+	for (unsigned m = 0; m < num_taps; m += 8) {
+		__m256 w0 = _mm256_permutevar8x32_ps(_mm256_castps128_ps256(_mm_loadu_ps(coeff + m)), dup);
+		__m256 w1 = _mm256_permutevar8x32_ps(_mm256_castps128_ps256(_mm_loadu_ps(coeff + m + 4)), dup);
+		sum0 = _mm256_fmadd_ps(_mm256_loadu_ps(in + m * 2), w0, sum0);
+		sum1 = _mm256_fmadd_ps(_mm256_loadu_ps(in + m * 2 + 8), w1, sum1);
+	}
+	horizontal_sum_stereo_sse2(fold_avx2(_mm256_add_ps(sum0, sum1)), out);
+}
+
+TARGET_AVX2 void filter_multi8_avx2(const float *in, const float *coeff, unsigned num_taps, unsigned num_channels, float *out)
+{
+	for (unsigned c = 0; c < num_channels; c += 8) {
+		const float *ptr = in + c;
+		__m256 sum = _mm256_setzero_ps();
+		for (unsigned m = 0; m < num_taps; ++m) {
+			sum = _mm256_fmadd_ps(_mm256_loadu_ps(ptr), _mm256_set1_ps(coeff[m]), sum);
+			ptr += num_channels;
+		}
+		_mm256_storeu_ps(out + c, sum);
+	}
+}
+
+TARGET_AVX2 void interpolate_avx2(const float *coeff0, const float *coeff1, float a, float b, unsigned num_taps, float *out)
+{
+	const __m256 av = _mm256_set1_ps(a), bv = _mm256_set1_ps(b);
+	for (unsigned m = 0; m < num_taps; m += 8) {
+		__m256 x = _mm256_fmadd_ps(av, _mm256_loadu_ps(coeff0 + m), _mm256_mul_ps(bv, _mm256_loadu_ps(coeff1 + m)));
+		_mm256_storeu_ps(out + m, x);
+	}
+}
+
+TARGET_AVX512 void filter_mono_avx512(const float *in, const float *coeff, unsigned num_taps, unsigned num_channels, float *out)
+{
+	__m512 sum = _mm512_setzero_ps();
+	for (unsigned m = 0; m < num_taps; m += 16) {
+		sum = _mm512_fmadd_ps(_mm512_loadu_ps(in + m), _mm512_loadu_ps(coeff + m), sum);
+	}
+	alignas(64) float tmp[16];
+	_mm512_store_ps(tmp, sum);
+	out[0] = 0.0f;
+	for (unsigned i = 0; i < 16; ++i) {
+		out[0] += tmp[i];
+	}
+}
+
+TARGET_AVX512 void filter_stereo_avx512(const float *in, const float *coeff, unsigned num_taps, unsigned num_channels, float *out)
+{
+	// Duplicates taps 0..7 (or 8..15) to match up with L/R pairs.
+	const __m512i dup_lo = _mm512_setr_epi32(0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7);
+	const __m512i dup_hi = _mm512_setr_epi32(8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13, 14, 14, 15, 15);
+	__m512 sum0 = _mm512_setzero_ps(), sum1 = _mm512_setzero_ps();
+	for (unsigned m = 0; m < num_taps; m += 16) {
+		__m512 w = _mm512_loadu_ps(coeff + m);
+		sum0 = _mm512_fmadd_ps(_mm512_loadu_ps(in + m * 2), _mm512_maskz_permutexvar_ps(0xffff, dup_lo, w), sum0);
+		sum1 = _mm512_fmadd_ps(_mm512_loadu_ps(in + m * 2 + 16), _mm512_maskz_permutexvar_ps(0xffff, dup_hi, w), sum1);
+	}
+	alignas(64) float tmp[16];
+	_mm512_store_ps(tmp, _mm512_add_ps(sum0, sum1));
+	out[0] = out[1] = 0.0f;
+	for (unsigned i = 0; i < 16; i += 2) {
+		out[0] += tmp[i];
+		out[1] += tmp[i + 1];
+	}
+}
+
+TARGET_AVX512 void filter_multi16_avx512(const float *in, const float *coeff, unsigned num_taps, unsigned num_channels, float *out)
+{
+	for (unsigned c = 0; c < num_channels; c += 16) {
+		const float *ptr = in + c;
+		__m512 sum = _mm512_setzero_ps();
+		for (unsigned m = 0; m < num_taps; ++m) {
+			sum = _mm512_fmadd_ps(_mm512_loadu_ps(ptr), _mm512_set1_ps(coeff[m]), sum);
+			ptr += num_channels;
+		}
+		_mm512_storeu_ps(out + c, sum);
+	}
+}
+
+TARGET_AVX512 void interpolate_avx512(const float *coeff0, const float *coeff1, float a, float b, unsigned num_taps, float *out)
+{
+	const __m512 av = _mm512_set1_ps(a), bv = _mm512_set1_ps(b);
+	for (unsigned m = 0; m < num_taps; m += 16) {
+		__m512 x = _mm512_fmadd_ps(av, _mm512_loadu_ps(coeff0 + m), _mm512_mul_ps(bv, _mm512_loadu_ps(coeff1 + m)));
+		_mm512_storeu_ps(out + m, x);
+	}
+}
+
+#endif  // defined(HAVE_AVX_KERNELS)
+
+void choose_kernels(unsigned num_channels, resampler_filter_kernel_t *filter_kernel, resampler_interpolate_kernel_t *interpolate_kernel)
+{
+	const ResamplerISA isa = min(detect_resampler_isa(), max_isa.load());
+
+	*filter_kernel = filter_scalar;
+	*interpolate_kernel = interpolate_scalar;
+#ifdef HAVE_SSE2_KERNELS
+	if (isa >= ResamplerISA::SSE2) {
+		*interpolate_kernel = interpolate_sse2;
+		if (num_channels == 1) {
+			*filter_kernel = filter_mono_sse2;
+		} else if (num_channels == 2) {
+			*filter_kernel = filter_stereo_sse2;
+		} else if (num_channels % 4 == 0) {
+			*filter_kernel = filter_multi4_sse2;
+		}
+	}
+#endif
+#ifdef HAVE_AVX_KERNELS
+	if (isa >= ResamplerISA::AVX2_FMA) {
+		*interpolate_kernel = interpolate_avx2;
+		if (num_channels == 1) {
+			*filter_kernel = filter_mono_avx2;
+		} else if (num_channels == 2) {
+			*filter_kernel = filter_stereo_avx2;
+		} else if (num_channels % 8 == 0) {
+			*filter_kernel = filter_multi8_avx2;
+		}
+	}
+	if (isa >= ResamplerISA::AVX512) {
+		*interpolate_kernel = interpolate_avx512;
+		if (num_channels == 1) {
+			*filter_kernel = filter_mono_avx512;
+		} else if (num_channels == 2) {
+			*filter_kernel = filter_stereo_avx512;
+		} else if (num_channels % 16 == 0) {
+			*filter_kernel = filter_multi16_avx512;
+		}
+	}
+#endif
+}
+
+// Flush denormals to zero while we're in scope; long decaying tails
+// would otherwise be very slow. (zita-resampler instead adds and
+// subtracts a tiny offset, which doesn't vectorize as nicely.)
+class FlushDenormals {
+public:
+#ifdef __SSE__
+	FlushDenormals() : old_mode(_MM_GET_FLUSH_ZERO_MODE()) { _MM_SET_FLUSH_ZERO_MODE(_MM_FLUSH_ZERO_ON); }
+	~FlushDenormals() { _MM_SET_FLUSH_ZERO_MODE(old_mode); }
+
+private:
+	unsigned old_mode;
+#endif
+};
+
+}  // namespace
+
+ResamplerISA detect_resampler_isa()
+{
+#ifdef HAVE_AVX_KERNELS
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f")) {
+		return ResamplerISA::AVX512;
+	}
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+		return ResamplerISA::AVX2_FMA;
+	}
+#endif
+#ifdef HAVE_SSE2_KERNELS
+	return ResamplerISA::SSE2;
+#else
+	return ResamplerISA::SCALAR;
+#endif
+}
+
+void set_max_resampler_isa(ResamplerISA isa)
+{
+	max_isa = isa;
+}
+
+const char *resampler_isa_name(ResamplerISA isa)
+{
+	switch (isa) {
+	case ResamplerISA::SCALAR:
+		return "scalar";
+	case ResamplerISA::SSE2:
+		return "SSE2";
+	case ResamplerISA::AVX2_FMA:
+		return "AVX2/FMA";
+	case ResamplerISA::AVX512:
+		return "AVX-512";
+	}
+	return "unknown";
+}
+
+int PolyphaseResamplerBase::inpsize() const
+{
+	if (table == nullptr) return 0;
+	return 2 * table->hl;
+}
+
+void PolyphaseResamplerBase::setup_base(shared_ptr<const PolyphaseTable> table, unsigned num_channels, unsigned max_index)
+{
+	this->table = table;
+	this->num_channels = num_channels;
+	this->max_index = max_index;
+
+	// The window can start anywhere before <max_index>, and the kernels
+	// read up to 15 frames past its end (see PolyphaseTable).
+	buffer.reset(new float[num_channels * (2 * table->hl - 1 + max_index + 16)]());
+	choose_kernels(num_channels, &filter_kernel, &interpolate_kernel);
+}
+
+void PolyphaseResamplerBase::clear_base()
+{
+	table.reset();
+	buffer.reset();
+	num_channels = 0;
+	max_index = 0;
+	filter_kernel = nullptr;
+	interpolate_kernel = nullptr;
+	inp_count = out_count = 0;
+	inp_data = nullptr;
+	out_data = nullptr;
+}
+
+void PolyphaseResamplerBase::reset_base()
+{
+	inp_count = out_count = 0;
+	inp_data = nullptr;
+	out_data = nullptr;
+	index = 0;
+	num_to_read = 2 * table->hl;
+	num_zero = 0;
+}
+
+bool PolyphaseResamplerBase::fill_window()
+{
+	if (num_to_read == 0) {
+		return true;
+	}
+	const unsigned hl = table->hl;
+	const unsigned n = min(num_to_read, inp_count);
+	float *dst = buffer.get() + (index + 2 * hl - num_to_read) * num_channels;
+	if (inp_data != nullptr) {
+		memcpy(dst, inp_data, n * num_channels * sizeof(float));
+		inp_data += n * num_channels;
+		if (n > 0) num_zero = 0;
+	} else {
+		memset(dst, 0, n * num_channels * sizeof(float));
+		num_zero = min(num_zero + n, 2 * hl);
+	}
+	num_to_read -= n;
+	inp_count -= n;
+	return num_to_read == 0;
+}
+
+void PolyphaseResamplerBase::advance_window(unsigned num_frames)
+{
+	const unsigned hl = table->hl;
+	assert(num_frames <= 2 * hl);
+	num_to_read = num_frames;
+	index += num_frames;
+	if (index >= max_index) {
+		// Move what we still need back to the start of the buffer.
+		memmove(buffer.get(), buffer.get() + index * num_channels, (2 * hl - num_frames) * num_channels * sizeof(float));
+		index = 0;
+	}
+}
+
+int PolyphaseResampler::setup(unsigned fs_inp, unsigned fs_out, unsigned num_channels, unsigned hlen)
+{
+	return setup(fs_inp, fs_out, num_channels, hlen, 1.0 - 2.6 / hlen);
+}
+
+int PolyphaseResampler::setup(unsigned fs_inp, unsigned fs_out, unsigned num_channels, unsigned hlen, double frel)
+{
+	clear();
+	if (fs_inp == 0 || fs_out == 0 || num_channels == 0) {
+		return 1;
+	}
+
+	const double r = double(fs_out) / double(fs_inp);
+	const unsigned g = gcd(fs_out, fs_inp);
+	const unsigned np = fs_out / g;
+	if (16 * r < 1 || np > 1000) {
+		return 1;
+	}
+
+	unsigned hl = hlen;
+	unsigned max_index = 250;
+	if (r < 1) {
+		frel *= r;
+		hl = unsigned(ceil(hl / r));
+		max_index = unsigned(ceil(max_index / r));
+	}
+	setup_base(PolyphaseTable::get(frel, hl, np), num_channels, max_index);
+	phase_step = fs_inp / g;
+	return reset();
+}
+
+void PolyphaseResampler::clear()
+{
+	clear_base();
+	phase = 0;
+	phase_step = 0;
+}
+
+int PolyphaseResampler::reset()
+{
+	if (table == nullptr) return 1;
+	reset_base();
+	phase = 0;
+	return 0;
+}
+
+double PolyphaseResampler::inpdist() const
+{
+	if (table == nullptr) return 0.0;
+	return int(table->hl + 1 - num_to_read) - double(phase) / table->np;
+}
+
+int PolyphaseResampler::process()
+{
+	if (table == nullptr) return 1;
+
+	FlushDenormals flush_denormals;
+	const unsigned np = table->np;
+	while (out_count > 0) {
+		if (!fill_window()) {
+			break;
+		}
+		if (out_data != nullptr) {
+			if (num_zero < 2 * table->hl) {
+				filter_kernel(window(), table->row(phase), table->stride, num_channels, out_data);
+			} else {
+				memset(out_data, 0, num_channels * sizeof(float));
+			}
+			out_data += num_channels;
+		}
+		--out_count;
+
+		phase += phase_step;
+		if (phase >= np) {
+			unsigned num_frames = phase / np;
+			phase -= num_frames * np;
+			advance_window(num_frames);
+		}
+	}
+	return 0;
+}
+
+int VariablePolyphaseResampler::setup(double ratio, unsigned num_channels, unsigned hlen)
+{
+	return setup(ratio, num_channels, hlen, 1.0 - 2.6 / hlen);
+}
+
+int VariablePolyphaseResampler::setup(double ratio, unsigned num_channels, unsigned hlen, double frel)
+{
+	static constexpr unsigned num_phases = 256;
+
+	clear();
+	if (num_channels == 0 || !(ratio >= 1.0 / 16.0)) {
+		return 1;
+	}
+
+	unsigned hl = hlen;
+	unsigned max_index = 250;
+	if (ratio < 1) {
+		frel *= ratio;
+		hl = unsigned(ceil(hl / ratio));
+		max_index = unsigned(ceil(max_index / ratio));
+	}
+	setup_base(PolyphaseTable::get(frel, hl, num_phases), num_channels, max_index);
+	coeff.reset(new float[table->stride]);
+	this->ratio = ratio;
+	smoothing = (ratio > 1.0) ? 0.1 : 0.1 * ratio;
+	return reset();
+}
+
+void VariablePolyphaseResampler::clear()
+{
+	clear_base();
+	coeff.reset();
+	ratio = 1.0;
+	phase = 0.0;
+	phase_step = target_phase_step = 0.0;
+	smoothing = 0.1;
+}
+
+int VariablePolyphaseResampler::reset()
+{
+	if (table == nullptr) return 1;
+	reset_base();
+	phase = 0.0;
+	phase_step = target_phase_step = table->np / ratio;
+	return 0;
+}
+
+double VariablePolyphaseResampler::inpdist() const
+{
+	if (table == nullptr) return 0.0;
+	return int(table->hl + 1 - num_to_read) - phase / table->np;
+}
+
+void VariablePolyphaseResampler::set_rratio(double r)
+{
+	if (table == nullptr) return;
+	r = max(min(r, 16.0), 0.95);
+	target_phase_step = table->np / (ratio * r);
+}
+
+int VariablePolyphaseResampler::process()
+{
+	if (table == nullptr) return 1;
+
+	FlushDenormals flush_denormals;
+	const unsigned np = table->np;
+	while (out_count > 0) {
+		if (!fill_window()) {
+			break;
+		}
+		if (out_data != nullptr) {
+			if (num_zero < 2 * table->hl) {
+				// Interpolate linearly between the two nearest phases.
+				const unsigned k = unsigned(phase);
+				const float b = phase - k;
+				interpolate_kernel(table->row(k), table->row(k + 1), 1.0f - b, b, table->stride, coeff.get());
+				filter_kernel(window(), coeff.get(), table->stride, num_channels, out_data);
+			} else {
+				memset(out_data, 0, num_channels * sizeof(float));
+			}
+			out_data += num_channels;
+		}
+		--out_count;
+
+		// Like zita-resampler, we don't jump to the new ratio immediately,
+		// but follow it with a simple one-pole lowpass.
+		phase += phase_step;
+		phase_step += smoothing * (target_phase_step - phase_step);
+		if (phase >= np) {
+			unsigned num_frames = unsigned(floor(phase / np));
+			phase -= num_frames * np;
+			advance_window(num_frames);
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,126 @@
+#ifndef _POLYPHASE_RESAMPLER_H
+#define _POLYPHASE_RESAMPLER_H 1
+
+// In-tree polyphase resamplers, replacing zita-resampler's Resampler and
+// VResampler. They are drop-in compatible with the parts of zita-resampler's
+// API that Nageru uses, and use the same filter design (windowed sinc with
+// the same window and relative bandwidth), but pick filter kernels for SSE2,
+// AVX2/FMA or AVX-512 at runtime, depending on what the CPU supports.
+// This means we don't need a patched zita-resampler for performance anymore.
+//
+// The main difference from zita-resampler is the layout of the filter table:
+// Instead of two half-filters per phase, one of which is applied backwards,
+// each phase is a single filter of 2 * hlen taps applied in the forward
+// direction, which is much easier to vectorize.
+
+#include <memory>
+
+// Which instruction set the filter kernels use.
+enum class ResamplerISA {
+	SCALAR,
+	SSE2,
+	AVX2_FMA,
+	AVX512
+};
+
+// The best instruction set supported by both the CPU and the compiler.
+ResamplerISA detect_resampler_isa();
+
+// Caps the instruction set used by resamplers set up after this call.
+// Only really useful for testing and benchmarking.
+void set_max_resampler_isa(ResamplerISA isa);
+
+const char *resampler_isa_name(ResamplerISA isa);
+
+class PolyphaseTable;
+
+// Computes one output frame: out[c] = sum_m in[m * num_channels + c] * coeff[m],
+// for m < num_taps. num_taps is always a multiple of 16; the coefficients
+// are zero-padded, and the input buffer has room for the extra frames.
+typedef void (*resampler_filter_kernel_t)(const float *in, const float *coeff, unsigned num_taps, unsigned num_channels, float *out);
+
+// out[m] = a * coeff0[m] + b * coeff1[m], for m < num_taps (again a multiple of 16).
+typedef void (*resampler_interpolate_kernel_t)(const float *coeff0, const float *coeff1, float a, float b, unsigned num_taps, float *out);
+
+// The state that PolyphaseResampler and VariablePolyphaseResampler have in common,
+// namely the input buffer and the chosen kernels.
+class PolyphaseResamplerBase {
+public:
+	unsigned inp_count = 0;
+	unsigned out_count = 0;
+	const float *inp_data = nullptr;
+	float *out_data = nullptr;
+
+	int nchan() const { return num_channels; }
+	int inpsize() const;
+
+protected:
+	PolyphaseResamplerBase() {}
+	~PolyphaseResamplerBase() {}
+	PolyphaseResamplerBase(const PolyphaseResamplerBase &) = delete;
+	PolyphaseResamplerBase &operator=(const PolyphaseResamplerBase &) = delete;
+
+	void setup_base(std::shared_ptr<const PolyphaseTable> table, unsigned num_channels, unsigned max_index);
+	void clear_base();
+	void reset_base();
+
+	// Reads input into the buffer until the filter window is full.
+	// Returns false if we ran out of input.
+	bool fill_window();
+
+	// Moves the filter window <num_frames> frames forward.
+	void advance_window(unsigned num_frames);
+
+	// The current filter window (2 * hlen frames).
+	const float *window() const { return buffer.get() + index * num_channels; }
+
+	std::shared_ptr<const PolyphaseTable> table;
+	std::unique_ptr<float[]> buffer;
+	unsigned num_channels = 0;
+	unsigned max_index = 0;  // When <index> reaches this, the buffer is shifted back to the start.
+	unsigned index = 0;  // Start of the filter window, in frames.
+	unsigned num_to_read = 0;  // Number of frames needed before the window is full.
+	unsigned num_zero = 0;  // Number of zero frames (from inp_data == nullptr) in the window.
+	resampler_filter_kernel_t filter_kernel = nullptr;
+	resampler_interpolate_kernel_t interpolate_kernel = nullptr;
+};
+
+// Fixed-ratio resampler, like zita-resampler's Resampler. fs_out / gcd(fs_inp, fs_out)
+// must be at most 1000, and the ratio must be at least 1/16.
+class PolyphaseResampler : public PolyphaseResamplerBase {
+public:
+	int setup(unsigned fs_inp, unsigned fs_out, unsigned num_channels, unsigned hlen);
+	int setup(unsigned fs_inp, unsigned fs_out, unsigned num_channels, unsigned hlen, double frel);
+	void clear();
+	int reset();
+	int process();
+	double inpdist() const;
+
+private:
+	unsigned phase = 0;
+	unsigned phase_step = 0;
+};
+
+// Variable-ratio resampler, like zita-resampler's VResampler. The ratio
+// can be adjusted (within 0.95 to 16 of the nominal ratio) with set_rratio().
+class VariablePolyphaseResampler : public PolyphaseResamplerBase {
+public:
+	int setup(double ratio, unsigned num_channels, unsigned hlen);
+	int setup(double ratio, unsigned num_channels, unsigned hlen, double frel);
+	void clear();
+	int reset();
+	int process();
+	double inpdist() const;
+
+	void set_rratio(double r);
+
+private:
+	double ratio = 1.0;
+	double phase = 0.0;
+	double phase_step = 0.0;
+	double target_phase_step = 0.0;  // Set by set_rratio(); phase_step follows it smoothly.
+	double smoothing = 0.1;
+	std::unique_ptr<float[]> coeff;  // Interpolated between two phases.
+};
+
+#endif  // !defined(_POLYPHASE_RESAMPLER_H)
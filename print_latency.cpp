@@ -12,17 +12,17 @@
 using namespace std;
 using namespace std::chrono;
 
-ReceivedTimestamps find_received_timestamp(const vector<RefCountedFrame> &input_frames)
+ReceivedTimestamps find_received_timestamp(const InputFrameSet &input_frames)
 {
 	unsigned num_cards = global_mixer->get_num_cards();
-	assert(input_frames.size() == num_cards * FRAME_HISTORY_LENGTH);
+	assert(input_frames != nullptr);
 
 	ReceivedTimestamps ts;
 	for (unsigned card_index = 0; card_index < num_cards; ++card_index) {
 		for (unsigned frame_index = 0; frame_index < FRAME_HISTORY_LENGTH; ++frame_index) {
-			const RefCountedFrame &input_frame = input_frames[card_index * FRAME_HISTORY_LENGTH + frame_index];
+			const RefCountedFrame &input_frame = input_frames->buffered_frames[card_index][frame_index].frame;
 			if (input_frame == nullptr ||
-			    (frame_index > 0 && input_frame.get() == input_frames[card_index * FRAME_HISTORY_LENGTH + frame_index - 1].get())) {
+			    (frame_index > 0 && input_frame == input_frames->buffered_frames[card_index][frame_index - 1].frame)) {
 				ts.ts.push_back(steady_clock::time_point::min());
 			} else {
 				ts.ts.push_back(input_frame->received_timestamp);
@@ -9,7 +9,7 @@
 #include <string>
 #include <vector>
 
-#include "ref_counted_frame.h"
+#include "input_state.h"
 #include "metrics.h"
 
 // Since every output frame is based on multiple input frames, we need
@@ -25,7 +25,7 @@ struct LatencyHistogram {
 	std::vector<std::vector<std::unique_ptr<Summary[]>>> summaries;
 };
 
-ReceivedTimestamps find_received_timestamp(const std::vector<RefCountedFrame> &input_frames);
+ReceivedTimestamps find_received_timestamp(const InputFrameSet &input_frames);
 
 void print_latency(const std::string &header, const ReceivedTimestamps &received_ts, bool is_b_frame, int *frameno, LatencyHistogram *histogram);
 
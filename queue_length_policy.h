@@ -0,0 +1,57 @@
+#ifndef _QUEUE_LENGTH_POLICY_H
+#define _QUEUE_LENGTH_POLICY_H 1
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <utility>
+#include <vector>
+
+// For any card that's not the master (where we pick out the frames as they
+// come, as fast as we can process), there's going to be a queue. The question
+// is when we should drop frames from that queue (apart from the obvious
+// dropping if the 16-frame queue should become full), especially given that
+// the frame rate could be lower or higher than the master (either subtly or
+// dramatically). We have two (conflicting) demands:
+//
+//   1. We want to avoid starving the queue.
+//   2. We don't want to add more delay than is needed.
+//
+// Our general strategy is to drop as many frames as we can (helping for #2)
+// that we think is safe for #1 given jitter. To this end, we measure the
+// deviation from the expected arrival time for all cards, and use that for
+// continuous jitter estimation.
+//
+// We then drop everything from the queue that we're sure we won't need to
+// serve the output in the time before the next frame arrives. Typically,
+// this means the queue will contain 0 or 1 frames, although more is also
+// possible if the jitter is very high.
+class QueueLengthPolicy {
+public:
+	QueueLengthPolicy() {}
+	void reset(unsigned card_index) {
+		this->card_index = card_index;
+	}
+
+	void register_metrics(const std::vector<std::pair<std::string, std::string>> &labels);
+	void unregister_metrics(const std::vector<std::pair<std::string, std::string>> &labels);
+
+	// Call after picking out a frame, so 0 means starvation.
+	void update_policy(std::chrono::steady_clock::time_point now,
+	                   std::chrono::steady_clock::time_point expected_next_frame,
+			   int64_t input_frame_duration,
+	                   int64_t master_frame_duration,
+	                   double max_input_card_jitter_seconds,
+	                   double max_master_card_jitter_seconds);
+	unsigned get_safe_queue_length() const { return safe_queue_length; }
+
+private:
+	unsigned card_index;  // For debugging and metrics only.
+	unsigned safe_queue_length = 0;  // Can never go below zero.
+
+	// Metrics.
+	std::atomic<int64_t> metric_input_queue_safe_length_frames{1};
+};
+
+#endif  // !defined(_QUEUE_LENGTH_POLICY_H)
@@ -0,0 +1,406 @@
+// Replays a frame arrival log (from --record-frame-arrivals) through the
+// production queue length policy, i.e. JitterHistory and QueueLengthPolicy
+// used exactly the way Mixer uses them, and through a few alternatives,
+// and reports how each of them would have done on every non-master card
+// in terms of latency, drops and underruns (duplicated frames).
+//
+// This supersedes experiments/queue_drop_policy.cpp, which needed a
+// hand-made log and reimplemented the policies. To try out a new policy,
+// subclass SimulatedPolicy and add it to make_policies().
+
+#include <assert.h>
+#include <getopt.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "defs.h"
+#include "frame_arrival_log.h"
+#include "jitter_history.h"
+#include "queue_length_policy.h"
+#include "timebase.h"
+
+using namespace std;
+using namespace std::chrono;
+
+namespace {
+
+// One instance per card. All functions are called in log order.
+class SimulatedPolicy {
+public:
+	virtual ~SimulatedPolicy() {}
+
+	// A frame from this card has been queued.
+	virtual void frame_arrived(const FrameArrivalRecord &in) {}
+
+	// The master clock ticked (<out> is the OUT record).
+	virtual void output_tick(const FrameArrivalRecord &out) {}
+
+	// This card had nothing to pick out at the last tick.
+	virtual void starved() {}
+
+	// Called where Mixer would call QueueLengthPolicy::update_policy(), ie.,
+	// after a frame has been picked out from this card (so <queue_length>,
+	// which counts dropped frames, can be zero even though we are not starved).
+	// Returns how many frames to keep in the queue; the simulator then also
+	// applies --max-input-queue-frames, like Mixer does.
+	virtual unsigned get_safe_queue_length(const FrameArrivalRecord &out, int64_t master_input_frame_duration, unsigned queue_length) = 0;
+};
+
+// What Nageru actually does.
+class ProductionPolicy : public SimulatedPolicy {
+public:
+	explicit ProductionPolicy(size_t history_length)
+		: input_jitter_history(history_length), output_jitter_history(history_length) {}
+
+	void frame_arrived(const FrameArrivalRecord &in) override
+	{
+		input_jitter_history.frame_arrived(in.timestamp, in.frame_duration, in.dropped_frames);
+	}
+
+	void output_tick(const FrameArrivalRecord &out) override
+	{
+		if (!(out.flags & FrameArrivalRecord::FLAG_PREROLL)) {
+			output_jitter_history.frame_arrived(out.timestamp, out.frame_duration, out.dropped_frames);
+		}
+	}
+
+	unsigned get_safe_queue_length(const FrameArrivalRecord &out, int64_t master_input_frame_duration, unsigned queue_length) override
+	{
+		policy.update_policy(
+			out.timestamp,
+			input_jitter_history.get_expected_next_frame(),
+			master_input_frame_duration,
+			out.frame_duration,
+			input_jitter_history.estimate_max_jitter(),
+			output_jitter_history.estimate_max_jitter());
+		return policy.get_safe_queue_length();
+	}
+
+private:
+	JitterHistory input_jitter_history, output_jitter_history;
+	QueueLengthPolicy policy;
+};
+
+// QueueLengthPolicy, but with a simple decaying-peak jitter estimate instead
+// of JitterHistory (similar to what Nageru used before 1.7.0).
+class JitterFilterPolicy : public SimulatedPolicy {
+public:
+	JitterFilterPolicy(double multiplier, double alpha)
+		: input_jitter(multiplier, alpha), output_jitter(multiplier, alpha) {}
+
+	void frame_arrived(const FrameArrivalRecord &in) override
+	{
+		input_jitter.update(in.timestamp, in.frame_duration, in.dropped_frames);
+	}
+
+	void output_tick(const FrameArrivalRecord &out) override
+	{
+		if (!(out.flags & FrameArrivalRecord::FLAG_PREROLL)) {
+			output_jitter.update(out.timestamp, out.frame_duration, out.dropped_frames);
+		}
+	}
+
+	unsigned get_safe_queue_length(const FrameArrivalRecord &out, int64_t master_input_frame_duration, unsigned queue_length) override
+	{
+		policy.update_policy(
+			out.timestamp,
+			input_jitter.expected_timestamp,
+			master_input_frame_duration,
+			out.frame_duration,
+			input_jitter.max_jitter_seconds * input_jitter.multiplier,
+			output_jitter.max_jitter_seconds * output_jitter.multiplier);
+		return policy.get_safe_queue_length();
+	}
+
+private:
+	struct Jitter {
+		Jitter(double multiplier, double alpha) : multiplier(multiplier), alpha(alpha) {}
+
+		void update(steady_clock::time_point now, int64_t frame_duration, unsigned dropped_frames)
+		{
+			const nanoseconds frame_duration_ns(frame_duration * 1000000000 / TIMEBASE);
+			if (expected_timestamp > steady_clock::time_point::min()) {
+				expected_timestamp += dropped_frames * frame_duration_ns;
+				double jitter_seconds = fabs(duration<double>(expected_timestamp - now).count());
+				max_jitter_seconds = max(jitter_seconds, alpha * max_jitter_seconds);
+			}
+			expected_timestamp = now + frame_duration_ns;
+		}
+
+		const double multiplier, alpha;
+		steady_clock::time_point expected_timestamp = steady_clock::time_point::min();
+		double max_jitter_seconds = 0.0;
+	};
+	Jitter input_jitter, output_jitter;
+	QueueLengthPolicy policy;
+};
+
+// Never drop; the anchor for lowest number of underruns (and highest latency).
+class NoDropPolicy : public SimulatedPolicy {
+public:
+	unsigned get_safe_queue_length(const FrameArrivalRecord &out, int64_t master_input_frame_duration, unsigned queue_length) override
+	{
+		return queue_length;
+	}
+};
+
+// Keep at most a fixed number of frames; with 0, the anchor for lowest latency.
+class FixedLengthPolicy : public SimulatedPolicy {
+public:
+	explicit FixedLengthPolicy(unsigned length) : length(length) {}
+
+	unsigned get_safe_queue_length(const FrameArrivalRecord &out, int64_t master_input_frame_duration, unsigned queue_length) override
+	{
+		return length;
+	}
+
+private:
+	const unsigned length;
+};
+
+struct PolicyFactory {
+	string name;
+	function<SimulatedPolicy *()> create;
+};
+
+vector<PolicyFactory> make_policies()
+{
+	vector<PolicyFactory> policies;
+	policies.push_back(PolicyFactory{ "production", []{ return new ProductionPolicy(5000); } });
+	for (size_t history_length : { 500, 50000 }) {
+		char name[256];
+		snprintf(name, sizeof(name), "production[history=%zu]", history_length);
+		policies.push_back(PolicyFactory{ name, [history_length]{ return new ProductionPolicy(history_length); } });
+	}
+	for (double multiplier : { 1.0, 2.0 }) {
+		for (double alpha : { 0.999, 0.9999 }) {
+			char name[256];
+			snprintf(name, sizeof(name), "jitter-filter[mul=%.1f,alpha=%.4f]", multiplier, alpha);
+			policies.push_back(PolicyFactory{ name, [multiplier, alpha]{ return new JitterFilterPolicy(multiplier, alpha); } });
+		}
+	}
+	policies.push_back(PolicyFactory{ "no-drop", []{ return new NoDropPolicy; } });
+	for (unsigned length : { 0, 1, 2 }) {
+		char name[256];
+		snprintf(name, sizeof(name), "fixed[len=%u]", length);
+		policies.push_back(PolicyFactory{ name, [length]{ return new FixedLengthPolicy(length); } });
+	}
+	return policies;
+}
+
+struct QueuedFrame {
+	steady_clock::time_point arrival;
+	int64_t frame_duration;
+	unsigned dropped_frames;
+};
+
+struct SimulatedCard {
+	unique_ptr<SimulatedPolicy> policy;
+	deque<QueuedFrame> queue;
+	bool picked_at_last_tick = false;
+	int64_t last_frame_duration = 0;
+
+	// Statistics; only for ticks where this card was not the master.
+	size_t num_ticks = 0;
+	size_t num_underruns = 0;
+	size_t num_drops = 0;
+	vector<double> latencies_seconds;
+};
+
+struct Result {
+	string name;
+	size_t num_ticks, num_underruns, num_drops;
+	double avg_latency_ms, p99_latency_ms, max_latency_ms;
+};
+
+// Mirrors Mixer::trim_queue().
+void trim_queue(SimulatedCard *card, unsigned safe_queue_length)
+{
+	unsigned queue_length = 0;
+	for (const QueuedFrame &frame : card->queue) {
+		queue_length += frame.dropped_frames + 1;
+	}
+	while (queue_length > safe_queue_length) {
+		assert(!card->queue.empty());
+		assert(queue_length > card->queue.front().dropped_frames);
+		queue_length -= card->queue.front().dropped_frames;
+
+		if (queue_length <= safe_queue_length) {
+			// No need to drop anything.
+			break;
+		}
+
+		card->queue.pop_front();
+		--queue_length;
+		++card->num_drops;
+	}
+}
+
+vector<Result> simulate(const vector<FrameArrivalRecord> &records, const PolicyFactory &factory, unsigned max_input_queue_frames)
+{
+	SimulatedCard cards[MAX_VIDEO_CARDS];
+	for (SimulatedCard &card : cards) {
+		card.policy.reset(factory.create());
+	}
+
+	const FrameArrivalRecord *last_out = nullptr;
+	int64_t master_input_frame_duration = 0;
+	for (const FrameArrivalRecord &record : records) {
+		if (record.card_index >= MAX_VIDEO_CARDS) {
+			continue;
+		}
+		const bool master_is_input = (last_out != nullptr && !(last_out->flags & FrameArrivalRecord::FLAG_MASTER_IS_OUTPUT));
+		switch (record.type) {
+		case FrameArrivalRecord::IN: {
+			SimulatedCard *card = &cards[record.card_index];
+			card->policy->frame_arrived(record);
+			card->queue.push_back(QueuedFrame{ record.timestamp, record.frame_duration, record.dropped_frames });
+			break;
+		}
+		case FrameArrivalRecord::OUT:
+			last_out = &record;
+			master_input_frame_duration = cards[record.card_index].queue.empty() ?
+				cards[record.card_index].last_frame_duration :
+				cards[record.card_index].queue.front().frame_duration;
+			for (unsigned card_index = 0; card_index < MAX_VIDEO_CARDS; ++card_index) {
+				SimulatedCard *card = &cards[card_index];
+				card->policy->output_tick(record);
+				const bool is_master = (card_index == record.card_index &&
+					!(record.flags & FrameArrivalRecord::FLAG_MASTER_IS_OUTPUT));
+				if (!is_master) {
+					++card->num_ticks;
+				}
+				if (card->queue.empty()) {
+					if (!is_master) {
+						++card->num_underruns;
+					}
+					card->policy->starved();
+					card->picked_at_last_tick = false;
+					continue;
+				}
+				if (!is_master) {
+					double latency = duration<double>(record.timestamp - card->queue.front().arrival).count();
+					card->latencies_seconds.push_back(max(latency, 0.0));
+				}
+				card->last_frame_duration = card->queue.front().frame_duration;
+				card->queue.pop_front();
+				card->picked_at_last_tick = true;
+			}
+			break;
+		case FrameArrivalRecord::POLICY:
+			if (last_out == nullptr || (last_out->flags & FrameArrivalRecord::FLAG_PREROLL)) {
+				break;
+			}
+			for (unsigned card_index = 0; card_index < MAX_VIDEO_CARDS; ++card_index) {
+				SimulatedCard *card = &cards[card_index];
+				if (!card->picked_at_last_tick || (master_is_input && card_index == last_out->card_index)) {
+					continue;
+				}
+				unsigned queue_length = 0;
+				for (const QueuedFrame &frame : card->queue) {
+					queue_length += frame.dropped_frames + 1;
+				}
+				unsigned safe_queue_length = card->policy->get_safe_queue_length(*last_out, master_input_frame_duration, queue_length);
+				trim_queue(card, min(max_input_queue_frames, safe_queue_length));
+			}
+			break;
+		}
+	}
+
+	vector<Result> results;
+	for (SimulatedCard &card : cards) {
+		Result result;
+		result.name = factory.name;
+		result.num_ticks = card.num_ticks;
+		result.num_underruns = card.num_underruns;
+		result.num_drops = card.num_drops;
+		result.avg_latency_ms = result.p99_latency_ms = result.max_latency_ms = 0.0 / 0.0;
+		if (!card.latencies_seconds.empty()) {
+			vector<double> &l = card.latencies_seconds;
+			double sum = 0.0;
+			for (double latency : l) sum += latency;
+			result.avg_latency_ms = 1e3 * sum / l.size();
+			size_t p99_idx = lrint(0.99 * (l.size() - 1));
+			nth_element(l.begin(), l.begin() + p99_idx, l.end());
+			result.p99_latency_ms = 1e3 * l[p99_idx];
+			result.max_latency_ms = 1e3 * *max_element(l.begin(), l.end());
+		}
+		results.push_back(result);
+	}
+	return results;
+}
+
+void usage()
+{
+	fprintf(stderr, "Usage: queue_policy_simulator [--max-input-queue-frames=FRAMES] LOGFILE\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "LOGFILE is recorded with nageru --record-frame-arrivals=LOGFILE.\n");
+}
+
+}  // namespace
+
+int main(int argc, char **argv)
+{
+	static const option long_options[] = {
+		{ "help", no_argument, 0, 'h' },
+		{ "max-input-queue-frames", required_argument, 0, 'q' },
+		{ 0, 0, 0, 0 }
+	};
+	unsigned max_input_queue_frames = 6;  // Same default as Nageru.
+	for ( ;; ) {
+		int option_index = 0;
+		int c = getopt_long(argc, argv, "hq:", long_options, &option_index);
+		if (c == -1) {
+			break;
+		}
+		switch (c) {
+		case 'q':
+			max_input_queue_frames = atoi(optarg);
+			break;
+		case 'h':
+		default:
+			usage();
+			exit(c == 'h' ? 0 : 1);
+		}
+	}
+	if (optind + 1 != argc) {
+		usage();
+		exit(1);
+	}
+
+	vector<FrameArrivalRecord> records;
+	if (!read_frame_arrival_log(argv[optind], TIMEBASE, &records)) {
+		exit(1);
+	}
+	size_t num_ticks = count_if(records.begin(), records.end(), [](const FrameArrivalRecord &r) { return r.type == FrameArrivalRecord::OUT; });
+	printf("Read %zu records (%zu output ticks).\n", records.size(), num_ticks);
+
+	vector<vector<Result>> results;  // Policy, card.
+	for (const PolicyFactory &factory : make_policies()) {
+		results.push_back(simulate(records, factory, max_input_queue_frames));
+	}
+
+	for (unsigned card_index = 0; card_index < MAX_VIDEO_CARDS; ++card_index) {
+		size_t num_frames_in = count_if(records.begin(), records.end(), [card_index](const FrameArrivalRecord &r) {
+			return r.type == FrameArrivalRecord::IN && r.card_index == card_index;
+		});
+		if (num_frames_in == 0 || results[0][card_index].num_ticks == 0) {
+			continue;  // Not present, or always master.
+		}
+		printf("\nCard %u (%zu frames in, %zu ticks as non-master):\n", card_index, num_frames_in, results[0][card_index].num_ticks);
+		printf("  %-40s %9s %9s %9s %9s %9s\n", "policy", "underruns", "drops", "avg ms", "p99 ms", "max ms");
+		for (const vector<Result> &policy_results : results) {
+			const Result &r = policy_results[card_index];
+			printf("  %-40s %9zu %9zu %9.2f %9.2f %9.2f\n",
+				r.name.c_str(), r.num_underruns, r.num_drops, r.avg_latency_ms, r.p99_latency_ms, r.max_latency_ms);
+		}
+	}
+}
@@ -1592,7 +1592,7 @@ bool QuickSyncEncoderImpl::is_zerocopy() const
 	return use_zerocopy;
 }
 
-bool QuickSyncEncoderImpl::begin_frame(int64_t pts, int64_t duration, YCbCrLumaCoefficients ycbcr_coefficients, const vector<RefCountedFrame> &input_frames, GLuint *y_tex, GLuint *cbcr_tex)
+bool QuickSyncEncoderImpl::begin_frame(int64_t pts, int64_t duration, YCbCrLumaCoefficients ycbcr_coefficients, const InputFrameSet &input_frames, GLuint *y_tex, GLuint *cbcr_tex)
 {
 	assert(!is_shutdown);
 	GLSurface *surf = nullptr;
@@ -1966,7 +1966,7 @@ void QuickSyncEncoderImpl::pass_frame(QuickSyncEncoderImpl::PendingFrame frame,
 		received_ts, false, &frameno, &mixer_latency_histogram);
 
 	// Release back any input frames we needed to render this frame.
-	frame.input_frames.clear();
+	frame.input_frames.reset();
 
 	GLSurface *surf;
 	{
@@ -2092,7 +2092,7 @@ bool QuickSyncEncoder::is_zerocopy() const
 	return impl->is_zerocopy();
 }
 
-bool QuickSyncEncoder::begin_frame(int64_t pts, int64_t duration, YCbCrLumaCoefficients ycbcr_coefficients, const vector<RefCountedFrame> &input_frames, GLuint *y_tex, GLuint *cbcr_tex)
+bool QuickSyncEncoder::begin_frame(int64_t pts, int64_t duration, YCbCrLumaCoefficients ycbcr_coefficients, const InputFrameSet &input_frames, GLuint *y_tex, GLuint *cbcr_tex)
 {
 	return impl->begin_frame(pts, duration, ycbcr_coefficients, input_frames, y_tex, cbcr_tex);
 }
@@ -43,13 +43,13 @@ extern "C" {
 #include <libavformat/avformat.h>
 }
 
+#include "input_state.h"
 #include "ref_counted_gl_sync.h"
 
 class DiskSpaceEstimator;
 class Mux;
 class QSurface;
 class QuickSyncEncoderImpl;
-class RefCountedFrame;
 class X264Encoder;
 
 namespace movit {
@@ -71,7 +71,7 @@ public:
 	bool is_zerocopy() const;  // Thread-safe.
 
 	// See VideoEncoder::begin_frame().
-	bool begin_frame(int64_t pts, int64_t duration, movit::YCbCrLumaCoefficients ycbcr_coefficients, const std::vector<RefCountedFrame> &input_frames, GLuint *y_tex, GLuint *cbcr_tex);
+	bool begin_frame(int64_t pts, int64_t duration, movit::YCbCrLumaCoefficients ycbcr_coefficients, const InputFrameSet &input_frames, GLuint *y_tex, GLuint *cbcr_tex);
 	RefCountedGLsync end_frame();
 	void shutdown();  // Blocking. Does not require an OpenGL context.
 	void close_file();  // Does not require an OpenGL context. Must be run after shutdown.
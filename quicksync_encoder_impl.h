@@ -37,7 +37,7 @@ public:
 	~QuickSyncEncoderImpl();
 	void add_audio(int64_t pts, std::vector<float> audio);
 	bool is_zerocopy() const;
-	bool begin_frame(int64_t pts, int64_t duration, movit::YCbCrLumaCoefficients ycbcr_coefficients, const std::vector<RefCountedFrame> &input_frames, GLuint *y_tex, GLuint *cbcr_tex);
+	bool begin_frame(int64_t pts, int64_t duration, movit::YCbCrLumaCoefficients ycbcr_coefficients, const InputFrameSet &input_frames, GLuint *y_tex, GLuint *cbcr_tex);
 	RefCountedGLsync end_frame();
 	void shutdown();
 	void close_file();
@@ -64,7 +64,7 @@ private:
 	};
 	struct PendingFrame {
 		RefCountedGLsync fence;
-		std::vector<RefCountedFrame> input_frames;
+		InputFrameSet input_frames;
 		int64_t pts, duration;
 		movit::YCbCrLumaCoefficients ycbcr_coefficients;
 	};
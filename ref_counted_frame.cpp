@@ -1,6 +1,20 @@
 #include "ref_counted_frame.h"
 
 #include <bmusb/bmusb.h>
+#include <mutex>
+
+using namespace std;
+
+namespace {
+
+// Enough for a few cards' worth of frames in flight; the pool grows
+// by this many slots at a time if that is not enough.
+constexpr unsigned SLOTS_PER_CHUNK = 64;
+
+mutex slot_pool_mu;
+RefCountedFrameSlot *first_free_slot = nullptr;  // Under <slot_pool_mu>.
+
+}  // namespace
 
 void release_refcounted_frame(bmusb::FrameAllocator::Frame *frame)
 {
@@ -9,3 +23,39 @@ void release_refcounted_frame(bmusb::FrameAllocator::Frame *frame)
 	}
 	delete frame;
 }
+
+RefCountedFrameSlot *alloc_refcounted_frame_slot(const bmusb::FrameAllocator::Frame &frame)
+{
+	RefCountedFrameSlot *slot;
+	{
+		lock_guard<mutex> lock(slot_pool_mu);
+		if (first_free_slot == nullptr) {
+			// Deliberately leaked; slots are only ever recycled.
+			RefCountedFrameSlot *chunk = new RefCountedFrameSlot[SLOTS_PER_CHUNK];
+			for (unsigned i = 0; i < SLOTS_PER_CHUNK; ++i) {
+				chunk[i].next_free = first_free_slot;
+				first_free_slot = &chunk[i];
+			}
+		}
+		slot = first_free_slot;
+		first_free_slot = slot->next_free;
+	}
+
+	slot->frame = frame;
+	slot->next_free = nullptr;
+	slot->refcount.store(1, memory_order_relaxed);
+	return slot;
+}
+
+void release_refcounted_frame_slot(RefCountedFrameSlot *slot)
+{
+	assert(slot->refcount.load(memory_order_relaxed) == 0);
+	if (slot->frame.owner) {
+		slot->frame.owner->release_frame(slot->frame);
+	}
+	slot->frame = bmusb::FrameAllocator::Frame();
+
+	lock_guard<mutex> lock(slot_pool_mu);
+	slot->next_free = first_free_slot;
+	first_free_slot = slot;
+}
@@ -6,21 +6,84 @@
 //
 // Note that the important point isn't really the pointer to the Frame itself,
 // it's the resources it's representing that need to go back to the allocator.
+//
+// The Frame and its refcount live together in a slot from a global pool
+// (the Frame struct belongs to bmusb, so we cannot put the refcount into it).
+// Slots are recycled, never freed, so once the pool has grown to the number
+// of frames in flight, wrapping a frame does not touch the heap, and copying
+// a reference is a single atomic increment.
 
+#include <assert.h>
+#include <stddef.h>
+#include <atomic>
 #include <memory>
+#include <utility>
 
 #include "bmusb/bmusb.h"
 
 void release_refcounted_frame(bmusb::FrameAllocator::Frame *frame);
 
-typedef std::shared_ptr<bmusb::FrameAllocator::Frame> RefCountedFrameBase;
+struct RefCountedFrameSlot {
+	bmusb::FrameAllocator::Frame frame;
+	std::atomic<int> refcount{0};
+	RefCountedFrameSlot *next_free = nullptr;  // Only used while in the pool.
+};
+
+// Returns a slot with refcount 1.
+RefCountedFrameSlot *alloc_refcounted_frame_slot(const bmusb::FrameAllocator::Frame &frame);
 
-class RefCountedFrame : public RefCountedFrameBase {
+// Gives the frame back to its allocator, and the slot back to the pool.
+void release_refcounted_frame_slot(RefCountedFrameSlot *slot);
+
+class RefCountedFrame {
 public:
 	RefCountedFrame() {}
 
 	RefCountedFrame(const bmusb::FrameAllocator::Frame &frame)
-		: RefCountedFrameBase(new bmusb::FrameAllocator::Frame(frame), release_refcounted_frame) {}
+		: slot(alloc_refcounted_frame_slot(frame)) {}
+
+	RefCountedFrame(const RefCountedFrame &other)
+		: slot(other.slot)
+	{
+		if (slot != nullptr) {
+			slot->refcount.fetch_add(1, std::memory_order_relaxed);
+		}
+	}
+
+	RefCountedFrame(RefCountedFrame &&other)
+		: slot(other.slot)
+	{
+		other.slot = nullptr;
+	}
+
+	~RefCountedFrame() { reset(); }
+
+	RefCountedFrame &operator=(RefCountedFrame other)
+	{
+		std::swap(slot, other.slot);
+		return *this;
+	}
+
+	void reset()
+	{
+		if (slot != nullptr && slot->refcount.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+			release_refcounted_frame_slot(slot);
+		}
+		slot = nullptr;
+	}
+
+	bmusb::FrameAllocator::Frame *get() const { return slot ? &slot->frame : nullptr; }
+	bmusb::FrameAllocator::Frame *operator->() const { assert(slot != nullptr); return &slot->frame; }
+	bmusb::FrameAllocator::Frame &operator*() const { assert(slot != nullptr); return slot->frame; }
+
+	bool operator==(std::nullptr_t) const { return slot == nullptr; }
+	bool operator!=(std::nullptr_t) const { return slot != nullptr; }
+	bool operator==(const RefCountedFrame &other) const { return slot == other.slot; }
+	bool operator!=(const RefCountedFrame &other) const { return slot != other.slot; }
+	explicit operator bool() const { return slot != nullptr; }
+
+private:
+	RefCountedFrameSlot *slot = nullptr;
 };
 
 // Similar to RefCountedFrame, but as unique_ptr instead of shared_ptr.
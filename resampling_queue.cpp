@@ -23,7 +23,6 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <zita-resampler/vresampler.h>
 #include <algorithm>
 #include <cmath>
 
@@ -39,12 +39,12 @@
 //  along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #include <sys/types.h>
-#include <zita-resampler/vresampler.h>
 #include <chrono>
 #include <deque>
 #include <memory>
 
 #include "defs.h"
+#include "polyphase_resampler.h"
 
 class ResamplingQueue {
 public:
@@ -66,7 +66,7 @@ public:
 private:
 	void init_loop_filter(double bandwidth_hz);
 
-	VResampler vresampler;
+	VariablePolyphaseResampler vresampler;
 
 	unsigned card_num;
 	unsigned freq_in, freq_out, num_channels;
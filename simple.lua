@@ -11,10 +11,29 @@
 -- switch between inputs and set white balance, no transitions or the likes.
 -- Thus, it should be simpler to understand.
 
-local input_neutral_color = {{0.5, 0.5, 0.5}, {0.5, 0.5, 0.5}}
+-- Everything that the UI changes (which signals are live and preview,
+-- and the white balance) is kept with Nageru.set_shared() instead of in
+-- Lua variables, so that the theme also works with --theme-state-per-channel,
+-- where the UI callbacks and the chains run in different Lua states.
+local function get_shared(key, default)
+	local value = Nageru.get_shared(key)
+	if value == nil then
+		return default
+	end
+	return value
+end
+
+local function get_live_signal_num()
+	return get_shared("live_signal_num", 0)
+end
+
+local function get_preview_signal_num()
+	return get_shared("preview_signal_num", 1)
+end
 
-local live_signal_num = 0
-local preview_signal_num = 1
+local function get_neutral_color(signal_num)
+	return get_shared("neutral_color" .. signal_num, {0.5, 0.5, 0.5})
+end
 
 -- A chain to show a single input, with white balance. In a real example,
 -- we'd probably want to support deinterlacing and high-quality scaling
@@ -97,17 +116,15 @@ end
 -- Gets called with a new gray point when the white balance is changing.
 -- The color is in linear light (not sRGB gamma).
 function set_wb(channel, red, green, blue)
-	if channel == 2 then
-		input_neutral_color[1] = { red, green, blue }
-	elseif channel == 3 then
-		input_neutral_color[2] = { red, green, blue }
+	if channel == 2 or channel == 3 then
+		Nageru.set_shared("neutral_color" .. (channel - 2), { red, green, blue })
 	end
 end
 
 -- API ENTRY POINT
 -- Called every frame.
 function get_transitions(t)
-	if live_signal_num == preview_signal_num then
+	if get_live_signal_num() == get_preview_signal_num() then
 		-- No transitions possible.
 		return {}
 	else
@@ -119,22 +136,21 @@ end
 -- Called when the user clicks a transition button. For our case,
 -- we only do cuts, so we ignore the parameters; just switch live and preview.
 function transition_clicked(num, t)
-	local temp = live_signal_num
-	live_signal_num = preview_signal_num
-	preview_signal_num = temp
+	local temp = get_live_signal_num()
+	Nageru.set_shared("live_signal_num", get_preview_signal_num())
+	Nageru.set_shared("preview_signal_num", temp)
 end
 
 -- API ENTRY POINT
 function channel_clicked(num)
-	preview_signal_num = num
+	Nageru.set_shared("preview_signal_num", num)
 end
 
 -- API ENTRY POINT
--- Called every frame. Get the chain for displaying at input <num>,
--- where 0 is live, 1 is preview, 2 is the first channel to display
--- in the bottom bar, and so on up to num_channels()+1. t is the
--- current time in seconds. width and height are the dimensions of
--- the output, although you can ignore them if you don't need them
+-- Declares the scene for displaying at input <num>, where 0 is live,
+-- 1 is preview, 2 is the first channel to display in the bottom bar,
+-- and so on up to num_channels()+1. width and height are the dimensions
+-- of the output, although you can ignore them if you don't need them
 -- (they're useful if you want to e.g. know what to resample by).
 --
 -- <signals> is basically an exposed InputState, which you can use to
@@ -142,34 +158,43 @@ end
 -- frame. In particular, you can call get_width() and get_height()
 -- for any signal number, and use that to e.g. assist in chain selection.
 --
+-- Unlike get_chain() (see theme.lua), this is not called every frame;
+-- Nageru keeps using the scene until the output resolution or the format
+-- of any signal changes, or the user clicks a transition or channel.
+--
 -- You should return two objects; the chain itself, and then a
--- function (taking no parameters) that is run just before rendering.
--- The function needs to call connect_signal on any inputs, so that
--- it gets updated video data for the given frame. (You are allowed
--- to switch which input your input is getting from between frames,
+-- function (taking the current time in seconds) that is run every frame,
+-- just before rendering. The function needs to call connect_signal on any
+-- inputs, so that it gets updated video data for the given frame. (You are
+-- allowed to switch which input your input is getting from between frames,
 -- but not calling connect_signal results in undefined behavior.)
 -- If you want to change any parameters in the chain, this is also
--- the right place.
+-- the right place. If the function returns false, the chain is not used
+-- for this frame, and get_scene() is called again instead.
 --
 -- NOTE: The chain returned must be finalized with the Y'CbCr flag
 -- if and only if num==0.
-function get_chain(num, t, width, height, signals)
-	local chain, signal_num
+function get_scene(num, width, height, signals)
+	local chain
 	if num == 0 then  -- Live (right pane).
 		chain = simple_hq_chain
-		signal_num = live_signal_num
-	elseif num == 1 then  -- Preview (left pane).
-		chain = simple_lq_chain
-		signal_num = preview_signal_num
-	else  -- One of the two previews (bottom panes).
+	else  -- Preview (left pane) or one of the two previews (bottom panes).
 		chain = simple_lq_chain
-		signal_num = num - 2
 	end
 
-	prepare = function()
+	local update = function(t)
+		local signal_num
+		if num == 0 then
+			signal_num = get_live_signal_num()
+		elseif num == 1 then
+			signal_num = get_preview_signal_num()
+		else
+			signal_num = num - 2
+		end
+
 		chain.input:connect_signal(signal_num)
-		local color = input_neutral_color[signal_num + 1]
+		local color = get_neutral_color(signal_num)
 		chain.wb_effect:set_vec3("neutral_color", color[1], color[2], color[3])
 	end
-	return chain.chain, prepare
+	return chain.chain, update
 end
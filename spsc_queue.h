@@ -0,0 +1,147 @@
+#ifndef _SPSC_QUEUE_H
+#define _SPSC_QUEUE_H 1
+
+// A bounded, lock-free queue for exactly one producer thread and one
+// consumer thread (the typical case being a capture card callback pushing
+// frames and the mixer thread consuming them). Neither side ever blocks
+// the other; the only system call is the futex wakeup, which is only
+// made if the consumer is actually sleeping in wait_for_data() (which,
+// in Nageru's case, only ever happens for the master card).
+//
+// The functions documented as consumer-only must only ever be called
+// from one thread at a time, and likewise for the producer-only functions.
+// If you need to reset the queue from some third thread, you must make sure
+// the producer is stopped first.
+
+#include <assert.h>
+#include <linux/futex.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <utility>
+
+template<class T, size_t Capacity>
+class SPSCQueue {
+	static_assert((Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+
+public:
+	// Producer only. Returns false (and leaves <elem> alone) if the queue is full.
+	bool push(T &&elem)
+	{
+		const uint64_t w = write_pos.load(std::memory_order_relaxed);
+		if (w - read_pos.load(std::memory_order_acquire) == Capacity) {
+			return false;
+		}
+		slots[w % Capacity] = std::move(elem);
+		write_pos.store(w + 1, std::memory_order_release);
+		wake();
+		return true;
+	}
+
+	// Can be called from any thread; makes a sleeping wait_for_data() reevaluate
+	// its condition (e.g. after the card has been disconnected).
+	void wake()
+	{
+		// seq_cst on both sides, so that either the consumer sees the new
+		// sequence number, or we see that it's waiting (or both).
+		wake_seq.fetch_add(1);
+		if (consumer_waiting.load()) {
+			++num_wakeups;
+			syscall(SYS_futex, &wake_seq, FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+		}
+	}
+
+	// Consumer only.
+	bool empty() const { return size() == 0; }
+	size_t size() const
+	{
+		return write_pos.load(std::memory_order_acquire) - read_pos.load(std::memory_order_relaxed);
+	}
+
+	// Consumer only. Elements are numbered from the head of the queue, and
+	// <index> must be less than a previous return value of size().
+	// The consumer is free to modify the elements in place.
+	T &at(size_t index) { return slots[(read_pos.load(std::memory_order_relaxed) + index) % Capacity]; }
+	T &front() { return at(0); }
+
+	// Consumer only. The element is destroyed (by assigning an empty T)
+	// before the slot is handed back to the producer.
+	void pop()
+	{
+		const uint64_t r = read_pos.load(std::memory_order_relaxed);
+		assert(write_pos.load(std::memory_order_acquire) != r);
+		slots[r % Capacity] = T();
+		read_pos.store(r + 1, std::memory_order_release);
+	}
+
+	void clear()
+	{
+		while (!empty()) pop();
+	}
+
+	// Consumer only. Sleeps until the queue is nonempty or <done>() returns true,
+	// whichever comes first. <done> is evaluated every time someone calls wake().
+	// Returns the time spent waiting.
+	template<class Pred>
+	std::chrono::steady_clock::duration wait_for_data(Pred done)
+	{
+		return wait_for_data_until(done, std::chrono::steady_clock::time_point::max());
+	}
+
+	// Consumer only. Like wait_for_data(), but also gives up at <deadline>,
+	// in which case the queue may still be empty (and <done>() false).
+	template<class Pred>
+	std::chrono::steady_clock::duration wait_for_data_until(Pred done, std::chrono::steady_clock::time_point deadline)
+	{
+		if (!empty() || done()) {
+			return std::chrono::steady_clock::duration::zero();
+		}
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		consumer_waiting = true;
+		for ( ;; ) {
+			const uint32_t seq = wake_seq.load();
+			if (!empty() || done()) {
+				break;
+			}
+			// Returns immediately if wake_seq has changed since we read it,
+			// so we cannot miss a wakeup.
+			if (deadline == std::chrono::steady_clock::time_point::max()) {
+				syscall(SYS_futex, &wake_seq, FUTEX_WAIT_PRIVATE, seq, nullptr, nullptr, 0);
+			} else {
+				const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+				if (now >= deadline) {
+					break;
+				}
+				// The timeout is relative, and measured against CLOCK_MONOTONIC
+				// (ie., the same clock as steady_clock).
+				const int64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline - now).count();
+				timespec timeout;
+				timeout.tv_sec = ns / 1000000000;
+				timeout.tv_nsec = ns % 1000000000;
+				syscall(SYS_futex, &wake_seq, FUTEX_WAIT_PRIVATE, seq, &timeout, nullptr, 0);
+			}
+		}
+		consumer_waiting = false;
+		return std::chrono::steady_clock::now() - start;
+	}
+
+	// Metrics. Can be read from any thread.
+	std::atomic<int64_t> num_wakeups{0};  // Number of futex wakeup calls made.
+
+private:
+	T slots[Capacity];
+
+	// Monotonically increasing; the actual slots are these modulo <Capacity>.
+	// Separated to avoid false sharing between the producer and the consumer.
+	alignas(64) std::atomic<uint64_t> write_pos{0};
+	alignas(64) std::atomic<uint64_t> read_pos{0};
+
+	alignas(64) std::atomic<uint32_t> wake_seq{0};  // The futex word.
+	std::atomic<bool> consumer_waiting{false};
+};
+
+#endif  // !defined(_SPSC_QUEUE_H)
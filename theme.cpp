@@ -3,6 +3,7 @@
 #include <assert.h>
 #include <bmusb/bmusb.h>
 #include <epoxy/gl.h>
+#include <pthread.h>
 #include <lauxlib.h>
 #include <lua.hpp>
 #include <movit/deinterlace_effect.h>
@@ -22,9 +23,14 @@
 #include <movit/ycbcr_input.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <chrono>
+#include <condition_variable>
 #include <cstddef>
+#include <deque>
+#include <future>
 #include <memory>
 #include <new>
+#include <thread>
 #include <utility>
 
 #include "defs.h"
@@ -32,6 +38,8 @@
 #include "flags.h"
 #include "image_input.h"
 #include "input_state.h"
+#include "lua_pool_allocator.h"
+#include "metrics.h"
 #include "pbo_frame_allocator.h"
 
 class Mixer;
@@ -41,12 +49,27 @@ class ResourcePool;
 }  // namespace movit
 
 using namespace std;
+using namespace std::chrono;
 using namespace movit;
 
 extern Mixer *global_mixer;
 
 namespace {
 
+// Set by Theme::get_chain_snapshots() while it runs chain setup functions.
+// If non-null, changes to effect state are appended here instead of being
+// applied immediately. Thread-local, since the same Lua state can
+// also be called (under the lock) from other threads in the meantime,
+// e.g. for set_wb() from the UI, and those should be applied as usual.
+thread_local vector<function<void(const InputState &)>> *recorded_setup_ops = nullptr;
+
+// Set at the same time as <recorded_setup_ops>; see Theme::get_fingerprint().
+thread_local Theme::ChainDependencies *recorded_dependencies = nullptr;
+
+// Set if a scene's update function returned false while it was being
+// run from Theme::get_chain_snapshot(); see Theme::get_scene_chain().
+thread_local bool scene_needs_reevaluation = false;
+
 // Contains basically the same data as InputState, but does not hold on to
 // a reference to the frames. This is important so that we can release them
 // without having to wait for Lua's GC.
@@ -67,6 +90,7 @@ InputStateInfo::InputStateInfo(const InputState &input_state)
 			last_interlaced[signal_num] = false;
 			last_has_signal[signal_num] = false;
 			last_is_connected[signal_num] = false;
+			last_frame_rate_nom[signal_num] = last_frame_rate_den[signal_num] = 0;
 			continue;
 		}
 		const PBOFrameAllocator::Userdata *userdata = (const PBOFrameAllocator::Userdata *)frame.frame->userdata;
@@ -80,6 +104,30 @@ InputStateInfo::InputStateInfo(const InputState &input_state)
 	}
 }
 
+template<class T>
+void append_raw(const T &val, string *out)
+{
+	out->append(reinterpret_cast<const char *>(&val), sizeof(val));
+}
+
+// Everything in <info> that get_scene() could base its choice of chain on.
+string get_input_signature(const InputStateInfo &info)
+{
+	string signature;
+	for (unsigned signal_num = 0; signal_num < MAX_VIDEO_CARDS; ++signal_num) {
+		append_raw(info.last_width[signal_num], &signature);
+		append_raw(info.last_height[signal_num], &signature);
+		append_raw(info.last_interlaced[signal_num], &signature);
+		append_raw(info.last_has_signal[signal_num], &signature);
+		append_raw(info.last_is_connected[signal_num], &signature);
+		append_raw(info.last_frame_rate_nom[signal_num], &signature);
+		append_raw(info.last_frame_rate_den[signal_num], &signature);
+	}
+	return signature;
+}
+
+}  // namespace
+
 class LuaRefWithDeleter {
 public:
 	LuaRefWithDeleter(mutex *m, lua_State *L, int ref) : m(m), L(L), ref(ref) {}
@@ -97,6 +145,49 @@ private:
 	int ref;
 };
 
+// A persistent thread for evaluating one channel state in
+// Theme::get_chain_snapshots(), so that we do not need to start
+// (and tear down) a thread per channel every frame.
+struct Theme::ChannelWorker {
+	thread worker_thread;
+	mutex mu;
+	condition_variable cond;
+	deque<packaged_task<ChainSnapshot()>> jobs;  // Under <mu>.
+	bool should_quit = false;  // Under <mu>.
+
+	future<ChainSnapshot> submit(function<ChainSnapshot()> &&func)
+	{
+		packaged_task<ChainSnapshot()> job(move(func));
+		future<ChainSnapshot> ret = job.get_future();
+		{
+			lock_guard<mutex> lock(mu);
+			jobs.push_back(move(job));
+		}
+		cond.notify_all();
+		return ret;
+	}
+
+	void thread_func()
+	{
+		pthread_setname_np(pthread_self(), "Theme_Channel");
+		for ( ;; ) {
+			packaged_task<ChainSnapshot()> job;
+			{
+				unique_lock<mutex> lock(mu);
+				cond.wait(lock, [this]{ return should_quit || !jobs.empty(); });
+				if (should_quit) {
+					return;
+				}
+				job = move(jobs.front());
+				jobs.pop_front();
+			}
+			job();
+		}
+	}
+};
+
+namespace {
+
 template<class T, class... Args>
 int wrap_lua_object(lua_State* L, const char *class_name, Args&&... args)
 {
@@ -165,6 +256,15 @@ InputStateInfo *get_input_state_info(lua_State *L, int idx)
 	return nullptr;
 }
 
+void record_parameter(Effect *effect, const string &key, const float *values, size_t num_values)
+{
+	string *out = &recorded_dependencies->parameters;
+	out->append(reinterpret_cast<const char *>(&effect), sizeof(effect));
+	out->append(key);
+	out->push_back('\0');
+	out->append(reinterpret_cast<const char *>(values), num_values * sizeof(float));
+}
+
 bool checkbool(lua_State* L, int idx)
 {
 	luaL_checktype(L, idx, LUA_TBOOLEAN);
@@ -239,6 +339,9 @@ int EffectChain_add_effect(lua_State* L)
 
 	// TODO: Better error reporting.
 	Effect *effect = get_effect(L, 2);
+	if (luaL_testudata(L, 2, "ImageInput")) {
+		get_theme_updata(L)->register_image_input(chain, static_cast<ImageInput *>(effect));
+	}
 	if (lua_gettop(L) == 2) {
 		if (effect->num_inputs() == 0) {
 			chain->add_input((Input *)effect);
@@ -350,31 +453,65 @@ int VideoInput_new(lua_State* L)
 			pixel_format);
 		pixel_format = bmusb::PixelFormat_8BitYCbCrPlanar;
 	}
+
+	// Channel states (see --theme-state-per-channel) get the video inputs
+	// that the main state has already created, in the same order.
+	Theme *theme = get_theme_updata(L);
+	if (theme->is_channel_state()) {
+		FFmpegCapture *capture = theme->reuse_video_input();
+		if (capture == nullptr) {
+			luaL_error(L, "Theme created more video inputs than the first time it was loaded");
+		}
+		FFmpegCapture **obj = (FFmpegCapture **)lua_newuserdata(L, sizeof(FFmpegCapture *));
+		*obj = capture;
+		luaL_getmetatable(L, "VideoInput");
+		lua_setmetatable(L, -2);
+		return 1;
+	}
+
 	int ret = wrap_lua_object_nonowned<FFmpegCapture>(L, "VideoInput", filename, global_flags.width, global_flags.height);
 	if (ret == 1) {
 		FFmpegCapture **capture = (FFmpegCapture **)lua_touserdata(L, -1);
 		(*capture)->set_pixel_format(bmusb::PixelFormat(pixel_format));
-
-		Theme *theme = get_theme_updata(L);
 		theme->register_video_input(*capture);
 	}
 	return ret;
 }
 
+// While recording a snapshot, calls on a video input are deferred until
+// the snapshot is bound (see ChainDependencies::video_input_ops).
+// The snapshot's fingerprint is made unique, so that it is always bound,
+// instead of being skipped as unchanged.
+void record_video_input_op(function<void()> &&op)
+{
+	static atomic<uint64_t> serial{0};
+	uint64_t op_serial = serial++;
+	recorded_dependencies->parameters.append(reinterpret_cast<const char *>(&op_serial), sizeof(op_serial));
+	recorded_dependencies->video_input_ops.push_back(move(op));
+}
+
 int VideoInput_rewind(lua_State* L)
 {
 	assert(lua_gettop(L) == 1);
-	FFmpegCapture **video_input = (FFmpegCapture **)luaL_checkudata(L, 1, "VideoInput");
-	(*video_input)->rewind();
+	FFmpegCapture *video_input = *(FFmpegCapture **)luaL_checkudata(L, 1, "VideoInput");
+	if (recorded_setup_ops != nullptr) {
+		record_video_input_op([video_input]{ video_input->rewind(); });
+	} else {
+		video_input->rewind();
+	}
 	return 0;
 }
 
 int VideoInput_change_rate(lua_State* L)
 {
 	assert(lua_gettop(L) == 2);
-	FFmpegCapture **video_input = (FFmpegCapture **)luaL_checkudata(L, 1, "VideoInput");
+	FFmpegCapture *video_input = *(FFmpegCapture **)luaL_checkudata(L, 1, "VideoInput");
 	double new_rate = luaL_checknumber(L, 2);
-	(*video_input)->change_rate(new_rate);
+	if (recorded_setup_ops != nullptr) {
+		record_video_input_op([video_input, new_rate]{ video_input->change_rate(new_rate); });
+	} else {
+		video_input->change_rate(new_rate);
+	}
 	return 0;
 }
 
@@ -510,8 +647,17 @@ int Effect_set_float(lua_State *L)
 	Effect *effect = (Effect *)get_effect(L, 1);
 	string key = checkstdstring(L, 2);
 	float value = luaL_checknumber(L, 3);
-	if (!effect->set_float(key, value)) {
+	if (recorded_setup_ops != nullptr) {
+		record_parameter(effect, key, &value, 1);
+		recorded_setup_ops->push_back([effect, key, value](const InputState &) {
+			if (!effect->set_float(key, value)) {
+				fprintf(stderr, "Effect refused set_float(\"%s\", %d) (invalid key?)\n", key.c_str(), int(value));
+			}
+		});
+	} else if (!effect->set_float(key, value)) {
 		luaL_error(L, "Effect refused set_float(\"%s\", %d) (invalid key?)", key.c_str(), int(value));
+	} else {
+		get_theme_updata(L)->note_direct_parameter_change();
 	}
 	return 0;
 }
@@ -522,8 +668,17 @@ int Effect_set_int(lua_State *L)
 	Effect *effect = (Effect *)get_effect(L, 1);
 	string key = checkstdstring(L, 2);
 	float value = luaL_checknumber(L, 3);
-	if (!effect->set_int(key, value)) {
+	if (recorded_setup_ops != nullptr) {
+		record_parameter(effect, key, &value, 1);
+		recorded_setup_ops->push_back([effect, key, value](const InputState &) {
+			if (!effect->set_int(key, value)) {
+				fprintf(stderr, "Effect refused set_int(\"%s\", %d) (invalid key?)\n", key.c_str(), int(value));
+			}
+		});
+	} else if (!effect->set_int(key, value)) {
 		luaL_error(L, "Effect refused set_int(\"%s\", %d) (invalid key?)", key.c_str(), int(value));
+	} else {
+		get_theme_updata(L)->note_direct_parameter_change();
 	}
 	return 0;
 }
@@ -537,9 +692,19 @@ int Effect_set_vec3(lua_State *L)
 	v[0] = luaL_checknumber(L, 3);
 	v[1] = luaL_checknumber(L, 4);
 	v[2] = luaL_checknumber(L, 5);
-	if (!effect->set_vec3(key, v)) {
+	if (recorded_setup_ops != nullptr) {
+		record_parameter(effect, key, v, 3);
+		recorded_setup_ops->push_back([effect, key, v](const InputState &) {
+			if (!effect->set_vec3(key, v)) {
+				fprintf(stderr, "Effect refused set_vec3(\"%s\", %f, %f, %f) (invalid key?)\n", key.c_str(),
+					v[0], v[1], v[2]);
+			}
+		});
+	} else if (!effect->set_vec3(key, v)) {
 		luaL_error(L, "Effect refused set_vec3(\"%s\", %f, %f, %f) (invalid key?)", key.c_str(),
 			v[0], v[1], v[2]);
+	} else {
+		get_theme_updata(L)->note_direct_parameter_change();
 	}
 	return 0;
 }
@@ -554,13 +719,90 @@ int Effect_set_vec4(lua_State *L)
 	v[1] = luaL_checknumber(L, 4);
 	v[2] = luaL_checknumber(L, 5);
 	v[3] = luaL_checknumber(L, 6);
-	if (!effect->set_vec4(key, v)) {
+	if (recorded_setup_ops != nullptr) {
+		record_parameter(effect, key, v, 4);
+		recorded_setup_ops->push_back([effect, key, v](const InputState &) {
+			if (!effect->set_vec4(key, v)) {
+				fprintf(stderr, "Effect refused set_vec4(\"%s\", %f, %f, %f, %f) (invalid key?)\n", key.c_str(),
+					v[0], v[1], v[2], v[3]);
+			}
+		});
+	} else if (!effect->set_vec4(key, v)) {
 		luaL_error(L, "Effect refused set_vec4(\"%s\", %f, %f, %f, %f) (invalid key?)", key.c_str(),
 			v[0], v[1], v[2], v[3]);
+	} else {
+		get_theme_updata(L)->note_direct_parameter_change();
+	}
+	return 0;
+}
+
+int Nageru_set_shared(lua_State* L)
+{
+	assert(lua_gettop(L) == 2);
+	Theme *theme = get_theme_updata(L);
+	string key = luaL_checkstring(L, 1);
+
+	Theme::SharedValue value;
+	value.type = lua_type(L, 2);
+	switch (value.type) {
+	case LUA_TNIL:
+		break;
+	case LUA_TBOOLEAN:
+		value.boolean = lua_toboolean(L, 2);
+		break;
+	case LUA_TNUMBER:
+		value.numbers.push_back(lua_tonumber(L, 2));
+		break;
+	case LUA_TSTRING:
+		value.str = checkstdstring(L, 2);
+		break;
+	case LUA_TTABLE: {
+		size_t len = lua_rawlen(L, 2);
+		for (size_t i = 1; i <= len; ++i) {
+			lua_rawgeti(L, 2, i);
+			value.numbers.push_back(luaL_checknumber(L, -1));
+			lua_pop(L, 1);
+		}
+		break;
+	}
+	default:
+		luaL_error(L, "Nageru.set_shared() can only store nil, booleans, numbers, strings and arrays of numbers");
 	}
+	theme->set_shared_value(key, value);
 	return 0;
 }
 
+int Nageru_get_shared(lua_State* L)
+{
+	assert(lua_gettop(L) == 1);
+	Theme *theme = get_theme_updata(L);
+	Theme::SharedValue value = theme->get_shared_value(luaL_checkstring(L, 1));
+	switch (value.type) {
+	case LUA_TNIL:
+		lua_pushnil(L);
+		break;
+	case LUA_TBOOLEAN:
+		lua_pushboolean(L, value.boolean);
+		break;
+	case LUA_TNUMBER:
+		lua_pushnumber(L, value.numbers[0]);
+		break;
+	case LUA_TSTRING:
+		lua_pushlstring(L, value.str.data(), value.str.size());
+		break;
+	case LUA_TTABLE:
+		lua_createtable(L, value.numbers.size(), 0);
+		for (size_t i = 0; i < value.numbers.size(); ++i) {
+			lua_pushnumber(L, value.numbers[i]);
+			lua_rawseti(L, -2, i + 1);
+		}
+		break;
+	default:
+		assert(false);
+	}
+	return 1;
+}
+
 const luaL_Reg EffectChain_funcs[] = {
 	{ "new", EffectChain_new },
 	{ "__gc", EffectChain_gc },
@@ -676,10 +918,17 @@ const luaL_Reg InputStateInfo_funcs[] = {
 	{ NULL, NULL }
 };
 
+const luaL_Reg Nageru_funcs[] = {
+	{ "set_shared", Nageru_set_shared },
+	{ "get_shared", Nageru_get_shared },
+	{ NULL, NULL }
+};
+
 }  // namespace
 
 LiveInputWrapper::LiveInputWrapper(Theme *theme, EffectChain *chain, bmusb::PixelFormat pixel_format, bool override_bounce, bool deinterlace)
 	: theme(theme),
+	  chain(chain),
 	  pixel_format(pixel_format),
 	  deinterlace(deinterlace)
 {
@@ -775,7 +1024,15 @@ void LiveInputWrapper::connect_signal(int signal_num)
 	}
 
 	signal_num = theme->map_signal(signal_num);
-	connect_signal_raw(signal_num, *theme->input_state);
+	if (recorded_setup_ops != nullptr) {
+		// Connect to whatever frames are current when the snapshot is applied.
+		recorded_dependencies->signals.emplace_back(signal_num, get_history_length());
+		recorded_setup_ops->push_back([this, signal_num](const InputState &input_state) {
+			connect_signal_raw(signal_num, input_state);
+		});
+	} else {
+		connect_signal_raw(signal_num, *theme->input_state);
+	}
 }
 
 void LiveInputWrapper::connect_signal_raw(int signal_num, const InputState &input_state)
@@ -878,6 +1135,13 @@ void LiveInputWrapper::connect_signal_raw(int signal_num, const InputState &inpu
 
 namespace {
 
+// The same as luaL_newstate() would set.
+int lua_panic(lua_State *L)
+{
+	fprintf(stderr, "PANIC: unprotected error in call to Lua API (%s)\n", lua_tostring(L, -1));
+	return 0;  // Lua will abort.
+}
+
 int call_num_channels(lua_State *L)
 {
 	lua_getglobal(L, "num_channels");
@@ -896,9 +1160,44 @@ int call_num_channels(lua_State *L)
 }  // namespace
 
 Theme::Theme(const string &filename, const vector<string> &search_dirs, ResourcePool *resource_pool, unsigned num_cards)
-	: resource_pool(resource_pool), num_cards(num_cards), signal_to_card_mapping(global_flags.default_stream_mapping)
+	: Theme(filename, search_dirs, resource_pool, num_cards, nullptr)
 {
-	L = luaL_newstate();
+	if (!global_flags.theme_state_per_channel) {
+		return;
+	}
+	for (int num = 0; num < num_channels + 2; ++num) {
+		Theme *channel_theme = new Theme(filename, search_dirs, resource_pool, num_cards, this);
+		channel_themes.emplace_back(channel_theme);
+		if (channel_theme->num_channels != num_channels ||
+		    channel_theme->num_video_inputs_reused != video_inputs.size()) {
+			fprintf(stderr, "The theme set up different channels or video inputs when loaded for channel %d;\n", num);
+			fprintf(stderr, "it needs to do the same every time to be used with --theme-state-per-channel.\n");
+			exit(1);
+		}
+	}
+
+	// The live channel is evaluated on the calling thread; see get_chain_snapshots().
+	for (int num = 1; num < num_channels + 2; ++num) {
+		ChannelWorker *worker = new ChannelWorker;
+		channel_workers.emplace_back(worker);
+		worker->worker_thread = thread(&ChannelWorker::thread_func, worker);
+	}
+}
+
+Theme::Theme(const string &filename, const vector<string> &search_dirs, ResourcePool *resource_pool, unsigned num_cards, Theme *root_theme)
+	: resource_pool(resource_pool), num_cards(num_cards), signal_to_card_mapping(global_flags.default_stream_mapping),
+	  root(root_theme == nullptr ? this : root_theme)
+{
+	if (root == this && global_flags.profile_theme) {
+		profiler.reset(new ThemeProfiler);
+	}
+
+	allocator.reset(new LuaPoolAllocator(&root->metric_lua_heap_bytes));
+	L = lua_newstate(LuaPoolAllocator::alloc, allocator.get());
+	lua_atpanic(L, lua_panic);
+	if (root->profiler) {
+		root->profiler->install_hook(L);
+	}
         luaL_openlibs(L);
 
 	register_constants();
@@ -952,13 +1251,74 @@ Theme::Theme(const string &filename, const vector<string> &search_dirs, Resource
 
 	// Ask it for the number of channels.
 	num_channels = call_num_channels(L);
+
+	// Themes that declare scenes get get_scene() called only when needed,
+	// instead of get_chain() every frame.
+	lua_getglobal(L, "get_scene");
+	has_scenes = lua_isfunction(L, -1);
+	lua_pop(L, 1);
+	assert(lua_gettop(L) == 0);
+
+	// From now on, the garbage collector only runs from step_garbage_collector(),
+	// so that it does not cause pauses in the middle of evaluating a frame.
+	lua_gc(L, LUA_GCSTOP, 0);
+
+	if (root == this) {
+		if (has_scenes) {
+			global_metrics.add("theme_scene_evaluations", &metric_scene_evaluations);
+		}
+		global_metrics.add("theme_lua_heap_bytes", &metric_lua_heap_bytes, Metrics::TYPE_GAUGE);
+		metric_lua_gc_seconds.init_geometric(1e-5, 0.1, 20);
+		global_metrics.add("theme_lua_gc_seconds", &metric_lua_gc_seconds);
+	}
 }
 
 Theme::~Theme()
 {
+	for (const unique_ptr<ChannelWorker> &worker : channel_workers) {
+		{
+			lock_guard<mutex> lock(worker->mu);
+			worker->should_quit = true;
+		}
+		worker->cond.notify_all();
+		worker->worker_thread.join();
+	}
+	scenes.clear();  // Releases references into the Lua state.
 	lua_close(L);
 }
 
+string Theme::get_profile_hot_spots()
+{
+	if (!profiler) {
+		return "Theme profiling is not enabled; use --profile-theme.\n";
+	}
+	return profiler->get_hot_spots();
+}
+
+int Theme::pcall(ThemeProfiler::EntryPoint entry_point, int nargs, int nresults)
+{
+	if (root->profiler) {
+		return root->profiler->pcall(entry_point, L, nargs, nresults);
+	}
+	return lua_pcall(L, nargs, nresults, 0);
+}
+
+void Theme::step_garbage_collector()
+{
+	{
+		unique_lock<mutex> lock(m);
+		size_t allocated_kb = allocator->take_allocated_kb();
+		if (allocated_kb > 0) {
+			steady_clock::time_point start = steady_clock::now();
+			lua_gc(L, LUA_GCSTEP, allocated_kb);
+			root->metric_lua_gc_seconds.count_event(duration<double>(steady_clock::now() - start).count());
+		}
+	}
+	for (const unique_ptr<Theme> &channel_theme : channel_themes) {
+		channel_theme->step_garbage_collector();
+	}
+}
+
 void Theme::register_constants()
 {
 	// Set Nageru.VIDEO_FORMAT_BGRA = bmusb::PixelFormat_8BitBGRA, etc.
@@ -975,6 +1335,15 @@ void Theme::register_constants()
 		lua_settable(L, 1);  // t[key] = value
 	}
 
+	// Whether there are Lua states per channel, so that the theme
+	// needs to use Nageru.set_shared() to talk to them.
+	lua_pushboolean(L, global_flags.theme_state_per_channel);
+	lua_setfield(L, 1, "STATE_PER_CHANNEL");
+
+	// Nageru.set_shared() and Nageru.get_shared(), with upvalue {theme}.
+	lua_pushlightuserdata(L, this);
+	luaL_setfuncs(L, Nageru_funcs, 1);
+
 	lua_setglobal(L, "Nageru");  // Nageru = t
 	assert(lua_gettop(L) == 0);
 }
@@ -991,8 +1360,15 @@ void Theme::register_class(const char *class_name, const luaL_Reg *funcs)
 	assert(lua_gettop(L) == 0);
 }
 
-Theme::Chain Theme::get_chain(unsigned num, float t, unsigned width, unsigned height, InputState input_state) 
+Theme::Chain Theme::get_chain(unsigned num, float t, unsigned width, unsigned height, const InputFrameSet &input_frames)
 {
+	if (!channel_themes.empty()) {
+		return channel_themes[num]->get_chain(num, t, width, height, input_frames);
+	}
+	if (has_scenes) {
+		return get_scene_chain(num, t, width, height, input_frames);
+	}
+
 	Chain chain;
 
 	unique_lock<mutex> lock(m);
@@ -1002,12 +1378,14 @@ Theme::Chain Theme::get_chain(unsigned num, float t, unsigned width, unsigned he
 	lua_pushnumber(L, t);
 	lua_pushnumber(L, width);
 	lua_pushnumber(L, height);
-	wrap_lua_object<InputStateInfo>(L, "InputStateInfo", input_state);
+	wrap_lua_object<InputStateInfo>(L, "InputStateInfo", *input_frames);
 
-	if (lua_pcall(L, 5, 2, 0) != 0) {
+	evaluating_chain = true;
+	if (pcall(ThemeProfiler::GET_CHAIN, 5, 2) != 0) {
 		fprintf(stderr, "error running function `get_chain': %s\n", lua_tostring(L, -1));
 		exit(1);
 	}
+	evaluating_chain = false;
 
 	chain.chain = (EffectChain *)luaL_testudata(L, -2, "EffectChain");
 	if (chain.chain == nullptr) {
@@ -1024,40 +1402,287 @@ Theme::Chain Theme::get_chain(unsigned num, float t, unsigned width, unsigned he
 	lua_pop(L, 2);
 	assert(lua_gettop(L) == 0);
 
-	chain.setup_chain = [this, funcref, input_state]{
+	chain.setup_chain = [this, funcref, input_frames]{
 		unique_lock<mutex> lock(m);
 
 		assert(this->input_state == nullptr);
-		this->input_state = &input_state;
+		this->input_state = input_frames.get();
+		evaluating_chain = true;
 
 		// Set up state, including connecting signals.
 		lua_rawgeti(L, LUA_REGISTRYINDEX, funcref->get());
-		if (lua_pcall(L, 0, 0, 0) != 0) {
+		if (pcall(ThemeProfiler::CHAIN_SETUP, 0, 0) != 0) {
 			fprintf(stderr, "error running chain setup callback: %s\n", lua_tostring(L, -1));
 			exit(1);
 		}
 		assert(lua_gettop(L) == 0);
 
+		evaluating_chain = false;
+		this->input_state = nullptr;
+	};
+
+	chain.input_frames = input_frames;
+	return chain;
+}
+
+Theme::Chain Theme::get_scene_chain(unsigned num, float t, unsigned width, unsigned height, const InputFrameSet &input_frames)
+{
+	InputStateInfo input_state_info(*input_frames);
+	string input_signature = get_input_signature(input_state_info);
+
+	// Declared before the lock, since dropping the last reference to
+	// an update function takes the lock.
+	shared_ptr<LuaRefWithDeleter> old_update_ref, update_ref;
+
+	Chain chain;
+	unique_lock<mutex> lock(m);
+	Scene &scene = scenes[num];
+	if (!scene.valid || scene.width != width || scene.height != height || scene.input_signature != input_signature) {
+		assert(lua_gettop(L) == 0);
+		lua_getglobal(L, "get_scene");  /* function to be called */
+		lua_pushnumber(L, num);
+		lua_pushnumber(L, width);
+		lua_pushnumber(L, height);
+		wrap_lua_object<InputStateInfo>(L, "InputStateInfo", input_state_info);
+
+		evaluating_chain = true;
+		if (pcall(ThemeProfiler::GET_SCENE, 4, 2) != 0) {
+			fprintf(stderr, "error running function `get_scene': %s\n", lua_tostring(L, -1));
+			exit(1);
+		}
+		evaluating_chain = false;
+
+		EffectChain *effect_chain = (EffectChain *)luaL_testudata(L, -2, "EffectChain");
+		if (effect_chain == nullptr) {
+			fprintf(stderr, "get_scene() for chain number %d did not return an EffectChain\n",
+				num);
+			exit(1);
+		}
+		if (!lua_isfunction(L, -1)) {
+			fprintf(stderr, "Argument #-1 should be a function\n");
+			exit(1);
+		}
+		lua_pushvalue(L, -1);
+		old_update_ref = move(scene.update_ref);
+		scene.update_ref.reset(new LuaRefWithDeleter(&m, L, luaL_ref(L, LUA_REGISTRYINDEX)));
+		lua_pop(L, 2);
+		assert(lua_gettop(L) == 0);
+
+		scene.valid = true;
+		scene.width = width;
+		scene.height = height;
+		scene.input_signature = move(input_signature);
+		scene.chain = effect_chain;
+		++root->metric_scene_evaluations;
+	}
+	chain.chain = scene.chain;
+	update_ref = scene.update_ref;
+	lock.unlock();
+
+	chain.setup_chain = [this, num, t, update_ref, input_frames]{
+		unique_lock<mutex> lock(m);
+
+		assert(this->input_state == nullptr);
+		this->input_state = input_frames.get();
+		evaluating_chain = true;
+
+		// Set up state, including connecting signals.
+		lua_rawgeti(L, LUA_REGISTRYINDEX, update_ref->get());
+		lua_pushnumber(L, t);
+		if (pcall(ThemeProfiler::CHAIN_SETUP, 1, 1) != 0) {
+			fprintf(stderr, "error running scene update callback: %s\n", lua_tostring(L, -1));
+			exit(1);
+		}
+
+		// Returning false means the theme wants a different chain for this
+		// scene, so get_scene() needs to be called again. (The scene might
+		// already have been evaluated anew on another thread in the meantime.)
+		if (lua_isboolean(L, -1) && !lua_toboolean(L, -1)) {
+			Scene &scene = scenes[num];
+			if (scene.update_ref == update_ref) {
+				scene.valid = false;
+			}
+			scene_needs_reevaluation = true;
+		}
+		lua_pop(L, 1);
+		assert(lua_gettop(L) == 0);
+
+		evaluating_chain = false;
 		this->input_state = nullptr;
 	};
 
-	// TODO: Can we do better, e.g. by running setup_chain() and seeing what it references?
-	// Actually, setup_chain does maybe hold all the references we need now anyway?
-	for (unsigned card_index = 0; card_index < num_cards; ++card_index) {
-		for (unsigned frame_num = 0; frame_num < FRAME_HISTORY_LENGTH; ++frame_num) {
-			chain.input_frames.push_back(input_state.buffered_frames[card_index][frame_num].frame);
+	chain.input_frames = input_frames;
+	return chain;
+}
+
+void Theme::invalidate_scenes()
+{
+	for (auto &num_and_scene : scenes) {
+		num_and_scene.second.valid = false;
+	}
+
+	// The channel states never take our lock, so this cannot deadlock.
+	for (const unique_ptr<Theme> &channel_theme : channel_themes) {
+		unique_lock<mutex> lock(channel_theme->m);
+		channel_theme->invalidate_scenes();
+	}
+}
+
+vector<Theme::ChainSnapshot> Theme::get_chain_snapshots(float t, unsigned width, unsigned height, unsigned preview_width, unsigned preview_height, const InputState &input_state, const vector<bool> &channels)
+{
+	auto evaluate = [&](int num) -> ChainSnapshot {
+		if (!channels[num]) {
+			return ChainSnapshot{ nullptr, nullptr, nullptr };
+		} else if (num == 0) {
+			return get_chain_snapshot(num, t, width, height, input_state);
+		} else {
+			return get_chain_snapshot(num, t, preview_width, preview_height, input_state);
+		}
+	};
+
+	vector<ChainSnapshot> snapshots;
+	if (channel_themes.empty()) {
+		for (int num = 0; num < num_channels + 2; ++num) {
+			snapshots.push_back(evaluate(num));
+		}
+		return snapshots;
+	}
+
+	// Every channel has its own Lua state, so they can all be evaluated
+	// at the same time, each on its own worker. The live channel is
+	// evaluated on this thread.
+	vector<future<ChainSnapshot>> futures(num_channels + 2);
+	for (int num = 1; num < num_channels + 2; ++num) {
+		if (channels[num]) {
+			futures[num] = channel_workers[num - 1]->submit(bind(evaluate, num));
+		}
+	}
+	snapshots.push_back(evaluate(0));
+	for (int num = 1; num < num_channels + 2; ++num) {
+		snapshots.push_back(channels[num] ? futures[num].get() : evaluate(num));
+	}
+	return snapshots;
+}
+
+Theme::ChainSnapshot Theme::get_chain_snapshot(unsigned num, float t, unsigned width, unsigned height, const InputState &input_state)
+{
+	if (!channel_themes.empty()) {
+		return channel_themes[num]->get_chain_snapshot(num, t, width, height, input_state);
+	}
+
+	// Record during get_chain() too, in case the theme changes
+	// effect parameters there; the chain might be rendering right now.
+	shared_ptr<vector<function<void(const InputState &)>>> setup_ops(new vector<function<void(const InputState &)>>);
+	shared_ptr<ChainDependencies> dependencies(new ChainDependencies);
+	Chain chain;
+	for (unsigned attempt = 0; attempt < 2; ++attempt) {
+		assert(recorded_setup_ops == nullptr);
+		recorded_setup_ops = setup_ops.get();
+		recorded_dependencies = dependencies.get();
+		scene_needs_reevaluation = false;
+		// The setup function is run right away, so the chain does not need
+		// to own the frames; use a non-owning pointer instead of copying them.
+		chain = get_chain(num, t, width, height, InputFrameSet(InputFrameSet(), &input_state));
+		chain.setup_chain();
+		recorded_setup_ops = nullptr;
+		recorded_dependencies = nullptr;
+		if (!scene_needs_reevaluation) {
+			break;
+		}
+
+		// The scene's update function asked for a new chain; throw away
+		// what it recorded and try again (but only once, so that a theme
+		// that always returns false does not hang us).
+		setup_ops->clear();
+		*dependencies = ChainDependencies();
+	}
+
+	{
+		unique_lock<mutex> lock(m);
+		auto image_inputs_it = chain_image_inputs.find(chain.chain);
+		if (image_inputs_it != chain_image_inputs.end()) {
+			dependencies->image_inputs = image_inputs_it->second;
+		}
+		dependencies->direct_parameter_generation = direct_parameter_generation;
+
+		// The mixer connects FFmpeg inputs on its own every frame,
+		// but the chain depends on them all the same.
+		for (const pair<LiveInputWrapper *, FFmpegCapture *> &conn : signal_connections) {
+			if (conn.first->get_chain() == chain.chain) {
+				dependencies->signals.emplace_back(conn.second->get_card_index(), conn.first->get_history_length());
+			}
+		}
+	}
+
+	return ChainSnapshot{ chain.chain, setup_ops, dependencies };
+}
+
+Theme::Chain Theme::bind_snapshot(const ChainSnapshot &snapshot, const InputState &input_state) const
+{
+	Chain chain;
+	chain.chain = snapshot.chain;
+
+	for (const function<void()> &op : snapshot.dependencies->video_input_ops) {
+		op();
+	}
+
+	// Copy references to only the frames the chain uses. The setup
+	// operations never look at any other signals, or further back in
+	// the history than the LiveInputWrapper needs.
+	InputState *used_input_state = new InputState;
+	for (unsigned card_index = 0; card_index < MAX_VIDEO_CARDS; ++card_index) {
+		used_input_state->ycbcr_coefficients_auto[card_index] = input_state.ycbcr_coefficients_auto[card_index];
+		used_input_state->ycbcr_coefficients[card_index] = input_state.ycbcr_coefficients[card_index];
+		used_input_state->full_range[card_index] = input_state.full_range[card_index];
+	}
+	for (const pair<int, unsigned> &signal : snapshot.dependencies->signals) {
+		for (unsigned frame_num = 0; frame_num < signal.second; ++frame_num) {
+			used_input_state->buffered_frames[signal.first][frame_num] = input_state.buffered_frames[signal.first][frame_num];
 		}
 	}
+	InputFrameSet input_frames(used_input_state);
 
+	shared_ptr<const vector<function<void(const InputState &)>>> setup_ops = snapshot.setup_ops;
+	chain.setup_chain = [setup_ops, input_frames]{
+		for (const function<void(const InputState &)> &op : *setup_ops) {
+			op(*input_frames);
+		}
+	};
+	chain.input_frames = input_frames;
 	return chain;
 }
 
+string Theme::get_fingerprint(const ChainSnapshot &snapshot, const InputState &input_state) const
+{
+	const ChainDependencies &dependencies = *snapshot.dependencies;
+	string fingerprint;
+	append_raw(snapshot.chain, &fingerprint);
+	append_raw(dependencies.direct_parameter_generation, &fingerprint);
+	fingerprint += dependencies.parameters;
+	for (const pair<int, unsigned> &signal : dependencies.signals) {
+		int signal_num = signal.first;
+		append_raw(signal_num, &fingerprint);
+		for (unsigned frame_num = 0; frame_num < signal.second; ++frame_num) {
+			const BufferedFrame &frame = input_state.buffered_frames[signal_num][frame_num];
+			append_raw(frame.frame.get(), &fingerprint);
+			append_raw(frame.field_number, &fingerprint);
+		}
+		append_raw(input_state.ycbcr_coefficients_auto[signal_num], &fingerprint);
+		append_raw(input_state.ycbcr_coefficients[signal_num], &fingerprint);
+		append_raw(input_state.full_range[signal_num], &fingerprint);
+	}
+	if (!dependencies.image_inputs.empty()) {
+		append_raw(ImageInput::get_image_generation(), &fingerprint);
+	}
+	return fingerprint;
+}
+
 string Theme::get_channel_name(unsigned channel)
 {
 	unique_lock<mutex> lock(m);
 	lua_getglobal(L, "channel_name");
 	lua_pushnumber(L, channel);
-	if (lua_pcall(L, 1, 1, 0) != 0) {
+	if (pcall(ThemeProfiler::CHANNEL_NAME, 1, 1) != 0) {
 		fprintf(stderr, "error running function `channel_name': %s\n", lua_tostring(L, -1));
 		exit(1);
 	}
@@ -1078,7 +1703,7 @@ int Theme::get_channel_signal(unsigned channel)
 	unique_lock<mutex> lock(m);
 	lua_getglobal(L, "channel_signal");
 	lua_pushnumber(L, channel);
-	if (lua_pcall(L, 1, 1, 0) != 0) {
+	if (pcall(ThemeProfiler::CHANNEL_SIGNAL, 1, 1) != 0) {
 		fprintf(stderr, "error running function `channel_signal': %s\n", lua_tostring(L, -1));
 		exit(1);
 	}
@@ -1094,7 +1719,7 @@ std::string Theme::get_channel_color(unsigned channel)
 	unique_lock<mutex> lock(m);
 	lua_getglobal(L, "channel_color");
 	lua_pushnumber(L, channel);
-	if (lua_pcall(L, 1, 1, 0) != 0) {
+	if (pcall(ThemeProfiler::CHANNEL_COLOR, 1, 1) != 0) {
 		fprintf(stderr, "error running function `channel_color': %s\n", lua_tostring(L, -1));
 		exit(1);
 	}
@@ -1116,7 +1741,7 @@ bool Theme::get_supports_set_wb(unsigned channel)
 	unique_lock<mutex> lock(m);
 	lua_getglobal(L, "supports_set_wb");
 	lua_pushnumber(L, channel);
-	if (lua_pcall(L, 1, 1, 0) != 0) {
+	if (pcall(ThemeProfiler::SUPPORTS_SET_WB, 1, 1) != 0) {
 		fprintf(stderr, "error running function `supports_set_wb': %s\n", lua_tostring(L, -1));
 		exit(1);
 	}
@@ -1135,7 +1760,7 @@ void Theme::set_wb(unsigned channel, double r, double g, double b)
 	lua_pushnumber(L, r);
 	lua_pushnumber(L, g);
 	lua_pushnumber(L, b);
-	if (lua_pcall(L, 4, 0, 0) != 0) {
+	if (pcall(ThemeProfiler::SET_WB, 4, 0) != 0) {
 		fprintf(stderr, "error running function `set_wb': %s\n", lua_tostring(L, -1));
 		exit(1);
 	}
@@ -1148,7 +1773,7 @@ vector<string> Theme::get_transition_names(float t)
 	unique_lock<mutex> lock(m);
 	lua_getglobal(L, "get_transitions");
 	lua_pushnumber(L, t);
-	if (lua_pcall(L, 1, 1, 0) != 0) {
+	if (pcall(ThemeProfiler::GET_TRANSITIONS, 1, 1) != 0) {
 		fprintf(stderr, "error running function `get_transitions': %s\n", lua_tostring(L, -1));
 		exit(1);
 	}
@@ -1166,6 +1791,10 @@ vector<string> Theme::get_transition_names(float t)
 
 int Theme::map_signal(int signal_num)
 {
+	if (root != this) {
+		return root->map_signal(signal_num);
+	}
+
 	// Negative numbers map to raw signals.
 	if (signal_num < 0) {
 		return -1 - signal_num;
@@ -1201,9 +1830,53 @@ int Theme::map_signal(int signal_num)
 
 void Theme::set_signal_mapping(int signal_num, int card_num)
 {
-	unique_lock<mutex> lock(map_m);
-	assert(card_num < int(num_cards));
-	signal_to_card_mapping[signal_num] = card_num;
+	{
+		unique_lock<mutex> lock(map_m);
+		assert(card_num < int(num_cards));
+		signal_to_card_mapping[signal_num] = card_num;
+	}
+
+	// get_scene() might have looked at the old signal.
+	unique_lock<mutex> lock(m);
+	invalidate_scenes();
+}
+
+void Theme::set_shared_value(const string &key, const SharedValue &value)
+{
+	if (root != this) {
+		root->set_shared_value(key, value);
+		return;
+	}
+
+	unique_lock<mutex> lock(shared_m);
+	if (value.type == LUA_TNIL) {
+		shared_values.erase(key);
+	} else {
+		shared_values[key] = value;
+	}
+}
+
+Theme::SharedValue Theme::get_shared_value(const string &key)
+{
+	if (root != this) {
+		return root->get_shared_value(key);
+	}
+
+	unique_lock<mutex> lock(shared_m);
+	auto it = shared_values.find(key);
+	if (it == shared_values.end()) {
+		return SharedValue();
+	}
+	return it->second;
+}
+
+FFmpegCapture *Theme::reuse_video_input()
+{
+	assert(root != this);
+	if (num_video_inputs_reused >= root->video_inputs.size()) {
+		return nullptr;
+	}
+	return root->video_inputs[num_video_inputs_reused++];
 }
 
 void Theme::transition_clicked(int transition_num, float t)
@@ -1213,11 +1886,14 @@ void Theme::transition_clicked(int transition_num, float t)
 	lua_pushnumber(L, transition_num);
 	lua_pushnumber(L, t);
 
-	if (lua_pcall(L, 2, 0, 0) != 0) {
+	if (pcall(ThemeProfiler::TRANSITION_CLICKED, 2, 0) != 0) {
 		fprintf(stderr, "error running function `transition_clicked': %s\n", lua_tostring(L, -1));
 		exit(1);
 	}
 	assert(lua_gettop(L) == 0);
+
+	// The theme probably changed what some channels show.
+	invalidate_scenes();
 }
 
 void Theme::channel_clicked(int preview_num)
@@ -1226,9 +1902,11 @@ void Theme::channel_clicked(int preview_num)
 	lua_getglobal(L, "channel_clicked");
 	lua_pushnumber(L, preview_num);
 
-	if (lua_pcall(L, 1, 0, 0) != 0) {
+	if (pcall(ThemeProfiler::CHANNEL_CLICKED, 1, 0) != 0) {
 		fprintf(stderr, "error running function `channel_clicked': %s\n", lua_tostring(L, -1));
 		exit(1);
 	}
 	assert(lua_gettop(L) == 0);
+
+	invalidate_scenes();
 }
@@ -5,19 +5,27 @@
 #include <movit/flat_input.h>
 #include <movit/ycbcr_input.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <atomic>
 #include <functional>
 #include <map>
+#include <memory>
 #include <mutex>
 #include <string>
 #include <vector>
 
 #include "bmusb/bmusb.h"
+#include "input_state.h"
+#include "metrics.h"
 #include "ref_counted_frame.h"
+#include "theme_profiler.h"
 #include "tweaked_inputs.h"
 
 class FFmpegCapture;
+class ImageInput;
 class LiveInputWrapper;
-struct InputState;
+class LuaPoolAllocator;
+class LuaRefWithDeleter;
 
 namespace movit {
 class Effect;
@@ -34,12 +42,85 @@ public:
 		movit::EffectChain *chain;
 		std::function<void()> setup_chain;
 
-		// FRAME_HISTORY frames for each input, in order. Will contain duplicates
-		// for non-interlaced inputs.
-		std::vector<RefCountedFrame> input_frames;
+		// The input frames the chain was set up with, so that they
+		// are not released while it is still rendering.
+		InputFrameSet input_frames;
 	};
 
-	Chain get_chain(unsigned num, float t, unsigned width, unsigned height, InputState input_state);
+	// Calls get_chain() in the theme. If the theme has get_scene() instead,
+	// that is only called when the scene for <num> needs to be declared anew
+	// (see get_scene_chain()), and the returned chain sets up the scene
+	// by calling its update function.
+	Chain get_chain(unsigned num, float t, unsigned width, unsigned height, const InputFrameSet &input_frames);
+
+	// Everything recorded for a snapshot that can affect what the chain
+	// renders, except for the input frames themselves (those are only
+	// known when the snapshot is bound); see get_fingerprint().
+	struct ChainDependencies {
+		std::string parameters;  // Every effect parameter set, serialized, in order.
+		// Every signal connected (after mapping), in order, with how many
+		// frames of its history the chain uses. Includes FFmpeg inputs,
+		// which the mixer connects instead of the theme.
+		std::vector<std::pair<int, unsigned>> signals;
+		std::vector<ImageInput *> image_inputs;  // All ImageInputs in the chain.
+		uint64_t direct_parameter_generation;  // See <direct_parameter_generation> below.
+
+		// Calls on video inputs (rewind(), change_rate()) made while recording.
+		// They are run by bind_snapshot(), so that they happen on the frame
+		// the snapshot is for, and not when the theme thread evaluates it.
+		std::vector<std::function<void()>> video_input_ops;
+	};
+
+	// A chain where the effects of its setup function have been recorded
+	// instead of applied; see get_chain_snapshots().
+	struct ChainSnapshot {
+		movit::EffectChain *chain;
+		std::shared_ptr<const std::vector<std::function<void(const InputState &)>>> setup_ops;
+		std::shared_ptr<const ChainDependencies> dependencies;
+	};
+
+	// Like get_chain(), but records instead of applying, as described below.
+	ChainSnapshot get_chain_snapshot(unsigned num, float t, unsigned width, unsigned height, const InputState &input_state);
+
+	// Calls get_chain() for every channel (0 up to and including num_channels + 1),
+	// and runs the setup function for each of them, but anything that would
+	// change the state of an effect (setting parameters, connecting signals)
+	// is recorded instead of applied. This means it can run on a different
+	// thread while the chains are being rendered, and that the result can
+	// be applied with bind_snapshot() without calling into Lua at all.
+	// The live channel is evaluated at <width>x<height>, and all others
+	// at <preview_width>x<preview_height>. Channels where <channels> is
+	// false are not evaluated, and get a snapshot with a null chain.
+	std::vector<ChainSnapshot> get_chain_snapshots(float t, unsigned width, unsigned height, unsigned preview_width, unsigned preview_height, const InputState &input_state, const std::vector<bool> &channels);
+
+	// Makes a Chain whose setup_chain applies the recorded state, connecting
+	// signals to the frames in <input_state> (which does not need to be the same
+	// as the one given to get_chain_snapshots()). The chain only holds on to
+	// the frames it uses (see ChainDependencies::signals), so that inputs that
+	// are not shown do not keep frames busy in their allocators.
+	// Also runs ChainDependencies::video_input_ops.
+	Chain bind_snapshot(const ChainSnapshot &snapshot, const InputState &input_state) const;
+
+	// Returns a string that summarizes everything that the given snapshot,
+	// bound to <input_state>, would render from: the chain, every parameter
+	// the theme set, the frames of every connected signal, and the versions of
+	// any images. If two frames have the same fingerprint, they will look the same,
+	// so the previous one can be reused instead of rendering the chain again.
+	// The frames are only identified by their address, so the caller must hold
+	// on to the frames of the previous fingerprint while comparing against it.
+	std::string get_fingerprint(const ChainSnapshot &snapshot, const InputState &input_state) const;
+
+	// Values that the theme keeps with Nageru.set_shared() and reads back
+	// with Nageru.get_shared(). They are the same for all Lua states
+	// (see <channel_themes>), and are the only Lua state they share.
+	struct SharedValue {
+		int type = LUA_TNIL;  // LUA_TNIL, LUA_TBOOLEAN, LUA_TNUMBER, LUA_TSTRING, or LUA_TTABLE for an array of numbers.
+		bool boolean = false;
+		std::string str;
+		std::vector<double> numbers;  // One element for LUA_TNUMBER.
+	};
+	void set_shared_value(const std::string &key, const SharedValue &value);
+	SharedValue get_shared_value(const std::string &key);
 
 	int get_num_channels() const { return num_channels; }
 	int map_signal(int signal_num);
@@ -55,6 +136,15 @@ public:
 	void transition_clicked(int transition_num, float t);
 	void channel_clicked(int preview_num);
 
+	// The Lua garbage collector does not run by itself; this does as much
+	// collection as corresponds to the memory allocated since last time
+	// (the same pace that Lua would keep by itself), for all Lua states.
+	// Should be called once per frame, when the mixer would otherwise be idle.
+	void step_garbage_collector();
+
+	// See ThemeProfiler; only if --profile-theme is given.
+	std::string get_profile_hot_spots();
+
 	movit::ResourcePool *get_resource_pool() const { return resource_pool; }
 
 	// Should be called as part of VideoInput.new() only.
@@ -68,21 +158,72 @@ public:
 		return video_inputs;
 	}
 
+	// Should be called as part of VideoInput.new() only. For channel states,
+	// which use the video inputs of the main state instead of creating their
+	// own, returns the next one in order, or nullptr if the theme is trying
+	// to create more video inputs than the first time.
+	FFmpegCapture *reuse_video_input();
+	bool is_channel_state() const { return root != this; }
+
 	void register_signal_connection(LiveInputWrapper *live_input, FFmpegCapture *capture)
 	{
 		signal_connections.emplace_back(live_input, capture);
 	}
 
+	// Includes the connections of all channel states.
 	std::vector<std::pair<LiveInputWrapper *, FFmpegCapture *>> get_signal_connections() const
 	{
-		return signal_connections;
+		std::vector<std::pair<LiveInputWrapper *, FFmpegCapture *>> ret = signal_connections;
+		for (const std::unique_ptr<Theme> &channel_theme : channel_themes) {
+			ret.insert(ret.end(), channel_theme->signal_connections.begin(), channel_theme->signal_connections.end());
+		}
+		return ret;
+	}
+
+	// Should be called as part of EffectChain.add_effect() only.
+	void register_image_input(movit::EffectChain *chain, ImageInput *input)
+	{
+		chain_image_inputs[chain].push_back(input);
+	}
+
+	// Should be called (with <m> held) whenever an effect parameter is set
+	// directly, instead of being recorded into a snapshot.
+	void note_direct_parameter_change()
+	{
+		if (!evaluating_chain) {
+			++direct_parameter_generation;
+		}
 	}
 
 private:
+	// A channel state if <root_theme> is not nullptr; see <channel_themes>.
+	Theme(const std::string &filename, const std::vector<std::string> &search_dirs, movit::ResourcePool *resource_pool, unsigned num_cards, Theme *root_theme);
+
 	void register_constants();
 	void register_class(const char *class_name, const luaL_Reg *funcs);
 
+	// Like lua_pcall(L, nargs, nresults, 0), but timed if profiling.
+	int pcall(ThemeProfiler::EntryPoint entry_point, int nargs, int nresults);
+
+	// get_chain() for themes with get_scene(). The scene is declared anew
+	// if the theme asked for it (by returning false from the update function),
+	// if the resolution or any signal's format has changed, or after anything
+	// from the UI that might change what a channel shows; otherwise, the
+	// cached chain and update function are reused.
+	Chain get_scene_chain(unsigned num, float t, unsigned width, unsigned height, const InputFrameSet &input_frames);
+	void invalidate_scenes();  // Must be called with <m> held. Includes all channel states.
+
+	// What get_scene() last returned for a given channel.
+	struct Scene {
+		bool valid = false;
+		unsigned width = 0, height = 0;
+		std::string input_signature;  // What get_scene() could see of the signals.
+		movit::EffectChain *chain = nullptr;
+		std::shared_ptr<LuaRefWithDeleter> update_ref;
+	};
+
 	std::mutex m;
+	std::unique_ptr<LuaPoolAllocator> allocator;  // Protected by <m>. Must outlive <L>.
 	lua_State *L;  // Protected by <m>.
 	const InputState *input_state = nullptr;  // Protected by <m>. Only set temporarily, during chain setup.
 	movit::ResourcePool *resource_pool;
@@ -94,6 +235,41 @@ private:
 
 	std::vector<FFmpegCapture *> video_inputs;
 	std::vector<std::pair<LiveInputWrapper *, FFmpegCapture *>> signal_connections;
+	std::map<movit::EffectChain *, std::vector<ImageInput *>> chain_image_inputs;  // Protected by <m>.
+
+	bool has_scenes = false;
+	std::map<unsigned, Scene> scenes;  // Protected by <m>.
+	std::atomic<int64_t> metric_scene_evaluations{0};
+
+	// For the main state only; the channel states count here, too.
+	std::atomic<int64_t> metric_lua_heap_bytes{0};
+	Histogram metric_lua_gc_seconds;
+	std::unique_ptr<ThemeProfiler> profiler;  // Only with --profile-theme.
+
+	// Parameters set by get_chain() or chain setup functions are part of
+	// each chain's fingerprint, but the theme could also set parameters
+	// from anywhere else (e.g. transition_clicked()). We cannot know which
+	// chains that affects, so any such change invalidates all fingerprints.
+	bool evaluating_chain = false;  // Protected by <m>.
+	uint64_t direct_parameter_generation = 0;  // Protected by <m>.
+
+	// With --theme-state-per-channel, the theme is loaded once more for each
+	// channel (0 up to and including num_channels + 1), and that channel's
+	// chain is always evaluated in its own Lua state, so that the channels
+	// can be evaluated in parallel, and the UI (which uses this state) never
+	// has to wait for any of them. The channel states share the video inputs,
+	// the signal mapping and the shared values (see SharedValue) with this one,
+	// but nothing else. Empty otherwise, and in the channel states themselves.
+	std::vector<std::unique_ptr<Theme>> channel_themes;
+	Theme *root;  // The main state; <this> unless we are in <channel_themes>.
+
+	// One for each channel state except the live one (so index 0 is channel 1).
+	struct ChannelWorker;
+	std::vector<std::unique_ptr<ChannelWorker>> channel_workers;
+	unsigned num_video_inputs_reused = 0;  // For channel states only.
+
+	std::mutex shared_m;
+	std::map<std::string, SharedValue> shared_values;  // Protected by <shared_m>. For the main state only.
 
 	friend class LiveInputWrapper;
 };
@@ -110,6 +286,15 @@ public:
 
 	void connect_signal(int signal_num);  // Must be called with the theme's <m> lock held, since it accesses theme->input_state.
 	void connect_signal_raw(int signal_num, const InputState &input_state);
+	movit::EffectChain *get_chain() const { return chain; }
+
+	// How many frames of history connect_signal_raw() uses; more than one
+	// only if deinterlacing.
+	unsigned get_history_length() const
+	{
+		return (pixel_format == bmusb::PixelFormat_8BitBGRA) ? rgba_inputs.size() : ycbcr_inputs.size();
+	}
+
 	movit::Effect *get_effect() const
 	{
 		if (deinterlace) {
@@ -123,6 +308,7 @@ public:
 
 private:
 	Theme *theme;  // Not owned by us.
+	movit::EffectChain *chain;  // Not owned by us.
 	bmusb::PixelFormat pixel_format;
 	movit::YCbCrFormat input_ycbcr_format;
 	std::vector<movit::YCbCrInput *> ycbcr_inputs;  // Multiple ones if deinterlacing. Owned by the chain.
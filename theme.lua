@@ -32,11 +32,79 @@ local NO_TRANSITION = 0
 local ZOOM_TRANSITION = 1  -- Also for slides.
 local FADE_TRANSITION = 2
 
--- Last width/height/frame rate for each channel, if we have it.
--- Note that unlike the values we get from Nageru, the resolution is per
--- frame and not per field, since we deinterlace.
+-- The variables above are changed by the UI callbacks, but read when
+-- getting the chains. With --theme-state-per-channel, the chains are
+-- evaluated in different Lua states than the UI callbacks, so the UI
+-- callbacks save the variables with Nageru.set_shared() after changing them,
+-- and everything that reads them starts with load_state(). They are saved
+-- as one value, so that nobody can see a half-done change. get_chain()
+-- never saves them (even when it finishes a transition for itself), so that
+-- it cannot overwrite a change from the UI with an older state.
+function load_state()
+	if not Nageru.STATE_PER_CHANNEL then
+		return
+	end
+	local s = Nageru.get_shared("state")
+	if s == nil then
+		return
+	end
+	transition_start, transition_end, transition_type = s[1], s[2], s[3]
+	transition_src_signal, transition_dst_signal = s[4], s[5]
+	live_signal_num, preview_signal_num = s[6], s[7]
+	for i=1,3 do
+		neutral_colors[1][i] = s[7 + i]
+		neutral_colors[2][i] = s[10 + i]
+	end
+end
+
+function save_state()
+	if not Nageru.STATE_PER_CHANNEL then
+		return
+	end
+	Nageru.set_shared("state", {
+		transition_start, transition_end, transition_type,
+		transition_src_signal, transition_dst_signal,
+		live_signal_num, preview_signal_num,
+		neutral_colors[1][1], neutral_colors[1][2], neutral_colors[1][3],
+		neutral_colors[2][1], neutral_colors[2][2], neutral_colors[2][3] })
+end
+
+-- Last width/height/frame rate for each channel, if we have it, as stored
+-- by get_chain() (which runs in a different Lua state than channel_name()
+-- with --theme-state-per-channel). Note that unlike the values we get from
+-- Nageru, the resolution is per frame and not per field, since we deinterlace.
 local last_resolution = {}
 
+function save_last_resolution(signal_num, res)
+	if not Nageru.STATE_PER_CHANNEL then
+		last_resolution[signal_num] = res
+		return
+	end
+	Nageru.set_shared("last_resolution" .. signal_num, {
+		res.width, res.height, res.interlaced and 1 or 0,
+		res.is_connected and 1 or 0, res.has_signal and 1 or 0,
+		res.frame_rate_nom, res.frame_rate_den })
+end
+
+function load_last_resolution(signal_num)
+	if not Nageru.STATE_PER_CHANNEL then
+		return last_resolution[signal_num]
+	end
+	local r = Nageru.get_shared("last_resolution" .. signal_num)
+	if r == nil then
+		return nil
+	end
+	return {
+		width = r[1],
+		height = r[2],
+		interlaced = (r[3] ~= 0),
+		is_connected = (r[4] ~= 0),
+		has_signal = (r[5] ~= 0),
+		frame_rate_nom = r[6],
+		frame_rate_den = r[7]
+	}
+end
+
 -- Utility function to help creating many similar chains that can differ
 -- in a free set of chosen parameters.
 function make_cartesian_product(parms, callback)
@@ -268,7 +336,7 @@ end
 -- and get_channel_resolution_raw() is that this one also can say that
 -- there's no signal.
 function get_channel_resolution(signal_num)
-	res = last_resolution[signal_num]
+	local res = load_last_resolution(signal_num)
 	if (not res) or not res.is_connected then
 		return "disconnected"
 	end
@@ -344,6 +412,7 @@ end
 -- "transparent" is allowed.
 -- Will never be called for live (0) or preview (1).
 function channel_color(channel)
+	load_state()
 	if transition_type ~= NO_TRANSITION then
 		if channel_involved_in(channel, transition_src_signal) or
 		   channel_involved_in(channel, transition_dst_signal) then
@@ -385,15 +454,21 @@ end
 -- The color is in linear light (not sRGB gamma).
 function set_wb(channel, red, green, blue)
 	if is_plain_signal(channel - 2) then
+		load_state()
 		neutral_colors[channel - 2 + 1] = { red, green, blue }
+		save_state()
 	end
 end
 
+-- Returns true if a transition was finished, in which case the caller
+-- should save_state() if it is a UI callback.
 function finish_transitions(t)
 	if transition_type ~= NO_TRANSITION and t >= transition_end then
 		live_signal_num = transition_dst_signal
 		transition_type = NO_TRANSITION
+		return true
 	end
+	return false
 end
 
 function in_transition(t)
@@ -403,13 +478,16 @@ end
 -- API ENTRY POINT
 -- Called every frame.
 function get_transitions(t)
+	load_state()
 	if in_transition(t) then
 		-- Transition already in progress, the only thing we can do is really
 		-- cut to the preview. (TODO: Make an “abort” and/or “finish”, too?)
 		return {"Cut"}
 	end
 
-	finish_transitions(t)
+	if finish_transitions(t) then
+		save_state()
+	end
 
 	if live_signal_num == preview_signal_num then
 		-- No transitions possible.
@@ -449,6 +527,12 @@ end
 -- API ENTRY POINT
 -- Called when the user clicks a transition button.
 function transition_clicked(num, t)
+	load_state()
+	do_transition_clicked(num, t)
+	save_state()
+end
+
+function do_transition_clicked(num, t)
 	if num == 0 then
 		-- Cut.
 		if in_transition(t) then
@@ -495,7 +579,9 @@ end
 
 -- API ENTRY POINT
 function channel_clicked(num)
+	load_state()
 	preview_signal_num = num
+	save_state()
 end
 
 function get_fade_chain(signals, t, width, height, input_resolution)
@@ -537,6 +623,8 @@ end
 -- current time in seconds. width and height are the dimensions of
 -- the output, although you can ignore them if you don't need them
 -- (they're useful if you want to e.g. know what to resample by).
+-- For all channels except live, they can be smaller than the live
+-- output (see --preview-resolution), so do not assume they are the same.
 --
 -- <signals> is basically an exposed InputState, which you can use to
 -- query for information about the signals at the point of the current
@@ -554,7 +642,13 @@ end
 --
 -- NOTE: The chain returned must be finalized with the Y'CbCr flag
 -- if and only if num==0.
+--
+-- Instead of get_chain(), a theme can define get_scene(num, width, height,
+-- signals), which returns the chain and a function taking <t> that is run
+-- every frame instead of the function above. get_scene() is then only called
+-- again when something structural might have changed (see simple.lua).
 function get_chain(num, t, width, height, signals)
+	load_state()
 	local input_resolution = {}
 	for signal_num=0,1 do
 		local res = {
@@ -580,7 +674,11 @@ function get_chain(num, t, width, height, signals)
 
 		input_resolution[signal_num] = res
 	end
-	last_resolution = input_resolution
+	if num == 0 then
+		for signal_num=0,1 do
+			save_last_resolution(signal_num, input_resolution[signal_num])
+		end
+	end
 
 	if num == 0 then  -- Live.
 		finish_transitions(t)
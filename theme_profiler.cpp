@@ -0,0 +1,144 @@
+#include "theme_profiler.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+using namespace std;
+using namespace std::chrono;
+
+namespace {
+
+const char *entry_point_names[ThemeProfiler::NUM_ENTRY_POINTS] = {
+	"get_chain",
+	"get_scene",
+	"chain_setup",
+	"channel_name",
+	"channel_signal",
+	"channel_color",
+	"supports_set_wb",
+	"set_wb",
+	"get_transitions",
+	"transition_clicked",
+	"channel_clicked",
+};
+
+// The hook has no user data of its own, and there is only ever one profiler.
+ThemeProfiler *hook_profiler = nullptr;
+
+// The time of the last sample (or the start of the call into Lua)
+// on this thread; everything since then belongs to the next sample.
+thread_local steady_clock::time_point last_sample_time;
+
+// The line of the last sample in the current call on this thread,
+// or empty if there has been none yet.
+thread_local string last_sample_key;
+
+string line_key(const lua_Debug &ar, int line)
+{
+	string key = ar.short_src;
+	key += ':';
+	key += to_string(line);
+	return key;
+}
+
+}  // namespace
+
+ThemeProfiler::ThemeProfiler()
+{
+	for (unsigned i = 0; i < NUM_ENTRY_POINTS; ++i) {
+		metric_call_seconds[i].init_geometric(1e-5, 1.0, 25);
+		global_metrics.add("theme_call_seconds", {{ "function", entry_point_names[i] }}, &metric_call_seconds[i], Metrics::PRINT_WHEN_NONEMPTY);
+	}
+}
+
+void ThemeProfiler::install_hook(lua_State *L)
+{
+	assert(hook_profiler == nullptr || hook_profiler == this);
+	hook_profiler = this;
+	last_sample_time = steady_clock::now();
+	lua_sethook(L, &ThemeProfiler::hook, LUA_MASKCOUNT, instructions_per_sample);
+}
+
+int ThemeProfiler::pcall(EntryPoint entry_point, lua_State *L, int nargs, int nresults)
+{
+	// Find where the function starts, in case the call is too short
+	// to get any samples.
+	string function_key;
+	lua_Debug ar;
+	lua_pushvalue(L, -(nargs + 1));
+	if (lua_getinfo(L, ">S", &ar)) {  // Pops the function.
+		function_key = line_key(ar, ar.linedefined);
+	}
+
+	steady_clock::time_point start = steady_clock::now();
+	last_sample_time = start;
+	last_sample_key.clear();
+	int ret = lua_pcall(L, nargs, nresults, 0);
+	steady_clock::time_point now = steady_clock::now();
+
+	// Flush the time since the last sample, which would otherwise be lost.
+	double remainder = duration<double>(now - last_sample_time).count();
+	if (!last_sample_key.empty()) {
+		add_to_line(last_sample_key, remainder, /*samples=*/0);
+	} else if (!function_key.empty()) {
+		add_to_line(function_key, remainder, /*samples=*/0);
+	}
+
+	lock_guard<mutex> lock(mu);
+	metric_call_seconds[entry_point].count_event(duration<double>(now - start).count());
+	return ret;
+}
+
+string ThemeProfiler::get_hot_spots(size_t max_lines)
+{
+	vector<pair<string, LineStats>> sorted;
+	{
+		lock_guard<mutex> lock(mu);
+		sorted.assign(lines.begin(), lines.end());
+	}
+	sort(sorted.begin(), sorted.end(), [](const pair<string, LineStats> &a, const pair<string, LineStats> &b) {
+		return a.second.seconds > b.second.seconds;
+	});
+	if (sorted.size() > max_lines) {
+		sorted.resize(max_lines);
+	}
+
+	string ret = "# seconds  samples  line\n";
+	for (const pair<string, LineStats> &line : sorted) {
+		char buf[64];
+		snprintf(buf, sizeof(buf), "%9.3f %8lld  ", line.second.seconds, (long long)line.second.samples);
+		ret += buf;
+		ret += line.first;
+		ret += '\n';
+	}
+	return ret;
+}
+
+void ThemeProfiler::hook(lua_State *L, lua_Debug *ar)
+{
+	hook_profiler->sample(L, ar);
+}
+
+void ThemeProfiler::sample(lua_State *L, lua_Debug *ar)
+{
+	steady_clock::time_point now = steady_clock::now();
+	double seconds = duration<double>(now - last_sample_time).count();
+	last_sample_time = now;
+
+	if (!lua_getinfo(L, "Sl", ar)) {
+		return;
+	}
+	last_sample_key = line_key(*ar, ar->currentline);
+	add_to_line(last_sample_key, seconds, /*samples=*/1);
+}
+
+void ThemeProfiler::add_to_line(const string &key, double seconds, int64_t samples)
+{
+	lock_guard<mutex> lock(mu);
+	LineStats &stats = lines[key];
+	stats.seconds += seconds;
+	stats.samples += samples;
+}
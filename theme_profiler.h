@@ -0,0 +1,85 @@
+#ifndef _THEME_PROFILER_H
+#define _THEME_PROFILER_H 1
+
+// An opt-in (--profile-theme) profiler for the theme. It measures two things:
+//
+//  - How long each call from Nageru into the theme takes, as one histogram
+//    per entry point (get_chain(), the chain setup functions, channel_name(),
+//    etc.), exported as theme_call_seconds{function="…"} in /metrics.
+//  - Where inside the theme the time goes. A Lua count hook runs every
+//    <instructions_per_sample> VM instructions, and attributes the time since
+//    the previous sample (or since the start of the call) to the source line
+//    that is running. Whatever is left when the call returns goes to the line
+//    of the last sample, or, if the call was too short to be sampled at all,
+//    to the first line of the function that was called. The lines that
+//    took the most time are served as text on /theme_profile.
+//
+// The line profile is biased: Time goes to whatever line happens to be running
+// when the hook fires, so time spent in C functions (such as setting effect
+// parameters) and in lines with few VM instructions tends to show up on the
+// lines that run after them. The histograms above are exact, so use them
+// for the total time of a call.
+//
+// Can be used from any thread, and from several Lua states at the same time.
+
+#include <lua.hpp>
+#include <stddef.h>
+#include <stdint.h>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <string>
+
+#include "metrics.h"
+
+class ThemeProfiler {
+public:
+	enum EntryPoint {
+		GET_CHAIN,
+		GET_SCENE,
+		CHAIN_SETUP,  // The function returned by get_chain(), or the update function from get_scene().
+		CHANNEL_NAME,
+		CHANNEL_SIGNAL,
+		CHANNEL_COLOR,
+		SUPPORTS_SET_WB,
+		SET_WB,
+		GET_TRANSITIONS,
+		TRANSITION_CLICKED,
+		CHANNEL_CLICKED,
+		NUM_ENTRY_POINTS
+	};
+
+	ThemeProfiler();
+
+	// Starts sampling <L>. Must be called before the theme is loaded,
+	// so that the time spent loading it is counted, too.
+	void install_hook(lua_State *L);
+
+	// Calls lua_pcall(L, nargs, nresults, 0), and measures how long it takes.
+	int pcall(EntryPoint entry_point, lua_State *L, int nargs, int nresults);
+
+	// The <max_lines> lines where the most time has been spent since startup,
+	// one per line, most first.
+	std::string get_hot_spots(size_t max_lines = 100);
+
+private:
+	static constexpr int instructions_per_sample = 1000;
+
+	static void hook(lua_State *L, lua_Debug *ar);
+	void sample(lua_State *L, lua_Debug *ar);
+	void add_to_line(const std::string &key, double seconds, int64_t samples);
+
+	std::mutex mu;
+
+	// Under <mu>, since Histogram assumes a single writer, and the channel
+	// states (see --theme-state-per-channel) call into the theme in parallel.
+	Histogram metric_call_seconds[NUM_ENTRY_POINTS];
+
+	struct LineStats {
+		double seconds = 0.0;
+		int64_t samples = 0;
+	};
+	std::map<std::string, LineStats> lines;  // Keyed by “source:line”. Under <mu>.
+};
+
+#endif  // !defined(_THEME_PROFILER_H)
@@ -0,0 +1,261 @@
+#include "tracing.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+using namespace std::chrono;
+
+atomic<bool> tracing_enabled{false};
+
+namespace {
+
+// About ten seconds' worth for the busiest threads (which have a handful
+// of events per frame), at 24 bytes of payload per event.
+constexpr size_t events_per_thread = 16384;
+
+struct TraceEvent {
+	// A sequence lock per slot, so that serialize_trace() can read the buffer
+	// while its thread is writing to it. Odd means the slot is being written.
+	// All the fields are atomic just to avoid formal data races; the accesses
+	// are all relaxed, and compile to plain loads and stores.
+	atomic<uint32_t> seq{0};
+	atomic<const char *> name{nullptr};
+	atomic<int64_t> start_ns{0};
+	atomic<int64_t> duration_ns{0};
+	atomic<int64_t> pts{-1};
+	atomic<int> card_index{-1};
+};
+
+struct TraceBuffer {
+	// These are under <buffers_mutex>.
+	bool in_use = false;
+	pid_t tid;
+	string thread_name;
+
+	// Only touched by the owning thread.
+	size_t next_slot = 0;
+
+	unique_ptr<TraceEvent[]> events{new TraceEvent[events_per_thread]};
+};
+
+// Buffers are never freed, but they are reused when threads exit,
+// so that the HTTP server's connection threads do not make us grow forever.
+mutex buffers_mutex;
+vector<TraceBuffer *> buffers;  // Under <buffers_mutex>.
+
+const steady_clock::time_point trace_epoch = steady_clock::now();
+
+struct ThreadTraceBuffer {
+	~ThreadTraceBuffer()
+	{
+		if (buf != nullptr) {
+			lock_guard<mutex> lock(buffers_mutex);
+			buf->in_use = false;
+		}
+	}
+
+	TraceBuffer *buf = nullptr;
+};
+thread_local ThreadTraceBuffer thread_trace_buffer;
+
+TraceBuffer *get_trace_buffer()
+{
+	if (thread_trace_buffer.buf != nullptr) {
+		return thread_trace_buffer.buf;
+	}
+
+	char thread_name[16];
+	if (pthread_getname_np(pthread_self(), thread_name, sizeof(thread_name)) != 0) {
+		strcpy(thread_name, "unknown");
+	}
+
+	lock_guard<mutex> lock(buffers_mutex);
+	TraceBuffer *buf = nullptr;
+	for (TraceBuffer *candidate : buffers) {
+		if (!candidate->in_use) {
+			buf = candidate;
+			break;
+		}
+	}
+	if (buf == nullptr) {
+		buf = new TraceBuffer;
+		buffers.push_back(buf);
+	} else {
+		// Throw away the previous thread's events, so that they don't
+		// get attributed to us. (serialize_trace() holds the lock,
+		// so nobody can be reading them.)
+		for (size_t i = 0; i < events_per_thread; ++i) {
+			buf->events[i].seq = 0;
+		}
+		buf->next_slot = 0;
+	}
+	buf->in_use = true;
+	buf->tid = syscall(SYS_gettid);
+	buf->thread_name = thread_name;
+	thread_trace_buffer.buf = buf;
+	return buf;
+}
+
+void append_json_string(const string &str, string *out)
+{
+	out->push_back('"');
+	for (char ch : str) {
+		if (ch == '"' || ch == '\\') {
+			out->push_back('\\');
+			out->push_back(ch);
+		} else if ((unsigned char)ch < 0x20) {
+			out->push_back('?');
+		} else {
+			out->push_back(ch);
+		}
+	}
+	out->push_back('"');
+}
+
+int dump_eventfd = -1;
+
+void dump_signal_handler(int signum)
+{
+	// Only async-signal-safe functions here; the actual work is done
+	// by dump_thread_func().
+	uint64_t one = 1;
+	int old_errno = errno;
+	if (write(dump_eventfd, &one, sizeof(one)) != sizeof(one)) {
+		// Nothing sensible to do.
+	}
+	errno = old_errno;
+}
+
+void dump_thread_func()
+{
+	pthread_setname_np(pthread_self(), "TraceDump");
+	for ( ;; ) {
+		uint64_t count;
+		ssize_t ret = read(dump_eventfd, &count, sizeof(count));
+		if (ret == -1 && errno == EINTR) {
+			continue;
+		}
+		if (ret != sizeof(count)) {
+			perror("read(eventfd)");
+			return;
+		}
+
+		char filename[256];
+		time_t now = time(nullptr);
+		strftime(filename, sizeof(filename), "trace-%Y%m%d-%H%M%S.json", localtime(&now));
+
+		string contents = serialize_trace();
+		FILE *fp = fopen(filename, "w");
+		if (fp == nullptr) {
+			perror(filename);
+			continue;
+		}
+		if (fwrite(contents.data(), contents.size(), 1, fp) != 1 || fclose(fp) != 0) {
+			perror(filename);
+			continue;
+		}
+		fprintf(stderr, "Wrote trace to %s.\n", filename);
+	}
+}
+
+}  // namespace
+
+void enable_tracing(int dump_signal)
+{
+	tracing_enabled = true;
+
+	if (dump_signal != 0) {
+		dump_eventfd = eventfd(0, EFD_CLOEXEC);
+		if (dump_eventfd == -1) {
+			perror("eventfd");
+			return;
+		}
+		thread(dump_thread_func).detach();
+
+		struct sigaction act;
+		memset(&act, 0, sizeof(act));
+		act.sa_handler = dump_signal_handler;
+		act.sa_flags = SA_RESTART;
+		sigemptyset(&act.sa_mask);
+		sigaction(dump_signal, &act, nullptr);
+	}
+}
+
+void add_trace_event(const char *name, steady_clock::time_point start, steady_clock::time_point end, int64_t pts, int card_index)
+{
+	TraceBuffer *buf = get_trace_buffer();
+	TraceEvent *event = &buf->events[buf->next_slot];
+	buf->next_slot = (buf->next_slot + 1) % events_per_thread;
+
+	uint32_t seq = event->seq.load(memory_order_relaxed);
+	event->seq.store(seq + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	event->name.store(name, memory_order_relaxed);
+	event->start_ns.store(duration_cast<nanoseconds>(start - trace_epoch).count(), memory_order_relaxed);
+	event->duration_ns.store(duration_cast<nanoseconds>(end - start).count(), memory_order_relaxed);
+	event->pts.store(pts, memory_order_relaxed);
+	event->card_index.store(card_index, memory_order_relaxed);
+	event->seq.store(seq + 2, memory_order_release);
+}
+
+string serialize_trace()
+{
+	string out = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+	bool first = true;
+	char tmp[256];
+
+	lock_guard<mutex> lock(buffers_mutex);
+	for (const TraceBuffer *buf : buffers) {
+		if (!first) out += ",\n";
+		first = false;
+		snprintf(tmp, sizeof(tmp), "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":", int(buf->tid));
+		out += tmp;
+		append_json_string(buf->thread_name, &out);
+		out += "}}";
+
+		for (size_t i = 0; i < events_per_thread; ++i) {
+			const TraceEvent &event = buf->events[i];
+			uint32_t seq = event.seq.load(memory_order_acquire);
+			if (seq == 0 || (seq & 1)) {
+				continue;  // Never written, or being written right now.
+			}
+			const char *name = event.name.load(memory_order_relaxed);
+			int64_t start_ns = event.start_ns.load(memory_order_relaxed);
+			int64_t duration_ns = event.duration_ns.load(memory_order_relaxed);
+			int64_t pts = event.pts.load(memory_order_relaxed);
+			int card_index = event.card_index.load(memory_order_relaxed);
+			atomic_thread_fence(memory_order_acquire);
+			if (event.seq.load(memory_order_relaxed) != seq) {
+				continue;  // Overwritten while we were reading.
+			}
+
+			snprintf(tmp, sizeof(tmp), ",\n{\"ph\":\"X\",\"name\":\"%s\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":{",
+				name, int(buf->tid), start_ns * 1e-3, duration_ns * 1e-3);
+			out += tmp;
+			if (pts != -1) {
+				snprintf(tmp, sizeof(tmp), "\"pts\":%lld%s", (long long)pts, card_index != -1 ? "," : "");
+				out += tmp;
+			}
+			if (card_index != -1) {
+				snprintf(tmp, sizeof(tmp), "\"card\":%d", card_index);
+				out += tmp;
+			}
+			out += "}}";
+		}
+	}
+	out += "\n]}\n";
+	return out;
+}
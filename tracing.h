@@ -0,0 +1,71 @@
+#ifndef _TRACING_H
+#define _TRACING_H 1
+
+// Low-overhead tracing of where the time goes for each frame, for when
+// print_latency and the latency histograms say that something is slow,
+// but not what.
+//
+// Each thread records events into its own ring buffer (so there is no
+// locking or sharing of cache lines on the hot path), and the last few
+// seconds' worth of events from all threads can be dumped on demand
+// in the Chrome trace event format, which can be loaded directly into
+// chrome://tracing or https://ui.perfetto.dev/. Events are tagged with the
+// pts of the frame they belong to (in TIMEBASE units), where known,
+// so that you can follow a single frame through the pipeline.
+//
+// When tracing is not enabled (the default), a TraceScope costs
+// one relaxed atomic load.
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <string>
+
+extern std::atomic<bool> tracing_enabled;
+
+// Starts recording events. If <dump_signal> is nonzero, a handler is
+// installed for that signal that writes the current trace to a file
+// in the current directory.
+void enable_tracing(int dump_signal);
+
+// Returns all events currently in the ring buffers, as Chrome trace JSON.
+// Can be called from any thread.
+std::string serialize_trace();
+
+// Used by TraceScope; you probably don't want to call this directly.
+// <name> must be a string literal (or otherwise live forever).
+void add_trace_event(const char *name, std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end, int64_t pts, int card_index);
+
+// Records the time from construction to destruction as one event.
+// Set <pts> and/or <card_index> to -1 if they are not known or not relevant.
+class TraceScope {
+public:
+	explicit TraceScope(const char *name, int64_t pts = -1, int card_index = -1)
+		: name(tracing_enabled.load(std::memory_order_relaxed) ? name : nullptr), pts(pts), card_index(card_index)
+	{
+		if (this->name != nullptr) {
+			start = std::chrono::steady_clock::now();
+		}
+	}
+
+	~TraceScope()
+	{
+		if (name != nullptr) {
+			add_trace_event(name, start, std::chrono::steady_clock::now(), pts, card_index);
+		}
+	}
+
+	// For when the pts is not known until partway through the scope.
+	void set_pts(int64_t pts) { this->pts = pts; }
+
+private:
+	TraceScope(const TraceScope &) = delete;
+	TraceScope &operator=(const TraceScope &) = delete;
+
+	const char *name;
+	int64_t pts;
+	int card_index;
+	std::chrono::steady_clock::time_point start;
+};
+
+#endif  // !defined(_TRACING_H)
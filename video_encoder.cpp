@@ -21,8 +21,6 @@ extern "C" {
 #include "timebase.h"
 #include "x264_encoder.h"
 
-class RefCountedFrame;
-
 using namespace std;
 using namespace movit;
 
@@ -46,6 +44,20 @@ string generate_local_dump_filename(int frame)
 	return filename;
 }
 
+// If the mux doesn't give us sync points, we need to guess where the
+// stream can start; updates <seen_sync_markers> and returns the type to use.
+AVIODataMarkerType fixup_marker_type(AVIODataMarkerType type, bool *seen_sync_markers)
+{
+	if (type == AVIO_DATA_MARKER_SYNC_POINT || type == AVIO_DATA_MARKER_BOUNDARY_POINT) {
+		*seen_sync_markers = true;
+	} else if (type == AVIO_DATA_MARKER_UNKNOWN && !*seen_sync_markers) {
+		// We don't know if this is a keyframe or not (the muxer could
+		// avoid marking it), so we just have to make the best of it.
+		type = AVIO_DATA_MARKER_SYNC_POINT;
+	}
+	return type;
+}
+
 }  // namespace
 
 VideoEncoder::VideoEncoder(ResourcePool *resource_pool, QSurface *surface, const std::string &va_display, int width, int height, HTTPD *httpd, DiskSpaceEstimator *disk_space_estimator)
@@ -61,6 +73,14 @@ VideoEncoder::VideoEncoder(ResourcePool *resource_pool, QSurface *surface, const
 	if (global_flags.x264_video_to_http || global_flags.x264_video_to_disk) {
 		x264_encoder.reset(new X264Encoder(oformat));
 	}
+	for (const X264LadderRung &rung : global_flags.x264_ladder) {
+		LadderRung *ladder_rung = new LadderRung;
+		ladder_rung->parent = this;
+		ladder_rung->config = &rung;
+		ladder_rung->x264_encoder.reset(new X264Encoder(oformat, &rung));
+		ladder.emplace_back(ladder_rung);
+		x264_encoder->add_downscaled_encoder(ladder_rung->x264_encoder.get());
+	}
 
 	string filename = generate_local_dump_filename(/*frame=*/0);
 	quicksync_encoder.reset(new QuickSyncEncoder(filename, resource_pool, surface, va_display, width, height, oformat, x264_encoder.get(), disk_space_estimator));
@@ -71,12 +91,18 @@ VideoEncoder::VideoEncoder(ResourcePool *resource_pool, QSurface *surface, const
 	if (global_flags.x264_video_to_http) {
 		x264_encoder->add_mux(stream_mux.get());
 	}
+	for (const unique_ptr<LadderRung> &rung : ladder) {
+		open_ladder_stream(rung.get());
+		stream_audio_encoder->add_mux(rung->mux.get());
+		rung->x264_encoder->add_mux(rung->mux.get());
+	}
 }
 
 VideoEncoder::~VideoEncoder()
 {
 	quicksync_encoder->shutdown();
 	x264_encoder.reset(nullptr);
+	ladder.clear();  // After the main encoder, which feeds it.
 	quicksync_encoder->close_file();
 	quicksync_encoder.reset(nullptr);
 	while (quicksync_encoders_in_shutdown.load() > 0) {
@@ -120,6 +146,9 @@ void VideoEncoder::do_cut(int frame)
 		if (global_flags.x264_video_to_http) {
 			x264_encoder->add_mux(stream_mux.get());
 		}
+		for (const unique_ptr<LadderRung> &rung : ladder) {
+			x264_encoder->add_downscaled_encoder(rung->x264_encoder.get());
+		}
 		if (overriding_bitrate != 0) {
 			x264_encoder->change_bitrate(overriding_bitrate);
 		}
@@ -156,7 +185,7 @@ bool VideoEncoder::is_zerocopy() const
 	return quicksync_encoder->is_zerocopy();
 }
 
-bool VideoEncoder::begin_frame(int64_t pts, int64_t duration, movit::YCbCrLumaCoefficients ycbcr_coefficients, const std::vector<RefCountedFrame> &input_frames, GLuint *y_tex, GLuint *cbcr_tex)
+bool VideoEncoder::begin_frame(int64_t pts, int64_t duration, movit::YCbCrLumaCoefficients ycbcr_coefficients, const InputFrameSet &input_frames, GLuint *y_tex, GLuint *cbcr_tex)
 {
 	lock_guard<mutex> lock(qs_mu);
 	qs_needing_cleanup.clear();  // Since we have an OpenGL context here, and are called regularly.
@@ -170,13 +199,34 @@ RefCountedGLsync VideoEncoder::end_frame()
 }
 
 void VideoEncoder::open_output_stream()
+{
+	string video_extradata;
+	if (global_flags.x264_video_to_http || global_flags.x264_video_to_disk) {
+		video_extradata = x264_encoder->get_global_headers();
+	}
+
+	stream_mux = open_mux(this, &VideoEncoder::write_packet2_thunk, width, height, video_extradata, &stream_mux_metrics);
+	stream_mux_metrics.init({{ "destination", "http" }});
+}
+
+void VideoEncoder::open_ladder_stream(LadderRung *rung)
+{
+	const string &rendition = rung->x264_encoder->get_rendition_name();
+	httpd->add_rendition(rendition);
+
+	rung->mux = open_mux(rung, &VideoEncoder::write_ladder_packet2_thunk, rung->config->width, rung->config->height,
+		rung->x264_encoder->get_global_headers(), &rung->mux_metrics);
+	rung->mux_metrics.init({{ "destination", "http" }, { "rendition", rendition }});
+}
+
+unique_ptr<Mux> VideoEncoder::open_mux(void *opaque, int (*write_packet)(void *, uint8_t *, int, AVIODataMarkerType, int64_t), int width, int height, const string &video_extradata, MuxMetrics *metrics)
 {
 	AVFormatContext *avctx = avformat_alloc_context();
 	avctx->oformat = oformat;
 
 	uint8_t *buf = (uint8_t *)av_malloc(MUX_BUFFER_SIZE);
-	avctx->pb = avio_alloc_context(buf, MUX_BUFFER_SIZE, 1, this, nullptr, nullptr, nullptr);
-	avctx->pb->write_data_type = &VideoEncoder::write_packet2_thunk;
+	avctx->pb = avio_alloc_context(buf, MUX_BUFFER_SIZE, 1, opaque, nullptr, nullptr, nullptr);
+	avctx->pb->write_data_type = write_packet;
 	avctx->pb->ignore_boundary_point = 1;
 
 	Mux::Codec video_codec;
@@ -188,15 +238,9 @@ void VideoEncoder::open_output_stream()
 
 	avctx->flags = AVFMT_FLAG_CUSTOM_IO;
 
-	string video_extradata;
-	if (global_flags.x264_video_to_http || global_flags.x264_video_to_disk) {
-		video_extradata = x264_encoder->get_global_headers();
-	}
-
 	int time_base = global_flags.stream_coarse_timebase ? COARSE_TIMEBASE : TIMEBASE;
-	stream_mux.reset(new Mux(avctx, width, height, video_codec, video_extradata, stream_audio_encoder->get_codec_parameters().get(), time_base,
-		/*write_callback=*/nullptr, Mux::WRITE_FOREGROUND, { &stream_mux_metrics }));
-	stream_mux_metrics.init({{ "destination", "http" }});
+	return unique_ptr<Mux>(new Mux(avctx, width, height, video_codec, video_extradata, stream_audio_encoder->get_codec_parameters().get(), time_base,
+		/*write_callback=*/nullptr, Mux::WRITE_FOREGROUND, { metrics }));
 }
 
 int VideoEncoder::write_packet2_thunk(void *opaque, uint8_t *buf, int buf_size, AVIODataMarkerType type, int64_t time)
@@ -207,14 +251,7 @@ int VideoEncoder::write_packet2_thunk(void *opaque, uint8_t *buf, int buf_size,
 
 int VideoEncoder::write_packet2(uint8_t *buf, int buf_size, AVIODataMarkerType type, int64_t time)
 {
-	if (type == AVIO_DATA_MARKER_SYNC_POINT || type == AVIO_DATA_MARKER_BOUNDARY_POINT) {
-		seen_sync_markers = true;
-	} else if (type == AVIO_DATA_MARKER_UNKNOWN && !seen_sync_markers) {
-		// We don't know if this is a keyframe or not (the muxer could
-		// avoid marking it), so we just have to make the best of it.
-		type = AVIO_DATA_MARKER_SYNC_POINT;
-	}
-
+	type = fixup_marker_type(type, &seen_sync_markers);
 	if (type == AVIO_DATA_MARKER_HEADER) {
 		stream_mux_header.append((char *)buf, buf_size);
 		httpd->set_header(stream_mux_header);
@@ -224,3 +261,18 @@ int VideoEncoder::write_packet2(uint8_t *buf, int buf_size, AVIODataMarkerType t
 	return buf_size;
 }
 
+int VideoEncoder::write_ladder_packet2_thunk(void *opaque, uint8_t *buf, int buf_size, AVIODataMarkerType type, int64_t time)
+{
+	LadderRung *rung = (LadderRung *)opaque;
+	HTTPD *httpd = rung->parent->httpd;
+	const string &rendition = rung->x264_encoder->get_rendition_name();
+
+	type = fixup_marker_type(type, &rung->seen_sync_markers);
+	if (type == AVIO_DATA_MARKER_HEADER) {
+		rung->mux_header.append((char *)buf, buf_size);
+		httpd->set_header(rendition, rung->mux_header);
+	} else {
+		httpd->add_data(rendition, (char *)buf, buf_size, type == AVIO_DATA_MARKER_SYNC_POINT);
+	}
+	return buf_size;
+}
@@ -20,6 +20,7 @@ extern "C" {
 #include <libavformat/avio.h>
 }
 
+#include "input_state.h"
 #include "mux.h"
 #include "ref_counted_gl_sync.h"
 
@@ -29,8 +30,8 @@ class HTTPD;
 class Mux;
 class QSurface;
 class QuickSyncEncoder;
-class RefCountedFrame;
 class X264Encoder;
+struct X264LadderRung;
 
 namespace movit {
 class ResourcePool;
@@ -59,7 +60,7 @@ public:
 	//     In this case, after end_frame(), you are no longer allowed
 	//     to use the textures; they are torn down and given to the
 	//     H.264 encoder.
-	bool begin_frame(int64_t pts, int64_t duration, movit::YCbCrLumaCoefficients ycbcr_coefficients, const std::vector<RefCountedFrame> &input_frames, GLuint *y_tex, GLuint *cbcr_tex);
+	bool begin_frame(int64_t pts, int64_t duration, movit::YCbCrLumaCoefficients ycbcr_coefficients, const InputFrameSet &input_frames, GLuint *y_tex, GLuint *cbcr_tex);
 
 	// Call after you are done rendering into the frame; at this point,
 	// y_tex and cbcr_tex will be assumed done, and handed over to the
@@ -74,9 +75,24 @@ public:
 	void change_x264_bitrate(unsigned rate_kbit);
 
 private:
+	// One downscaled rendition of the x264 stream (see --x264-ladder),
+	// with its own mux, served by HTTPD on its own URL.
+	struct LadderRung {
+		VideoEncoder *parent;
+		const X264LadderRung *config;  // Points into global_flags.
+		std::unique_ptr<X264Encoder> x264_encoder;
+		std::unique_ptr<Mux> mux;
+		std::string mux_header;
+		bool seen_sync_markers = false;
+		MuxMetrics mux_metrics;
+	};
+
 	void open_output_stream();
+	void open_ladder_stream(LadderRung *rung);
+	std::unique_ptr<Mux> open_mux(void *opaque, int (*write_packet)(void *, uint8_t *, int, AVIODataMarkerType, int64_t), int width, int height, const std::string &video_extradata, MuxMetrics *metrics);
 	static int write_packet2_thunk(void *opaque, uint8_t *buf, int buf_size, AVIODataMarkerType type, int64_t time);
 	int write_packet2(uint8_t *buf, int buf_size, AVIODataMarkerType type, int64_t time);
+	static int write_ladder_packet2_thunk(void *opaque, uint8_t *buf, int buf_size, AVIODataMarkerType type, int64_t time);
 
 	AVOutputFormat *oformat;
 	mutable std::mutex qs_mu, qs_audio_mu;
@@ -93,6 +109,7 @@ private:
 	std::unique_ptr<Mux> stream_mux;  // To HTTP.
 	std::unique_ptr<AudioEncoder> stream_audio_encoder;
 	std::unique_ptr<X264Encoder> x264_encoder;  // nullptr if not using x264.
+	std::vector<std::unique_ptr<LadderRung>> ladder;  // Fed by <x264_encoder>.
 
 	std::string stream_mux_header;
 	MuxMetrics stream_mux_metrics;
@@ -2,14 +2,17 @@
 
 #include <assert.h>
 #include <dlfcn.h>
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <x264.h>
+#include <algorithm>
 #include <atomic>
 #include <cstdint>
 #include <mutex>
+#include <thread>
 
 #include "defs.h"
 #include "flags.h"
@@ -17,37 +20,53 @@
 #include "mux.h"
 #include "print_latency.h"
 #include "timebase.h"
+#include "tracing.h"
 #include "x264_dynamic.h"
 #include "x264_speed_control.h"
 
 extern "C" {
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
+#include <libavutil/pixfmt.h>
+#include <libswscale/swscale.h>
 }
 
 using namespace movit;
 using namespace std;
 using namespace std::chrono;
 
+struct X264Metrics {
+	atomic<int64_t> queued_frames{0};
+	atomic<int64_t> max_queued_frames{X264_QUEUE_LENGTH};
+	atomic<int64_t> dropped_frames{0};
+	atomic<int64_t> output_frames_i{0};
+	atomic<int64_t> output_frames_p{0};
+	atomic<int64_t> output_frames_b{0};
+	atomic<int64_t> output_bytes{0};
+	Histogram crf;
+	Histogram scale_seconds;  // Rungs only.
+};
+
 namespace {
 
 // X264Encoder can be restarted if --record-x264-video is set, so make these
 // metrics global.
-atomic<int64_t> metric_x264_queued_frames{0};
-atomic<int64_t> metric_x264_max_queued_frames{X264_QUEUE_LENGTH};
-atomic<int64_t> metric_x264_dropped_frames{0};
-atomic<int64_t> metric_x264_output_frames_i{0};
-atomic<int64_t> metric_x264_output_frames_p{0};
-atomic<int64_t> metric_x264_output_frames_b{0};
-Histogram metric_x264_crf;
+X264Metrics main_metrics;
 LatencyHistogram x264_latency_histogram;
 once_flag x264_metrics_inited;
 
-void update_vbv_settings(x264_param_t *param)
+void update_vbv_settings(x264_param_t *param, bool is_rung)
 {
 	if (global_flags.x264_bitrate == -1) {
 		return;
 	}
+	if (is_rung) {
+		// The VBV flags are absolute numbers meant for the main stream,
+		// so the rungs just get one-second-VBV CBR at their own bitrate.
+		param->rc.i_vbv_buffer_size = param->rc.i_bitrate;
+		param->rc.i_vbv_max_bitrate = param->rc.i_bitrate;
+		return;
+	}
 	if (global_flags.x264_vbv_buffer_size < 0) {
 		param->rc.i_vbv_buffer_size = param->rc.i_bitrate;  // One-second VBV.
 	} else {
@@ -60,29 +79,82 @@ void update_vbv_settings(x264_param_t *param)
 	}
 }
 
+// The bitrate a rung should have when the main stream runs at <main_bitrate_kbit>.
+// Explicit rung bitrates are relative to --x264-bitrate, so that they follow
+// the main stream if its bitrate is changed at runtime.
+unsigned rung_bitrate_kbit(const X264LadderRung &rung, unsigned main_bitrate_kbit)
+{
+	if (rung.bitrate_kbit != 0) {
+		return max(1l, lrint(double(rung.bitrate_kbit) * main_bitrate_kbit / global_flags.x264_bitrate));
+	} else {
+		double pixel_ratio = double(rung.width * rung.height) / (global_flags.width * global_flags.height);
+		return max(1l, lrint(main_bitrate_kbit * pixel_ratio));
+	}
+}
+
+vector<pair<string, string>> add_label(vector<pair<string, string>> labels, const string &key, const string &value)
+{
+	labels.emplace_back(key, value);
+	return labels;
+}
+
 }  // namespace
 
-X264Encoder::X264Encoder(AVOutputFormat *oformat)
-	: wants_global_headers(oformat->flags & AVFMT_GLOBALHEADER),
+X264Encoder::X264Encoder(AVOutputFormat *oformat, const X264LadderRung *rung)
+	: width(rung ? rung->width : global_flags.width),
+	  height(rung ? rung->height : global_flags.height),
+	  rung(rung),
+	  queue_length(rung ? X264_LADDER_QUEUE_LENGTH : X264_QUEUE_LENGTH),
+	  wants_global_headers(oformat->flags & AVFMT_GLOBALHEADER),
 	  dyn(load_x264_for_bit_depth(global_flags.x264_bit_depth))
 {
-	call_once(x264_metrics_inited, [](){
-		global_metrics.add("x264_queued_frames", &metric_x264_queued_frames, Metrics::TYPE_GAUGE);
-		global_metrics.add("x264_max_queued_frames", &metric_x264_max_queued_frames, Metrics::TYPE_GAUGE);
-		global_metrics.add("x264_dropped_frames", &metric_x264_dropped_frames);
-		global_metrics.add("x264_output_frames", {{ "type", "i" }}, &metric_x264_output_frames_i);
-		global_metrics.add("x264_output_frames", {{ "type", "p" }}, &metric_x264_output_frames_p);
-		global_metrics.add("x264_output_frames", {{ "type", "b" }}, &metric_x264_output_frames_b);
-
-		metric_x264_crf.init_uniform(50);
-		global_metrics.add("x264_crf", &metric_x264_crf);
-		x264_latency_histogram.init("x264");
-	});
+	if (rung == nullptr) {
+		call_once(x264_metrics_inited, [](){
+			global_metrics.add("x264_queued_frames", &main_metrics.queued_frames, Metrics::TYPE_GAUGE);
+			global_metrics.add("x264_max_queued_frames", &main_metrics.max_queued_frames, Metrics::TYPE_GAUGE);
+			global_metrics.add("x264_dropped_frames", &main_metrics.dropped_frames);
+			global_metrics.add("x264_output_frames", {{ "type", "i" }}, &main_metrics.output_frames_i);
+			global_metrics.add("x264_output_frames", {{ "type", "p" }}, &main_metrics.output_frames_p);
+			global_metrics.add("x264_output_frames", {{ "type", "b" }}, &main_metrics.output_frames_b);
+			global_metrics.add("x264_output_bytes", &main_metrics.output_bytes);
+
+			main_metrics.crf.init_uniform(50);
+			global_metrics.add("x264_crf", &main_metrics.crf);
+			x264_latency_histogram.init("x264");
+		});
+		metrics = &main_metrics;
+	} else {
+		rendition_name = to_string(width) + "x" + to_string(height);
+		own_metrics.reset(new X264Metrics);
+		metrics = own_metrics.get();
+		metrics->max_queued_frames = queue_length;
+
+		vector<pair<string, string>> labels{{ "rendition", rendition_name }};
+		global_metrics.add("x264_ladder_queued_frames", labels, &metrics->queued_frames, Metrics::TYPE_GAUGE);
+		global_metrics.add("x264_ladder_max_queued_frames", labels, &metrics->max_queued_frames, Metrics::TYPE_GAUGE);
+		global_metrics.add("x264_ladder_dropped_frames", labels, &metrics->dropped_frames);
+		global_metrics.add("x264_ladder_output_frames", add_label(labels, "type", "i"), &metrics->output_frames_i);
+		global_metrics.add("x264_ladder_output_frames", add_label(labels, "type", "p"), &metrics->output_frames_p);
+		global_metrics.add("x264_ladder_output_frames", add_label(labels, "type", "b"), &metrics->output_frames_b);
+		global_metrics.add("x264_ladder_output_bytes", labels, &metrics->output_bytes);
+
+		metrics->crf.init_uniform(50);
+		global_metrics.add("x264_ladder_crf", labels, &metrics->crf);
+		metrics->scale_seconds.init_geometric(0.0001, 0.1, 20);
+		global_metrics.add("x264_ladder_scale_seconds", labels, &metrics->scale_seconds);
+	}
 
+	// Rungs queue the main stream's frames as they are, and downscale them
+	// on their own encoder thread (see encode_frame()), so all queued frames
+	// are full-size.
 	size_t bytes_per_pixel = global_flags.x264_bit_depth > 8 ? 2 : 1;
-	frame_pool.reset(new uint8_t[global_flags.width * global_flags.height * 2 * bytes_per_pixel * X264_QUEUE_LENGTH]);
-	for (unsigned i = 0; i < X264_QUEUE_LENGTH; ++i) {
-		free_frames.push(frame_pool.get() + i * (global_flags.width * global_flags.height * 2 * bytes_per_pixel));
+	size_t frame_size = global_flags.width * global_flags.height * 2 * bytes_per_pixel;
+	frame_pool.reset(new uint8_t[frame_size * queue_length]);
+	for (unsigned i = 0; i < queue_length; ++i) {
+		free_frames.push(frame_pool.get() + i * frame_size);
+	}
+	if (rung != nullptr) {
+		scaled_frame.reset(new uint8_t[width * height * 2 * bytes_per_pixel]);
 	}
 	encoder_thread = thread(&X264Encoder::encoder_thread_func, this);
 }
@@ -95,12 +167,58 @@ X264Encoder::~X264Encoder()
 	if (dyn.handle) {
 		dlclose(dyn.handle);
 	}
+
+	if (rung != nullptr) {
+		vector<pair<string, string>> labels{{ "rendition", rendition_name }};
+		global_metrics.remove("x264_ladder_queued_frames", labels);
+		global_metrics.remove("x264_ladder_max_queued_frames", labels);
+		global_metrics.remove("x264_ladder_dropped_frames", labels);
+		global_metrics.remove("x264_ladder_output_frames", add_label(labels, "type", "i"));
+		global_metrics.remove("x264_ladder_output_frames", add_label(labels, "type", "p"));
+		global_metrics.remove("x264_ladder_output_frames", add_label(labels, "type", "b"));
+		global_metrics.remove("x264_ladder_output_bytes", labels);
+		global_metrics.remove("x264_ladder_crf", labels);
+		global_metrics.remove("x264_ladder_scale_seconds", labels);
+	}
 }
 
 void X264Encoder::add_frame(int64_t pts, int64_t duration, YCbCrLumaCoefficients ycbcr_coefficients, const uint8_t *data, const ReceivedTimestamps &received_ts)
+{
+	add_frame_from(pts, duration, ycbcr_coefficients, data, received_ts);
+	for (X264Encoder *encoder : downscaled_encoders) {
+		encoder->add_frame_from(pts, duration, ycbcr_coefficients, data, received_ts);
+	}
+}
+
+void X264Encoder::change_bitrate(unsigned rate_kbit)
+{
+	new_bitrate_kbit = rate_kbit;
+	if (global_flags.x264_bitrate > 0) {
+		for (X264Encoder *encoder : downscaled_encoders) {
+			encoder->new_bitrate_kbit = rung_bitrate_kbit(*encoder->rung, rate_kbit);
+		}
+	}
+}
+
+void X264Encoder::add_frame_from(int64_t pts, int64_t duration, YCbCrLumaCoefficients ycbcr_coefficients, const uint8_t *data, const ReceivedTimestamps &received_ts)
 {
 	assert(!should_quit);
 
+	// For rungs, hold the ordering lock until the frame is queued,
+	// so that frames from two different senders cannot be reordered.
+	unique_lock<mutex> order_lock(order_mu, defer_lock);
+	if (rung != nullptr) {
+		order_lock.lock();
+		if (pts <= last_pts) {
+			// While the main encoder is being restarted (see VideoEncoder::do_cut()),
+			// both the old and the new one send us frames for a short while.
+			// x264 cannot take pts going backwards, so drop the stragglers.
+			++metrics->dropped_frames;
+			return;
+		}
+		last_pts = pts;
+	}
+
 	QueuedFrame qf;
 	qf.pts = pts;
 	qf.duration = duration;
@@ -110,8 +228,12 @@ void X264Encoder::add_frame(int64_t pts, int64_t duration, YCbCrLumaCoefficients
 	{
 		lock_guard<mutex> lock(mu);
 		if (free_frames.empty()) {
-			fprintf(stderr, "WARNING: x264 queue full, dropping frame with pts %ld\n", pts);
-			++metric_x264_dropped_frames;
+			if (rung == nullptr) {
+				fprintf(stderr, "WARNING: x264 queue full, dropping frame with pts %ld\n", pts);
+			} else {
+				fprintf(stderr, "WARNING: x264 queue for %s full, dropping frame with pts %ld\n", rendition_name.c_str(), pts);
+			}
+			++metrics->dropped_frames;
 			return;
 		}
 
@@ -126,17 +248,48 @@ void X264Encoder::add_frame(int64_t pts, int64_t duration, YCbCrLumaCoefficients
 		lock_guard<mutex> lock(mu);
 		queued_frames.push(qf);
 		queued_frames_nonempty.notify_all();
-		metric_x264_queued_frames = queued_frames.size();
+		metrics->queued_frames = queued_frames.size();
 	}
 }
+
+void X264Encoder::downscale(const uint8_t *src, unsigned src_width, unsigned src_height, uint8_t *dst)
+{
+	TraceScope trace("X264Encoder::downscale");
+	steady_clock::time_point start = steady_clock::now();
+
+	size_t bytes_per_pixel = global_flags.x264_bit_depth > 8 ? 2 : 1;
+	if (scaler == nullptr) {
+		// High-bit-depth frames are 16-bit little-endian with the value in
+		// the low bits, not the high bits as P010 would have it; but the
+		// scaling is linear, so treating them as P016 gives the right result.
+		AVPixelFormat pix_fmt = (bytes_per_pixel == 2) ? AV_PIX_FMT_P016LE : AV_PIX_FMT_NV12;
+		scaler.reset(sws_getContext(src_width, src_height, pix_fmt,
+			width, height, pix_fmt, SWS_BICUBIC, nullptr, nullptr, nullptr));
+		if (scaler == nullptr) {
+			fprintf(stderr, "ERROR: Could not create a scaler from %ux%u to %ux%u.\n",
+				src_width, src_height, width, height);
+			exit(1);
+		}
+	}
+
+	// NV12 is a full-resolution Y' plane followed by an interleaved CbCr
+	// plane of half the height, so both have the same stride.
+	const uint8_t *src_planes[4] = { src, src + src_width * src_height * bytes_per_pixel, nullptr, nullptr };
+	int src_strides[4] = { int(src_width * bytes_per_pixel), int(src_width * bytes_per_pixel), 0, 0 };
+	uint8_t *dst_planes[4] = { dst, dst + width * height * bytes_per_pixel, nullptr, nullptr };
+	int dst_strides[4] = { int(width * bytes_per_pixel), int(width * bytes_per_pixel), 0, 0 };
+	sws_scale(scaler.get(), src_planes, src_strides, 0, src_height, dst_planes, dst_strides);
+
+	metrics->scale_seconds.count_event(duration<double>(steady_clock::now() - start).count());
+}
 	
 void X264Encoder::init_x264()
 {
 	x264_param_t param;
 	dyn.x264_param_default_preset(&param, global_flags.x264_preset.c_str(), global_flags.x264_tune.c_str());
 
-	param.i_width = global_flags.width;
-	param.i_height = global_flags.height;
+	param.i_width = width;
+	param.i_height = height;
 	param.i_csp = X264_CSP_NV12;
 	if (global_flags.x264_bit_depth > 8) {
 		param.i_csp |= X264_CSP_HIGH_DEPTH;
@@ -165,9 +318,13 @@ void X264Encoder::init_x264()
 		param.rc.f_rf_constant = global_flags.x264_crf;
 	} else {
 		param.rc.i_rc_method = X264_RC_ABR;
-		param.rc.i_bitrate = global_flags.x264_bitrate;
+		if (rung == nullptr) {
+			param.rc.i_bitrate = global_flags.x264_bitrate;
+		} else {
+			param.rc.i_bitrate = rung_bitrate_kbit(*rung, global_flags.x264_bitrate);
+		}
 	}
-	update_vbv_settings(&param);
+	update_vbv_settings(&param, rung != nullptr);
 	if (param.rc.i_vbv_max_bitrate > 0) {
 		// If the user wants VBV control to cap the max rate, it is
 		// also reasonable to assume that they are fine with the stream
@@ -200,6 +357,18 @@ void X264Encoder::init_x264()
 	// be on the safe side. Shouldn't affect quality in any meaningful way.
 	param.rc.i_qp_min = 5;
 
+	if (!global_flags.x264_ladder.empty()) {
+		// Each x264 instance would otherwise start threads for the entire
+		// machine; split the cores between the encoders in proportion to
+		// how many pixels each of them has to encode.
+		unsigned total_pixels = global_flags.width * global_flags.height;
+		for (const X264LadderRung &other_rung : global_flags.x264_ladder) {
+			total_pixels += other_rung.width * other_rung.height;
+		}
+		double share = double(width * height) / total_pixels;
+		param.i_threads = max(1l, lrint(thread::hardware_concurrency() * share));
+	}
+
 	for (const string &str : global_flags.x264_extra_param) {
 		const size_t pos = str.find(',');
 		if (pos == string::npos) {
@@ -216,6 +385,15 @@ void X264Encoder::init_x264()
 		}
 	}
 
+	if (!global_flags.x264_ladder.empty()) {
+		// Keyframes are forced on fixed pts boundaries instead (see
+		// encode_frame()), so that all renditions have them on the same
+		// frames even if one of them drops a frame. Done after the extra
+		// parameters, since the renditions would be useless without it.
+		param.i_keyint_max = X264_KEYINT_MAX_INFINITE;
+		param.i_scenecut_threshold = 0;
+	}
+
 	if (global_flags.x264_bit_depth > 8) {
 		dyn.x264_param_apply_profile(&param, "high10");
 	} else {
@@ -231,7 +409,7 @@ void X264Encoder::init_x264()
 	}
 
 	if (global_flags.x264_speedcontrol) {
-		speed_control.reset(new X264SpeedControl(x264, /*f_speed=*/1.0f, X264_QUEUE_LENGTH, /*f_buffer_init=*/1.0f));
+		speed_control.reset(new X264SpeedControl(x264, /*f_speed=*/1.0f, queue_length, /*f_buffer_init=*/1.0f, rendition_name));
 	}
 
 	if (wants_global_headers) {
@@ -279,7 +457,7 @@ void X264Encoder::encoder_thread_func()
 				qf.data = nullptr;
 			}
 
-			metric_x264_queued_frames = queued_frames.size();
+			metrics->queued_frames = queued_frames.size();
 			frames_left = !queued_frames.empty();
 		}
 
@@ -299,29 +477,47 @@ void X264Encoder::encoder_thread_func()
 
 void X264Encoder::encode_frame(X264Encoder::QueuedFrame qf)
 {
+	TraceScope trace("X264Encoder::encode_frame", qf.pts);
 	x264_nal_t *nal = nullptr;
 	int num_nal = 0;
 	x264_picture_t pic;
 	x264_picture_t *input_pic = nullptr;
 
 	if (qf.data) {
+		uint8_t *data = qf.data;
+		if (rung != nullptr) {
+			// x264 copies the picture in x264_encoder_encode(),
+			// so the same scratch buffer can be reused for every frame.
+			downscale(qf.data, global_flags.width, global_flags.height, scaled_frame.get());
+			data = scaled_frame.get();
+		}
+
 		dyn.x264_picture_init(&pic);
 
 		pic.i_pts = qf.pts;
 		if (global_flags.x264_bit_depth > 8) {
 			pic.img.i_csp = X264_CSP_NV12 | X264_CSP_HIGH_DEPTH;
 			pic.img.i_plane = 2;
-			pic.img.plane[0] = qf.data;
-			pic.img.i_stride[0] = global_flags.width * sizeof(uint16_t);
-			pic.img.plane[1] = qf.data + global_flags.width * global_flags.height * sizeof(uint16_t);
-			pic.img.i_stride[1] = global_flags.width / 2 * sizeof(uint32_t);
+			pic.img.plane[0] = data;
+			pic.img.i_stride[0] = width * sizeof(uint16_t);
+			pic.img.plane[1] = data + width * height * sizeof(uint16_t);
+			pic.img.i_stride[1] = width / 2 * sizeof(uint32_t);
 		} else {
 			pic.img.i_csp = X264_CSP_NV12;
 			pic.img.i_plane = 2;
-			pic.img.plane[0] = qf.data;
-			pic.img.i_stride[0] = global_flags.width;
-			pic.img.plane[1] = qf.data + global_flags.width * global_flags.height;
-			pic.img.i_stride[1] = global_flags.width / 2 * sizeof(uint16_t);
+			pic.img.plane[0] = data;
+			pic.img.i_stride[0] = width;
+			pic.img.plane[1] = data + width * height;
+			pic.img.i_stride[1] = width / 2 * sizeof(uint16_t);
+		}
+		if (!global_flags.x264_ladder.empty()) {
+			// One keyframe per second of pts, so that all renditions
+			// (including the main stream) switch GOPs in lockstep.
+			int64_t keyframe_slot = qf.pts / TIMEBASE;
+			if (keyframe_slot != last_keyframe_slot) {
+				pic.i_type = X264_TYPE_IDR;
+				last_keyframe_slot = keyframe_slot;
+			}
 		}
 		pic.opaque = reinterpret_cast<void *>(intptr_t(qf.duration));
 
@@ -333,9 +529,10 @@ void X264Encoder::encode_frame(X264Encoder::QueuedFrame qf)
 	// See if we have a new bitrate to change to.
 	unsigned new_rate = new_bitrate_kbit.exchange(0);  // Read and clear.
 	if (new_rate != 0) {
-		bitrate_override_func = [new_rate](x264_param_t *param) {
+		bool is_rung = (rung != nullptr);
+		bitrate_override_func = [new_rate, is_rung](x264_param_t *param) {
 			param->rc.i_bitrate = new_rate;
-			update_vbv_settings(param);
+			update_vbv_settings(param, is_rung);
 		};
 	}
 
@@ -366,7 +563,7 @@ void X264Encoder::encode_frame(X264Encoder::QueuedFrame qf)
 	}
 
 	if (speed_control) {
-		speed_control->before_frame(float(free_frames.size()) / X264_QUEUE_LENGTH, X264_QUEUE_LENGTH, 1e6 * qf.duration / TIMEBASE);
+		speed_control->before_frame(float(free_frames.size()) / queue_length, queue_length, 1e6 * qf.duration / TIMEBASE);
 	}
 	dyn.x264_encoder_encode(x264, &nal, &num_nal, input_pic, &pic);
 	if (speed_control) {
@@ -376,23 +573,26 @@ void X264Encoder::encode_frame(X264Encoder::QueuedFrame qf)
 	if (num_nal == 0) return;
 
 	if (IS_X264_TYPE_I(pic.i_type)) {
-		++metric_x264_output_frames_i;
+		++metrics->output_frames_i;
 	} else if (IS_X264_TYPE_B(pic.i_type)) {
-		++metric_x264_output_frames_b;
+		++metrics->output_frames_b;
 	} else {
-		++metric_x264_output_frames_p;
+		++metrics->output_frames_p;
 	}
 
-	metric_x264_crf.count_event(pic.prop.f_crf_avg);
+	metrics->crf.count_event(pic.prop.f_crf_avg);
 
 	if (frames_being_encoded.count(pic.i_pts)) {
 		ReceivedTimestamps received_ts = frames_being_encoded[pic.i_pts];
 		frames_being_encoded.erase(pic.i_pts);
 
-		static int frameno = 0;
-		print_latency("Current x264 latency (video inputs → network mux):",
-			received_ts, (pic.i_type == X264_TYPE_B || pic.i_type == X264_TYPE_BREF),
-			&frameno, &x264_latency_histogram);
+		// The rungs see the same frames, so only the main encoder reports latency.
+		if (rung == nullptr) {
+			static int frameno = 0;
+			print_latency("Current x264 latency (video inputs → network mux):",
+				received_ts, (pic.i_type == X264_TYPE_B || pic.i_type == X264_TYPE_BREF),
+				&frameno, &x264_latency_histogram);
+		}
 	} else {
 		assert(false);
 	}
@@ -403,6 +603,7 @@ void X264Encoder::encode_frame(X264Encoder::QueuedFrame qf)
 	for (int i = 0; i < num_nal; ++i) {
 		num_bytes += nal[i].i_payload;
 	}
+	metrics->output_bytes += num_bytes;
 
 	unique_ptr<uint8_t[]> data(new uint8_t[num_bytes]);
 	uint8_t *ptr = data.get();
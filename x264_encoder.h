@@ -8,6 +8,11 @@
 // to the stream, as where if we lose frames in encoding, we'll lose frames
 // to the stream only, so the latter is strictly better. More importantly,
 // this allows speedcontrol to do its thing without disturbing the mixer.
+//
+// If --x264-ladder is given, the main encoder also feeds a set of extra
+// encoders (“rungs”), each of which gets its own downscaled copy of every
+// frame. All of them force keyframes on the same pts boundaries, so that
+// a client can switch between the renditions at any keyframe.
 
 #ifndef _X264ENCODE_H
 #define _X264ENCODE_H 1
@@ -33,16 +38,21 @@ extern "C" {
 #include <movit/image_format.h>
 
 #include "defs.h"
+#include "ffmpeg_raii.h"
 #include "metrics.h"
 #include "print_latency.h"
 #include "x264_dynamic.h"
 
 class Mux;
 class X264SpeedControl;
+struct X264LadderRung;
+struct X264Metrics;
 
 class X264Encoder {
 public:
-	X264Encoder(AVOutputFormat *oformat);  // Does not take ownership.
+	// If <rung> is nullptr, this is the main encoder, which encodes
+	// at full resolution. Does not take ownership of either.
+	X264Encoder(AVOutputFormat *oformat, const X264LadderRung *rung = nullptr);
 
 	// Called after the last frame. Will block; once this returns,
 	// the last data is flushed.
@@ -51,8 +61,14 @@ public:
 	// Must be called before first frame. Does not take ownership.
 	void add_mux(Mux *mux) { muxes.push_back(mux); }
 
+	// Every frame given to add_frame() from now on will also be
+	// downscaled and given to <encoder>, which must be a rung.
+	// Does not take ownership.
+	void add_downscaled_encoder(X264Encoder *encoder) { downscaled_encoders.push_back(encoder); }
+
 	// <data> is taken to be raw NV12 data of WIDTHxHEIGHT resolution.
-	// Does not block.
+	// Does not block; the rungs (if any) get a copy of the frame,
+	// which they downscale on their own encoder threads.
 	void add_frame(int64_t pts, int64_t duration, movit::YCbCrLumaCoefficients ycbcr_coefficients, const uint8_t *data, const ReceivedTimestamps &received_ts);
 
 	std::string get_global_headers() const {
@@ -62,9 +78,12 @@ public:
 		return global_headers;
 	}
 
-	void change_bitrate(unsigned rate_kbit) {
-		new_bitrate_kbit = rate_kbit;
-	}
+	// Also changes the bitrate of the rungs (if any), in proportion
+	// to what they had relative to --x264-bitrate.
+	void change_bitrate(unsigned rate_kbit);
+
+	// “WxH” for rungs, empty for the main encoder.
+	const std::string &get_rendition_name() const { return rendition_name; }
 
 private:
 	struct QueuedFrame {
@@ -73,11 +92,35 @@ private:
 		uint8_t *data;
 		ReceivedTimestamps received_ts;
 	};
+	void add_frame_from(int64_t pts, int64_t duration, movit::YCbCrLumaCoefficients ycbcr_coefficients, const uint8_t *data, const ReceivedTimestamps &received_ts);
+	void downscale(const uint8_t *src, unsigned src_width, unsigned src_height, uint8_t *dst);
 	void encoder_thread_func();
 	void init_x264();
 	void encode_frame(QueuedFrame qf);
 
-	// One big memory chunk of all 50 (or whatever) frames, allocated in
+	unsigned width, height;
+	const X264LadderRung *rung;  // nullptr for the main encoder.
+	unsigned queue_length;  // X264_QUEUE_LENGTH, or X264_LADDER_QUEUE_LENGTH for rungs.
+	std::string rendition_name;
+
+	// Points to the global x264 metrics for the main encoder,
+	// or to <own_metrics> for rungs.
+	X264Metrics *metrics;
+	std::unique_ptr<X264Metrics> own_metrics;
+
+	std::vector<X264Encoder *> downscaled_encoders;
+
+	// For rungs only. add_frame_from() can be called from two threads
+	// at the same time while the main encoder is being restarted,
+	// so queueing needs its own lock to keep the frames in order.
+	std::mutex order_mu;
+	int64_t last_pts = -1;  // Under <order_mu>.
+
+	// For rungs only. Only used from the encoder thread.
+	SwsContextWithDeleter scaler;
+	std::unique_ptr<uint8_t[]> scaled_frame;
+
+	// One big memory chunk of all <queue_length> frames, allocated in
 	// the constructor. All data functions just use pointers into this
 	// pool.
 	std::unique_ptr<uint8_t[]> frame_pool;
@@ -97,6 +140,10 @@ private:
 
 	std::function<void(x264_param_t *)> bitrate_override_func;
 
+	// The pts / TIMEBASE of the last forced keyframe; see encode_frame().
+	// Only used from the encoder thread.
+	int64_t last_keyframe_slot = -1;
+
 	std::atomic<unsigned> new_bitrate_kbit{0};  // 0 for no change.
 
 	// Protects everything below it.
@@ -9,6 +9,8 @@
 #include <cmath>
 #include <ratio>
 #include <type_traits>
+#include <utility>
+#include <vector>
 
 #include "flags.h"
 #include "metrics.h"
@@ -18,9 +20,9 @@ using namespace std::chrono;
 
 #define SC_PRESETS 25
 
-X264SpeedControl::X264SpeedControl(x264_t *x264, float f_speed, int i_buffer_size, float f_buffer_init)
+X264SpeedControl::X264SpeedControl(x264_t *x264, float f_speed, int i_buffer_size, float f_buffer_init, const string &rendition_name)
 	: dyn(load_x264_for_bit_depth(global_flags.x264_bit_depth)),
-	  x264(x264), f_speed(f_speed)
+	  x264(x264), f_speed(f_speed), rendition_name(rendition_name)
 {
 	x264_param_t param;
 	dyn.x264_encoder_parameters(x264, &param);
@@ -43,11 +45,20 @@ X264SpeedControl::X264SpeedControl(x264_t *x264, float f_speed, int i_buffer_siz
 	metric_x264_speedcontrol_buffer_available_seconds = buffer_fill * 1e-6;
 	metric_x264_speedcontrol_buffer_size_seconds = buffer_size * 1e-6;
 	metric_x264_speedcontrol_preset_used_frames.init_uniform(SC_PRESETS);
-	global_metrics.add("x264_speedcontrol_preset_used_frames", &metric_x264_speedcontrol_preset_used_frames);
-	global_metrics.add("x264_speedcontrol_buffer_available_seconds", &metric_x264_speedcontrol_buffer_available_seconds, Metrics::TYPE_GAUGE);
-	global_metrics.add("x264_speedcontrol_buffer_size_seconds", &metric_x264_speedcontrol_buffer_size_seconds, Metrics::TYPE_GAUGE);
-	global_metrics.add("x264_speedcontrol_idle_frames", &metric_x264_speedcontrol_idle_frames);
-	global_metrics.add("x264_speedcontrol_late_frames", &metric_x264_speedcontrol_late_frames);
+	if (rendition_name.empty()) {
+		global_metrics.add("x264_speedcontrol_preset_used_frames", &metric_x264_speedcontrol_preset_used_frames);
+		global_metrics.add("x264_speedcontrol_buffer_available_seconds", &metric_x264_speedcontrol_buffer_available_seconds, Metrics::TYPE_GAUGE);
+		global_metrics.add("x264_speedcontrol_buffer_size_seconds", &metric_x264_speedcontrol_buffer_size_seconds, Metrics::TYPE_GAUGE);
+		global_metrics.add("x264_speedcontrol_idle_frames", &metric_x264_speedcontrol_idle_frames);
+		global_metrics.add("x264_speedcontrol_late_frames", &metric_x264_speedcontrol_late_frames);
+	} else {
+		vector<pair<string, string>> labels{{ "rendition", rendition_name }};
+		global_metrics.add("x264_ladder_speedcontrol_preset_used_frames", labels, &metric_x264_speedcontrol_preset_used_frames);
+		global_metrics.add("x264_ladder_speedcontrol_buffer_available_seconds", labels, &metric_x264_speedcontrol_buffer_available_seconds, Metrics::TYPE_GAUGE);
+		global_metrics.add("x264_ladder_speedcontrol_buffer_size_seconds", labels, &metric_x264_speedcontrol_buffer_size_seconds, Metrics::TYPE_GAUGE);
+		global_metrics.add("x264_ladder_speedcontrol_idle_frames", labels, &metric_x264_speedcontrol_idle_frames);
+		global_metrics.add("x264_ladder_speedcontrol_late_frames", labels, &metric_x264_speedcontrol_late_frames);
+	}
 }
 
 X264SpeedControl::~X264SpeedControl()
@@ -57,6 +68,14 @@ X264SpeedControl::~X264SpeedControl()
 		(float)stat.min_buffer / buffer_size,
 		(float)stat.max_buffer / buffer_size );
 	//  x264_log( x264, X264_LOG_INFO, "speedcontrol: avg cplx=%.5f\n", cplx_num / cplx_den );
+	if (!rendition_name.empty()) {
+		vector<pair<string, string>> labels{{ "rendition", rendition_name }};
+		global_metrics.remove("x264_ladder_speedcontrol_preset_used_frames", labels);
+		global_metrics.remove("x264_ladder_speedcontrol_buffer_available_seconds", labels);
+		global_metrics.remove("x264_ladder_speedcontrol_buffer_size_seconds", labels);
+		global_metrics.remove("x264_ladder_speedcontrol_idle_frames", labels);
+		global_metrics.remove("x264_ladder_speedcontrol_late_frames", labels);
+	}
 	if (dyn.handle) {
 		dlclose(dyn.handle);
 	}
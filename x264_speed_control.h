@@ -47,6 +47,7 @@
 #include <atomic>
 #include <chrono>
 #include <functional>
+#include <string>
 
 extern "C" {
 #include <x264.h>
@@ -64,7 +65,10 @@ public:
 	// f_buffer_init: Relative fullness of buffer at start
 	//    (0.0 = assumed to be <i_buffer_size> frames in buffer,
 	//     1.0 = no frames in buffer)
-	X264SpeedControl(x264_t *x264, float f_speed, int i_buffer_size, float f_buffer_init);
+	// rendition_name: Empty for the main stream. For ladder rungs, the metrics
+	//    are exported as x264_ladder_speedcontrol_* with this as the rendition
+	//    label, instead of as x264_speedcontrol_*.
+	X264SpeedControl(x264_t *x264, float f_speed, int i_buffer_size, float f_buffer_init, const std::string &rendition_name = "");
 	~X264SpeedControl();
 
 	// You need to call before_frame() immediately before each call to
@@ -131,6 +135,7 @@ private:
 	std::function<void(x264_param_t *)> override_func = nullptr;
 
 	// Metrics.
+	std::string rendition_name;
 	Histogram metric_x264_speedcontrol_preset_used_frames;
 	std::atomic<double> metric_x264_speedcontrol_buffer_available_seconds{0.0};
 	std::atomic<double> metric_x264_speedcontrol_buffer_size_seconds{0.0};